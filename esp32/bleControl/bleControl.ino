@@ -5,22 +5,63 @@
 #include <BLEUtils.h>
 #include <BLE2902.h>
 
+#include "byte_ring.h"
+#include "clearance.h"
+#include "command_parser.h"
+
 #define SERVICE_UUID           "6E400001-B5A3-F393-E0A9-E50E24DCCA9E" // UART service UUID
 #define CHARACTERISTIC_UUID_RX "6E400002-B5A3-F393-E0A9-E50E24DCCA9E"
 #define CHARACTERISTIC_UUID_TX "6E400003-B5A3-F393-E0A9-E50E24DCCA9E"
 
+// ATT MTU we offer, a notification carries up to the negotiated MTU - 3 bytes
+#define BLE_SERIAL_MTU 247
+// Bytes written but not notified yet, write() waits for room while the stack is congested
+#define BLE_SERIAL_TX_BUFFER_SIZE 512
+// flush() gives up on a link that takes nothing for this long and drops what is buffered
+#define BLE_SERIAL_TX_TIMEOUT_MS 500
+// A notification the stack refused without reporting congestion is tried again after this
+#define BLE_SERIAL_TX_RETRY_MS 10
+// Received bytes waiting for loop(), anything beyond that is dropped
+#define BLE_SERIAL_RX_BUFFER_SIZE 256
+
 
 #define DEVICE_LETTER "B"
 #define DEVICE_NAME "Intersection" DEVICE_LETTER
 
-//GPIO pins for our light control
-// Note: These are not physical pin numbers, these are GPIO pin numbers. Example: r1Pin is set to GPIO23, which is physical pin #37
-int r1Pin = 23;
-int y1Pin = 22;
-int g1Pin = 21;
-int r2Pin = 19;
-int y2Pin = 18;
-int g2Pin = 5;
+// Clearance intervals, see clearance.h. A green head that is to stop shows amber this long,
+// then every head stays red this long before another group gets green.
+#define CLEARANCE_AMBER_MS 3000
+#define CLEARANCE_ALL_RED_MS 1000
+// Hardware timer that wakes loop() at the end of each interval, ticking every microsecond
+#define CLEARANCE_TIMER 0
+#define CLEARANCE_TIMER_DIVIDER 80
+
+//GPIO pins for our light control, one entry per signal head (light 1, light 2, ...)
+// Note: These are not physical pin numbers, these are GPIO pin numbers. Example: light 1 red is set to GPIO23, which is physical pin #37
+// Heads of the same group never conflict and may be green together, the others are cleared first.
+struct SignalHead {
+  int redPin;
+  int yellowPin;
+  int greenPin;
+  int group;
+};
+
+SignalHead heads[] = {
+  { 23, 22, 21, 1 },
+  { 19, 18, 5, 2 },
+};
+
+#define HEAD_COUNT (sizeof(heads) / sizeof(heads[0]))
+static_assert(HEAD_COUNT <= COMMAND_MAX_HEADS, "A frame cannot address every head");
+static_assert(HEAD_COUNT <= CLEARANCE_MAX_HEADS, "The sequencer cannot run every head");
+
+// Commands set the state each head is to reach, the sequencer runs the clearance on the way there
+ClearanceSequencer sequencer(HEAD_COUNT, { CLEARANCE_AMBER_MS, CLEARANCE_ALL_RED_MS });
+hw_timer_t* clearanceTimer = NULL;
+// Task that runs setup() and loop(), woken by BLE data and by the clearance timer
+TaskHandle_t loopTask = NULL;
+// Sequence number of the newest frame, lamp changes are reported under it. 0 until a frame had one.
+long lastSeq = 0;
 
 class BLESerial: public Stream
 {
@@ -34,8 +75,13 @@ class BLESerial: public Stream
         int peek(void);
         bool connected(void);
         int read(void);
+        // Task to wake with xTaskNotifyGive() whenever data has been received
+        void notifyOnReceive(TaskHandle_t task);
+        // Writes are buffered and go out as notifications of up to MTU - 3 bytes. Full notifications
+        // are sent straight away, call flush() to send the rest.
         size_t write(uint8_t c);
         size_t write(const uint8_t *buffer, size_t size);
+        // Sends everything written so far, waiting while the stack is congested
         void flush();
         void end(void);
 
@@ -45,12 +91,28 @@ class BLESerial: public Stream
         BLEService *pService;
         BLECharacteristic * pTxCharacteristic;
         bool deviceConnected = false;
-        uint8_t txValue = 0;
         
-        std::string receiveBuffer;
+        // Filled by the write callback on the Bluetooth task, emptied by read()
+        ByteRing<BLE_SERIAL_RX_BUFFER_SIZE> receiveBuffer;
+        TaskHandle_t receiveTask = NULL;
+
+        // Only touched by write() and flush(), ie. from loop()
+        uint8_t txBuffer[BLE_SERIAL_TX_BUFFER_SIZE];
+        size_t txLength = 0;
+        // Set from the Bluetooth task
+        volatile uint16_t txMtu = 23;
+        volatile bool txCongested = false;
+        volatile BLECharacteristicCallbacks::Status txStatus;
+        // Given when the congestion is over or the client went away
+        SemaphoreHandle_t txWake;
+
+        void txSend(bool partial);
+        static void gattsEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param);
+        static BLESerial* instance;
 
         friend class BLESerialServerCallbacks;
         friend class BLESerialCharacteristicCallbacks;
+        friend class BLESerialTxCallbacks;
 
 };
 
@@ -75,18 +137,62 @@ class BLESerialCharacteristicCallbacks: public BLECharacteristicCallbacks {
     BLESerial* bleSerial;
     
     void onWrite(BLECharacteristic *pCharacteristic) {
- 
-      bleSerial->receiveBuffer = bleSerial->receiveBuffer + pCharacteristic->getValue();
+      const uint8_t* data = pCharacteristic->getData();
+      size_t length = pCharacteristic->getLength();
+
+      for (size_t i = 0; i < length; i++) {
+        bleSerial->receiveBuffer.push(data[i]);
+      }
+      if (bleSerial->receiveTask != NULL) {
+        xTaskNotifyGive(bleSerial->receiveTask);
+      }
+    }
+
+};
+
+// Called from within notify(), tells txSend() whether the stack took the notification
+class BLESerialTxCallbacks: public BLECharacteristicCallbacks {
+    friend class BLESerial; 
+    BLESerial* bleSerial;
+    
+    void onStatus(BLECharacteristic* pCharacteristic, Status s, uint32_t code) {
+      bleSerial->txStatus = s;
     }
 
 };
 
+BLESerial* BLESerial::instance = NULL;
+
+// The stack's flow control: it reports congestion when its buffers for the link fill up, and again once
+// they have room. Also keeps the MTU of the connection.
+void BLESerial::gattsEvent(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if, esp_ble_gatts_cb_param_t* param)
+{
+    switch (event) {
+        case ESP_GATTS_CONGEST_EVT:
+            instance->txCongested = param->congest.congested;
+            if (!param->congest.congested) {
+                xSemaphoreGive(instance->txWake);
+            }
+            break;
+        case ESP_GATTS_MTU_EVT:
+            instance->txMtu = param->mtu.mtu;
+            break;
+        case ESP_GATTS_DISCONNECT_EVT:
+            instance->txMtu = 23;
+            instance->txCongested = false;
+            xSemaphoreGive(instance->txWake);
+            break;
+        default:
+            break;
+    }
+}
+
 // Constructor
 
 BLESerial::BLESerial()
 {
   // create instance  
-  receiveBuffer = "";
+  txWake = xSemaphoreCreateBinary();
 }
 
 // Destructor
@@ -102,6 +208,9 @@ bool BLESerial::begin(char* localName)
 {
     // Create the BLE Device
     BLEDevice::init(localName);
+    BLEDevice::setMTU(BLE_SERIAL_MTU);
+    instance = this;
+    BLEDevice::setCustomGattsHandler(gattsEvent);
 
     // Create the BLE Server
     pServer = BLEDevice::createServer();
@@ -125,10 +234,15 @@ bool BLESerial::begin(char* localName)
     if (pTxCharacteristic == nullptr)
         return false;                    
     pTxCharacteristic->addDescriptor(new BLE2902());
+    BLESerialTxCallbacks* bleSerialTxCallbacks = new BLESerialTxCallbacks();
+    bleSerialTxCallbacks->bleSerial = this;
+    pTxCharacteristic->setCallbacks(bleSerialTxCallbacks);
 
+    // Write without response lets the gateway send the next command without waiting for an ATT round trip
     BLECharacteristic * pRxCharacteristic = pService->createCharacteristic(
                                                 CHARACTERISTIC_UUID_RX,
-                                                BLECharacteristic::PROPERTY_WRITE
+                                                BLECharacteristic::PROPERTY_WRITE |
+                                                BLECharacteristic::PROPERTY_WRITE_NR
                                             );
     if (pRxCharacteristic == nullptr)
         return false; 
@@ -151,19 +265,14 @@ bool BLESerial::begin(char* localName)
 int BLESerial::available(void)
 {
     // reply with data available
-    return receiveBuffer.length();
+    return receiveBuffer.size();
 }
 
 int BLESerial::peek(void)
 {
     // return first character available
     // but don't remove it from the buffer
-    if ((receiveBuffer.length() > 0)){
-        uint8_t c = receiveBuffer[0];
-        return c;
-    }
-    else
-        return -1;
+    return receiveBuffer.peek();
 }
 
 bool BLESerial::connected(void)
@@ -177,39 +286,81 @@ bool BLESerial::connected(void)
 
 int BLESerial::read(void)
 {
-    // read a character
-    if ((receiveBuffer.length() > 0)){
-        uint8_t c = receiveBuffer[0];
-        receiveBuffer.erase(0,1); // remove it from the buffer
-        return c;
+    // read a character, -1 if there is none
+    return receiveBuffer.pop();
+}
+
+void BLESerial::notifyOnReceive(TaskHandle_t task)
+{
+    receiveTask = task;
+}
+
+// Notifies as much of the buffer as the stack takes, in MTU - 3 byte pieces.
+// Unless partial, a last piece shorter than that stays buffered for more data.
+void BLESerial::txSend(bool partial)
+{
+    size_t chunk = txMtu - 3;
+    size_t sent = 0;
+
+    while (!txCongested && sent < txLength && (partial || txLength - sent >= chunk)) {
+        size_t len = min(chunk, txLength - sent);
+        pTxCharacteristic->setValue(&txBuffer[sent], len);
+        txStatus = BLECharacteristicCallbacks::Status::SUCCESS_NOTIFY;
+        pTxCharacteristic->notify();
+        if (txStatus == BLECharacteristicCallbacks::Status::ERROR_GATT) {
+            // Out of buffers, try again later
+            break;
+        }
+        if (txStatus != BLECharacteristicCallbacks::Status::SUCCESS_NOTIFY) {
+            // No client, or it has not subscribed: nobody to send to
+            sent = txLength;
+            break;
+        }
+        sent += len;
     }
-    else
-        return -1;
+
+    memmove(txBuffer, &txBuffer[sent], txLength - sent);
+    txLength -= sent;
 }
 
 size_t BLESerial::write(uint8_t c)
 {
-    // write a character
-    uint8_t _c = c;
-    pTxCharacteristic->setValue(&_c, 1);
-    pTxCharacteristic->notify();
-    delay(10); // bluetooth stack will go into congestion, if too many packets are sent
-    return 1;
+    return write(&c, 1);
 }
 
 size_t BLESerial::write(const uint8_t *buffer, size_t size)
 {
-    // write a buffer
-    for(int i=0; i < size; i++){
-        write(buffer[i]);
-  }
-  return size;
+    size_t written = 0;
+
+    while (written < size) {
+        size_t len = min(size - written, sizeof(txBuffer) - txLength);
+        memcpy(&txBuffer[txLength], &buffer[written], len);
+        txLength += len;
+        written += len;
+        txSend(false);
+        if (txLength == sizeof(txBuffer)) {
+            // Full, and the stack takes no more right now
+            flush();
+        }
+    }
+    return size;
 }
 
 void BLESerial::flush()
 {
-    // remove buffered data
-    receiveBuffer.clear();
+    unsigned long start = millis();
+
+    txSend(true);
+    while (txLength > 0) {
+        if (millis() - start >= BLE_SERIAL_TX_TIMEOUT_MS) {
+            Serial.println("BLE link congested, dropping " + String(txLength) + " bytes");
+            txLength = 0;
+            return;
+        }
+        // Woken as soon as the congestion is over, a refused notification is retried on the timeout
+        xSemaphoreTake(txWake, pdMS_TO_TICKS(BLE_SERIAL_TX_RETRY_MS));
+        txSend(true);
+    }
 }
 
 void BLESerial::end()
@@ -220,90 +371,122 @@ void BLESerial::end()
 //Instance of the class that handles bt communication
 BLESerial bt;
 
+// Sets the pins of every head to what the sequencer says it shows
+void showHeads() {
+  for (int i = 0; i < HEAD_COUNT; i++) {
+    char state = sequencer.shown(i);
+    digitalWrite(heads[i].redPin, state == 'r' ? HIGH : LOW);
+    digitalWrite(heads[i].yellowPin, state == 'y' ? HIGH : LOW);
+    digitalWrite(heads[i].greenPin, state == 'g' ? HIGH : LOW);
+  }
+}
+
+void IRAM_ATTR onClearanceTimer() {
+  BaseType_t woken = pdFALSE;
+  vTaskNotifyGiveFromISR(loopTask, &woken);
+  if (woken) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+// "a<seq>:<one state char per head>;", sent for every frame that has a sequence number, applied or not,
+// and again with the same number whenever the clearance changes the lamps. Carries what each head shows.
+void sendAck(long seq) {
+  String ack = "a" + String(seq) + ":";
+  for (int i = 0; i < HEAD_COUNT; i++) {
+    ack += sequencer.shown(i);
+  }
+  bt.print(ack + ";");
+  bt.flush();
+}
+
+// Moves the heads on, and sets the timer for the next interval that ends, if any.
+// Lamps that change on their own, ie. at the end of an amber or all-red interval, are reported unasked.
+void runClearance() {
+  uint32_t now = millis();
+  uint32_t delayMs;
+
+  if (sequencer.update(now)) {
+    showHeads();
+    if (lastSeq > 0) {
+      sendAck(lastSeq);
+    }
+  }
+
+  timerAlarmDisable(clearanceTimer);
+  if (sequencer.nextDelay(now, delayMs)) {
+    timerWrite(clearanceTimer, 0);
+    timerAlarmWrite(clearanceTimer, (uint64_t) max(delayMs, (uint32_t) 1) * 1000, false);
+    timerAlarmEnable(clearanceTimer);
+  }
+}
+
 void setup() {
   
   Serial.begin(115200);
 
-  // Set LED as output
-  pinMode(r1Pin, OUTPUT);
-  pinMode(g1Pin, OUTPUT);
-  pinMode(y1Pin, OUTPUT);
-  pinMode(r2Pin, OUTPUT);
-  pinMode(g2Pin, OUTPUT);
-  pinMode(y2Pin, OUTPUT);
-
-  digitalWrite(r1Pin, HIGH);
-  digitalWrite(y1Pin, LOW);
-  digitalWrite(g1Pin, LOW);
-  digitalWrite(r2Pin, HIGH);
-  digitalWrite(y2Pin, LOW);
-  digitalWrite(g2Pin, LOW);
+  // Set LED as output, every light starts out red
+  for (int i = 0; i < HEAD_COUNT; i++) {
+    pinMode(heads[i].redPin, OUTPUT);
+    pinMode(heads[i].yellowPin, OUTPUT);
+    pinMode(heads[i].greenPin, OUTPUT);
+    sequencer.setGroup(i, heads[i].group);
+  }
+  sequencer.reset('r');
+  showHeads();
   
+  // setup() and loop() run on the same task, it sleeps in loop() until data arrives or an interval ends
+  loopTask = xTaskGetCurrentTaskHandle();
+  bt.notifyOnReceive(loopTask);
+  clearanceTimer = timerBegin(CLEARANCE_TIMER, CLEARANCE_TIMER_DIVIDER, true);
+  timerAttachInterrupt(clearanceTimer, &onClearanceTimer, true);
+
   //Bluetooth device name
   bt.begin(DEVICE_NAME);
 
   //Serial.println("Device started!");
 }
 
-String message = "";
+CommandParser parser(HEAD_COUNT);
 
-void loop() {
-
-  //If the BT server has given us a message
-  if(bt.available()) {
-
-    //Read incoming byte
-    char incomingChar = bt.read();
+// Applies a parsed command. Every head was checked by the parser before any target is set,
+// so a bad command changes nothing. A command with a sequence number is acknowledged with what
+// every head shows once the command took effect, ie. "a42:yr;" for a green head that is clearing.
+void applyCommand(const Command& command) {
+  if (!command.valid) {
+    Serial.print("Invalid command: ");
+    Serial.println(parser.text());
+  }
 
-    //if it is the end of a word, we can clear it. Else, build the string
-    if(incomingChar != ';') {
-      message += String(incomingChar);
-    } else {
-      message = "";
+  for (int i = 0; command.valid && command.states[i] != '\0'; i++) {
+    if (command.states[i] != '-') {
+      sequencer.setTarget(command.first - 1 + i, command.states[i]);
     }
-
-    //Serial.write(incomingChar);
   }
 
-  if(message == "red1") {
-    digitalWrite(r1Pin, HIGH);
-    digitalWrite(y1Pin, LOW);
-    digitalWrite(g1Pin, LOW);
-  } 
-  else if (message == "green1") {   
-    digitalWrite(r1Pin, LOW);
-    digitalWrite(y1Pin, LOW);
-    digitalWrite(g1Pin, HIGH);
-  
-  }
-  else if (message == "yellow1") {
-    digitalWrite(r1Pin, LOW);
-    digitalWrite(y1Pin, HIGH);
-    digitalWrite(g1Pin, LOW);
-    
-  } else if (message == "off1") {
-    digitalWrite(r1Pin, LOW);
-    digitalWrite(y1Pin, LOW);
-    digitalWrite(g1Pin, LOW);
+  // Whatever may change straight away does, so the acknowledgement shows it
+  if (sequencer.update(millis())) {
+    showHeads();
   }
-  else if(message == "red2") {
-    digitalWrite(r2Pin, HIGH);
-    digitalWrite(y2Pin, LOW);
-    digitalWrite(g2Pin, LOW);
-  } 
-  else if (message == "green2") {   
-    digitalWrite(r2Pin, LOW);
-    digitalWrite(y2Pin, LOW);
-    digitalWrite(g2Pin, HIGH);
+  if (command.seq > 0) {
+    lastSeq = command.seq;
+    sendAck(command.seq);
   }
-  else if (message == "yellow2") {
-    digitalWrite(r2Pin, LOW);
-    digitalWrite(y2Pin, HIGH);
-    digitalWrite(g2Pin, LOW);
-    
-  } else if (message == "off2") {
-    digitalWrite(r2Pin, LOW);
-    digitalWrite(y2Pin, LOW);
-    digitalWrite(g2Pin, LOW);
+}
+
+void loop() {
+  Command command;
+  int c;
+
+  // Sleeps until the BLE write callback has put something into the receive buffer,
+  // or the clearance timer says an interval is over
+  ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+  // Each command is applied once, when its ';' arrives
+  while ((c = bt.read()) >= 0) {
+    if (parser.feed((char) c, command)) {
+      applyCommand(command);
+    }
   }
+  runClearance();
 }
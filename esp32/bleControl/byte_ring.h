@@ -0,0 +1,72 @@
+#ifndef BLE_CONTROL_BYTE_RING_H_
+#define BLE_CONTROL_BYTE_RING_H_
+
+// Fixed size byte FIFO for one producer (the BLE write callback) and one consumer (loop()).
+// No locks and no allocation, each side only ever moves its own index.
+// Plain C++, so it builds on the host as well.
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+template <size_t N>
+class ByteRing
+{
+    public:
+        // Producer side
+        // @return false if the ring is full and the byte was dropped
+        bool push(uint8_t c)
+        {
+            size_t head = this->head.load(std::memory_order_relaxed);
+            size_t next = (head + 1) % N;
+            if (next == tail.load(std::memory_order_acquire)) {
+                dropped++;
+                return false;
+            }
+            buffer[head] = c;
+            this->head.store(next, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer side
+        // @return the oldest byte, or -1 if the ring is empty
+        int pop()
+        {
+            size_t tail = this->tail.load(std::memory_order_relaxed);
+            if (tail == head.load(std::memory_order_acquire)) {
+                return -1;
+            }
+            uint8_t c = buffer[tail];
+            this->tail.store((tail + 1) % N, std::memory_order_release);
+            return c;
+        }
+
+        int peek() const
+        {
+            size_t tail = this->tail.load(std::memory_order_relaxed);
+            if (tail == head.load(std::memory_order_acquire)) {
+                return -1;
+            }
+            return buffer[tail];
+        }
+
+        size_t size() const
+        {
+            return (head.load(std::memory_order_acquire) + N - tail.load(std::memory_order_acquire)) % N;
+        }
+
+        // Bytes pushed while the ring was full
+        uint32_t droppedCount() const
+        {
+            return dropped;
+        }
+
+    private:
+        // One slot always stays free to tell a full ring from an empty one
+        uint8_t buffer[N];
+        std::atomic<size_t> head{0};
+        std::atomic<size_t> tail{0};
+        uint32_t dropped = 0;
+};
+
+#endif // BLE_CONTROL_BYTE_RING_H_
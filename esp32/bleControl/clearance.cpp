@@ -0,0 +1,147 @@
+#include "clearance.h"
+
+namespace {
+
+// True once nowMs has reached end, across a wrap of the ms counter
+bool reached(uint32_t nowMs, uint32_t end)
+{
+    return (int32_t) (nowMs - end) >= 0;
+}
+
+} // namespace
+
+ClearanceSequencer::ClearanceSequencer(int headCount, const ClearanceTiming& timing)
+    : headCount(headCount > CLEARANCE_MAX_HEADS ? CLEARANCE_MAX_HEADS : headCount), timing(timing)
+{
+    for (int i = 0; i < CLEARANCE_MAX_HEADS; i++) {
+        heads[i].group = i;
+    }
+    reset('r');
+}
+
+void ClearanceSequencer::setGroup(int head, int group)
+{
+    heads[head].group = group;
+}
+
+void ClearanceSequencer::reset(char state)
+{
+    for (int i = 0; i < headCount; i++) {
+        heads[i].shown = state;
+        heads[i].target = state;
+        heads[i].amberEnd = 0;
+    }
+    allRedActive = false;
+}
+
+void ClearanceSequencer::setTarget(int head, char state)
+{
+    heads[head].target = state;
+}
+
+void ClearanceSequencer::show(int head, char state, uint32_t nowMs)
+{
+    Head& h = heads[head];
+
+    if (state == 'y' && h.shown != 'y') {
+        h.amberEnd = nowMs + timing.amberMs;
+    }
+    if (state == 'r' && h.shown == 'y') {
+        // The end of a clearance, the others wait for the all-red interval
+        allRedEnd = nowMs + timing.allRedMs;
+        allRedActive = true;
+    }
+    h.shown = state;
+}
+
+bool ClearanceSequencer::conflictingGreen(int head) const
+{
+    for (int i = 0; i < headCount; i++) {
+        if (heads[i].group != heads[head].group && (heads[i].shown == 'g' || heads[i].shown == 'y')) {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool ClearanceSequencer::mayTurnGreen(int head, uint32_t nowMs) const
+{
+    return (!allRedActive || reached(nowMs, allRedEnd)) && !conflictingGreen(head);
+}
+
+bool ClearanceSequencer::update(uint32_t nowMs)
+{
+    bool changed = false;
+
+    if (allRedActive && reached(nowMs, allRedEnd)) {
+        allRedActive = false;
+    }
+
+    // Clearances first, so a head that just turned red counts when granting green below
+    for (int i = 0; i < headCount; i++) {
+        Head& h = heads[i];
+        char next = h.shown;
+
+        if (h.target == h.shown) {
+            continue;
+        }
+        if (h.target == 'o') {
+            next = 'o';
+        }
+        else if (h.shown == 'g') {
+            next = 'y';
+        }
+        else if (h.shown == 'y') {
+            // Amber is never cut short, and never goes straight back to green
+            if (reached(nowMs, h.amberEnd)) {
+                next = 'r';
+            }
+        }
+        else if (h.target != 'g') {
+            // From red or off to red, off or amber
+            next = h.target;
+        }
+
+        if (next != h.shown) {
+            show(i, next, nowMs);
+            changed = true;
+        }
+    }
+
+    // Lowest head first when several want green, a conflicting one waits for it to clear again
+    for (int i = 0; i < headCount; i++) {
+        Head& h = heads[i];
+        if (h.target == 'g' && (h.shown == 'r' || h.shown == 'o') && mayTurnGreen(i, nowMs)) {
+            show(i, 'g', nowMs);
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+bool ClearanceSequencer::nextDelay(uint32_t nowMs, uint32_t& delayMs) const
+{
+    bool waiting = false;
+
+    for (int i = 0; i < headCount; i++) {
+        const Head& h = heads[i];
+        uint32_t end;
+
+        if (h.shown == 'y' && h.target != 'y' && h.target != 'o') {
+            end = h.amberEnd;
+        }
+        else if (h.target == 'g' && h.shown != 'g' && h.shown != 'y' && allRedActive && !conflictingGreen(i)) {
+            end = allRedEnd;
+        }
+        else {
+            continue;
+        }
+
+        uint32_t delay = reached(nowMs, end) ? 0 : end - nowMs;
+        if (!waiting || delay < delayMs) {
+            delayMs = delay;
+        }
+        waiting = true;
+    }
+    return waiting;
+}
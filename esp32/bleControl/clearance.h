@@ -0,0 +1,76 @@
+#ifndef BLE_CONTROL_CLEARANCE_H_
+#define BLE_CONTROL_CLEARANCE_H_
+
+// Clearance sequencing of the heads of one controller. Commands set the state each head is to reach
+// (its target), the sequencer decides what the heads show on the way there:
+//   - a green head that is to stop shows amber for amberMs first, then red
+//   - once a head has turned red, no other group may turn green for allRedMs
+//   - a head only turns green while no head of another group shows green or amber
+// Off is applied straight away from any state, it is for maintenance and dark signals. Amber, once
+// shown, always lasts amberMs, whatever the commands in between say. Heads in the same group never
+// conflict and may be green together.
+// Time is passed in by the caller in ms, so this is plain C++ that builds and can be tested on the host.
+
+#include <stdint.h>
+
+#define CLEARANCE_MAX_HEADS 8
+
+struct ClearanceTiming {
+    uint32_t amberMs;
+    uint32_t allRedMs;
+};
+
+class ClearanceSequencer
+{
+    public:
+        ClearanceSequencer(int headCount, const ClearanceTiming& timing);
+
+        // Heads in the same group may show green at the same time, by default every head is its own group
+        void setGroup(int head, int group);
+
+        // Every head shows state and has it as its target, without any clearance
+        void reset(char state);
+
+        // Sets the state a head is to reach, r/y/g/o. Call update() afterwards.
+        void setTarget(int head, char state);
+
+        // Moves every head on as far as it may go at nowMs
+        // @return true if what any head shows changed
+        bool update(uint32_t nowMs);
+
+        // Time from nowMs until update() has something to do
+        // @return false if nothing is waiting for time to pass
+        bool nextDelay(uint32_t nowMs, uint32_t& delayMs) const;
+
+        char shown(int head) const
+        {
+            return heads[head].shown;
+        }
+
+        char target(int head) const
+        {
+            return heads[head].target;
+        }
+
+    private:
+        struct Head {
+            char shown;
+            char target;
+            int group;
+            // While shown is amber, when it may turn red
+            uint32_t amberEnd;
+        };
+
+        int headCount;
+        ClearanceTiming timing;
+        Head heads[CLEARANCE_MAX_HEADS];
+        // No group may turn green before this, valid while allRedActive
+        uint32_t allRedEnd = 0;
+        bool allRedActive = false;
+
+        void show(int head, char state, uint32_t nowMs);
+        bool conflictingGreen(int head) const;
+        bool mayTurnGreen(int head, uint32_t nowMs) const;
+};
+
+#endif // BLE_CONTROL_CLEARANCE_H_
@@ -0,0 +1,130 @@
+#include "command_parser.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+namespace {
+
+struct CommandPattern {
+    const char* prefix;
+    // State the command sets its head to, 0 for a frame
+    char state;
+};
+
+// Matched in order, the first prefix that fits decides how the rest is parsed
+const CommandPattern patterns[] = {
+    { "S", 0 },
+    { "red", 'r' },
+    { "yellow", 'y' },
+    { "green", 'g' },
+    { "off", 'o' },
+};
+
+// A decimal number that takes up everything from text to end
+bool parseNumber(const char* text, const char* end, long& value)
+{
+    char* stop;
+    if (text == end) {
+        return false;
+    }
+    value = strtol(text, &stop, 10);
+    return stop == end;
+}
+
+} // namespace
+
+CommandParser::CommandParser(int headCount) : headCount(headCount)
+{
+    line[0] = '\0';
+}
+
+bool CommandParser::feed(char c, Command& command)
+{
+    if (c != ';') {
+        if (length < COMMAND_MAX_LENGTH) {
+            line[length++] = c;
+        }
+        else {
+            overflow = true;
+        }
+        return false;
+    }
+
+    line[length] = '\0';
+    bool complete = (length > 0 && !overflow);
+    if (overflow) {
+        overflows++;
+    }
+    if (complete) {
+        parse(command);
+    }
+    length = 0;
+    overflow = false;
+    return complete;
+}
+
+void CommandParser::parse(Command& command)
+{
+    command.valid = false;
+    command.first = 0;
+    command.states[0] = '\0';
+    command.seq = 0;
+
+    for (const CommandPattern& pattern : patterns) {
+        size_t prefixLength = strlen(pattern.prefix);
+        if (strncmp(line, pattern.prefix, prefixLength) != 0) {
+            continue;
+        }
+        const char* args = line + prefixLength;
+        command.valid = (pattern.state == 0) ? parseFrame(args, command) : parseHead(args, pattern.state, command);
+        return;
+    }
+}
+
+// "<first>:<states>[#<seq>]", the sequence number is taken even if the rest is wrong,
+// the nRF52840 waits for its acknowledgement either way
+bool CommandParser::parseFrame(const char* args, Command& command)
+{
+    const char* end = args + strlen(args);
+    const char* hash = strchr(args, '#');
+    long value;
+
+    if (hash != NULL) {
+        if (parseNumber(hash + 1, end, value) && value > 0) {
+            command.seq = value;
+        }
+        end = hash;
+    }
+
+    const char* colon = strchr(args, ':');
+    if (colon == NULL || colon > end || !parseNumber(args, colon, value)) {
+        return false;
+    }
+    size_t count = end - (colon + 1);
+    if (value < 1 || count > COMMAND_MAX_HEADS || value - 1 + (long) count > headCount) {
+        return false;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (strchr("rygo-", colon[1 + i]) == NULL) {
+            return false;
+        }
+        command.states[i] = colon[1 + i];
+    }
+    command.states[count] = '\0';
+    command.first = (int) value;
+    return true;
+}
+
+// "<head>"
+bool CommandParser::parseHead(const char* args, char state, Command& command)
+{
+    long head;
+
+    if (!parseNumber(args, args + strlen(args), head) || head < 1 || head > headCount) {
+        return false;
+    }
+    command.first = (int) head;
+    command.states[0] = state;
+    command.states[1] = '\0';
+    return true;
+}
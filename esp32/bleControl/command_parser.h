@@ -0,0 +1,63 @@
+#ifndef BLE_CONTROL_COMMAND_PARSER_H_
+#define BLE_CONTROL_COMMAND_PARSER_H_
+
+// Parser for the commands the nRF52840 writes over NUS, one byte at a time, each command ends with ';':
+//   S<first head>:<one state char per head>[#<seq>]   a frame, ie. "S1:g-#42", '-' leaves a head unchanged
+//   <red|yellow|green|off><head>                      one head, ie. "red1"
+// r/y/g/o are red/yellow/green/off. A command is reported once, when its ';' arrives.
+// No allocation and no Arduino dependencies, so it builds and can be tested on the host.
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Longest command kept, anything longer is discarded up to its ';'
+#define COMMAND_MAX_LENGTH 32
+// Heads one frame can set, same as the nRF52840's AE_CMD_MAX_FRAME_LIGHTS
+#define COMMAND_MAX_HEADS 8
+
+struct Command {
+    // False if it was malformed or named a head that does not exist, nothing must be applied then
+    bool valid;
+    // First head the states are for, from 1
+    int first;
+    // One state char per head from first on, r/y/g/o or '-', terminated
+    char states[COMMAND_MAX_HEADS + 1];
+    // Sequence number to acknowledge, 0 if the command has none. Set even when the command is invalid.
+    long seq;
+};
+
+class CommandParser
+{
+    public:
+        // @param headCount - Heads of this controller, commands for any other head are invalid
+        explicit CommandParser(int headCount);
+
+        // Feeds one received byte
+        // @return true if it completed a command, which is then in command
+        bool feed(char c, Command& command);
+
+        // The command feed() last completed, for logging
+        const char* text() const
+        {
+            return line;
+        }
+
+        // Commands discarded for being longer than COMMAND_MAX_LENGTH
+        uint32_t overflowCount() const
+        {
+            return overflows;
+        }
+
+    private:
+        int headCount;
+        char line[COMMAND_MAX_LENGTH + 1];
+        size_t length = 0;
+        bool overflow = false;
+        uint32_t overflows = 0;
+
+        void parse(Command& command);
+        bool parseFrame(const char* args, Command& command);
+        bool parseHead(const char* args, char state, Command& command);
+};
+
+#endif // BLE_CONTROL_COMMAND_PARSER_H_
@@ -0,0 +1,37 @@
+#ifndef BLE_CONTROL_TESTS_TEST_H_
+#define BLE_CONTROL_TESTS_TEST_H_
+
+// Bare bones test harness, a failed CHECK prints where it failed and the test executable exits with 1
+
+#include <stdio.h>
+
+static int testFailures = 0;
+
+#define CHECK(cond)                                                                 \
+    do {                                                                            \
+        if (!(cond)) {                                                              \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            testFailures++;                                                         \
+        }                                                                           \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                                          \
+    do {                                                                                        \
+        long long _a = (long long) (a);                                                         \
+        long long _b = (long long) (b);                                                         \
+        if (_a != _b) {                                                                         \
+            fprintf(stderr, "%s:%d: %s == %s failed, %lld != %lld\n", __FILE__, __LINE__, #a, #b, \
+                    _a, _b);                                                                    \
+            testFailures++;                                                                     \
+        }                                                                                       \
+    } while (0)
+
+#define RUN_TEST(fn)         \
+    do {                     \
+        printf("%s\n", #fn); \
+        fn();                \
+    } while (0)
+
+#define TEST_RESULT() (testFailures > 0 ? (fprintf(stderr, "%d failures\n", testFailures), 1) : 0)
+
+#endif // BLE_CONTROL_TESTS_TEST_H_
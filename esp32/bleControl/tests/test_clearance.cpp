@@ -0,0 +1,185 @@
+#include "clearance.h"
+#include "test.h"
+
+static const ClearanceTiming timing = { 3000, 1000 };
+
+// Two heads, each its own group: 0 shows green, 1 red
+static void setUpCrossing(ClearanceSequencer& sequencer)
+{
+    sequencer.setTarget(0, 'g');
+    sequencer.update(0);
+    CHECK_EQ(sequencer.shown(0), 'g');
+    CHECK_EQ(sequencer.shown(1), 'r');
+}
+
+static void testGreenToRed()
+{
+    ClearanceSequencer sequencer(2, timing);
+    uint32_t delay;
+
+    setUpCrossing(sequencer);
+    CHECK(!sequencer.nextDelay(0, delay));
+
+    sequencer.setTarget(0, 'r');
+    CHECK(sequencer.update(100));
+    CHECK_EQ(sequencer.shown(0), 'y');
+    CHECK(sequencer.nextDelay(100, delay));
+    CHECK_EQ(delay, 3000);
+
+    // Amber lasts amberMs, not a ms less
+    CHECK(!sequencer.update(3099));
+    CHECK_EQ(sequencer.shown(0), 'y');
+    CHECK(sequencer.update(3100));
+    CHECK_EQ(sequencer.shown(0), 'r');
+    CHECK(!sequencer.nextDelay(3100, delay));
+}
+
+static void testAmberRetargeted()
+{
+    ClearanceSequencer sequencer(2, timing);
+
+    setUpCrossing(sequencer);
+    sequencer.setTarget(0, 'r');
+    sequencer.update(0);
+    CHECK_EQ(sequencer.shown(0), 'y');
+
+    // Back to green while amber, amber still runs its course and clears through red
+    sequencer.setTarget(0, 'g');
+    sequencer.update(1000);
+    CHECK_EQ(sequencer.shown(0), 'y');
+    sequencer.update(3000);
+    CHECK_EQ(sequencer.shown(0), 'r');
+    // All-red first, even for the same head
+    sequencer.update(3999);
+    CHECK_EQ(sequencer.shown(0), 'r');
+    sequencer.update(4000);
+    CHECK_EQ(sequencer.shown(0), 'g');
+}
+
+static void testAllRedHold()
+{
+    ClearanceSequencer sequencer(2, timing);
+    uint32_t delay;
+
+    setUpCrossing(sequencer);
+    sequencer.setTarget(0, 'r');
+    sequencer.setTarget(1, 'g');
+    sequencer.update(0);
+    CHECK_EQ(sequencer.shown(0), 'y');
+    // Head 0 is still amber
+    CHECK_EQ(sequencer.shown(1), 'r');
+
+    sequencer.update(3000);
+    CHECK_EQ(sequencer.shown(0), 'r');
+    CHECK_EQ(sequencer.shown(1), 'r');
+    CHECK(sequencer.nextDelay(3000, delay));
+    CHECK_EQ(delay, 1000);
+
+    sequencer.update(3999);
+    CHECK_EQ(sequencer.shown(1), 'r');
+    CHECK(sequencer.update(4000));
+    CHECK_EQ(sequencer.shown(1), 'g');
+}
+
+static void testGroups()
+{
+    ClearanceSequencer sequencer(3, timing);
+
+    // 0 and 1 may be green together, 2 conflicts with both
+    sequencer.setGroup(0, 0);
+    sequencer.setGroup(1, 0);
+    sequencer.setGroup(2, 1);
+
+    sequencer.setTarget(0, 'g');
+    sequencer.setTarget(1, 'g');
+    sequencer.setTarget(2, 'g');
+    sequencer.update(0);
+    // Lowest head first, the conflicting head waits
+    CHECK_EQ(sequencer.shown(0), 'g');
+    CHECK_EQ(sequencer.shown(1), 'g');
+    CHECK_EQ(sequencer.shown(2), 'r');
+
+    // Only one of the group stops, the other still holds head 2 back
+    sequencer.setTarget(0, 'r');
+    sequencer.update(10000);
+    sequencer.update(13000);
+    CHECK_EQ(sequencer.shown(0), 'r');
+    CHECK_EQ(sequencer.shown(1), 'g');
+    sequencer.update(20000);
+    CHECK_EQ(sequencer.shown(2), 'r');
+
+    sequencer.setTarget(1, 'r');
+    sequencer.update(20000);
+    sequencer.update(23000);
+    CHECK_EQ(sequencer.shown(1), 'r');
+    CHECK_EQ(sequencer.shown(2), 'r');
+    sequencer.update(24000);
+    CHECK_EQ(sequencer.shown(2), 'g');
+}
+
+static void testOff()
+{
+    ClearanceSequencer sequencer(2, timing);
+
+    setUpCrossing(sequencer);
+
+    // Straight from green, no amber
+    sequencer.setTarget(0, 'o');
+    CHECK(sequencer.update(10));
+    CHECK_EQ(sequencer.shown(0), 'o');
+
+    // And from amber, without waiting for it to end
+    sequencer.setTarget(1, 'g');
+    sequencer.update(20);
+    CHECK_EQ(sequencer.shown(1), 'g');
+    sequencer.setTarget(1, 'r');
+    sequencer.update(30);
+    CHECK_EQ(sequencer.shown(1), 'y');
+    sequencer.setTarget(1, 'o');
+    CHECK(sequencer.update(31));
+    CHECK_EQ(sequencer.shown(1), 'o');
+
+    // From off to green goes straight to green, nothing conflicts
+    sequencer.setTarget(0, 'g');
+    sequencer.update(40);
+    CHECK_EQ(sequencer.shown(0), 'g');
+}
+
+static void testWraparound()
+{
+    ClearanceSequencer sequencer(2, timing);
+    const uint32_t start = 0xFFFFFFFFu - 1000;
+    uint32_t delay;
+
+    sequencer.setTarget(0, 'g');
+    sequencer.update(start);
+    sequencer.setTarget(0, 'r');
+    sequencer.setTarget(1, 'g');
+    sequencer.update(start);
+    CHECK_EQ(sequencer.shown(0), 'y');
+
+    // The amber ends after the ms counter has wrapped
+    CHECK(sequencer.nextDelay(start + 500, delay));
+    CHECK_EQ(delay, 2500);
+    sequencer.update(start + 500);
+    CHECK_EQ(sequencer.shown(0), 'y');
+    sequencer.update(start + 2999);
+    CHECK_EQ(sequencer.shown(0), 'y');
+    sequencer.update(start + 3000);
+    CHECK_EQ(sequencer.shown(0), 'r');
+    sequencer.update(start + 3999);
+    CHECK_EQ(sequencer.shown(1), 'r');
+    sequencer.update(start + 4000);
+    CHECK_EQ(sequencer.shown(1), 'g');
+}
+
+int main()
+{
+    RUN_TEST(testGreenToRed);
+    RUN_TEST(testAmberRetargeted);
+    RUN_TEST(testAllRedHold);
+    RUN_TEST(testGroups);
+    RUN_TEST(testOff);
+    RUN_TEST(testWraparound);
+    return TEST_RESULT();
+}
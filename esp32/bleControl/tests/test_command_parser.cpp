@@ -0,0 +1,219 @@
+#include <string.h>
+
+#include "command_parser.h"
+#include "byte_ring.h"
+#include "test.h"
+
+// Feeds text, returns the number of commands it completed, the last one in command
+static int feedAll(CommandParser& parser, const char* text, Command& command)
+{
+    int completed = 0;
+    for (const char* p = text; *p != '\0'; p++) {
+        if (parser.feed(*p, command)) {
+            completed++;
+        }
+    }
+    return completed;
+}
+
+static void testFrame()
+{
+    CommandParser parser(3);
+    Command command;
+
+    CHECK_EQ(feedAll(parser, "S1:g-r#42;", command), 1);
+    CHECK(command.valid);
+    CHECK_EQ(command.first, 1);
+    CHECK(strcmp(command.states, "g-r") == 0);
+    CHECK_EQ(command.seq, 42);
+    CHECK(strcmp(parser.text(), "S1:g-r#42") == 0);
+
+    // No sequence number
+    CHECK_EQ(feedAll(parser, "S2:oy;", command), 1);
+    CHECK(command.valid);
+    CHECK_EQ(command.first, 2);
+    CHECK(strcmp(command.states, "oy") == 0);
+    CHECK_EQ(command.seq, 0);
+}
+
+static void testSingleHead()
+{
+    CommandParser parser(2);
+    Command command;
+
+    CHECK_EQ(feedAll(parser, "yellow2;", command), 1);
+    CHECK(command.valid);
+    CHECK_EQ(command.first, 2);
+    CHECK(strcmp(command.states, "y") == 0);
+
+    CHECK_EQ(feedAll(parser, "off1;", command), 1);
+    CHECK(command.valid);
+    CHECK(strcmp(command.states, "o") == 0);
+}
+
+static void testBoundaries()
+{
+    CommandParser parser(2);
+    Command command;
+
+    // One command split over several writes
+    CHECK_EQ(feedAll(parser, "gre", command), 0);
+    CHECK_EQ(feedAll(parser, "en", command), 0);
+    CHECK_EQ(feedAll(parser, "1;", command), 1);
+    CHECK(command.valid);
+    CHECK_EQ(command.first, 1);
+    CHECK(strcmp(command.states, "g") == 0);
+
+    // Several commands in one write, each reported once
+    const char* merged = "red1;green2;S1:rr#7;";
+    int completed = 0;
+    char seen[3][COMMAND_MAX_HEADS + 1];
+    for (const char* p = merged; *p != '\0'; p++) {
+        if (parser.feed(*p, command)) {
+            CHECK(command.valid);
+            strcpy(seen[completed++], command.states);
+        }
+    }
+    CHECK_EQ(completed, 3);
+    CHECK(strcmp(seen[0], "r") == 0);
+    CHECK(strcmp(seen[1], "g") == 0);
+    CHECK(strcmp(seen[2], "rr") == 0);
+    CHECK_EQ(command.seq, 7);
+
+    // Empty commands are not commands
+    CHECK_EQ(feedAll(parser, ";;", command), 0);
+}
+
+static void testOverflow()
+{
+    CommandParser parser(8);
+    Command command;
+    char longCommand[COMMAND_MAX_LENGTH + 8];
+
+    // Exactly COMMAND_MAX_LENGTH still fits
+    memset(longCommand, 0, sizeof(longCommand));
+    memcpy(longCommand, "S1:rygo-ryg#", 12);
+    memset(longCommand + 12, '0', COMMAND_MAX_LENGTH - 12);
+    longCommand[COMMAND_MAX_LENGTH - 1] = '5';
+    CHECK_EQ(strlen(longCommand), COMMAND_MAX_LENGTH);
+    CHECK_EQ(feedAll(parser, longCommand, command) + feedAll(parser, ";", command), 1);
+    CHECK(command.valid);
+    CHECK_EQ(command.seq, 5);
+    CHECK_EQ(parser.overflowCount(), 0);
+
+    // One more and it is discarded up to its ';', the next command is fine
+    memset(longCommand + 12, '0', COMMAND_MAX_LENGTH - 11);
+    CHECK_EQ(feedAll(parser, longCommand, command), 0);
+    CHECK_EQ(feedAll(parser, "x;red1;", command), 1);
+    CHECK(command.valid);
+    CHECK(strcmp(command.states, "r") == 0);
+    CHECK_EQ(parser.overflowCount(), 1);
+}
+
+static void testInvalid()
+{
+    CommandParser parser(2);
+    Command command;
+    const char* invalid[] = {
+        // Unknown command
+        "blue1;",
+        "X1:g;",
+        // Heads that do not exist
+        "red0;",
+        "red3;",
+        "S2:gg;",
+        "S0:g;",
+        // Not a number or a state
+        "redx;",
+        "red;",
+        "S1:gx;",
+        "S:g;",
+        "S1g;",
+    };
+
+    for (const char* text : invalid) {
+        command.valid = true;
+        CHECK_EQ(feedAll(parser, text, command), 1);
+        if (command.valid) {
+            fprintf(stderr, "    accepted %s\n", text);
+        }
+        CHECK(!command.valid);
+        CHECK_EQ(command.seq, 0);
+    }
+}
+
+static void testSequence()
+{
+    CommandParser parser(2);
+    Command command;
+
+    // Taken even when the frame is invalid, the nRF52840 waits for the acknowledgement either way
+    CHECK_EQ(feedAll(parser, "S3:g#9;", command), 1);
+    CHECK(!command.valid);
+    CHECK_EQ(command.seq, 9);
+
+    // Zero, negative or not a number is no sequence number
+    CHECK_EQ(feedAll(parser, "S1:g#0;", command), 1);
+    CHECK(command.valid);
+    CHECK_EQ(command.seq, 0);
+    CHECK_EQ(feedAll(parser, "S1:g#-4;", command), 1);
+    CHECK_EQ(command.seq, 0);
+    CHECK_EQ(feedAll(parser, "S1:g#4a;", command), 1);
+    CHECK_EQ(command.seq, 0);
+
+    CHECK_EQ(feedAll(parser, "S1:g#65535;", command), 1);
+    CHECK(command.valid);
+    CHECK_EQ(command.seq, 65535);
+}
+
+static void testRing()
+{
+    ByteRing<8> ring;
+
+    CHECK_EQ(ring.pop(), -1);
+    CHECK_EQ(ring.peek(), -1);
+
+    // One slot stays free, so 7 fit
+    for (int i = 0; i < 7; i++) {
+        CHECK(ring.push((uint8_t) i));
+    }
+    CHECK_EQ(ring.size(), 7);
+    CHECK(!ring.push(99));
+    CHECK_EQ(ring.droppedCount(), 1);
+    CHECK_EQ(ring.peek(), 0);
+
+    // Around the end of the buffer several times, in order
+    int expected = 0;
+    int next = 7;
+    for (int round = 0; round < 20; round++) {
+        for (int i = 0; i < 3; i++) {
+            CHECK_EQ(ring.pop(), expected++ & 0xFF);
+        }
+        for (int i = 0; i < 3; i++) {
+            CHECK(ring.push((uint8_t) next++));
+        }
+        CHECK_EQ(ring.size(), 7);
+    }
+    while (ring.size() > 0) {
+        CHECK_EQ(ring.pop(), expected++ & 0xFF);
+    }
+    CHECK_EQ(expected, next);
+    CHECK_EQ(ring.pop(), -1);
+    CHECK_EQ(ring.droppedCount(), 1);
+
+    // Bytes above 127 come out as they went in, not as negative numbers
+    CHECK(ring.push(0xFF));
+    CHECK_EQ(ring.pop(), 0xFF);
+}
+
+int main()
+{
+    RUN_TEST(testFrame);
+    RUN_TEST(testSingleHead);
+    RUN_TEST(testBoundaries);
+    RUN_TEST(testOverflow);
+    RUN_TEST(testInvalid);
+    RUN_TEST(testSequence);
+    RUN_TEST(testRing);
+    return TEST_RESULT();
+}
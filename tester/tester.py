@@ -62,6 +62,104 @@ class Thingy:
         # bit of buffer room just in case
         time.sleep(self.sleep_time)
 
+    # Asks the thingy for its peak memory usage, prints the report and
+    # returns the number of stacks, heaps and slabs that are over budget
+    def check_memory(self, timeout=5.0):
+
+        self.ser.reset_input_buffer()
+        self.ser.write('!memStats;\r\n'.encode('UTF-8'))
+        print("Sent message: !memStats;")
+
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            line = self.ser.readline().decode('UTF-8', errors='ignore').strip()
+            if not line.startswith('!mem:'):
+                continue
+
+            fields = line[len('!mem:'):].rstrip(';').split(',')
+            if fields[0] == 'done':
+                return int(fields[1])
+
+            # kind, name, peak, size, ok/over
+            print("{:<7} {:<24} {:>6} / {:<6} {}".format(*fields))
+
+        print("No memory report received")
+        return -1
+
+    # Asks the thingy for its UART counters, prints them and returns the
+    # number of TX writes and RX chunks lost across both UARTs
+    def check_uarts(self, timeout=5.0):
+
+        self.ser.reset_input_buffer()
+        self.ser.write('!uartStats;\r\n'.encode('UTF-8'))
+        print("Sent message: !uartStats;")
+
+        lost = 0
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            line = self.ser.readline().decode('UTF-8', errors='ignore').strip()
+            if not line.startswith('!uart:'):
+                continue
+
+            fields = line[len('!uart:'):].rstrip(';').split(',')
+            if fields[0] == 'done':
+                return lost
+
+            if fields[0] == 'link':
+                # baud rate, negotiations, fallbacks, retransmits, lost, CRC errors
+                baudrate = int(fields[1]) or 'default'
+                print("link    {} baud, {} negotiations {} fallbacks {} retransmits {} lost {} CRC errors".format(
+                    baudrate, *fields[2:]))
+                continue
+
+            if fields[1] == 'tx':
+                # bytes, frames, drops, ring peak, ring size, TX_DONE avg us, TX_DONE max us
+                print("UART{} tx {:>8} B {:>6} frames {:>4} drops ring {:>5} / {:<5} done avg {} us max {} us".format(
+                    fields[0], *fields[2:]))
+                lost += int(fields[4])
+            else:
+                # chunks, dropped, overruns, queue peak, RX timeout us, line errors
+                print("UART{} rx {:>8} chunks {:>4} dropped {:>4} overruns queue peak {:>3} timeout {} us {} line errors".format(
+                    fields[0], *fields[2:]))
+                lost += int(fields[3]) + int(fields[4])
+
+        print("No UART report received")
+        return -1
+
+    # Runs the nRF9160 <-> nRF52840 link benchmark, needs test mode ("!testBegin;").
+    # frames=0 is a soak test that reports every 10 seconds until stopped, so give it a duration.
+    # Returns the final report as a dict, None if there was none
+    def bench_link(self, size=32, interval_ms=5, frames=1000, duration=None, timeout=30.0):
+
+        self.ser.reset_input_buffer()
+        command = '!bench{},{},{};'.format(size, interval_ms, frames)
+        self.ser.write((command + '\r\n').encode('UTF-8'))
+        print("Sent message: " + command)
+
+        names = ['sent', 'echoed', 'lost', 'reordered', 'skipped', 'bytes_per_sec',
+                 'p50_us', 'p90_us', 'p99_us', 'max_us']
+        stop_at = time.time() + duration if duration is not None else None
+        deadline = time.time() + timeout
+        while time.time() < deadline:
+            if stop_at is not None and time.time() >= stop_at:
+                self.ser.write('!benchStop;\r\n'.encode('UTF-8'))
+                print("Sent message: !benchStop;")
+                stop_at = None
+
+            line = self.ser.readline().decode('UTF-8', errors='ignore').strip()
+            if not line.startswith('!bench:'):
+                continue
+
+            fields = line[len('!bench:'):].rstrip(';').split(',')
+            report = dict(zip(names, (int(f) for f in fields[:len(names)])))
+            print("bench {sent} sent {echoed} echoed {lost} lost {reordered} reordered {skipped} skipped, "
+                  "{bytes_per_sec} B/s, rtt p50 {p50_us} p90 {p90_us} p99 {p99_us} max {max_us} us".format(**report))
+            if len(fields) > len(names) and fields[-1] == 'done':
+                return report
+
+        print("No final benchmark report received")
+        return None
+
     def close(self):
 
         # Close the serial
@@ -83,4 +181,14 @@ if __name__ == "__main__":
     tester.run_test("A;")
     tester.run_test("Test;")
 
-    tester.close()
\ No newline at end of file
+    print("\nChecking memory budgets")
+    over_budget = tester.check_memory()
+
+    print("\nChecking UART counters")
+    tester.check_uarts()
+
+    tester.close()
+
+    # Fail the run if any stack, heap or slab went over its budget
+    if over_budget != 0:
+        sys.exit(1)
\ No newline at end of file
@@ -0,0 +1,290 @@
+#ifndef TRAFFIC_LIGHT_COMMON_CHIP_LINK_H_
+#define TRAFFIC_LIGHT_COMMON_CHIP_LINK_H_
+
+/*
+    Binary framing for the UART between the nRF9160 and the nRF52840, shared by both applications.
+
+    Every frame is COBS encoded and delimited by 0x00 on both ends, so a receiver can always find the
+    start of the next frame and the ASCII messages ("!C;", "!S1:g-;", ...) can still be mixed in on
+    the same UART, they never contain 0x00. Decoded, a frame is:
+        type (1) | seq (1) | payload length (1) | payload (0..CHIP_LINK_MAX_PAYLOAD) | CRC16 (2, little endian)
+    The CRC is CRC-16/CCITT over everything before it. Frames with a bad CRC are dropped and counted.
+
+    Every frame except an ACK is acknowledged with an ACK carrying the same seq. Unacknowledged frames
+    are retransmitted, duplicates are acknowledged again but only delivered once.
+
+    At startup both sides send a HELLO with their protocol version until it is acknowledged, and answer
+    a peer's HELLO with their own. Binary frames are only sent once the peer has introduced itself with
+    a matching version. Until then, and for any message the peer never acknowledged, the message is
+    handed back to the application to send as ASCII, so old firmware and the tester keep working.
+
+    Both sides start at the devicetree baud rate. Once the handshake is done the side that called
+    chip_link_negotiate() tries the rates in CHIP_LINK_BAUD_RATES from the fastest down:
+        BAUD_SWITCH (acknowledged at the old rate), both switch after CHIP_LINK_BAUD_SETTLE_MS,
+        BAUD_TEST frames echoed back CHIP_LINK_BAUD_TESTS times, then BAUD_COMMIT.
+    A side that does not get that far within CHIP_LINK_BAUD_TRIAL_MS of switching goes back to the
+    default rate, and the next slower rate is tried. At a negotiated rate BAUD_TEST doubles as a
+    keepalive. Too many line errors, or a silent peer, drops both sides back to the default rate and
+    the negotiation starts over, one rate slower unless the rate had been working for a long time.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <zephyr/kernel.h>
+
+// Bump this when the frame layout or the meaning of a message changes
+#define CHIP_LINK_VERSION 6
+
+#define CHIP_LINK_MAX_PAYLOAD 32
+// Signal controllers (ESP32s) the nRF52840 can keep connected at the same time, the target of a message
+#define CHIP_LINK_MAX_TARGETS 4
+// Frames that can be waiting for an ACK at the same time, anything more goes out as ASCII
+#define CHIP_LINK_TX_WINDOW 4
+#define CHIP_LINK_ACK_TIMEOUT_MS 100
+#define CHIP_LINK_MAX_RETRIES 3
+// How often an unanswered HELLO is repeated, the peer may not have booted yet
+#define CHIP_LINK_HELLO_INTERVAL_MS 2000
+// Received sequence numbers remembered to spot retransmissions
+#define CHIP_LINK_RX_HISTORY 8
+
+// Rates tried by the negotiation, fastest first, the UART falls back to its devicetree rate
+#define CHIP_LINK_BAUD_RATES { 1000000, 460800, 230400 }
+#define CHIP_LINK_BAUD_RATE_COUNT 3
+// Time for the last frame at the old rate to leave the UART before switching
+#define CHIP_LINK_BAUD_SETTLE_MS 20
+// Echoed test frames needed before a rate is committed
+#define CHIP_LINK_BAUD_TESTS 3
+// A side that switched and saw no commit within this goes back to the default rate
+#define CHIP_LINK_BAUD_TRIAL_MS 1000
+#define CHIP_LINK_KEEPALIVE_INTERVAL_MS 2000
+// Nothing valid received for this long at a negotiated rate means the rates no longer match
+#define CHIP_LINK_SILENCE_MS (3 * CHIP_LINK_KEEPALIVE_INTERVAL_MS)
+// Line errors (UART errors, bad CRC, malformed frames) tolerated per window before falling back
+#define CHIP_LINK_LINE_ERROR_LIMIT 5
+#define CHIP_LINK_LINE_ERROR_WINDOW_MS 10000
+// A rate that worked this long before the peer went silent is tried again, the peer most likely restarted
+#define CHIP_LINK_BAUD_STABLE_MS 60000
+
+// type + seq + length + payload + CRC16
+#define CHIP_LINK_MAX_DECODED (3 + CHIP_LINK_MAX_PAYLOAD + 2)
+// RSSI histogram of CHIP_LINK_MSG_LINK_QUALITY, upper bounds (dBm) of the buckets, the last bucket holds everything stronger
+#define CHIP_LINK_RSSI_BUCKET_BOUNDS { -90, -80, -70, -60 }
+#define CHIP_LINK_RSSI_BUCKET_COUNT 5
+// How often the nRF52840 sends CHIP_LINK_MSG_LINK_QUALITY for each target in use
+#define CHIP_LINK_QUALITY_INTERVAL_MS 60000
+
+// COBS adds at most one byte for frames this short, plus the two delimiters
+#define CHIP_LINK_MAX_ENCODED (CHIP_LINK_MAX_DECODED + 1 + 2)
+
+enum chip_link_msg {
+    // No payload, seq is the frame being acknowledged
+    CHIP_LINK_MSG_ACK = 0x01,
+    // Protocol version (1), 1 if this is the answer to the peer's HELLO (1)
+    CHIP_LINK_MSG_HELLO = 0x02,
+    // Baud rate (4, little endian), switch to it after CHIP_LINK_BAUD_SETTLE_MS
+    CHIP_LINK_MSG_BAUD_SWITCH = 0x03,
+    // Test pattern, never acknowledged, the follower echoes it with the same seq
+    CHIP_LINK_MSG_BAUD_TEST = 0x04,
+    // Baud rate (4, little endian), the trial passed, stay at it
+    CHIP_LINK_MSG_BAUD_COMMIT = 0x05,
+    // Link benchmark, never acknowledged or retransmitted. The peer answers every BENCH_PING with a
+    // BENCH_ECHO carrying the same seq and payload, only the echo is handed to ops->received
+    CHIP_LINK_MSG_BENCH_PING = 0x06,
+    CHIP_LINK_MSG_BENCH_ECHO = 0x07,
+
+    // nRF9160 -> nRF52840
+    // Target (1), first light (1), command ID (2, 0 if untracked), one chip_link_light per light
+    CHIP_LINK_MSG_SET_FRAME = 0x10,
+    // Target (1), name of the device to scan for, not terminated
+    CHIP_LINK_MSG_START_SCAN = 0x11,
+    // Stops scanning for every target that is not connected yet
+    CHIP_LINK_MSG_STOP_SCAN = 0x12,
+
+    // nRF52840 -> nRF9160
+    // Target (1)
+    CHIP_LINK_MSG_BLE_CONNECTED = 0x20,
+    // Target (1)
+    CHIP_LINK_MSG_BLE_DISCONNECTED = 0x21,
+    CHIP_LINK_MSG_SCAN_STARTED = 0x22,
+    CHIP_LINK_MSG_SCAN_STOPPED = 0x23,
+    // Command ID (2), BLE hop ms (2)
+    CHIP_LINK_MSG_CMD_ACK = 0x24,
+    // Target (1), one chip_link_light per head of the signal controller (light 1 first) as the ESP32
+    // acknowledged it, CHIP_LINK_LIGHT_UNCHANGED for a head it has not confirmed yet
+    CHIP_LINK_MSG_LIGHT_STATE = 0x25,
+    // Target (1), then struct chip_link_quality, see chip_link_quality_encode(). Telemetry, no ASCII form
+    CHIP_LINK_MSG_LINK_QUALITY = 0x26,
+};
+
+// Light states in CHIP_LINK_MSG_SET_FRAME
+enum chip_link_light {
+    CHIP_LINK_LIGHT_UNCHANGED, CHIP_LINK_LIGHT_OFF, CHIP_LINK_LIGHT_RED, CHIP_LINK_LIGHT_YELLOW, CHIP_LINK_LIGHT_GREEN
+};
+
+// How the BLE link to a signal controller did over one CHIP_LINK_QUALITY_INTERVAL_MS
+struct chip_link_quality {
+    // dBm, all 0 if the RSSI was never read
+    int8_t rssi_min;
+    int8_t rssi_mean;
+    int8_t rssi_max;
+    // RSSI readings per CHIP_LINK_RSSI_BUCKET_BOUNDS bucket
+    uint16_t rssi_buckets[CHIP_LINK_RSSI_BUCKET_COUNT];
+    // Connection events that took place, and the ones the nRF52840 skipped (ie. for scanning or another peer)
+    uint32_t conn_events;
+    uint32_t conn_events_skipped;
+    uint8_t disconnects;
+    // HCI reason of the last disconnect, 0 if there was none
+    uint8_t last_reason;
+    uint8_t reconnects;
+    uint16_t reconnect_ms_max;
+    // Frames written again because the ESP32 did not acknowledge them in time
+    uint16_t retransmits;
+};
+
+// Target + 3 RSSI + buckets + events + skipped + disconnects + reason + reconnects + reconnect ms + retransmits
+#define CHIP_LINK_QUALITY_LENGTH (1 + 3 + 2 * CHIP_LINK_RSSI_BUCKET_COUNT + 4 + 4 + 1 + 1 + 1 + 2 + 2)
+
+struct chip_link_ops {
+    // Writes raw bytes to the UART
+    int (*write)(const uint8_t* data, size_t len);
+    // A message arrived from the peer, called once per message even when it was retransmitted
+    void (*received)(uint8_t type, const uint8_t* payload, size_t len);
+    // The message could not go out as a binary frame, send it as ASCII instead
+    void (*send_ascii)(uint8_t type, const uint8_t* payload, size_t len);
+    // Optional, switches the UART to a baud rate, 0 for its devicetree rate. Without it the link
+    // stays at the devicetree rate
+    int (*set_baudrate)(uint32_t baudrate);
+    // Optional, framing, parity, overrun and break errors the UART has counted so far
+    uint32_t (*line_errors)(void);
+};
+
+enum chip_link_baud_state {
+    // At the devicetree rate
+    CHIP_LINK_BAUD_IDLE,
+    // BAUD_SWITCH sent, waiting for its ACK
+    CHIP_LINK_BAUD_SWITCH,
+    // Waiting for the UART to drain before switching
+    CHIP_LINK_BAUD_SETTLE,
+    // Switched, sending test frames and waiting for the echoes
+    CHIP_LINK_BAUD_TEST,
+    // BAUD_COMMIT sent (leader), or waiting for it (follower)
+    CHIP_LINK_BAUD_COMMIT,
+    // The trial failed, waiting for the follower to give up as well before going back
+    CHIP_LINK_BAUD_REVERT,
+    // Running at a negotiated rate
+    CHIP_LINK_BAUD_DONE
+};
+
+struct chip_link_stats {
+    uint32_t tx_frames;
+    uint32_t tx_retransmits;
+    // Never acknowledged, sent as ASCII in the end
+    uint32_t tx_lost;
+    uint32_t rx_frames;
+    uint32_t rx_duplicates;
+    uint32_t rx_crc_errors;
+    // Bad COBS, wrong length or too long
+    uint32_t rx_malformed;
+    // 0 while at the devicetree rate
+    uint32_t baudrate;
+    uint32_t baud_negotiations;
+    // Back to the devicetree rate because of line errors or a silent peer
+    uint32_t baud_fallbacks;
+};
+
+struct chip_link_pending {
+    uint8_t type;
+    uint8_t seq;
+    uint8_t len;
+    uint8_t payload[CHIP_LINK_MAX_PAYLOAD];
+    int64_t sent_time;
+    uint8_t tries;
+    bool in_use;
+};
+
+struct chip_link {
+    const struct chip_link_ops* ops;
+    struct k_mutex lock;
+    struct k_work_delayable work;
+    bool peer_ready;
+    struct chip_link_stats stats;
+
+    // Receiving, only ever touched from the thread that calls chip_link_rx_byte()
+    uint8_t rx_buf[CHIP_LINK_MAX_ENCODED];
+    size_t rx_len;
+    bool rx_in_frame;
+    bool rx_overrun;
+    int16_t rx_history[CHIP_LINK_RX_HISTORY];
+    size_t rx_history_next;
+
+    // Sending
+    uint8_t tx_seq;
+    struct chip_link_pending pending[CHIP_LINK_TX_WINDOW];
+    bool hello_pending;
+    bool hello_reply;
+    uint8_t hello_seq;
+    int64_t hello_next;
+
+    // Baud rate negotiation, run by the work handler
+    bool baud_leader;
+    enum chip_link_baud_state baud_state;
+    // Index into CHIP_LINK_BAUD_RATES being tried or in use, CHIP_LINK_BAUD_RATE_COUNT for the default
+    uint8_t baud_idx;
+    // Fastest rate still worth trying, moves down after a fallback
+    uint8_t baud_max_idx;
+    bool baud_switched;
+    int64_t baud_deadline;
+    int64_t baud_trial_end;
+    int64_t baud_done_since;
+    // BAUD_SWITCH and BAUD_COMMIT are retransmitted like any other frame
+    uint8_t baud_seq;
+    uint8_t baud_tries;
+    uint8_t baud_tests_ok;
+    int64_t rx_last;
+    uint32_t line_errors_seen;
+    uint32_t line_errors_window;
+    int64_t line_error_window_start;
+};
+
+// Call this once before anything else
+void chip_link_init(struct chip_link* link, const struct chip_link_ops* ops);
+
+// Starts the version handshake, keeps sending HELLO until the peer acknowledges it
+void chip_link_start(struct chip_link* link);
+
+// Feeds one received byte to the link
+// @return true if the byte was part of a binary frame, false if it belongs to the ASCII protocol
+bool chip_link_rx_byte(struct chip_link* link, uint8_t byte);
+
+// Makes this side lead the baud rate negotiation, the peer follows. Call once, on one side only
+void chip_link_negotiate(struct chip_link* link);
+
+// Sends a message as a binary frame, or hands it to ops->send_ascii if the peer has not completed
+// the handshake or too many frames are waiting for an ACK
+// @return 0 if it went out as a binary frame, -ENOTCONN if it was sent as ASCII
+int chip_link_send(struct chip_link* link, uint8_t type, const uint8_t* payload, size_t len);
+
+// Sends a frame once, without waiting for an ACK, for messages where a loss is the information (ie. BENCH_PING)
+// @return 0, -ENOTCONN if the peer has not completed the handshake or the baud rate is being changed,
+//         -EINVAL if the payload is too long, or the error from ops->write
+int chip_link_send_unreliable(struct chip_link* link, uint8_t type, const uint8_t* payload, size_t len);
+
+// True once the peer has sent a HELLO with our protocol version
+bool chip_link_peer_ready(struct chip_link* link);
+
+void chip_link_stats_get(struct chip_link* link, struct chip_link_stats* stats);
+
+// Encodes one complete frame, delimiters included, into output (at least CHIP_LINK_MAX_ENCODED bytes)
+// @return the number of bytes written, 0 if the payload is too long
+size_t chip_link_encode(uint8_t type, uint8_t seq, const uint8_t* payload, size_t len, uint8_t* output);
+
+// Writes the payload of a CHIP_LINK_MSG_LINK_QUALITY, multi byte fields little endian
+// @return CHIP_LINK_QUALITY_LENGTH
+size_t chip_link_quality_encode(uint8_t target, const struct chip_link_quality* quality, uint8_t* payload);
+
+// Reads the payload of a CHIP_LINK_MSG_LINK_QUALITY
+// @return 0, or -EINVAL if it is too short
+int chip_link_quality_decode(const uint8_t* payload, size_t len, uint8_t* target, struct chip_link_quality* quality);
+
+#endif // TRAFFIC_LIGHT_COMMON_CHIP_LINK_H_
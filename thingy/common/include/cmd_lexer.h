@@ -0,0 +1,117 @@
+#ifndef TRAFFIC_LIGHT_COMMON_CMD_LEXER_H_
+#define TRAFFIC_LIGHT_COMMON_CMD_LEXER_H_
+
+/*
+    Lexer for the ASCII commands used on the UARTs, "!<command>[<arguments>];".
+    Used by the upper tester commands and the ASCII side of the link between the nRF9160 and nRF52840.
+
+    Each parser lists its commands in a const table. cmd_lexer_init() turns the table into a trie once,
+    so finding the command costs one step per character of its name however many commands there are.
+    A command with has_args set matches as a prefix and gets whatever follows its name, ie. "green"
+    matches "green1" with the arguments "1". Otherwise the whole message has to equal the name.
+    The longest matching name wins, so "SCAN_START" and "S" can live in the same table.
+    If the trie cannot be built, ie. max_nodes is too small, the lexer still works and compares the message
+    with every name in the table instead.
+
+    Messages longer than the buffer are dropped and counted, the lexer then waits for the next '!'.
+    A '!' inside a message means its end was lost, the partial message is dropped and counted and a new one starts.
+    No dynamic memory and no logging, callers log from the result of cmd_lexer_feed().
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#define CMD_LEXER_START '!'
+#define CMD_LEXER_END ';'
+
+struct cmd_lexer_cmd;
+
+// @param cmd - The table entry that matched
+// @param args - Everything after the name, "" if there is nothing
+// @return 0 on success, anything else if the arguments are invalid
+typedef int (*cmd_lexer_handler_t)(const struct cmd_lexer_cmd* cmd, const char* args);
+
+struct cmd_lexer_cmd {
+    const char* name;
+    // Whether anything may follow the name
+    bool has_args;
+    cmd_lexer_handler_t handler;
+    // Free for the handler, ie. the light state of "green", so several names can share a handler
+    int value;
+};
+
+struct cmd_lexer_node {
+    char c;
+    // Index + 1 of the command that ends here, 0 if none does
+    uint8_t cmd;
+    // Node indices, 0 means none since the root is never a child or sibling
+    uint16_t child;
+    uint16_t sibling;
+};
+
+struct cmd_lexer_stats {
+    uint32_t commands;
+    uint32_t unknown;
+    uint32_t bad_args;
+    uint32_t overflows;
+    // Messages cut short by the next '!'
+    uint32_t resyncs;
+};
+
+enum cmd_lexer_result {
+    // Nothing complete yet
+    CMD_LEXER_PENDING,
+    CMD_LEXER_DISPATCHED,
+    CMD_LEXER_UNKNOWN,
+    // The handler rejected the arguments
+    CMD_LEXER_BAD_ARGS,
+    // Message longer than the buffer, dropped
+    CMD_LEXER_OVERFLOW
+};
+
+struct cmd_lexer {
+    const struct cmd_lexer_cmd* cmds;
+    size_t cmd_count;
+    struct cmd_lexer_node* nodes;
+    size_t max_nodes;
+    size_t node_count;
+    // Holds the message being received, and the last complete one until the next '!'
+    char* buf;
+    size_t buf_size;
+    size_t len;
+    bool started;
+    struct cmd_lexer_stats stats;
+};
+
+// Defines a lexer for a command table
+// @param max_nodes - At least the number of characters in all the names together, plus one
+#define CMD_LEXER_DEFINE(_name, _cmds, _buf_size, _max_nodes)         \
+    static char _name##_buf[_buf_size];                              \
+    static struct cmd_lexer_node _name##_nodes[_max_nodes];          \
+    static struct cmd_lexer _name = {                                \
+        .cmds = _cmds,                                               \
+        .cmd_count = sizeof(_cmds) / sizeof((_cmds)[0]),             \
+        .nodes = _name##_nodes,                                      \
+        .max_nodes = _max_nodes,                                     \
+        .buf = _name##_buf,                                          \
+        .buf_size = _buf_size,                                       \
+    }
+
+// Resets the lexer and builds the trie. When building the trie fails commands are looked up by scanning the table.
+// @return 0, -ENOMEM if the names do not fit in max_nodes, -EINVAL for an empty or duplicate name.
+//         -EINVAL as well for a buffer shorter than 2 bytes, only then is the lexer not usable.
+int cmd_lexer_init(struct cmd_lexer* lexer);
+
+// Drops any partial message
+void cmd_lexer_reset(struct cmd_lexer* lexer);
+
+// Feeds one received character, calls the command's handler when a message is complete
+enum cmd_lexer_result cmd_lexer_feed(struct cmd_lexer* lexer, char c);
+
+// Finds the command for a message body (without '!' and ';')
+// @param args - Set to the arguments of the command
+// @return the command, NULL if there is none
+const struct cmd_lexer_cmd* cmd_lexer_lookup(const struct cmd_lexer* lexer, const char* body, const char** args);
+
+#endif // TRAFFIC_LIGHT_COMMON_CMD_LEXER_H_
@@ -0,0 +1,779 @@
+#include <string.h>
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+
+#include "chip_link.h"
+
+LOG_MODULE_REGISTER(chip_link, LOG_LEVEL_INF);
+
+#define CHIP_LINK_DELIMITER 0x00
+#define CHIP_LINK_CRC_SEED 0xFFFF
+// type + seq + length + CRC16
+#define CHIP_LINK_OVERHEAD 5
+
+static const uint32_t baud_rates[CHIP_LINK_BAUD_RATE_COUNT] = CHIP_LINK_BAUD_RATES;
+BUILD_ASSERT(CHIP_LINK_QUALITY_LENGTH <= CHIP_LINK_MAX_PAYLOAD, "Link quality does not fit a frame");
+
+// Alternating bits, bytes with every bit set or clear and runs of zeros for COBS
+static const uint8_t baud_test_pattern[] = {
+    0x55, 0xAA, 0x00, 0xFF, 0x0F, 0xF0, 0x33, 0xCC, 0x00, 0x00, 0x01, 0x80, 0x7E, 0x81, 0xA5, 0x5A
+};
+
+static size_t cobs_encode(const uint8_t* input, size_t len, uint8_t* output) {
+    size_t code_idx = 0;
+    size_t out_idx = 1;
+    uint8_t code = 1;
+
+    for (size_t i = 0; i < len; i++) {
+        if (input[i] == 0) {
+            output[code_idx] = code;
+            code_idx = out_idx++;
+            code = 1;
+            continue;
+        }
+        output[out_idx++] = input[i];
+        code++;
+        if (code == 0xFF) {
+            output[code_idx] = code;
+            code_idx = out_idx++;
+            code = 1;
+        }
+    }
+    output[code_idx] = code;
+    return out_idx;
+}
+
+static int cobs_decode(const uint8_t* input, size_t len, uint8_t* output, size_t output_len) {
+    size_t in_idx = 0;
+    size_t out_idx = 0;
+
+    while (in_idx < len) {
+        uint8_t code = input[in_idx++];
+        if (code == 0) {
+            return -EINVAL;
+        }
+        for (uint8_t i = 1; i < code; i++) {
+            if (in_idx >= len || out_idx >= output_len) {
+                return -EINVAL;
+            }
+            output[out_idx++] = input[in_idx++];
+        }
+        if (code != 0xFF && in_idx < len) {
+            if (out_idx >= output_len) {
+                return -EINVAL;
+            }
+            output[out_idx++] = 0;
+        }
+    }
+    return out_idx;
+}
+
+size_t chip_link_encode(uint8_t type, uint8_t seq, const uint8_t* payload, size_t len, uint8_t* output) {
+    uint8_t frame[CHIP_LINK_MAX_DECODED];
+
+    if (len > CHIP_LINK_MAX_PAYLOAD) {
+        return 0;
+    }
+
+    frame[0] = type;
+    frame[1] = seq;
+    frame[2] = (uint8_t) len;
+    if (len > 0) {
+        memcpy(&frame[3], payload, len);
+    }
+    sys_put_le16(crc16_itu_t(CHIP_LINK_CRC_SEED, frame, 3 + len), &frame[3 + len]);
+
+    output[0] = CHIP_LINK_DELIMITER;
+    size_t encoded_len = 1 + cobs_encode(frame, len + CHIP_LINK_OVERHEAD, &output[1]);
+    output[encoded_len++] = CHIP_LINK_DELIMITER;
+    return encoded_len;
+}
+
+// Call with the lock held
+static void write_frame(struct chip_link* link, uint8_t type, uint8_t seq, const uint8_t* payload, size_t len) {
+    uint8_t encoded[CHIP_LINK_MAX_ENCODED];
+    size_t encoded_len = chip_link_encode(type, seq, payload, len, encoded);
+    if (encoded_len > 0) {
+        link->ops->write(encoded, encoded_len);
+    }
+}
+
+static void write_hello(struct chip_link* link) {
+    uint8_t payload[2] = { CHIP_LINK_VERSION, link->hello_reply ? 1 : 0 };
+    write_frame(link, CHIP_LINK_MSG_HELLO, link->hello_seq, payload, sizeof(payload));
+}
+
+// Call with the lock held, (re)starts sending our HELLO
+static void queue_hello(struct chip_link* link, bool reply) {
+    link->hello_seq = link->tx_seq++;
+    link->hello_reply = reply;
+    link->hello_pending = true;
+    link->hello_next = 0;
+}
+
+static uint32_t baud_rate(uint8_t idx) {
+    return (idx < CHIP_LINK_BAUD_RATE_COUNT) ? baud_rates[idx] : 0;
+}
+
+// Between the switch and the commit frames may be sent at a rate the peer is not using,
+// so retransmissions and HELLOs wait until the rate is settled
+static bool baud_switching(struct chip_link* link) {
+    return link->baud_state == CHIP_LINK_BAUD_SETTLE || link->baud_state == CHIP_LINK_BAUD_TEST ||
+           link->baud_state == CHIP_LINK_BAUD_COMMIT || link->baud_state == CHIP_LINK_BAUD_REVERT;
+}
+
+// Call with the lock held
+static void set_baudrate(struct chip_link* link, uint8_t idx) {
+    int err = link->ops->set_baudrate(baud_rate(idx));
+    if (err) {
+        LOG_ERR("Could not switch the UART to %u baud: %d", baud_rate(idx), err);
+    }
+    link->stats.baudrate = baud_rate(idx);
+}
+
+// Call with the lock held, sends BAUD_SWITCH or BAUD_COMMIT for the rate being tried
+static void write_baud_ctrl(struct chip_link* link, uint8_t type, int64_t now) {
+    uint8_t payload[4];
+    sys_put_le32(baud_rate(link->baud_idx), payload);
+    write_frame(link, type, link->baud_seq, payload, sizeof(payload));
+    link->baud_deadline = now + CHIP_LINK_ACK_TIMEOUT_MS;
+}
+
+// Call with the lock held
+static void write_baud_test(struct chip_link* link, int64_t now) {
+    link->baud_seq = link->tx_seq++;
+    write_frame(link, CHIP_LINK_MSG_BAUD_TEST, link->baud_seq, baud_test_pattern, sizeof(baud_test_pattern));
+    link->baud_deadline = now + CHIP_LINK_ACK_TIMEOUT_MS;
+}
+
+// Call with the lock held
+static void baud_enter_done(struct chip_link* link, int64_t now) {
+    link->baud_state = CHIP_LINK_BAUD_DONE;
+    link->baud_done_since = now;
+    link->baud_deadline = now + CHIP_LINK_KEEPALIVE_INTERVAL_MS;
+    link->rx_last = now;
+    link->line_errors_seen = link->stats.rx_crc_errors + link->stats.rx_malformed +
+                             (link->ops->line_errors ? link->ops->line_errors() : 0);
+    link->line_errors_window = 0;
+    link->line_error_window_start = now;
+    link->stats.baud_negotiations++;
+    LOG_INF("Link running at %u baud", baud_rate(link->baud_idx));
+}
+
+// Call with the lock held, the leader gives up on the rate being tried
+static void baud_fail(struct chip_link* link, int64_t now, const char* why) {
+    LOG_WRN("%u baud failed, %s", baud_rate(link->baud_idx), why);
+    if (link->baud_state == CHIP_LINK_BAUD_COMMIT) {
+        // The follower may have committed and only our ACK got lost, it goes back once it hears nothing
+        link->baud_deadline = now + CHIP_LINK_SILENCE_MS + CHIP_LINK_KEEPALIVE_INTERVAL_MS;
+    }
+    else if (link->baud_switched) {
+        link->baud_deadline = link->baud_trial_end;
+    }
+    else {
+        // Only the ACK may have been lost, in which case the follower switched anyway
+        link->baud_deadline = now + CHIP_LINK_BAUD_SETTLE_MS + CHIP_LINK_BAUD_TRIAL_MS;
+    }
+    link->baud_state = CHIP_LINK_BAUD_REVERT;
+}
+
+// Call with the lock held, leaves a negotiated rate that stopped working
+// @param line_errors - The line itself is bad, rather than the peer having gone quiet
+static void baud_fall_back(struct chip_link* link, int64_t now, bool line_errors, const char* why) {
+    LOG_WRN("Link at %u baud %s, back to the default rate", baud_rate(link->baud_idx), why);
+    set_baudrate(link, CHIP_LINK_BAUD_RATE_COUNT);
+    link->stats.baud_fallbacks++;
+    link->baud_switched = false;
+    link->baud_state = CHIP_LINK_BAUD_IDLE;
+    if (link->baud_leader) {
+        // Start over once the follower has noticed the silence and fallen back as well
+        bool stable = !line_errors && now - link->baud_done_since >= CHIP_LINK_BAUD_STABLE_MS;
+        link->baud_max_idx = stable ? link->baud_idx : link->baud_idx + 1;
+        link->baud_deadline = now + CHIP_LINK_SILENCE_MS + CHIP_LINK_KEEPALIVE_INTERVAL_MS;
+    }
+    link->baud_idx = CHIP_LINK_BAUD_RATE_COUNT;
+}
+
+// Call with the lock held, keeps an eye on the line at a negotiated rate
+static void baud_check_line(struct chip_link* link, int64_t now) {
+    uint32_t errors = link->stats.rx_crc_errors + link->stats.rx_malformed +
+                      (link->ops->line_errors ? link->ops->line_errors() : 0);
+
+    if (now - link->line_error_window_start >= CHIP_LINK_LINE_ERROR_WINDOW_MS) {
+        link->line_error_window_start = now;
+        link->line_errors_window = 0;
+    }
+    link->line_errors_window += errors - link->line_errors_seen;
+    link->line_errors_seen = errors;
+
+    if (link->line_errors_window >= CHIP_LINK_LINE_ERROR_LIMIT) {
+        baud_fall_back(link, now, true, "has too many line errors");
+        return;
+    }
+    if (now - link->rx_last >= CHIP_LINK_SILENCE_MS) {
+        baud_fall_back(link, now, false, "went silent");
+        return;
+    }
+    if (link->baud_leader) {
+        write_baud_test(link, now);
+    }
+    link->baud_deadline = now + CHIP_LINK_KEEPALIVE_INTERVAL_MS;
+}
+
+// Call with the lock held, runs the negotiation
+// @return when it next needs to run, INT64_MAX if it does not
+static int64_t baud_poll(struct chip_link* link, int64_t now) {
+    if (link->ops->set_baudrate == NULL) {
+        return INT64_MAX;
+    }
+
+    switch (link->baud_state) {
+        case CHIP_LINK_BAUD_IDLE:
+            if (!link->baud_leader || !link->peer_ready || link->baud_max_idx >= CHIP_LINK_BAUD_RATE_COUNT) {
+                return INT64_MAX;
+            }
+            if (now < link->baud_deadline) {
+                break;
+            }
+            link->baud_idx = link->baud_max_idx;
+            link->baud_switched = false;
+            link->baud_seq = link->tx_seq++;
+            link->baud_tries = 1;
+            link->baud_state = CHIP_LINK_BAUD_SWITCH;
+            LOG_INF("Trying %u baud", baud_rate(link->baud_idx));
+            write_baud_ctrl(link, CHIP_LINK_MSG_BAUD_SWITCH, now);
+        break;
+        case CHIP_LINK_BAUD_SWITCH:
+        case CHIP_LINK_BAUD_COMMIT:
+            if (now < link->baud_deadline) {
+                break;
+            }
+            if (!link->baud_leader) {
+                // Follower, the trial ran out
+                LOG_WRN("No commit for %u baud, back to the default rate", baud_rate(link->baud_idx));
+                set_baudrate(link, CHIP_LINK_BAUD_RATE_COUNT);
+                link->baud_switched = false;
+                link->baud_idx = CHIP_LINK_BAUD_RATE_COUNT;
+                link->baud_state = CHIP_LINK_BAUD_IDLE;
+                return INT64_MAX;
+            }
+            if (link->baud_tries > CHIP_LINK_MAX_RETRIES) {
+                baud_fail(link, now, "never acknowledged");
+                break;
+            }
+            link->baud_tries++;
+            write_baud_ctrl(link, link->baud_state == CHIP_LINK_BAUD_SWITCH ?
+                            CHIP_LINK_MSG_BAUD_SWITCH : CHIP_LINK_MSG_BAUD_COMMIT, now);
+        break;
+        case CHIP_LINK_BAUD_SETTLE:
+            if (now < link->baud_deadline) {
+                break;
+            }
+            set_baudrate(link, link->baud_idx);
+            link->baud_switched = true;
+            if (link->baud_leader) {
+                link->baud_trial_end = now + CHIP_LINK_BAUD_TRIAL_MS;
+                link->baud_tests_ok = 0;
+                link->baud_tries = 1;
+                link->baud_state = CHIP_LINK_BAUD_TEST;
+                write_baud_test(link, now);
+            }
+            else {
+                link->baud_state = CHIP_LINK_BAUD_COMMIT;
+                link->baud_deadline = now + CHIP_LINK_BAUD_TRIAL_MS;
+            }
+        break;
+        case CHIP_LINK_BAUD_TEST:
+            if (now < link->baud_deadline) {
+                break;
+            }
+            if (link->baud_tries > CHIP_LINK_MAX_RETRIES) {
+                baud_fail(link, now, "test frames were not echoed");
+                break;
+            }
+            link->baud_tries++;
+            write_baud_test(link, now);
+        break;
+        case CHIP_LINK_BAUD_REVERT:
+            if (now < link->baud_deadline) {
+                break;
+            }
+            if (link->baud_switched) {
+                set_baudrate(link, CHIP_LINK_BAUD_RATE_COUNT);
+                link->baud_switched = false;
+            }
+            link->baud_max_idx = link->baud_idx + 1;
+            link->baud_idx = CHIP_LINK_BAUD_RATE_COUNT;
+            link->baud_state = CHIP_LINK_BAUD_IDLE;
+            link->baud_deadline = now + CHIP_LINK_BAUD_SETTLE_MS;
+            if (link->baud_max_idx >= CHIP_LINK_BAUD_RATE_COUNT) {
+                LOG_WRN("No faster rate works, staying at the default rate");
+                return INT64_MAX;
+            }
+        break;
+        case CHIP_LINK_BAUD_DONE:
+            if (now >= link->baud_deadline) {
+                baud_check_line(link, now);
+            }
+        break;
+    }
+
+    if (link->baud_state == CHIP_LINK_BAUD_IDLE && !link->baud_leader) {
+        return INT64_MAX;
+    }
+    return link->baud_deadline;
+}
+
+// BAUD_SWITCH or BAUD_COMMIT from the leader, already acknowledged
+static void handle_baud_ctrl(struct chip_link* link, uint8_t type, const uint8_t* payload, size_t len) {
+    if (link->baud_leader || link->ops->set_baudrate == NULL || len < 4) {
+        return;
+    }
+
+    uint32_t rate = sys_get_le32(payload);
+    uint8_t idx = 0;
+    while (idx < CHIP_LINK_BAUD_RATE_COUNT && baud_rates[idx] != rate) {
+        idx++;
+    }
+    if (idx == CHIP_LINK_BAUD_RATE_COUNT) {
+        LOG_WRN("Peer asked for %u baud, which we do not support", rate);
+        return;
+    }
+
+    k_mutex_lock(&link->lock, K_FOREVER);
+    int64_t now = k_uptime_get();
+    // Retransmissions change nothing, our previous ACK got lost
+    if (type == CHIP_LINK_MSG_BAUD_SWITCH && link->baud_state == CHIP_LINK_BAUD_IDLE) {
+        link->baud_idx = idx;
+        link->baud_state = CHIP_LINK_BAUD_SETTLE;
+        link->baud_deadline = now + CHIP_LINK_BAUD_SETTLE_MS;
+    }
+    else if (type == CHIP_LINK_MSG_BAUD_COMMIT && link->baud_state == CHIP_LINK_BAUD_COMMIT &&
+             idx == link->baud_idx) {
+        baud_enter_done(link, now);
+    }
+    k_mutex_unlock(&link->lock);
+    k_work_reschedule(&link->work, K_NO_WAIT);
+}
+
+// BAUD_TEST, the follower echoes it, the leader counts the echoes
+static void handle_baud_test(struct chip_link* link, uint8_t seq, const uint8_t* payload, size_t len) {
+    k_mutex_lock(&link->lock, K_FOREVER);
+    if (!link->baud_leader) {
+        write_frame(link, CHIP_LINK_MSG_BAUD_TEST, seq, payload, len);
+        k_mutex_unlock(&link->lock);
+        return;
+    }
+
+    bool intact = len == sizeof(baud_test_pattern) && memcmp(payload, baud_test_pattern, len) == 0;
+    if (link->baud_state != CHIP_LINK_BAUD_TEST || seq != link->baud_seq || !intact) {
+        k_mutex_unlock(&link->lock);
+        return;
+    }
+
+    int64_t now = k_uptime_get();
+    if (++link->baud_tests_ok < CHIP_LINK_BAUD_TESTS) {
+        write_baud_test(link, now);
+    }
+    else {
+        link->baud_seq = link->tx_seq++;
+        link->baud_tries = 1;
+        link->baud_state = CHIP_LINK_BAUD_COMMIT;
+        write_baud_ctrl(link, CHIP_LINK_MSG_BAUD_COMMIT, now);
+    }
+    k_mutex_unlock(&link->lock);
+    k_work_reschedule(&link->work, K_MSEC(CHIP_LINK_ACK_TIMEOUT_MS));
+}
+
+// Call with the lock held, an ACK for BAUD_SWITCH or BAUD_COMMIT
+// @return true if the negotiation moved on
+static bool baud_acked(struct chip_link* link, uint8_t seq) {
+    if (!link->baud_leader || seq != link->baud_seq) {
+        return false;
+    }
+
+    int64_t now = k_uptime_get();
+    if (link->baud_state == CHIP_LINK_BAUD_SWITCH) {
+        link->baud_state = CHIP_LINK_BAUD_SETTLE;
+        link->baud_deadline = now + CHIP_LINK_BAUD_SETTLE_MS;
+        return true;
+    }
+    if (link->baud_state == CHIP_LINK_BAUD_COMMIT) {
+        baud_enter_done(link, now);
+        return true;
+    }
+    return false;
+}
+
+static void link_work_handler(struct k_work* work) {
+    struct k_work_delayable* dwork = k_work_delayable_from_work(work);
+    struct chip_link* link = CONTAINER_OF(dwork, struct chip_link, work);
+    struct chip_link_pending lost[CHIP_LINK_TX_WINDOW];
+    size_t lost_count = 0;
+
+    k_mutex_lock(&link->lock, K_FOREVER);
+    int64_t now = k_uptime_get();
+    int64_t next = baud_poll(link, now);
+    bool hold = baud_switching(link);
+
+    for (size_t i = 0; i < CHIP_LINK_TX_WINDOW; i++) {
+        struct chip_link_pending* p = &link->pending[i];
+        if (!p->in_use) {
+            continue;
+        }
+        if (hold) {
+            // Counted from when the rate is settled
+            p->sent_time = now;
+            continue;
+        }
+        if (now - p->sent_time >= CHIP_LINK_ACK_TIMEOUT_MS) {
+            if (p->tries > CHIP_LINK_MAX_RETRIES) {
+                // The peer is gone or was replaced, go back to ASCII until it says hello again
+                lost[lost_count++] = *p;
+                p->in_use = false;
+                link->stats.tx_lost++;
+                if (link->peer_ready) {
+                    LOG_WRN("Frame %d was never acknowledged, falling back to ASCII", p->seq);
+                    link->peer_ready = false;
+                    queue_hello(link, false);
+                }
+                continue;
+            }
+            write_frame(link, p->type, p->seq, p->payload, p->len);
+            p->tries++;
+            p->sent_time = now;
+            link->stats.tx_retransmits++;
+        }
+        next = MIN(next, p->sent_time + CHIP_LINK_ACK_TIMEOUT_MS);
+    }
+
+    if (link->hello_pending && !hold) {
+        if (now >= link->hello_next) {
+            write_hello(link);
+            link->hello_next = now + CHIP_LINK_HELLO_INTERVAL_MS;
+        }
+        next = MIN(next, link->hello_next);
+    }
+    k_mutex_unlock(&link->lock);
+
+    for (size_t i = 0; i < lost_count; i++) {
+        link->ops->send_ascii(lost[i].type, lost[i].payload, lost[i].len);
+    }
+
+    if (next != INT64_MAX) {
+        k_work_reschedule(&link->work, K_MSEC(MAX(next - now, 1)));
+    }
+}
+
+void chip_link_init(struct chip_link* link, const struct chip_link_ops* ops) {
+    memset(link, 0, sizeof(struct chip_link));
+    link->ops = ops;
+    k_mutex_init(&link->lock);
+    k_work_init_delayable(&link->work, link_work_handler);
+    for (size_t i = 0; i < CHIP_LINK_RX_HISTORY; i++) {
+        link->rx_history[i] = -1;
+    }
+    link->baud_state = CHIP_LINK_BAUD_IDLE;
+    link->baud_idx = CHIP_LINK_BAUD_RATE_COUNT;
+    link->baud_max_idx = CHIP_LINK_BAUD_RATE_COUNT;
+}
+
+void chip_link_negotiate(struct chip_link* link) {
+    k_mutex_lock(&link->lock, K_FOREVER);
+    link->baud_leader = true;
+    link->baud_max_idx = 0;
+    link->baud_deadline = 0;
+    k_mutex_unlock(&link->lock);
+    k_work_reschedule(&link->work, K_NO_WAIT);
+}
+
+void chip_link_start(struct chip_link* link) {
+    k_mutex_lock(&link->lock, K_FOREVER);
+    queue_hello(link, false);
+    k_mutex_unlock(&link->lock);
+    k_work_reschedule(&link->work, K_NO_WAIT);
+}
+
+static bool rx_seen(struct chip_link* link, uint8_t seq) {
+    for (size_t i = 0; i < CHIP_LINK_RX_HISTORY; i++) {
+        if (link->rx_history[i] == seq) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void rx_remember(struct chip_link* link, uint8_t seq) {
+    link->rx_history[link->rx_history_next] = seq;
+    link->rx_history_next = (link->rx_history_next + 1) % CHIP_LINK_RX_HISTORY;
+}
+
+static void handle_hello(struct chip_link* link, uint8_t seq, const uint8_t* payload, size_t len) {
+    uint8_t version = (len > 0) ? payload[0] : 0;
+    bool reply = (len > 1) && payload[1] != 0;
+
+    // The peer has just (re)started and numbers its frames from scratch
+    for (size_t i = 0; i < CHIP_LINK_RX_HISTORY; i++) {
+        link->rx_history[i] = -1;
+    }
+    rx_remember(link, seq);
+
+    k_mutex_lock(&link->lock, K_FOREVER);
+    bool was_ready = link->peer_ready;
+    link->peer_ready = (version == CHIP_LINK_VERSION);
+    if (!reply) {
+        // It does not know about us yet
+        queue_hello(link, true);
+    }
+    bool negotiate = link->baud_leader && link->peer_ready && !was_ready;
+    k_mutex_unlock(&link->lock);
+
+    if (version != CHIP_LINK_VERSION) {
+        LOG_ERR("Peer speaks protocol version %d, we speak %d, staying with ASCII", version, CHIP_LINK_VERSION);
+    }
+    else if (!was_ready) {
+        LOG_INF("Peer speaks protocol version %d, switching to binary frames", version);
+    }
+
+    if (!reply || negotiate) {
+        k_work_reschedule(&link->work, K_NO_WAIT);
+    }
+}
+
+static void handle_frame(struct chip_link* link) {
+    uint8_t frame[CHIP_LINK_MAX_DECODED];
+    int len = cobs_decode(link->rx_buf, link->rx_len, frame, sizeof(frame));
+
+    if (len < CHIP_LINK_OVERHEAD || frame[2] != len - CHIP_LINK_OVERHEAD) {
+        LOG_WRN("Dropped malformed frame");
+        link->stats.rx_malformed++;
+        return;
+    }
+    if (crc16_itu_t(CHIP_LINK_CRC_SEED, frame, len - 2) != sys_get_le16(&frame[len - 2])) {
+        LOG_WRN("Dropped frame with bad CRC");
+        link->stats.rx_crc_errors++;
+        return;
+    }
+
+    uint8_t type = frame[0];
+    uint8_t seq = frame[1];
+    const uint8_t* payload = &frame[3];
+    size_t payload_len = frame[2];
+
+    k_mutex_lock(&link->lock, K_FOREVER);
+    link->rx_last = k_uptime_get();
+    k_mutex_unlock(&link->lock);
+
+    if (type == CHIP_LINK_MSG_BAUD_TEST) {
+        handle_baud_test(link, seq, payload, payload_len);
+        return;
+    }
+    if (type == CHIP_LINK_MSG_BENCH_PING) {
+        k_mutex_lock(&link->lock, K_FOREVER);
+        write_frame(link, CHIP_LINK_MSG_BENCH_ECHO, seq, payload, payload_len);
+        k_mutex_unlock(&link->lock);
+        return;
+    }
+    if (type == CHIP_LINK_MSG_BENCH_ECHO) {
+        link->ops->received(type, payload, payload_len);
+        return;
+    }
+
+    if (type == CHIP_LINK_MSG_ACK) {
+        k_mutex_lock(&link->lock, K_FOREVER);
+        for (size_t i = 0; i < CHIP_LINK_TX_WINDOW; i++) {
+            if (link->pending[i].in_use && link->pending[i].seq == seq) {
+                link->pending[i].in_use = false;
+            }
+        }
+        if (link->hello_pending && link->hello_seq == seq) {
+            link->hello_pending = false;
+        }
+        bool baud_moved = baud_acked(link, seq);
+        k_mutex_unlock(&link->lock);
+        if (baud_moved) {
+            k_work_reschedule(&link->work, K_NO_WAIT);
+        }
+        return;
+    }
+
+    // Acknowledge even duplicates, our previous ACK may be the one that got lost
+    k_mutex_lock(&link->lock, K_FOREVER);
+    write_frame(link, CHIP_LINK_MSG_ACK, seq, NULL, 0);
+    k_mutex_unlock(&link->lock);
+
+    if (type == CHIP_LINK_MSG_HELLO) {
+        handle_hello(link, seq, payload, payload_len);
+        return;
+    }
+    if (type == CHIP_LINK_MSG_BAUD_SWITCH || type == CHIP_LINK_MSG_BAUD_COMMIT) {
+        handle_baud_ctrl(link, type, payload, payload_len);
+        return;
+    }
+
+    if (rx_seen(link, seq)) {
+        link->stats.rx_duplicates++;
+        return;
+    }
+    rx_remember(link, seq);
+    link->stats.rx_frames++;
+    link->ops->received(type, payload, payload_len);
+}
+
+bool chip_link_rx_byte(struct chip_link* link, uint8_t byte) {
+    if (byte == CHIP_LINK_DELIMITER) {
+        if (link->rx_in_frame && link->rx_len > 0) {
+            // Closing delimiter
+            if (!link->rx_overrun) {
+                handle_frame(link);
+            }
+            link->rx_in_frame = false;
+        }
+        else {
+            // Opening delimiter, or the closing one of a frame we joined halfway through
+            link->rx_in_frame = true;
+        }
+        link->rx_len = 0;
+        link->rx_overrun = false;
+        return true;
+    }
+
+    if (!link->rx_in_frame) {
+        return false;
+    }
+
+    if (link->rx_len >= CHIP_LINK_MAX_ENCODED) {
+        if (!link->rx_overrun) {
+            LOG_WRN("Dropped frame that is too long");
+            link->stats.rx_malformed++;
+            link->rx_overrun = true;
+        }
+        return true;
+    }
+    link->rx_buf[link->rx_len++] = byte;
+    return true;
+}
+
+int chip_link_send(struct chip_link* link, uint8_t type, const uint8_t* payload, size_t len) {
+    struct chip_link_pending* p = NULL;
+
+    k_mutex_lock(&link->lock, K_FOREVER);
+    if (link->peer_ready && len <= CHIP_LINK_MAX_PAYLOAD) {
+        for (size_t i = 0; i < CHIP_LINK_TX_WINDOW; i++) {
+            if (!link->pending[i].in_use) {
+                p = &link->pending[i];
+                break;
+            }
+        }
+        if (p == NULL) {
+            LOG_WRN("Too many frames waiting for an ACK, sending as ASCII");
+        }
+    }
+
+    if (p == NULL) {
+        k_mutex_unlock(&link->lock);
+        link->ops->send_ascii(type, payload, len);
+        return -ENOTCONN;
+    }
+
+    p->type = type;
+    p->seq = link->tx_seq++;
+    p->len = (uint8_t) len;
+    if (len > 0) {
+        memcpy(p->payload, payload, len);
+    }
+    p->tries = 1;
+    p->sent_time = k_uptime_get();
+    p->in_use = true;
+    if (!baud_switching(link)) {
+        write_frame(link, p->type, p->seq, p->payload, p->len);
+    }
+    link->stats.tx_frames++;
+    k_mutex_unlock(&link->lock);
+
+    k_work_reschedule(&link->work, K_MSEC(CHIP_LINK_ACK_TIMEOUT_MS));
+    return 0;
+}
+
+int chip_link_send_unreliable(struct chip_link* link, uint8_t type, const uint8_t* payload, size_t len) {
+    uint8_t encoded[CHIP_LINK_MAX_ENCODED];
+    int err;
+
+    if (len > CHIP_LINK_MAX_PAYLOAD) {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&link->lock, K_FOREVER);
+    if (!link->peer_ready || baud_switching(link)) {
+        k_mutex_unlock(&link->lock);
+        return -ENOTCONN;
+    }
+    size_t encoded_len = chip_link_encode(type, link->tx_seq++, payload, len, encoded);
+    err = link->ops->write(encoded, encoded_len);
+    k_mutex_unlock(&link->lock);
+    return err;
+}
+
+bool chip_link_peer_ready(struct chip_link* link) {
+    return link->peer_ready;
+}
+
+void chip_link_stats_get(struct chip_link* link, struct chip_link_stats* stats) {
+    k_mutex_lock(&link->lock, K_FOREVER);
+    *stats = link->stats;
+    k_mutex_unlock(&link->lock);
+}
+
+size_t chip_link_quality_encode(uint8_t target, const struct chip_link_quality* quality, uint8_t* payload) {
+    size_t i = 0;
+    payload[i++] = target;
+    payload[i++] = (uint8_t) quality->rssi_min;
+    payload[i++] = (uint8_t) quality->rssi_mean;
+    payload[i++] = (uint8_t) quality->rssi_max;
+    for (size_t b = 0; b < CHIP_LINK_RSSI_BUCKET_COUNT; b++) {
+        sys_put_le16(quality->rssi_buckets[b], &payload[i]);
+        i += 2;
+    }
+    sys_put_le32(quality->conn_events, &payload[i]);
+    i += 4;
+    sys_put_le32(quality->conn_events_skipped, &payload[i]);
+    i += 4;
+    payload[i++] = quality->disconnects;
+    payload[i++] = quality->last_reason;
+    payload[i++] = quality->reconnects;
+    sys_put_le16(quality->reconnect_ms_max, &payload[i]);
+    i += 2;
+    sys_put_le16(quality->retransmits, &payload[i]);
+    i += 2;
+    return i;
+}
+
+int chip_link_quality_decode(const uint8_t* payload, size_t len, uint8_t* target, struct chip_link_quality* quality) {
+    if (len < CHIP_LINK_QUALITY_LENGTH) {
+        return -EINVAL;
+    }
+
+    size_t i = 0;
+    *target = payload[i++];
+    quality->rssi_min = (int8_t) payload[i++];
+    quality->rssi_mean = (int8_t) payload[i++];
+    quality->rssi_max = (int8_t) payload[i++];
+    for (size_t b = 0; b < CHIP_LINK_RSSI_BUCKET_COUNT; b++) {
+        quality->rssi_buckets[b] = sys_get_le16(&payload[i]);
+        i += 2;
+    }
+    quality->conn_events = sys_get_le32(&payload[i]);
+    i += 4;
+    quality->conn_events_skipped = sys_get_le32(&payload[i]);
+    i += 4;
+    quality->disconnects = payload[i++];
+    quality->last_reason = payload[i++];
+    quality->reconnects = payload[i++];
+    quality->reconnect_ms_max = sys_get_le16(&payload[i]);
+    i += 2;
+    quality->retransmits = sys_get_le16(&payload[i]);
+    return 0;
+}
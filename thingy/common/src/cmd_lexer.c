@@ -0,0 +1,182 @@
+#include <string.h>
+#include <errno.h>
+
+#include "cmd_lexer.h"
+
+#define CMD_LEXER_ROOT 0
+
+static uint16_t find_child(const struct cmd_lexer* lexer, uint16_t node, char c) {
+    for (uint16_t child = lexer->nodes[node].child; child != 0; child = lexer->nodes[child].sibling) {
+        if (lexer->nodes[child].c == c) {
+            return child;
+        }
+    }
+    return 0;
+}
+
+static int insert(struct cmd_lexer* lexer, size_t cmd_idx) {
+    const char* name = lexer->cmds[cmd_idx].name;
+    uint16_t node = CMD_LEXER_ROOT;
+
+    if (name == NULL || name[0] == '\0') {
+        return -EINVAL;
+    }
+
+    for (const char* p = name; *p != '\0'; p++) {
+        uint16_t child = find_child(lexer, node, *p);
+        if (child == 0) {
+            if (lexer->node_count >= lexer->max_nodes) {
+                return -ENOMEM;
+            }
+            child = (uint16_t) lexer->node_count++;
+            lexer->nodes[child].c = *p;
+            lexer->nodes[child].cmd = 0;
+            lexer->nodes[child].child = 0;
+            lexer->nodes[child].sibling = lexer->nodes[node].child;
+            lexer->nodes[node].child = child;
+        }
+        node = child;
+    }
+
+    if (lexer->nodes[node].cmd != 0) {
+        return -EINVAL;
+    }
+    lexer->nodes[node].cmd = (uint8_t) (cmd_idx + 1);
+    return 0;
+}
+
+int cmd_lexer_init(struct cmd_lexer* lexer) {
+    if (lexer->buf_size < 2) {
+        return -EINVAL;
+    }
+
+    memset(&lexer->stats, 0, sizeof(struct cmd_lexer_stats));
+    cmd_lexer_reset(lexer);
+
+    // Until the trie is complete lookups go through the table one by one
+    lexer->node_count = 0;
+    if (lexer->max_nodes == 0 || lexer->cmd_count > UINT8_MAX) {
+        return -ENOMEM;
+    }
+
+    memset(lexer->nodes, 0, lexer->max_nodes * sizeof(struct cmd_lexer_node));
+    lexer->node_count = 1;
+    for (size_t i = 0; i < lexer->cmd_count; i++) {
+        int err = insert(lexer, i);
+        if (err) {
+            lexer->node_count = 0;
+            return err;
+        }
+    }
+    return 0;
+}
+
+void cmd_lexer_reset(struct cmd_lexer* lexer) {
+    lexer->started = false;
+    lexer->len = 0;
+    lexer->buf[0] = '\0';
+}
+
+// Same result as the trie, one name at a time
+static const struct cmd_lexer_cmd* lookup_linear(const struct cmd_lexer* lexer, const char* body, const char** args) {
+    const struct cmd_lexer_cmd* best = NULL;
+    size_t best_len = 0;
+
+    for (size_t i = 0; i < lexer->cmd_count; i++) {
+        const struct cmd_lexer_cmd* cmd = &lexer->cmds[i];
+        if (cmd->name == NULL) {
+            continue;
+        }
+        size_t len = strlen(cmd->name);
+        if (len <= best_len || strncmp(body, cmd->name, len) != 0) {
+            continue;
+        }
+        if (body[len] == '\0' || cmd->has_args) {
+            best = cmd;
+            best_len = len;
+            *args = &body[len];
+        }
+    }
+    return best;
+}
+
+const struct cmd_lexer_cmd* cmd_lexer_lookup(const struct cmd_lexer* lexer, const char* body, const char** args) {
+    const struct cmd_lexer_cmd* best = NULL;
+    uint16_t node = CMD_LEXER_ROOT;
+    const char* p = body;
+
+    *args = NULL;
+    if (lexer->node_count == 0) {
+        return lookup_linear(lexer, body, args);
+    }
+    while (*p != '\0') {
+        node = find_child(lexer, node, *p);
+        if (node == 0) {
+            break;
+        }
+        p++;
+
+        uint8_t cmd_idx = lexer->nodes[node].cmd;
+        if (cmd_idx == 0) {
+            continue;
+        }
+        const struct cmd_lexer_cmd* cmd = &lexer->cmds[cmd_idx - 1];
+        if (*p == '\0' || cmd->has_args) {
+            // Longest match so far
+            best = cmd;
+            *args = p;
+        }
+    }
+    return best;
+}
+
+static enum cmd_lexer_result dispatch(struct cmd_lexer* lexer) {
+    const char* args;
+    const struct cmd_lexer_cmd* cmd = cmd_lexer_lookup(lexer, lexer->buf, &args);
+
+    if (cmd == NULL) {
+        lexer->stats.unknown++;
+        return CMD_LEXER_UNKNOWN;
+    }
+    if (cmd->handler(cmd, args) != 0) {
+        lexer->stats.bad_args++;
+        return CMD_LEXER_BAD_ARGS;
+    }
+    lexer->stats.commands++;
+    return CMD_LEXER_DISPATCHED;
+}
+
+enum cmd_lexer_result cmd_lexer_feed(struct cmd_lexer* lexer, char c) {
+    if (!lexer->started) {
+        if (c == CMD_LEXER_START) {
+            lexer->started = true;
+            lexer->len = 0;
+            lexer->buf[0] = '\0';
+        }
+        return CMD_LEXER_PENDING;
+    }
+
+    if (c == CMD_LEXER_START) {
+        // The end of the previous message was lost, start over with this one
+        lexer->len = 0;
+        lexer->buf[0] = '\0';
+        lexer->stats.resyncs++;
+        return CMD_LEXER_PENDING;
+    }
+
+    if (c == CMD_LEXER_END) {
+        lexer->started = false;
+        lexer->buf[lexer->len] = '\0';
+        return dispatch(lexer);
+    }
+
+    // Always leave room for the terminator
+    if (lexer->len >= lexer->buf_size - 1) {
+        lexer->buf[lexer->len] = '\0';
+        lexer->started = false;
+        lexer->stats.overflows++;
+        return CMD_LEXER_OVERFLOW;
+    }
+    lexer->buf[lexer->len++] = c;
+    return CMD_LEXER_PENDING;
+}
@@ -0,0 +1,12 @@
+#ifndef TRAFFIC_LIGHT_TESTS_SHIM_APP_EVENT_MANAGER_H_
+#define TRAFFIC_LIGHT_TESTS_SHIM_APP_EVENT_MANAGER_H_
+
+// Enough for the event headers to be included, none of the tested code submits events
+
+struct app_event_header {
+    int unused;
+};
+
+#define APP_EVENT_TYPE_DECLARE(name) struct name
+
+#endif // TRAFFIC_LIGHT_TESTS_SHIM_APP_EVENT_MANAGER_H_
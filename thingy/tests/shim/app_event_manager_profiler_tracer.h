@@ -0,0 +1,3 @@
+#ifndef TRAFFIC_LIGHT_TESTS_SHIM_APP_EVENT_MANAGER_PROFILER_TRACER_H_
+#define TRAFFIC_LIGHT_TESTS_SHIM_APP_EVENT_MANAGER_PROFILER_TRACER_H_
+#endif // TRAFFIC_LIGHT_TESTS_SHIM_APP_EVENT_MANAGER_PROFILER_TRACER_H_
@@ -0,0 +1,92 @@
+#include <zephyr/kernel.h>
+#include <zephyr/sys/crc.h>
+
+#include "test.h"
+
+int test_failures = 0;
+
+#define SHIM_MAX_WORKS 32
+
+static int64_t now_us = 0;
+// Not linked through the work items, the code under test may memset them before initializing them again
+static struct k_work_delayable* works[SHIM_MAX_WORKS];
+static size_t work_count = 0;
+
+void k_work_init_delayable(struct k_work_delayable* dwork, k_work_handler_t handler) {
+    dwork->work.handler = handler;
+    dwork->pending = false;
+    for (size_t i = 0; i < work_count; i++) {
+        if (works[i] == dwork) {
+            return;
+        }
+    }
+    if (work_count >= SHIM_MAX_WORKS) {
+        fprintf(stderr, "Too many work items for the shim\n");
+        exit(1);
+    }
+    works[work_count++] = dwork;
+}
+
+int k_work_reschedule(struct k_work_delayable* dwork, k_timeout_t delay) {
+    dwork->due_us = now_us + MAX(delay.ms, 0) * USEC_PER_MSEC;
+    dwork->pending = true;
+    return 1;
+}
+
+int k_work_schedule(struct k_work_delayable* dwork, k_timeout_t delay) {
+    if (dwork->pending) {
+        return 0;
+    }
+    return k_work_reschedule(dwork, delay);
+}
+
+int k_work_cancel_delayable(struct k_work_delayable* dwork) {
+    dwork->pending = false;
+    return 0;
+}
+
+int64_t k_uptime_get() {
+    return now_us / USEC_PER_MSEC;
+}
+
+uint32_t k_cycle_get_32() {
+    return (uint32_t) now_us;
+}
+
+void shim_advance_us(int64_t us) {
+    int64_t end = now_us + us;
+
+    for (;;) {
+        struct k_work_delayable* next = NULL;
+        for (size_t i = 0; i < work_count; i++) {
+            struct k_work_delayable* w = works[i];
+            if (w->pending && w->due_us <= end && (next == NULL || w->due_us < next->due_us)) {
+                next = w;
+            }
+        }
+        if (next == NULL) {
+            break;
+        }
+        now_us = MAX(now_us, next->due_us);
+        next->pending = false;
+        next->work.handler(&next->work);
+    }
+    now_us = end;
+}
+
+void shim_reset() {
+    for (size_t i = 0; i < work_count; i++) {
+        works[i]->pending = false;
+    }
+    now_us = 0;
+}
+
+uint16_t crc16_itu_t(uint16_t seed, const uint8_t* src, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        seed ^= (uint16_t) src[i] << 8;
+        for (int bit = 0; bit < 8; bit++) {
+            seed = (seed & 0x8000) ? (uint16_t) ((seed << 1) ^ 0x1021) : (uint16_t) (seed << 1);
+        }
+    }
+    return seed;
+}
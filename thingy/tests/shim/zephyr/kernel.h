@@ -0,0 +1,86 @@
+#ifndef TRAFFIC_LIGHT_TESTS_SHIM_KERNEL_H_
+#define TRAFFIC_LIGHT_TESTS_SHIM_KERNEL_H_
+
+/*
+    The bits of the Zephyr kernel API the code under test uses, for running it on the host.
+    Single threaded: mutexes do nothing and delayable work runs from shim_advance_us(), when the clock
+    the test moves reaches the time it was scheduled for. The cycle counter counts microseconds.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <zephyr/sys/util.h>
+
+#define MSEC_PER_SEC 1000
+#define USEC_PER_MSEC 1000
+
+typedef struct {
+    int64_t ms;
+} k_timeout_t;
+
+#define K_MSEC(ms) ((k_timeout_t) { (ms) })
+#define K_SECONDS(s) K_MSEC((s) * MSEC_PER_SEC)
+#define K_NO_WAIT K_MSEC(0)
+#define K_FOREVER K_MSEC(-1)
+
+struct k_mutex {
+    int unused;
+};
+
+#define K_MUTEX_DEFINE(name) struct k_mutex name
+
+static inline int k_mutex_init(struct k_mutex* mutex) {
+    return 0;
+}
+
+static inline int k_mutex_lock(struct k_mutex* mutex, k_timeout_t timeout) {
+    return 0;
+}
+
+static inline int k_mutex_unlock(struct k_mutex* mutex) {
+    return 0;
+}
+
+struct k_work;
+typedef void (*k_work_handler_t)(struct k_work* work);
+
+struct k_work {
+    k_work_handler_t handler;
+};
+
+struct k_work_delayable {
+    struct k_work work;
+    int64_t due_us;
+    bool pending;
+};
+
+void k_work_init_delayable(struct k_work_delayable* dwork, k_work_handler_t handler);
+int k_work_reschedule(struct k_work_delayable* dwork, k_timeout_t delay);
+int k_work_schedule(struct k_work_delayable* dwork, k_timeout_t delay);
+int k_work_cancel_delayable(struct k_work_delayable* dwork);
+
+static inline struct k_work_delayable* k_work_delayable_from_work(struct k_work* work) {
+    return CONTAINER_OF(work, struct k_work_delayable, work);
+}
+
+int64_t k_uptime_get();
+uint32_t k_cycle_get_32();
+
+static inline uint32_t k_cyc_to_us_floor32(uint32_t cycles) {
+    return cycles;
+}
+
+// Moves the clock forward, running every work item that comes due on the way in order
+void shim_advance_us(int64_t us);
+
+static inline void shim_advance_ms(int64_t ms) {
+    shim_advance_us(ms * USEC_PER_MSEC);
+}
+
+// Cancels all work items and sets the clock back to 0, for the start of a test
+void shim_reset();
+
+#endif // TRAFFIC_LIGHT_TESTS_SHIM_KERNEL_H_
@@ -0,0 +1,10 @@
+#ifndef TRAFFIC_LIGHT_TESTS_SHIM_SYS_CRC_H_
+#define TRAFFIC_LIGHT_TESTS_SHIM_SYS_CRC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+// CRC-16/CCITT, polynomial 0x1021, bits in MSB first, as Zephyr's crc16_itu_t()
+uint16_t crc16_itu_t(uint16_t seed, const uint8_t* src, size_t len);
+
+#endif // TRAFFIC_LIGHT_TESTS_SHIM_SYS_CRC_H_
@@ -0,0 +1,12 @@
+#ifndef TRAFFIC_LIGHT_TESTS_SHIM_SYS_UTIL_H_
+#define TRAFFIC_LIGHT_TESTS_SHIM_SYS_UTIL_H_
+
+#include <stddef.h>
+
+#define CONTAINER_OF(ptr, type, field) ((type*) (((char*) (ptr)) - offsetof(type, field)))
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define ARRAY_SIZE(array) (sizeof(array) / sizeof((array)[0]))
+#define BUILD_ASSERT(cond, msg) _Static_assert(cond, msg)
+
+#endif // TRAFFIC_LIGHT_TESTS_SHIM_SYS_UTIL_H_
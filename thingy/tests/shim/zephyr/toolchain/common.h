@@ -0,0 +1,3 @@
+#ifndef TRAFFIC_LIGHT_TESTS_SHIM_TOOLCHAIN_COMMON_H_
+#define TRAFFIC_LIGHT_TESTS_SHIM_TOOLCHAIN_COMMON_H_
+#endif // TRAFFIC_LIGHT_TESTS_SHIM_TOOLCHAIN_COMMON_H_
@@ -0,0 +1,47 @@
+#ifndef TRAFFIC_LIGHT_TESTS_TEST_H_
+#define TRAFFIC_LIGHT_TESTS_TEST_H_
+
+/*
+    Bare bones test harness, a failed CHECK prints where it failed and the test executable exits with 1.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+extern int test_failures;
+
+#define CHECK(cond)                                                                 \
+    do {                                                                            \
+        if (!(cond)) {                                                              \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            test_failures++;                                                        \
+        }                                                                           \
+    } while (0)
+
+#define CHECK_EQ(a, b)                                                                          \
+    do {                                                                                        \
+        long long _a = (long long) (a);                                                         \
+        long long _b = (long long) (b);                                                         \
+        if (_a != _b) {                                                                         \
+            fprintf(stderr, "%s:%d: %s == %s failed, %lld != %lld\n", __FILE__, __LINE__, #a, #b, \
+                    _a, _b);                                                                    \
+            test_failures++;                                                                    \
+        }                                                                                       \
+    } while (0)
+
+#define RUN_TEST(fn)                  \
+    do {                              \
+        printf("%s\n", #fn);          \
+        fn();                         \
+    } while (0)
+
+#define TEST_MAIN_END()                                  \
+    do {                                                 \
+        if (test_failures > 0) {                         \
+            fprintf(stderr, "%d failures\n", test_failures); \
+            return 1;                                    \
+        }                                                \
+        return 0;                                        \
+    } while (0)
+
+#endif // TRAFFIC_LIGHT_TESTS_TEST_H_
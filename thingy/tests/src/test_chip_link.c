@@ -0,0 +1,314 @@
+#include <string.h>
+#include <errno.h>
+#include <zephyr/kernel.h>
+
+#include "chip_link.h"
+#include "test.h"
+
+// One direction of the emulated UART pair, bytes sit here until pump() hands them to the other side
+struct wire {
+    uint8_t buf[4096];
+    size_t len;
+    // Frames to lose, -1 loses everything
+    int drop;
+    // Frames to damage on the way
+    int corrupt;
+};
+
+// What one side of the link saw
+struct side {
+    struct chip_link link;
+    struct wire* out;
+    uint32_t received;
+    uint8_t last_type;
+    uint8_t last_payload[CHIP_LINK_MAX_PAYLOAD];
+    size_t last_len;
+    uint32_t ascii_sent;
+    uint32_t ascii_bytes;
+};
+
+static struct wire a_to_b;
+static struct wire b_to_a;
+static struct side a;
+static struct side b;
+
+static int wire_write(struct wire* w, const uint8_t* data, size_t len) {
+    if (w->drop != 0) {
+        if (w->drop > 0) {
+            w->drop--;
+        }
+        return 0;
+    }
+    if (w->len + len > sizeof(w->buf)) {
+        return -ENOMEM;
+    }
+    memcpy(&w->buf[w->len], data, len);
+    if (w->corrupt > 0) {
+        // One bit in the middle of the frame, never turning it into a delimiter
+        uint8_t* byte = &w->buf[w->len + len / 2];
+        *byte ^= (*byte == 0x01) ? 0x02 : 0x01;
+        w->corrupt--;
+    }
+    w->len += len;
+    return 0;
+}
+
+static void side_received(struct side* s, uint8_t type, const uint8_t* payload, size_t len) {
+    s->received++;
+    s->last_type = type;
+    s->last_len = len;
+    memcpy(s->last_payload, payload, len);
+}
+
+static int a_write(const uint8_t* data, size_t len) {
+    return wire_write(&a_to_b, data, len);
+}
+
+static int b_write(const uint8_t* data, size_t len) {
+    return wire_write(&b_to_a, data, len);
+}
+
+static void a_received(uint8_t type, const uint8_t* payload, size_t len) {
+    side_received(&a, type, payload, len);
+}
+
+static void b_received(uint8_t type, const uint8_t* payload, size_t len) {
+    side_received(&b, type, payload, len);
+}
+
+static void a_send_ascii(uint8_t type, const uint8_t* payload, size_t len) {
+    a.ascii_sent++;
+}
+
+static void b_send_ascii(uint8_t type, const uint8_t* payload, size_t len) {
+    b.ascii_sent++;
+}
+
+static const struct chip_link_ops a_ops = { .write = a_write, .received = a_received, .send_ascii = a_send_ascii };
+static const struct chip_link_ops b_ops = { .write = b_write, .received = b_received, .send_ascii = b_send_ascii };
+
+// Delivers whatever is on the wires, including the answers that provokes
+static void pump() {
+    uint8_t bytes[sizeof(a_to_b.buf)];
+
+    while (a_to_b.len > 0 || b_to_a.len > 0) {
+        size_t len = a_to_b.len;
+        memcpy(bytes, a_to_b.buf, len);
+        a_to_b.len = 0;
+        for (size_t i = 0; i < len; i++) {
+            if (!chip_link_rx_byte(&b.link, bytes[i])) {
+                b.ascii_bytes++;
+            }
+        }
+
+        len = b_to_a.len;
+        memcpy(bytes, b_to_a.buf, len);
+        b_to_a.len = 0;
+        for (size_t i = 0; i < len; i++) {
+            if (!chip_link_rx_byte(&a.link, bytes[i])) {
+                a.ascii_bytes++;
+            }
+        }
+    }
+}
+
+static void run_ms(int ms) {
+    for (int i = 0; i < ms; i++) {
+        pump();
+        shim_advance_ms(1);
+    }
+    pump();
+}
+
+static void setup(bool handshake) {
+    shim_reset();
+    memset(&a_to_b, 0, sizeof(a_to_b));
+    memset(&b_to_a, 0, sizeof(b_to_a));
+    memset(&a, 0, sizeof(a));
+    memset(&b, 0, sizeof(b));
+    chip_link_init(&a.link, &a_ops);
+    chip_link_init(&b.link, &b_ops);
+    if (handshake) {
+        chip_link_start(&a.link);
+        chip_link_start(&b.link);
+        run_ms(10);
+    }
+}
+
+static void feed(struct chip_link* link, const uint8_t* bytes, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        chip_link_rx_byte(link, bytes[i]);
+    }
+}
+
+static void test_round_trip() {
+    uint8_t payload[CHIP_LINK_MAX_PAYLOAD + 1];
+    uint8_t encoded[CHIP_LINK_MAX_ENCODED];
+
+    setup(false);
+    for (size_t len = 0; len <= CHIP_LINK_MAX_PAYLOAD; len++) {
+        // Zeros all over the place for COBS to get rid of
+        for (size_t i = 0; i < len; i++) {
+            payload[i] = (i % 3 == 0) ? 0 : (uint8_t) (i * 0x35);
+        }
+        size_t encoded_len = chip_link_encode(CHIP_LINK_MSG_SET_FRAME, (uint8_t) len, payload, len, encoded);
+        CHECK(encoded_len > 0 && encoded_len <= CHIP_LINK_MAX_ENCODED);
+        CHECK_EQ(encoded[0], 0);
+        CHECK_EQ(encoded[encoded_len - 1], 0);
+        CHECK(memchr(&encoded[1], 0, encoded_len - 2) == NULL);
+
+        uint32_t received = b.received;
+        feed(&b.link, encoded, encoded_len);
+        CHECK_EQ(b.received, received + 1);
+        CHECK_EQ(b.last_type, CHIP_LINK_MSG_SET_FRAME);
+        CHECK_EQ(b.last_len, len);
+        CHECK(memcmp(b.last_payload, payload, len) == 0);
+    }
+
+    // Acknowledged, one ACK per frame
+    struct chip_link_stats stats;
+    chip_link_stats_get(&b.link, &stats);
+    CHECK_EQ(stats.rx_frames, CHIP_LINK_MAX_PAYLOAD + 1);
+    CHECK(b_to_a.len > 0);
+
+    CHECK_EQ(chip_link_encode(CHIP_LINK_MSG_SET_FRAME, 0, payload, CHIP_LINK_MAX_PAYLOAD + 1, encoded), 0);
+}
+
+static void test_crc_rejection() {
+    const uint8_t payload[8] = { 'A', 'B', 'C', 'D', 'E', 'F', 'G', 'H' };
+    uint8_t encoded[CHIP_LINK_MAX_ENCODED];
+    struct chip_link_stats stats;
+
+    setup(false);
+    size_t encoded_len = chip_link_encode(CHIP_LINK_MSG_SET_FRAME, 5, payload, sizeof(payload), encoded);
+    // Delimiter, COBS code, type, seq, length, then the payload
+    encoded[6] ^= 0x01;
+    feed(&b.link, encoded, encoded_len);
+    chip_link_stats_get(&b.link, &stats);
+    CHECK_EQ(b.received, 0);
+    CHECK_EQ(stats.rx_crc_errors, 1);
+    // Nothing acknowledged, the sender retransmits
+    CHECK_EQ(b_to_a.len, 0);
+
+    // A frame too short to hold the header
+    const uint8_t runt[] = { 0x00, 0x02, 0x10, 0x00 };
+    feed(&b.link, runt, sizeof(runt));
+    chip_link_stats_get(&b.link, &stats);
+    CHECK_EQ(stats.rx_malformed, 1);
+
+    // The receiver is back in step for the next good frame
+    encoded_len = chip_link_encode(CHIP_LINK_MSG_SET_FRAME, 5, payload, sizeof(payload), encoded);
+    feed(&b.link, encoded, encoded_len);
+    CHECK_EQ(b.received, 1);
+    CHECK(memcmp(b.last_payload, payload, sizeof(payload)) == 0);
+
+    // ASCII between frames is left to the caller
+    CHECK(!chip_link_rx_byte(&b.link, '!'));
+}
+
+static void test_handshake() {
+    setup(true);
+    CHECK(chip_link_peer_ready(&a.link));
+    CHECK(chip_link_peer_ready(&b.link));
+
+    const uint8_t payload[] = { 0, 1, 0, 0, CHIP_LINK_LIGHT_GREEN };
+    CHECK_EQ(chip_link_send(&a.link, CHIP_LINK_MSG_SET_FRAME, payload, sizeof(payload)), 0);
+    run_ms(10);
+    CHECK_EQ(b.received, 1);
+    CHECK_EQ(b.last_type, CHIP_LINK_MSG_SET_FRAME);
+    CHECK_EQ(a.ascii_sent, 0);
+    for (size_t i = 0; i < CHIP_LINK_TX_WINDOW; i++) {
+        CHECK(!a.link.pending[i].in_use);
+    }
+}
+
+static void test_no_peer() {
+    setup(false);
+    const uint8_t payload[] = { 0 };
+    CHECK_EQ(chip_link_send(&a.link, CHIP_LINK_MSG_STOP_SCAN, payload, sizeof(payload)), -ENOTCONN);
+    CHECK_EQ(a.ascii_sent, 1);
+    CHECK_EQ(chip_link_send_unreliable(&a.link, CHIP_LINK_MSG_BENCH_PING, payload, sizeof(payload)), -ENOTCONN);
+}
+
+static void test_retransmit() {
+    const uint8_t payload[] = { 1 };
+    struct chip_link_stats a_stats;
+    struct chip_link_stats b_stats;
+
+    setup(true);
+
+    // The frame is lost, the retransmission gets through
+    a_to_b.drop = 1;
+    CHECK_EQ(chip_link_send(&a.link, CHIP_LINK_MSG_STOP_SCAN, payload, sizeof(payload)), 0);
+    run_ms(CHIP_LINK_ACK_TIMEOUT_MS / 2);
+    CHECK_EQ(b.received, 0);
+    run_ms(CHIP_LINK_ACK_TIMEOUT_MS);
+    CHECK_EQ(b.received, 1);
+    chip_link_stats_get(&a.link, &a_stats);
+    CHECK_EQ(a_stats.tx_retransmits, 1);
+
+    // The ACK is lost, the retransmission is acknowledged again but not handed over twice
+    b_to_a.drop = 1;
+    CHECK_EQ(chip_link_send(&a.link, CHIP_LINK_MSG_STOP_SCAN, payload, sizeof(payload)), 0);
+    run_ms(3 * CHIP_LINK_ACK_TIMEOUT_MS);
+    CHECK_EQ(b.received, 2);
+    chip_link_stats_get(&a.link, &a_stats);
+    chip_link_stats_get(&b.link, &b_stats);
+    CHECK_EQ(a_stats.tx_retransmits, 2);
+    CHECK_EQ(b_stats.rx_duplicates, 1);
+
+    // Damaged on the way, same as lost
+    a_to_b.corrupt = 1;
+    CHECK_EQ(chip_link_send(&a.link, CHIP_LINK_MSG_STOP_SCAN, payload, sizeof(payload)), 0);
+    run_ms(3 * CHIP_LINK_ACK_TIMEOUT_MS);
+    CHECK_EQ(b.received, 3);
+    chip_link_stats_get(&b.link, &b_stats);
+    // The bit may have hit the length rather than what the CRC covers
+    CHECK_EQ(b_stats.rx_crc_errors + b_stats.rx_malformed, 1);
+    CHECK_EQ(a.ascii_sent, 0);
+}
+
+static void test_window() {
+    uint8_t payload[1];
+    struct chip_link_stats stats;
+
+    setup(true);
+    a_to_b.drop = -1;
+
+    // The window fills up, the next message goes out as ASCII straight away
+    for (uint8_t i = 0; i < CHIP_LINK_TX_WINDOW; i++) {
+        payload[0] = i;
+        CHECK_EQ(chip_link_send(&a.link, CHIP_LINK_MSG_STOP_SCAN, payload, sizeof(payload)), 0);
+    }
+    CHECK_EQ(chip_link_send(&a.link, CHIP_LINK_MSG_STOP_SCAN, payload, sizeof(payload)), -ENOTCONN);
+    CHECK_EQ(a.ascii_sent, 1);
+
+    // Every frame is tried 1 + CHIP_LINK_MAX_RETRIES times, then sent as ASCII
+    run_ms((CHIP_LINK_MAX_RETRIES + 1) * CHIP_LINK_ACK_TIMEOUT_MS + 10);
+    chip_link_stats_get(&a.link, &stats);
+    CHECK_EQ(stats.tx_retransmits, CHIP_LINK_TX_WINDOW * CHIP_LINK_MAX_RETRIES);
+    CHECK_EQ(stats.tx_lost, CHIP_LINK_TX_WINDOW);
+    CHECK_EQ(a.ascii_sent, 1 + CHIP_LINK_TX_WINDOW);
+    CHECK(!chip_link_peer_ready(&a.link));
+    CHECK_EQ(b.received, 0);
+
+    // Until the peer answers a HELLO again everything goes out as ASCII
+    CHECK_EQ(chip_link_send(&a.link, CHIP_LINK_MSG_STOP_SCAN, payload, sizeof(payload)), -ENOTCONN);
+
+    a_to_b.drop = 0;
+    run_ms(CHIP_LINK_HELLO_INTERVAL_MS + 10);
+    CHECK(chip_link_peer_ready(&a.link));
+    CHECK_EQ(chip_link_send(&a.link, CHIP_LINK_MSG_STOP_SCAN, payload, sizeof(payload)), 0);
+    run_ms(10);
+    CHECK_EQ(b.received, 1);
+}
+
+int main() {
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_crc_rejection);
+    RUN_TEST(test_handshake);
+    RUN_TEST(test_no_peer);
+    RUN_TEST(test_retransmit);
+    RUN_TEST(test_window);
+    TEST_MAIN_END();
+}
@@ -0,0 +1,199 @@
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "cmd_lexer.h"
+#include "test.h"
+
+static const struct cmd_lexer_cmd* last_cmd;
+static char last_args[64];
+
+static int record(const struct cmd_lexer_cmd* cmd, const char* args) {
+    last_cmd = cmd;
+    strncpy(last_args, args, sizeof(last_args) - 1);
+    return 0;
+}
+
+// Accepts a single digit
+static int digit(const struct cmd_lexer_cmd* cmd, const char* args) {
+    if (args[0] < '0' || args[0] > '9' || args[1] != '\0') {
+        return -EINVAL;
+    }
+    return record(cmd, args);
+}
+
+static const struct cmd_lexer_cmd cmds[] = {
+    { "S", true, record, 1 },
+    { "SCAN_START", false, record, 2 },
+    { "green", true, digit, 3 },
+    { "red", true, digit, 4 },
+    { "reset", false, record, 5 },
+    { "stop_scan", false, record, 6 },
+};
+
+// Every character of the names plus the root
+#define NODES (1 + 1 + 9 + 5 + 3 + 3 + 9)
+
+CMD_LEXER_DEFINE(lexer, cmds, 16, NODES);
+CMD_LEXER_DEFINE(small_lexer, cmds, 16, 8);
+
+static enum cmd_lexer_result feed(struct cmd_lexer* l, const char* input) {
+    enum cmd_lexer_result result = CMD_LEXER_PENDING;
+    last_cmd = NULL;
+    memset(last_args, 0, sizeof(last_args));
+    for (const char* p = input; *p != '\0'; p++) {
+        enum cmd_lexer_result r = cmd_lexer_feed(l, *p);
+        if (r != CMD_LEXER_PENDING) {
+            result = r;
+        }
+    }
+    return result;
+}
+
+static void check_lookups(struct cmd_lexer* l) {
+    const char* args;
+
+    // Longest match, and has_args decides whether a prefix is enough
+    CHECK(cmd_lexer_lookup(l, "SCAN_START", &args) == &cmds[1]);
+    CHECK(strcmp(args, "") == 0);
+    CHECK(cmd_lexer_lookup(l, "SCAN_STARTX", &args) == &cmds[0]);
+    CHECK(strcmp(args, "CAN_STARTX") == 0);
+    CHECK(cmd_lexer_lookup(l, "S1:g", &args) == &cmds[0]);
+    CHECK(strcmp(args, "1:g") == 0);
+    CHECK(cmd_lexer_lookup(l, "green1", &args) == &cmds[2]);
+    CHECK(strcmp(args, "1") == 0);
+    CHECK(cmd_lexer_lookup(l, "reset", &args) == &cmds[4]);
+    CHECK(cmd_lexer_lookup(l, "red2", &args) == &cmds[3]);
+    CHECK(strcmp(args, "2") == 0);
+
+    // Unknown, a prefix of a name or a name followed by arguments it does not take
+    CHECK(cmd_lexer_lookup(l, "blue", &args) == NULL);
+    CHECK(cmd_lexer_lookup(l, "gre", &args) == NULL);
+    CHECK(cmd_lexer_lookup(l, "reset1", &args) == NULL);
+    CHECK(cmd_lexer_lookup(l, "stop_scan_now", &args) == NULL);
+    CHECK(cmd_lexer_lookup(l, "", &args) == NULL);
+}
+
+static void test_lookup() {
+    CHECK_EQ(cmd_lexer_init(&lexer), 0);
+    check_lookups(&lexer);
+}
+
+static void test_feed() {
+    CHECK_EQ(cmd_lexer_init(&lexer), 0);
+
+    CHECK_EQ(feed(&lexer, "!green1;"), CMD_LEXER_DISPATCHED);
+    CHECK(last_cmd == &cmds[2]);
+    CHECK(strcmp(last_args, "1") == 0);
+
+    // Noise between messages is skipped
+    CHECK_EQ(feed(&lexer, "xx;!reset;"), CMD_LEXER_DISPATCHED);
+    CHECK(last_cmd == &cmds[4]);
+
+    CHECK_EQ(feed(&lexer, "!blue;"), CMD_LEXER_UNKNOWN);
+    CHECK(last_cmd == NULL);
+    CHECK_EQ(feed(&lexer, "!green12;"), CMD_LEXER_BAD_ARGS);
+    CHECK(last_cmd == NULL);
+
+    CHECK_EQ(lexer.stats.commands, 2);
+    CHECK_EQ(lexer.stats.unknown, 1);
+    CHECK_EQ(lexer.stats.bad_args, 1);
+}
+
+static void test_overflow() {
+    CHECK_EQ(cmd_lexer_init(&lexer), 0);
+
+    // 15 characters fit next to the terminator, the 16th overflows
+    CHECK_EQ(feed(&lexer, "!0123456789abcde"), CMD_LEXER_PENDING);
+    CHECK_EQ(feed(&lexer, "f"), CMD_LEXER_OVERFLOW);
+    CHECK_EQ(lexer.stats.overflows, 1);
+
+    // The rest of the long message is ignored, the next one works
+    CHECK_EQ(feed(&lexer, "ghij;!reset;"), CMD_LEXER_DISPATCHED);
+    CHECK(last_cmd == &cmds[4]);
+    CHECK_EQ(lexer.stats.overflows, 1);
+}
+
+static void test_resync() {
+    CHECK_EQ(cmd_lexer_init(&lexer), 0);
+
+    // A message that lost its ';' is dropped by the next '!', which starts a new one
+    CHECK_EQ(feed(&lexer, "!S1:g!S2:r;"), CMD_LEXER_DISPATCHED);
+    CHECK(last_cmd == &cmds[0]);
+    CHECK(strcmp(last_args, "2:r") == 0);
+    CHECK_EQ(lexer.stats.resyncs, 1);
+    CHECK_EQ(lexer.stats.commands, 1);
+
+    CHECK_EQ(feed(&lexer, "!gre!!reset;"), CMD_LEXER_DISPATCHED);
+    CHECK(last_cmd == &cmds[4]);
+    CHECK_EQ(lexer.stats.resyncs, 3);
+}
+
+static void test_node_limit() {
+    // The names do not fit in 8 nodes, the lexer still finds every command by scanning the table
+    CHECK_EQ(cmd_lexer_init(&small_lexer), -ENOMEM);
+    check_lookups(&small_lexer);
+    CHECK_EQ(feed(&small_lexer, "!green3;"), CMD_LEXER_DISPATCHED);
+    CHECK(last_cmd == &cmds[2]);
+
+    // Exactly enough nodes
+    static struct cmd_lexer_node nodes[NODES];
+    static char buf[16];
+    struct cmd_lexer exact = {
+        .cmds = cmds, .cmd_count = sizeof(cmds) / sizeof(cmds[0]), .nodes = nodes, .max_nodes = NODES, .buf = buf, .buf_size = sizeof(buf)
+    };
+    CHECK_EQ(cmd_lexer_init(&exact), 0);
+    exact.max_nodes = NODES - 1;
+    CHECK_EQ(cmd_lexer_init(&exact), -ENOMEM);
+}
+
+static void test_duplicate() {
+    static const struct cmd_lexer_cmd dup_cmds[] = {
+        { "reset", false, record, 1 },
+        { "reset", false, record, 2 },
+    };
+    CMD_LEXER_DEFINE(dup_lexer, dup_cmds, 16, 16);
+
+    CHECK_EQ(cmd_lexer_init(&dup_lexer), -EINVAL);
+    // The first one wins
+    CHECK_EQ(feed(&dup_lexer, "!reset;"), CMD_LEXER_DISPATCHED);
+    CHECK(last_cmd == &dup_cmds[0]);
+}
+
+static double messages_per_sec(struct cmd_lexer* l, const char* message, int count) {
+    clock_t start = clock();
+    for (int i = 0; i < count; i++) {
+        for (const char* p = message; *p != '\0'; p++) {
+            cmd_lexer_feed(l, *p);
+        }
+    }
+    double elapsed = (double) (clock() - start) / CLOCKS_PER_SEC;
+    return elapsed > 0 ? count / elapsed : 1e12;
+}
+
+static void test_throughput() {
+    const int count = 200000;
+
+    CHECK_EQ(cmd_lexer_init(&lexer), 0);
+    CHECK_EQ(cmd_lexer_init(&small_lexer), -ENOMEM);
+    double trie = messages_per_sec(&lexer, "!stop_scan;", count);
+    double linear = messages_per_sec(&small_lexer, "!stop_scan;", count);
+    printf("    trie %.0f msg/s, table scan %.0f msg/s\n", trie, linear);
+
+    CHECK_EQ(lexer.stats.commands, count);
+    CHECK_EQ(small_lexer.stats.commands, count);
+    // Far more than a UART at 1 Mbaud can deliver, about 9000 of these per second
+    CHECK(trie > 100000);
+    CHECK(linear > 100000);
+}
+
+int main() {
+    RUN_TEST(test_lookup);
+    RUN_TEST(test_feed);
+    RUN_TEST(test_overflow);
+    RUN_TEST(test_resync);
+    RUN_TEST(test_node_limit);
+    RUN_TEST(test_duplicate);
+    RUN_TEST(test_throughput);
+    TEST_MAIN_END();
+}
@@ -0,0 +1,135 @@
+#include <string.h>
+#include <errno.h>
+#include <zephyr/kernel.h>
+
+#include "link_bench.h"
+#include "nrf52840_link.h"
+#include "test.h"
+
+// Stands in for the nRF52840, each ping comes back after the round trip time the test picks for it.
+// The shim's cycle counter counts microseconds.
+struct echo {
+    uint8_t payload[CHIP_LINK_MAX_PAYLOAD];
+    size_t len;
+    int64_t due_us;
+    bool waiting;
+};
+
+static struct echo echoes[256];
+static uint32_t pings;
+// Round trip time of the n-th ping in µs, negative to lose it
+static int32_t (*rtt_of)(uint32_t n);
+
+static struct link_bench_report last_report;
+static uint32_t reports;
+static bool final_seen;
+
+int nrf52840_link_bench_ping(const uint8_t* payload, size_t len) {
+    int32_t rtt = rtt_of(pings);
+    struct echo* e = &echoes[pings++ % ARRAY_SIZE(echoes)];
+
+    if (rtt >= 0) {
+        memcpy(e->payload, payload, len);
+        e->len = len;
+        e->due_us = (int64_t) k_cycle_get_32() + rtt;
+        e->waiting = true;
+    }
+    return 0;
+}
+
+static void report_cb(const struct link_bench_report* report, bool final) {
+    last_report = *report;
+    reports++;
+    final_seen = final;
+}
+
+// Moves time on in 50 µs steps, the bucket width, handing back echoes as they come due
+static void run_ms(int ms) {
+    const int64_t step_us = LINK_BENCH_BUCKET_US;
+
+    for (int64_t i = 0; i < ms * USEC_PER_MSEC / step_us; i++) {
+        shim_advance_us(step_us);
+        int64_t now_us = k_cycle_get_32();
+        for (size_t j = 0; j < ARRAY_SIZE(echoes); j++) {
+            struct echo* e = &echoes[j];
+            if (e->waiting && e->due_us <= now_us) {
+                e->waiting = false;
+                link_bench_echo(e->payload, e->len);
+            }
+        }
+    }
+}
+
+static void setup() {
+    shim_reset();
+    memset(echoes, 0, sizeof(echoes));
+    memset(&last_report, 0, sizeof(last_report));
+    pings = 0;
+    reports = 0;
+    final_seen = false;
+}
+
+// 100, 200 ... 1000 µs, each ten times in every hundred pings
+static int32_t rtt_spread(uint32_t n) {
+    return (n % 10 + 1) * 100;
+}
+
+static void test_percentiles() {
+    setup();
+    rtt_of = rtt_spread;
+    CHECK_EQ(link_bench_start(16, 2, 100, report_cb), 0);
+    run_ms(100 * 2 + LINK_BENCH_GRACE_MS + 10);
+
+    CHECK_EQ(reports, 1);
+    CHECK(final_seen);
+    CHECK_EQ(last_report.sent, 100);
+    CHECK_EQ(last_report.echoed, 100);
+    CHECK_EQ(last_report.lost, 0);
+    CHECK_EQ(last_report.reordered, 0);
+    // The 50th sample is 500 µs, in the 500-550 µs bucket
+    CHECK_EQ(last_report.rtt_p50_us, 550);
+    // The 90th is 900 µs
+    CHECK_EQ(last_report.rtt_p90_us, 950);
+    // The 99th is in the 1000-1050 µs bucket, but nothing took longer than 1000 µs
+    CHECK_EQ(last_report.rtt_p99_us, 1000);
+    CHECK_EQ(last_report.rtt_max_us, 1000);
+    CHECK(last_report.bytes_per_sec > 0);
+}
+
+// Every tenth ping is lost, ping 5 comes back after ping 6
+static int32_t rtt_lossy(uint32_t n) {
+    if (n % 10 == 9) {
+        return -1;
+    }
+    return (n == 5) ? 3000 : 200;
+}
+
+static void test_loss_reorder() {
+    setup();
+    rtt_of = rtt_lossy;
+    CHECK_EQ(link_bench_start(LINK_BENCH_MIN_SIZE, 1, 50, report_cb), 0);
+    run_ms(50 + LINK_BENCH_GRACE_MS + 10);
+
+    CHECK(final_seen);
+    CHECK_EQ(last_report.sent, 50);
+    CHECK_EQ(last_report.echoed, 45);
+    CHECK_EQ(last_report.lost, 5);
+    CHECK_EQ(last_report.reordered, 1);
+    CHECK_EQ(last_report.rtt_max_us, 3000);
+    CHECK_EQ(last_report.rtt_p50_us, 250);
+}
+
+static void test_bad_args() {
+    setup();
+    rtt_of = rtt_spread;
+    CHECK_EQ(link_bench_start(LINK_BENCH_MIN_SIZE - 1, 1, 1, report_cb), -EINVAL);
+    CHECK_EQ(link_bench_start(CHIP_LINK_MAX_PAYLOAD + 1, 1, 1, report_cb), -EINVAL);
+    CHECK_EQ(link_bench_start(LINK_BENCH_MIN_SIZE, 0, 1, report_cb), -EINVAL);
+}
+
+int main() {
+    RUN_TEST(test_percentiles);
+    RUN_TEST(test_loss_reorder);
+    RUN_TEST(test_bad_args);
+    TEST_MAIN_END();
+}
@@ -0,0 +1,61 @@
+#include <string.h>
+#include <stdlib.h>
+
+#include "mem_budget.h"
+#include "test.h"
+
+static void test_budget() {
+    // MEM_MONITOR_BUDGET_PERCENT of the size is still fine, a byte more is not
+    CHECK(!mem_budget_over(0, 1000));
+    CHECK(!mem_budget_over(1000 * MEM_MONITOR_BUDGET_PERCENT / 100, 1000));
+    CHECK(mem_budget_over(1000 * MEM_MONITOR_BUDGET_PERCENT / 100 + 1, 1000));
+    CHECK(mem_budget_over(1, 0));
+
+    // Sizes where peak * 100 overflows 32 bits
+    CHECK(!mem_budget_over(40000000, 64000000));
+    CHECK(mem_budget_over(60000000, 64000000));
+}
+
+// Splits a line as tester.py does
+static int parse(char* line, char** fields, int max_fields) {
+    CHECK(strncmp(line, "!mem:", 5) == 0);
+    size_t len = strlen(line);
+    CHECK(len >= 3 && strcmp(&line[len - 3], ";\r\n") == 0);
+    line[len - 3] = '\0';
+
+    int count = 0;
+    for (char* field = strtok(&line[5], ","); field != NULL && count < max_fields; field = strtok(NULL, ",")) {
+        fields[count++] = field;
+    }
+    return count;
+}
+
+static void test_format() {
+    char line[MEM_BUDGET_LINE_SIZE];
+    char* fields[6];
+
+    size_t len = mem_budget_format(line, "thread", "poll_workq", 20000, 32768);
+    CHECK_EQ(len, strlen(line));
+    CHECK(strcmp(line, "!mem:thread,poll_workq,20000,32768,ok;\r\n") == 0);
+
+    mem_budget_format(line, "heap", "cjson_heap", 5000, 5120);
+    CHECK_EQ(parse(line, fields, 6), 5);
+    CHECK(strcmp(fields[4], "over") == 0);
+
+    // The longest kind, name and numbers still give a complete line
+    char name[MEM_BUDGET_NAME_MAX + 20];
+    memset(name, 'n', sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    len = mem_budget_format(line, "thread", name, 4000000000u, 4000000000u);
+    CHECK(len < MEM_BUDGET_LINE_SIZE);
+    CHECK_EQ(parse(line, fields, 6), 5);
+    CHECK_EQ(strlen(fields[1]), MEM_BUDGET_NAME_MAX);
+    CHECK(strcmp(fields[2], "4000000000") == 0);
+    CHECK(strcmp(fields[4], "over") == 0);
+}
+
+int main() {
+    RUN_TEST(test_budget);
+    RUN_TEST(test_format);
+    TEST_MAIN_END();
+}
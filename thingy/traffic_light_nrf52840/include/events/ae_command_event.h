@@ -24,10 +24,13 @@ extern "C" {
 #endif
 
 enum ae_commands {
-	AE_CMD_SET_STATE1, AE_CMD_SET_STATE2, 
+	AE_CMD_SET_STATE, AE_CMD_SET_FRAME,
 	AE_CMD_START_SCAN, AE_CMD_STOP_SCAN
 };
 
+// Maximum number of signal heads in one AE_CMD_SET_FRAME
+#define AE_CMD_MAX_FRAME_LIGHTS 8
+
 enum light_states {
     LIGHT_OFF, LIGHT_RED, LIGHT_YELLOW, LIGHT_GREEN, LIGHT_CYCLE
 };
@@ -36,12 +39,23 @@ enum light_states {
 struct ae_command_event {
 	struct app_event_header header;
 	enum ae_commands cmd;
+	// Signal controller (ESP32) the command is for, 0..CHIP_LINK_MAX_TARGETS - 1. AE_CMD_STOP_SCAN applies to all of them
+	uint8_t target;
 	enum light_states light_state;
+	// Light number (1..N on the controller) that AE_CMD_SET_STATE applies to, or the first light of AE_CMD_SET_FRAME
+	uint8_t light;
+	// AE_CMD_SET_FRAME only, one of 'r', 'y', 'g', 'o' or '-' (unchanged) per light starting at light
+	char frame[AE_CMD_MAX_FRAME_LIGHTS + 1];
+	// AE_CMD_SET_FRAME only, latency tracking ID that the ESP32 acknowledges, 0 if there is none
+	uint16_t cmd_id;
 	char* scan_target;
 };
 
 APP_EVENT_TYPE_DECLARE(ae_command_event);
 
+// Converts a light state to the word used for it on the UART and BLE links ("red", "green", ...)
+const char* light_state_to_string(enum light_states state);
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,6 +19,8 @@
 #include <app_event_manager.h>
 #include <app_event_manager_profiler_tracer.h>
 
+#include "chip_link.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -27,14 +29,31 @@ enum ble_ctrl_cmd {
     BLE_CTRL_CONNECTED,
     BLE_CTRL_DISCONNECTED,
 	BLE_CTRL_SCAN_STARTED,
-	BLE_CTRL_SCAN_STOPPED
+	BLE_CTRL_SCAN_STOPPED,
+	BLE_CTRL_CMD_ACK,
+	BLE_CTRL_LIGHT_STATE,
+	BLE_CTRL_LINK_QUALITY
 };
 
+// Heads a BLE_CTRL_LIGHT_STATE can carry
+#define BLE_CTRL_MAX_LIGHTS 8
+
 /** BLE control event. */
 struct ble_ctrl_event {
 	struct app_event_header header;
 
 	enum ble_ctrl_cmd cmd;
+	// BLE_CTRL_CONNECTED, BLE_CTRL_DISCONNECTED, BLE_CTRL_LIGHT_STATE and BLE_CTRL_LINK_QUALITY only,
+	// the signal controller it is about
+	uint8_t target;
+	// BLE_CTRL_CMD_ACK only, the command the ESP32 acknowledged and how long the BLE hop took
+	uint16_t cmd_id;
+	uint32_t ble_ms;
+	// BLE_CTRL_LIGHT_STATE only, what the ESP32 confirmed the heads show: one state char per head
+	// (light 1 first), '-' for a head not confirmed yet
+	char light_states[BLE_CTRL_MAX_LIGHTS + 1];
+	// BLE_CTRL_LINK_QUALITY only, the link to the target since the previous report
+	struct chip_link_quality link_quality;
 /*
 	union {
 		const char *name_update;
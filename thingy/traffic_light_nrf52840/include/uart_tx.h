@@ -0,0 +1,30 @@
+#ifndef TRAFFIC_LIGHT_NRF52840_UART_TX_H_
+#define TRAFFIC_LIGHT_NRF52840_UART_TX_H_
+
+/*
+    Sending on the UARTs, implemented in uart_handler.c.
+    UART0 is bridged to USB CDC, UART1 goes to the nRF9160.
+    Data is copied into a ring buffer per UART and sent from there. A write is all or nothing,
+    so a frame is never cut in half when the ring is full: the caller either waits for room
+    or gets an error.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zephyr/kernel.h>
+
+// Queues data for sending
+// @param timeout - How long to wait for room in the ring, K_NO_WAIT fails straight away when it is full
+// @return 0, -ENOMEM if there was no room in time, -EINVAL if the data can never fit
+int uart_tx_enqueue(const uint8_t* data, size_t data_len, uint8_t dev_idx, k_timeout_t timeout);
+
+// Changes the baud rate of a UART, in both directions. Waits for the TX ring to go out at the old rate
+// and stops RX across the switch, writers wait meanwhile.
+// @param baudrate - 0 goes back to the devicetree rate
+// @return 0, -EBUSY if the TX ring did not go out in time, or the error of the UART driver
+int uart_baudrate_set(uint8_t dev_idx, uint32_t baudrate);
+
+// Framing, parity, overrun and break errors seen on a UART since boot
+uint32_t uart_line_errors_get(uint8_t dev_idx);
+
+#endif // TRAFFIC_LIGHT_NRF52840_UART_TX_H_
@@ -9,6 +9,22 @@
 
 #include "events/ae_command_event.h"
 
+const char* light_state_to_string(enum light_states state)
+{
+	switch (state) {
+	case LIGHT_OFF:
+		return "off";
+	case LIGHT_RED:
+		return "red";
+	case LIGHT_YELLOW:
+		return "yellow";
+	case LIGHT_GREEN:
+		return "green";
+	default:
+		return NULL;
+	}
+}
+
 static void log_ae_command_event(const struct app_event_header *aeh)
 {
 	const struct ae_command_event *event = cast_ae_command_event(aeh);
@@ -4,7 +4,10 @@
  * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
  */
 
+#include <stdlib.h>
+#include <stdio.h>
 #include <zephyr/types.h>
+#include <zephyr/sys/byteorder.h>
 #include <zephyr/sys/ring_buffer.h>
 #include <zephyr/drivers/uart.h>
 #include <zephyr/pm/device.h>
@@ -13,115 +16,345 @@
 #include "events/module_state_event.h"
 #include "events/ae_command_event.h"
 #include "events/uart_data_event.h"
+#include "events/ble_ctrl_event.h"
+#include "chip_link.h"
+#include "cmd_lexer.h"
+#include "uart_tx.h"
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(MODULE);
 
+// Link frames are retransmitted by the chip link, so they only wait briefly for room in the TX ring
+#define LINK_TX_TIMEOUT_MS 10
+
 // Parser variables
 #define CMD_PARSE_BUFFER_SIZE 30
-char cmd_parse_buf[CMD_PARSE_BUFFER_SIZE];
-bool cmd_started = false;
-bool cmd_ended = false;
-size_t parse_buf_idx = 0; // the location in the cmd_parse_buff that we are writing to
+#define CMD_LEXER_NODES 48
+
+// Length of the scan target passed with AE_CMD_START_SCAN
+#define SCAN_TARGET_SIZE 30
+
+static struct chip_link link;
+static bool link_initialized = false;
 
 /*
     This module parses UART event data from the uart_handler and turns it into an ae_command_event.
     Although this could be purely implemented in the uart_handler, I believe it is best to implement
     this functionality in a separate handler to reduce complexity.
+    It owns both directions of the link with the nRF9160: binary frames once the handshake is done
+    (see chip_link.h), and the ASCII commands before that or from older firmware.
 */
 
-void reset_parser() {
-    // Zero out the parsing buffer
-    memset(&cmd_parse_buf[0],0,CMD_PARSE_BUFFER_SIZE);
-    cmd_started = false;
-    cmd_ended = false;
-    parse_buf_idx = 0;
-}
-
-void parser_end() {
-    // We've reached the end of a command, turn it into an event
-    if (parse_buf_idx == 0) {
-        // We parsed nothing!
-        LOG_WRN("parse buff len==0");
-    }
-    else {
-        bool valid_cmd = false;
-        enum ae_commands cmd;
-        enum light_states state;
-        char* scan_target = 0;
-
-        if (strncmp(&cmd_parse_buf[0], "green1", CMD_PARSE_BUFFER_SIZE) == 0) {
-            cmd = AE_CMD_SET_STATE1;
-            state = LIGHT_GREEN;
-            valid_cmd = true;
-        }
-        else if (strncmp(&cmd_parse_buf[0], "yellow1", CMD_PARSE_BUFFER_SIZE) == 0) {
-            cmd = AE_CMD_SET_STATE1;
-            state = LIGHT_YELLOW;
-            valid_cmd = true;
-             LOG_INF("parsed YELLOW 1");
-        }
-        else if (strncmp(&cmd_parse_buf[0], "red1", CMD_PARSE_BUFFER_SIZE) == 0) {
-            cmd = AE_CMD_SET_STATE1;
-            state = LIGHT_RED;
-            valid_cmd = true;
-            LOG_INF("parsed RED 1");
-        }
-        else if (strncmp(&cmd_parse_buf[0], "off1", CMD_PARSE_BUFFER_SIZE) == 0) {
-            cmd = AE_CMD_SET_STATE1;
-            state = LIGHT_OFF;
-            valid_cmd = true;
-        }
-        else if (strncmp(&cmd_parse_buf[0], "green2", CMD_PARSE_BUFFER_SIZE) == 0) {
-            cmd = AE_CMD_SET_STATE2;
-            state = LIGHT_GREEN;
-            valid_cmd = true;
-            LOG_INF("parsed GREEN 2");
-        }
-        else if (strncmp(&cmd_parse_buf[0], "yellow2", CMD_PARSE_BUFFER_SIZE) == 0) {
-            cmd = AE_CMD_SET_STATE2;
-            state = LIGHT_YELLOW;
-            valid_cmd = true;
-            LOG_INF("parsed YELLOW 2");
-        }
-        else if (strncmp(&cmd_parse_buf[0], "red2", CMD_PARSE_BUFFER_SIZE) == 0) {
-            cmd = AE_CMD_SET_STATE2;
-            state = LIGHT_RED;
-            valid_cmd = true;
-            LOG_INF("parsed RED 2");
+static void submit_command(enum ae_commands cmd, uint8_t target, enum light_states state, uint8_t light,
+                           const char* frame, uint16_t cmd_id, char* scan_target) {
+    struct ae_command_event *event;
+    event = new_ae_command_event();
+    event->cmd = cmd;
+    event->target = target;
+    event->light_state = state;
+    event->light = light;
+    strncpy(event->frame, frame, AE_CMD_MAX_FRAME_LIGHTS);
+    event->frame[AE_CMD_MAX_FRAME_LIGHTS] = '\0';
+    event->cmd_id = cmd_id;
+    event->scan_target = scan_target;
+    APP_EVENT_SUBMIT(event);
+}
+
+static char* copy_scan_target(const char* target, size_t len) {
+    char* scan_target = k_malloc(SCAN_TARGET_SIZE);
+    if (scan_target == NULL) {
+        LOG_ERR("No memory for the scan target");
+        return NULL;
+    }
+    memset(scan_target, 0, SCAN_TARGET_SIZE);
+    memcpy(scan_target, target, MIN(len, SCAN_TARGET_SIZE - 1));
+    return scan_target;
+}
+
+// Commands for any signal controller but the first end with "@<target>", ie. "S1:g-#42@1".
+// Copies args without that suffix into body (CMD_PARSE_BUFFER_SIZE bytes).
+static int split_target(const char* args, char* body, uint8_t* target) {
+    const char* at = strrchr(args, '@');
+    size_t len = strlen(args);
+
+    *target = 0;
+    if (at != NULL) {
+        char* end = NULL;
+        long value = strtol(at + 1, &end, 10);
+        if (end == at + 1 || *end != '\0' || value < 0 || value >= CHIP_LINK_MAX_TARGETS) {
+            return -EINVAL;
         }
-        else if (strncmp(&cmd_parse_buf[0], "off2", CMD_PARSE_BUFFER_SIZE) == 0) {
-            cmd = AE_CMD_SET_STATE2;
-            state = LIGHT_OFF;
-            valid_cmd = true;
+        *target = (uint8_t) value;
+        len = at - args;
+    }
+    len = MIN(len, CMD_PARSE_BUFFER_SIZE - 1);
+    memcpy(body, args, len);
+    body[len] = '\0';
+    return 0;
+}
+
+// Light commands are a state word followed by the light number, ie. "green1" or "red3".
+// value is the light state of the word.
+static int cmd_light_word(const struct cmd_lexer_cmd* cmd, const char* args) {
+    char body[CMD_PARSE_BUFFER_SIZE];
+    uint8_t target;
+    if (split_target(args, body, &target) != 0) {
+        return -EINVAL;
+    }
+
+    char* end = NULL;
+    long light = strtol(body, &end, 10);
+    if (end == body || *end != '\0' || light <= 0 || light > UINT8_MAX) {
+        return -EINVAL;
+    }
+    LOG_INF("parsed %s %d for %d", cmd->name, (int) light, target);
+    submit_command(AE_CMD_SET_STATE, target, cmd->value, (uint8_t) light, "", 0, NULL);
+    return 0;
+}
+
+// Every head of a controller in one frame, "S<first light>:<state chars>[#<command id>]", ie. "S1:g-" or "S1:g-#42"
+static int cmd_frame(const struct cmd_lexer_cmd* cmd, const char* args) {
+    char body[CMD_PARSE_BUFFER_SIZE];
+    uint8_t target;
+    if (split_target(args, body, &target) != 0) {
+        return -EINVAL;
+    }
+
+    char* end = NULL;
+    long light = strtol(body, &end, 10);
+    if (end == body || *end != ':' || light <= 0 || light > UINT8_MAX) {
+        return -EINVAL;
+    }
+
+    size_t frame_len = strspn(end + 1, "rygo-");
+    if (frame_len == 0 || frame_len > AE_CMD_MAX_FRAME_LIGHTS) {
+        return -EINVAL;
+    }
+
+    const char* id_str = end + 1 + frame_len;
+    long id = 0;
+    if (*id_str == '#') {
+        char* id_end = NULL;
+        id = strtol(id_str + 1, &id_end, 10);
+        if (id_end == id_str + 1 || *id_end != '\0' || id <= 0 || id > UINT16_MAX) {
+            return -EINVAL;
         }
-        else if (strncmp(&cmd_parse_buf[0], "start_scan", 10) == 0) {
-            cmd = AE_CMD_START_SCAN;
-            scan_target = k_malloc(30);
-            memset(scan_target,0,30);
-            strncpy(scan_target, &cmd_parse_buf[10], 30);
-            state = 0;
-            valid_cmd = true;
+    }
+    else if (*id_str != '\0') {
+        return -EINVAL;
+    }
+
+    char frame[AE_CMD_MAX_FRAME_LIGHTS + 1] = {0};
+    strncpy(frame, end + 1, frame_len);
+    LOG_INF("parsed frame %d:%s id %d for %d", (int) light, frame, (int) id, target);
+    submit_command(AE_CMD_SET_FRAME, target, 0, (uint8_t) light, frame, (uint16_t) id, NULL);
+    return 0;
+}
+
+static int cmd_start_scan(const struct cmd_lexer_cmd* cmd, const char* args) {
+    char body[CMD_PARSE_BUFFER_SIZE];
+    uint8_t target;
+    if (split_target(args, body, &target) != 0 || body[0] == '\0') {
+        return -EINVAL;
+    }
+
+    char* scan_target = copy_scan_target(body, strlen(body));
+    if (scan_target != NULL) {
+        submit_command(AE_CMD_START_SCAN, target, 0, 0, "", 0, scan_target);
+    }
+    return 0;
+}
+
+static int cmd_stop_scan(const struct cmd_lexer_cmd* cmd, const char* args) {
+    submit_command(AE_CMD_STOP_SCAN, 0, 0, 0, "", 0, NULL);
+    return 0;
+}
+
+static const struct cmd_lexer_cmd ae_commands[] = {
+    { "green", true, cmd_light_word, LIGHT_GREEN },
+    { "yellow", true, cmd_light_word, LIGHT_YELLOW },
+    { "red", true, cmd_light_word, LIGHT_RED },
+    { "off", true, cmd_light_word, LIGHT_OFF },
+    { "S", true, cmd_frame, 0 },
+    { "start_scan", true, cmd_start_scan, 0 },
+    { "stop_scan", false, cmd_stop_scan, 0 },
+};
+
+CMD_LEXER_DEFINE(ae_lexer, ae_commands, CMD_PARSE_BUFFER_SIZE, CMD_LEXER_NODES);
+
+static int link_write(const uint8_t* data, size_t len) {
+    // 1 - device index (corresponds to UART1)
+    int err = uart_tx_enqueue(data, len, 1, K_MSEC(LINK_TX_TIMEOUT_MS));
+    if (err == -ENOMEM) {
+        LOG_WRN("Link->UART_1 overflow");
+    } else if (err) {
+        LOG_ERR("uart_tx_enqueue: %d", err);
+    }
+    return err;
+}
+
+static char link_light_to_char(uint8_t light) {
+    switch (light) {
+        case CHIP_LINK_LIGHT_OFF:
+            return 'o';
+        case CHIP_LINK_LIGHT_RED:
+            return 'r';
+        case CHIP_LINK_LIGHT_YELLOW:
+            return 'y';
+        case CHIP_LINK_LIGHT_GREEN:
+            return 'g';
+        case CHIP_LINK_LIGHT_UNCHANGED:
+            return '-';
+        default:
+            return 0;
+    }
+}
+
+static uint8_t char_to_link_light(char c) {
+    switch (c) {
+        case 'o':
+            return CHIP_LINK_LIGHT_OFF;
+        case 'r':
+            return CHIP_LINK_LIGHT_RED;
+        case 'y':
+            return CHIP_LINK_LIGHT_YELLOW;
+        case 'g':
+            return CHIP_LINK_LIGHT_GREEN;
+        default:
+            return CHIP_LINK_LIGHT_UNCHANGED;
+    }
+}
+
+// A binary frame from the nRF9160, produces the same events as the ASCII commands
+static void link_received(uint8_t type, const uint8_t* payload, size_t len) {
+    switch (type) {
+        case CHIP_LINK_MSG_SET_FRAME: {
+            size_t light_count = (len > 4) ? len - 4 : 0;
+            if (light_count == 0 || light_count > AE_CMD_MAX_FRAME_LIGHTS || payload[0] >= CHIP_LINK_MAX_TARGETS
+                || payload[1] == 0) {
+                LOG_WRN("Invalid frame from nRF9160, %d lights", (int) light_count);
+                return;
+            }
+            char frame[AE_CMD_MAX_FRAME_LIGHTS + 1] = {0};
+            for (size_t i = 0; i < light_count; i++) {
+                frame[i] = link_light_to_char(payload[4 + i]);
+                if (frame[i] == 0) {
+                    LOG_WRN("Invalid light state %d from nRF9160", payload[4 + i]);
+                    return;
+                }
+            }
+            LOG_INF("parsed frame %d:%s id %d for %d", payload[1], frame, sys_get_le16(&payload[2]), payload[0]);
+            submit_command(AE_CMD_SET_FRAME, payload[0], 0, payload[1], frame, sys_get_le16(&payload[2]), NULL);
         }
-        else if (strncmp(&cmd_parse_buf[0], "stop_scan", CMD_PARSE_BUFFER_SIZE) == 0) {
-            cmd = AE_CMD_STOP_SCAN;
-            state = 0;
-            valid_cmd = true;
+        break;
+        case CHIP_LINK_MSG_START_SCAN: {
+            if (len < 2 || payload[0] >= CHIP_LINK_MAX_TARGETS) {
+                LOG_WRN("Invalid scan target from nRF9160");
+                return;
+            }
+            char* scan_target = copy_scan_target((const char*) &payload[1], len - 1);
+            if (scan_target != NULL) {
+                submit_command(AE_CMD_START_SCAN, payload[0], 0, 0, "", 0, scan_target);
+            }
         }
+        break;
+        case CHIP_LINK_MSG_STOP_SCAN:
+            submit_command(AE_CMD_STOP_SCAN, 0, 0, 0, "", 0, NULL);
+        break;
+        default:
+            LOG_WRN("Unknown frame type 0x%02x from nRF9160", type);
+        break;
+    }
+}
 
-        if (valid_cmd) {
-            // If we parsed a valid command, trigger it
-            struct ae_command_event *event;
-            event = new_ae_command_event();
-            event->cmd = cmd;
-            event->light_state = state;
-            event->scan_target = scan_target;
-            APP_EVENT_SUBMIT(event);
-        }
-        else {
-            LOG_WRN("Invalid AE cmd string! No event produced. %s", cmd_parse_buf);
+// The nRF9160 has not completed the handshake, or did not acknowledge a frame, use the ASCII messages
+static void link_send_ascii(uint8_t type, const uint8_t* payload, size_t len) {
+    char msg[24];
+    int msg_len;
+
+    switch (type) {
+        case CHIP_LINK_MSG_BLE_CONNECTED:
+        case CHIP_LINK_MSG_BLE_DISCONNECTED:
+            // "!C;" or "!D;" for the first controller, the others add "@<target>"
+            if (len != 1) {
+                return;
+            }
+            if (payload[0] == 0) {
+                msg_len = snprintf(msg, sizeof(msg), "!%s;", type == CHIP_LINK_MSG_BLE_CONNECTED ? "C" : "D");
+            }
+            else {
+                msg_len = snprintf(msg, sizeof(msg), "!%s@%d;", type == CHIP_LINK_MSG_BLE_CONNECTED ? "C" : "D",
+                                   payload[0]);
+            }
+        break;
+        case CHIP_LINK_MSG_SCAN_STARTED:
+            msg_len = snprintf(msg, sizeof(msg), "!SCAN_START;");
+        break;
+        case CHIP_LINK_MSG_SCAN_STOPPED:
+            msg_len = snprintf(msg, sizeof(msg), "!SCAN_STOP;");
+        break;
+        case CHIP_LINK_MSG_CMD_ACK:
+            // "!A<command id>,<BLE hop ms>;" - light command applied by the ESP32
+            if (len != 4) {
+                return;
+            }
+            msg_len = snprintf(msg, sizeof(msg), "!A%d,%d;", sys_get_le16(&payload[0]), sys_get_le16(&payload[2]));
+        break;
+        case CHIP_LINK_MSG_LIGHT_STATE: {
+            // "!L<one state char per head>;" - what the ESP32 confirmed, the others add "@<target>"
+            char states[BLE_CTRL_MAX_LIGHTS + 1];
+            if (len < 2 || len - 1 > BLE_CTRL_MAX_LIGHTS) {
+                return;
+            }
+            for (size_t i = 0; i < len - 1; i++) {
+                states[i] = link_light_to_char(payload[1 + i]);
+                if (states[i] == 0) {
+                    return;
+                }
+            }
+            states[len - 1] = '\0';
+            if (payload[0] == 0) {
+                msg_len = snprintf(msg, sizeof(msg), "!L%s;", states);
+            }
+            else {
+                msg_len = snprintf(msg, sizeof(msg), "!L%s@%d;", states, payload[0]);
+            }
         }
+        break;
+        case CHIP_LINK_MSG_LINK_QUALITY:
+            // Telemetry only, not worth a message of its own while the nRF9160 speaks ASCII
+            return;
+        default:
+            LOG_ERR("No ASCII message for frame type 0x%02x", type);
+            return;
     }
+
+    link_write((const uint8_t*) msg, MIN((size_t) msg_len, sizeof(msg) - 1));
+}
+
+// The nRF9160 picks the baud rate, we follow
+static int link_set_baudrate(uint32_t baudrate) {
+    return uart_baudrate_set(1, baudrate);
+}
+
+static uint32_t link_line_errors(void) {
+    return uart_line_errors_get(1);
+}
+
+static const struct chip_link_ops link_ops = {
+    .write = link_write,
+    .received = link_received,
+    .send_ascii = link_send_ascii,
+    .set_baudrate = link_set_baudrate,
+    .line_errors = link_line_errors,
+};
+
+static void link_send(uint8_t type, const uint8_t* payload, size_t len) {
+    if (!link_initialized) {
+        link_send_ascii(type, payload, len);
+        return;
+    }
+    chip_link_send(&link, type, payload, len);
 }
 
 static bool app_event_handler(const struct app_event_header *aeh)
@@ -148,39 +381,22 @@ static bool app_event_handler(const struct app_event_header *aeh)
 
 		// We got characters from the UART connection
         if (event->len > 0) {
-            printk("\nGot from 91: ");
-            for (size_t i = 0; i < event->len; i++) {
-                printk("%c", event->buf[i]);
-            }
-            printk("\n");
-            
+            LOG_HEXDUMP_DBG(event->buf, event->len, "Got from 91");
+
             for (size_t i = 0; i < event->len; i++) {
-                printk(event->buf[i]);
-                if (!cmd_started && event->buf[i] == '!') {
-                    // We found the start of a command
-                    reset_parser();
-                    cmd_started = true;
-                    continue;
-                }
-                else if (cmd_started && event->buf[i] == ';') {
-                    // We found the end of a command
-                    parser_end();
-                    reset_parser();
-                    continue;
-                }
-                else if (cmd_started) {
-                    // copy character to the parse buffer
-                    cmd_parse_buf[parse_buf_idx] = event->buf[i];
-                    parse_buf_idx++;
-                }
-                else {
-                    // Command not started yet, continue
+                if (link_initialized && chip_link_rx_byte(&link, event->buf[i])) {
+                    // Part of a binary frame
                     continue;
                 }
-
-                if (parse_buf_idx >= CMD_PARSE_BUFFER_SIZE) {
-                    LOG_WRN("parse buffer overrun!");
-                    reset_parser();
+                switch (cmd_lexer_feed(&ae_lexer, event->buf[i])) {
+                    case CMD_LEXER_UNKNOWN:
+                    case CMD_LEXER_BAD_ARGS:
+                        LOG_WRN("Invalid AE cmd string! No event produced. %s", ae_lexer.buf);
+                    break;
+                    case CMD_LEXER_OVERFLOW:
+                        LOG_WRN("parse buffer overrun!");
+                    break;
+                    default:
                     break;
                 }
             }
@@ -194,12 +410,62 @@ static bool app_event_handler(const struct app_event_header *aeh)
 			cast_module_state_event(aeh);
 
 		if (check_state(event, MODULE_ID(main), MODULE_STATE_READY)) {
-            reset_parser();
+            int err = cmd_lexer_init(&ae_lexer);
+            if (err) {
+                LOG_ERR("Failed to build the command table (err %d), looking commands up one by one", err);
+            }
+            chip_link_init(&link, &link_ops);
+            link_initialized = true;
+            chip_link_start(&link);
 		}
 
 		return false;
 	}
 
+	if (is_ble_ctrl_event(aeh)) {
+		const struct ble_ctrl_event *event =
+			cast_ble_ctrl_event(aeh);
+        uint8_t payload[CHIP_LINK_MAX_PAYLOAD];
+        size_t count;
+
+        switch (event->cmd) {
+            case BLE_CTRL_CONNECTED:
+                link_send(CHIP_LINK_MSG_BLE_CONNECTED, &event->target, 1);
+            break;
+            case BLE_CTRL_DISCONNECTED:
+                link_send(CHIP_LINK_MSG_BLE_DISCONNECTED, &event->target, 1);
+            break;
+            case BLE_CTRL_SCAN_STARTED:
+                link_send(CHIP_LINK_MSG_SCAN_STARTED, NULL, 0);
+            break;
+            case BLE_CTRL_SCAN_STOPPED:
+                link_send(CHIP_LINK_MSG_SCAN_STOPPED, NULL, 0);
+            break;
+            case BLE_CTRL_CMD_ACK:
+                sys_put_le16(event->cmd_id, &payload[0]);
+                sys_put_le16((uint16_t) MIN(event->ble_ms, UINT16_MAX), &payload[2]);
+                link_send(CHIP_LINK_MSG_CMD_ACK, payload, 4);
+            break;
+            case BLE_CTRL_LIGHT_STATE:
+                payload[0] = event->target;
+                count = strnlen(event->light_states, BLE_CTRL_MAX_LIGHTS);
+                for (size_t i = 0; i < count; i++) {
+                    payload[1 + i] = char_to_link_light(event->light_states[i]);
+                }
+                link_send(CHIP_LINK_MSG_LIGHT_STATE, payload, 1 + count);
+            break;
+            case BLE_CTRL_LINK_QUALITY:
+                count = chip_link_quality_encode(event->target, &event->link_quality, payload);
+                link_send(CHIP_LINK_MSG_LINK_QUALITY, payload, count);
+            break;
+            default:
+                LOG_ERR("Unhandled BLE CTRL event! cmd: %d", event->cmd);
+            break;
+        }
+
+		return false;
+	}
+
 	/* If event is unhandled, unsubscribe. */
 	__ASSERT_NO_MSG(false);
 
@@ -208,4 +474,5 @@ static bool app_event_handler(const struct app_event_header *aeh)
 APP_EVENT_LISTENER(MODULE, app_event_handler);
 APP_EVENT_SUBSCRIBE(MODULE, module_state_event);
 APP_EVENT_SUBSCRIBE(MODULE, uart_data_event);
+APP_EVENT_SUBSCRIBE(MODULE, ble_ctrl_event);
 APP_EVENT_SUBSCRIBE_FINAL(MODULE, ae_command_event);
\ No newline at end of file
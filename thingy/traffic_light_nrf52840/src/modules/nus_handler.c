@@ -4,8 +4,11 @@
  * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
  */
 
+#include <stdio.h>
+#include <stdlib.h>
 #include <zephyr/types.h>
 #include <zephyr/sys/ring_buffer.h>
+#include <zephyr/sys/byteorder.h>
 #include <zephyr/drivers/uart.h>
 #include <zephyr/pm/device.h>
 
@@ -22,74 +25,1258 @@
 
 #include <zephyr/settings/settings.h>
 
+#if defined(CONFIG_BT_HCI_VS_EVT_USER)
+#include <sdc_hci_vs.h>
+#endif
+
 #define MODULE nus_handler
 #include "events/module_state_event.h"
 #include "events/ae_command_event.h"
 #include "events/ble_data_event.h"
 #include "events/ble_ctrl_event.h"
+#include "chip_link.h"
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(MODULE);
 
 /*
-    This module handles scanning, connecting, disconnecting, and sending data to the ESP32s over BLE with Nordic UART Service
+    This module handles scanning, connecting, disconnecting, and sending data to the ESP32s over BLE with Nordic UART Service.
+    Several signal controllers can be connected at the same time, each one is a peer with its own NUS client.
+    The nRF9160 assigns each target ID (0..NUS_MAX_PEERS - 1) the name of its controller with AE_CMD_START_SCAN,
+    and commands are routed to the peer of their target.
+
+    Scanning by name is only the cold start. Once a target has been connected, its address is remembered
+    (and kept in settings, so it survives a restart) and a missing target is connected to by address: directly
+    if it is the only one, through the filter accept list otherwise. The controller then connects as soon as
+    one advertising packet from that address is heard, without us waiting for and matching a name. An address
+    that gets no answer within NUS_RECONNECT_TIMEOUT_MS is set aside, and the target is scanned for by name,
+    with a name filter for each such target, until it is found again.
+
+    The NUS handles found by service discovery are kept along with the address. A reconnect to the same
+    address uses them straight away, so commands can be sent as soon as the link is up, and checks them
+    afterwards against the RX and TX characteristic declarations. If the peer's GATT database changed it
+    is disconnected, and discovers its service again once it is back.
+
+    Light commands never wait for BLE on the event manager thread. They are merged into the peer's waiting
+    frame, the latest state per head wins, and the peer's TX work writes that frame once the previous write
+    has completed. Writes go without response when the ESP32 allows it, its acknowledgement is the
+    confirmation that matters.
+
+    Every frame carries a sequence number ("S1:g-#<seq>;") and the ESP32 acknowledges each one with what
+    its heads show ("a<seq>:<one state char per head>;"). A head on its way to a new state passes through
+    the ESP32's own amber and all-red clearance first, and the ESP32 sends the acknowledgement of its last
+    frame again each time that changes the lamps. That confirmed state goes to the nRF9160 whenever it changes. Heads that are still not confirmed NUS_ACK_TIMEOUT_MS after the
+    newest frame are written again, up to NUS_ACK_RETRIES times in a row.
+
+    The quality of every link is collected into fixed size aggregates: the RSSI read every NUS_RSSI_SAMPLE_MS
+    (min, max, mean and a histogram), the connection events from the controller's QoS reports, disconnects,
+    reconnects and retransmitted frames. Every CHIP_LINK_QUALITY_INTERVAL_MS each target in use sends its
+    aggregate to the nRF9160 in one message and starts over, nothing is sent per event.
 */
 
 #define KEY_PASSKEY_ACCEPT DK_BTN1_MSK
 #define KEY_PASSKEY_REJECT DK_BTN2_MSK
 
-#define NUS_WRITE_TIMEOUT K_MSEC(500)
+// A write that has not completed by then is given up on, and the next frame goes out
+#define NUS_WRITE_TIMEOUT_MS 500
+// Retry delay after the stack refused a write, ie. it was out of buffers
+#define NUS_WRITE_RETRY_MS 20
+// Unconfirmed heads are written again this long after the newest frame, if its acknowledgement has not come
+#define NUS_ACK_TIMEOUT_MS 300
+#define NUS_ACK_RETRIES 3
+
+#define NUS_MAX_PEERS CHIP_LINK_MAX_TARGETS
+BUILD_ASSERT(NUS_MAX_PEERS <= CONFIG_BT_MAX_CONN, "CONFIG_BT_MAX_CONN is too low for every target");
+BUILD_ASSERT(NUS_MAX_PEERS <= CONFIG_BT_SCAN_NAME_CNT, "CONFIG_BT_SCAN_NAME_CNT is too low for every target");
+
+// Length of a controller name, as passed with AE_CMD_START_SCAN
+#define NUS_PEER_NAME_SIZE 30
+// Commands are copied into a buffer per peer, it must stay valid until the BLE write completes
+#define BLE_CMD_BUF_SIZE 20
+// Commands written to the ESP32 that are waiting for the acknowledgement of their frame
+#define PENDING_ACK_COUNT 8
+// Command IDs that can be merged into one waiting frame, the oldest one is no longer tracked after that
+#define NUS_TX_IDS 4
+// Acknowledgements arrive in pieces, the ESP32 notifies one byte at a time.
+// Sequence number, ':' and one state char per head.
+#define BLE_RX_BUF_SIZE (8 + AE_CMD_MAX_FRAME_LIGHTS)
+BUILD_ASSERT(AE_CMD_MAX_FRAME_LIGHTS <= BLE_CTRL_MAX_LIGHTS, "Confirmed light states do not fit ble_ctrl_event");
+
+// Connection parameters, the interval is in 1.25 ms units and the supervision timeout in 10 ms units.
+// While commands are flowing a short interval gets each write out within a few ms.
+#define NUS_ACTIVE_INTERVAL_MIN 6
+#define NUS_ACTIVE_INTERVAL_MAX 12
+#define NUS_ACTIVE_LATENCY 0
+// Idle, the ESP32 may also skip NUS_IDLE_LATENCY connection events, so the first command after a
+// quiet spell can take up to (NUS_IDLE_LATENCY + 1) * 100 ms while the short interval is set up again
+#define NUS_IDLE_INTERVAL_MIN 80
+#define NUS_IDLE_INTERVAL_MAX 80
+#define NUS_IDLE_LATENCY 2
+#define NUS_CONN_TIMEOUT 400
+// Back to the idle parameters this long after the last command
+#define NUS_ACTIVE_HOLD_MS 10000
+// The 2M PHY and the longest data length are asked for on connecting, checked this much later
+#define NUS_LINK_CHECK_DELAY_MS 3000
+#define NUS_DATA_LEN_MAX 251
+// A connection attempt to a known address gives up after this, the target is then scanned for by name.
+// Name scanning for targets without an address waits while an attempt runs.
+#define NUS_RECONNECT_TIMEOUT_MS 5000
+// The RSSI of every connected peer is read this often for the link quality
+#define NUS_RSSI_SAMPLE_MS 5000
+
+// What was negotiated with a peer and how the parameter changes went
+struct nus_link_stats {
+	// Interval in 1.25 ms units, timeout in 10 ms units
+	uint16_t interval;
+	uint16_t latency;
+	uint16_t timeout;
+	uint8_t tx_phy;
+	uint8_t rx_phy;
+	uint16_t tx_max_len;
+	uint16_t rx_max_len;
+	uint32_t param_updates;
+	// From asking for new parameters until they were in use
+	uint32_t param_update_ms_last;
+	uint32_t param_update_ms_max;
+	// Time spent on the short interval
+	uint32_t active_ms;
+};
+
+struct nus_tx_stats {
+	uint32_t writes;
+	// Commands merged into a frame that was already waiting
+	uint32_t coalesced;
+	uint32_t errors;
+	uint32_t timeouts;
+	// Frames whose acknowledgement did not come in time, and frames written again because of that
+	uint32_t ack_timeouts;
+	uint32_t retransmits;
+	// Heads given up on after NUS_ACK_RETRIES
+	uint32_t unconfirmed;
+	// Commands waiting in one frame
+	uint32_t depth_max;
+	// From the oldest command of a frame being queued to its write completing
+	uint32_t latency_avg_ms;
+	uint32_t latency_max_ms;
+};
+
+// How a target came back after losing its connection
+struct nus_reconnect_stats {
+	uint32_t reconnects;
+	// Came back at its known address, the others were found by scanning for the name
+	uint32_t by_address;
+	// Attempts at the known address that timed out
+	uint32_t address_misses;
+	// Connections that used the cached handles, and cached handles that turned out to be wrong
+	uint32_t cached;
+	uint32_t cache_stale;
+	// From the disconnect until commands could be sent again
+	uint32_t ms_last;
+	uint32_t ms_avg;
+	uint32_t ms_max;
+};
+
+// What is kept in settings for each target, under "nus/peer/<target>"
+struct nus_peer_record {
+	char name[NUS_PEER_NAME_SIZE];
+	bt_addr_le_t addr;
+	// NUS handles discovered at addr, all 0 if there are none
+	uint16_t rx;
+	uint16_t tx;
+	uint16_t tx_ccc;
+	uint8_t write_nr;
+};
 
-K_SEM_DEFINE(nus_write_sem,1,1);
+struct nus_peer {
+	// Name of the controller for this target, empty while the target is not in use
+	char name[NUS_PEER_NAME_SIZE];
+	struct bt_conn *conn;
+	// Address the controller called addr_name was last connected at
+	bool have_addr;
+	bt_addr_le_t addr;
+	char addr_name[NUS_PEER_NAME_SIZE];
+	// Nothing answered at addr, scanned for by name until it is found again
+	bool addr_failed;
+	// Handles from service discovery at addr, used instead of discovering again
+	bool have_handles;
+	struct bt_nus_client_handles handles;
+	bool handles_write_nr;
+	// Checks the cached handles, one read per characteristic declaration
+	struct bt_gatt_read_params verify_params[2];
+	// addr or the handles are to be written to settings
+	bool addr_dirty;
+	// The current connection was made by address rather than by name
+	bool by_address;
+	// When a ready connection was lost, 0 if it was not
+	int64_t lost_at;
+	struct nus_reconnect_stats reconnect;
+	struct bt_nus_client client;
+	struct bt_gatt_exchange_params exchange_params;
+	// Waiting for another peer's service discovery to finish, only one can run at a time
+	bool discovery_pending;
+	// Service discovery done, commands can be sent
+	bool ready;
+
+	// The RX characteristic takes write without response
+	bool write_nr;
+	// Waiting to be written, one state char per head (light 1 first) or '-', see nus_tx_queue()
+	char tx_heads[AE_CMD_MAX_FRAME_LIGHTS];
+	uint32_t tx_depth;
+	int64_t tx_queued;
+	struct {
+		uint16_t cmd_id;
+		int64_t queued;
+	} tx_ids[NUS_TX_IDS];
+	size_t tx_id_count;
+	// Being written, cmd_buf must stay valid until the write completes
+	bool tx_in_flight;
+	int64_t tx_in_flight_queued;
+	int64_t tx_write_time;
+	char cmd_buf[BLE_CMD_BUF_SIZE];
+	struct k_work_delayable tx_work;
+	struct nus_tx_stats tx;
+
+	// Sequence number of the newest frame written, never 0
+	uint16_t tx_seq;
+	// Every head as written so far, and as the ESP32 last acknowledged it, '-' while unknown
+	char written_heads[AE_CMD_MAX_FRAME_LIGHTS];
+	char confirmed_heads[AE_CMD_MAX_FRAME_LIGHTS];
+	// Newest acknowledgement seen, 0 if none
+	uint16_t acked_seq;
+	// When the newest frame was written, 0 once it is acknowledged
+	int64_t ack_wait_since;
+	uint8_t ack_retries;
+	struct k_work_delayable ack_work;
+
+	// frame_id is the sequence number of the frame the command went out in, the ESP32 acknowledges
+	// that one for every command merged into the frame
+	struct {
+		uint16_t cmd_id;
+		uint16_t frame_id;
+		int64_t sent_time;
+	} pending_acks[PENDING_ACK_COUNT];
+	size_t next_pending_ack;
+
+	char rx_buf[BLE_RX_BUF_SIZE];
+	size_t rx_idx;
+	bool rx_started;
+
+	// On the short interval, see peer_command_sent(). Guarded by nus_tx_lock, like param_requested.
+	bool active;
+	int64_t active_since;
+	// When new parameters were asked for, 0 once they are in use
+	int64_t param_requested;
+	struct k_work_delayable idle_work;
+	struct k_work_delayable link_check_work;
+	struct nus_link_stats link;
+
+	// Link quality since the last report, see quality_work_handler()
+	struct chip_link_quality quality;
+	int32_t rssi_sum;
+	uint16_t rssi_samples;
+	// Matches the controller's QoS reports to the peer, valid while have_conn_handle
+	uint16_t conn_handle;
+	bool have_conn_handle;
+	// Counted by qos_event_received() on the Bluetooth RX thread
+	atomic_t conn_events;
+	atomic_t conn_events_skipped;
+	uint16_t qos_last_counter;
+	bool qos_have_counter;
+};
 
-static struct bt_conn *default_conn;
-static struct bt_nus_client nus_client;
-bool ble_connected = false;
+static struct nus_peer peers[NUS_MAX_PEERS];
+// Guards the TX, acknowledgement and link quality state of every peer, shared by the event manager thread,
+// the system work queue and the Bluetooth callbacks
+K_MUTEX_DEFINE(nus_tx_lock);
+// Target whose advertisement matched, from the filter match until connected() for it, -1 if none
+static int connecting_peer = -1;
+// A connection attempt to known addresses runs, through the filter accept list if initiating_auto
+static bool initiating = false;
+static bool initiating_auto = false;
+static bool discovery_running = false;
+static struct k_work save_work;
+static struct k_work_delayable quality_work;
+// RSSI samples taken since the last link quality report
+static uint32_t quality_ticks = 0;
+static const int8_t rssi_bucket_bounds[CHIP_LINK_RSSI_BUCKET_COUNT - 1] = CHIP_LINK_RSSI_BUCKET_BOUNDS;
 bool ble_scanning = false;
-static char* target_device_name;
+
+static uint8_t peer_target(const struct nus_peer *peer)
+{
+	return (uint8_t) (peer - peers);
+}
+
+static struct nus_peer *peer_by_conn(const struct bt_conn *conn)
+{
+	for (size_t i = 0; i < NUS_MAX_PEERS; i++) {
+		if (peers[i].conn == conn) {
+			return &peers[i];
+		}
+	}
+	return NULL;
+}
+
+// Missing target that is connected to by its address
+static bool peer_by_address_wanted(const struct nus_peer *peer)
+{
+	return peer->name[0] != '\0' && peer->conn == NULL && peer->have_addr && !peer->addr_failed;
+}
+
+static struct nus_peer *peer_by_address(const bt_addr_le_t *addr)
+{
+	for (size_t i = 0; i < NUS_MAX_PEERS; i++) {
+		if (peer_by_address_wanted(&peers[i]) && bt_addr_le_cmp(&peers[i].addr, addr) == 0) {
+			return &peers[i];
+		}
+	}
+	return NULL;
+}
+
+static void submit_ble_ctrl_event(enum ble_ctrl_cmd cmd, uint8_t target)
+{
+	struct ble_ctrl_event *event = new_ble_ctrl_event();
+	event->cmd = cmd;
+	event->target = target;
+	event->cmd_id = 0;
+	event->ble_ms = 0;
+	event->light_states[0] = '\0';
+	memset(&event->link_quality, 0, sizeof(event->link_quality));
+	APP_EVENT_SUBMIT(event);
+}
+
+// Initiator for known addresses, the timeout is in 10 ms units
+static const struct bt_conn_le_create_param reconnect_param = {
+	.options = BT_CONN_LE_OPT_NONE,
+	.interval = BT_GAP_SCAN_FAST_INTERVAL,
+	.window = BT_GAP_SCAN_FAST_WINDOW,
+	.interval_coded = 0,
+	.window_coded = 0,
+	.timeout = NUS_RECONNECT_TIMEOUT_MS / 10,
+};
+
+// Starts connecting to the missing targets with a known address
+// @return True if an attempt is running
+static bool start_initiating(void)
+{
+	struct nus_peer *direct = NULL;
+	size_t known = 0;
+	int err;
+
+	for (size_t i = 0; i < NUS_MAX_PEERS; i++) {
+		if (peer_by_address_wanted(&peers[i])) {
+			direct = &peers[i];
+			known++;
+		}
+	}
+	if (known == 0) {
+		return false;
+	}
+
+	if (known == 1) {
+		struct bt_conn *conn;
+
+		err = bt_conn_le_create(&direct->addr, &reconnect_param, BT_LE_CONN_PARAM_DEFAULT, &conn);
+		if (err) {
+			LOG_WRN("Connecting to target %d by address failed (err %d)", peer_target(direct), err);
+			direct->addr_failed = true;
+			return false;
+		}
+		// The reference from bt_conn_le_create() is the peer's
+		direct->conn = conn;
+		direct->by_address = true;
+		initiating = true;
+		initiating_auto = false;
+		LOG_INF("Connecting to target %d by address", peer_target(direct));
+		return true;
+	}
+
+	// The accept list can only change while no attempt uses it, update_connecting() stopped any
+	bt_le_filter_accept_list_clear();
+	for (size_t i = 0; i < NUS_MAX_PEERS; i++) {
+		if (!peer_by_address_wanted(&peers[i])) {
+			continue;
+		}
+		err = bt_le_filter_accept_list_add(&peers[i].addr);
+		if (err) {
+			LOG_WRN("Target %d cannot go on the accept list (err %d)", (int) i, err);
+			peers[i].addr_failed = true;
+		}
+	}
+
+	err = bt_conn_le_create_auto(&reconnect_param, BT_LE_CONN_PARAM_DEFAULT);
+	if (err) {
+		LOG_WRN("Connecting through the accept list failed (err %d)", err);
+		for (size_t i = 0; i < NUS_MAX_PEERS; i++) {
+			if (peer_by_address_wanted(&peers[i])) {
+				peers[i].addr_failed = true;
+			}
+		}
+		return false;
+	}
+	initiating = true;
+	initiating_auto = true;
+	LOG_INF("Connecting to %d targets through the accept list", (int) known);
+	return true;
+}
+
+// Looks for every target in use that is not connected: by address where one is known, otherwise by
+// scanning with a name filter for each of them. Call again whenever a target, or the connection of one, changes.
+static void update_connecting(void)
+{
+	bool wanted = false;
+	int err;
+
+	if (connecting_peer >= 0 || (initiating && !initiating_auto)) {
+		// A connection is being made, carry on once connected() has run
+		return;
+	}
+	if (initiating) {
+		// The accept list is built again for the targets missing now
+		err = bt_conn_create_auto_stop();
+		if (err) {
+			// It just connected, connected() is on its way
+			LOG_WRN("Stopping the accept list connection failed (err %d)", err);
+			return;
+		}
+		initiating = false;
+		initiating_auto = false;
+	}
+
+	err = bt_scan_stop();
+	if (err && err != -EALREADY) {
+		LOG_ERR("Stop LE scan failed (err %d)", err);
+	}
+
+	if (start_initiating()) {
+		wanted = true;
+	}
+	else {
+		bt_scan_filter_remove_all();
+		for (size_t i = 0; i < NUS_MAX_PEERS; i++) {
+			if (peers[i].name[0] == '\0' || peers[i].conn != NULL) {
+				continue;
+			}
+			err = bt_scan_filter_add(BT_SCAN_FILTER_TYPE_NAME, peers[i].name);
+			if (err) {
+				LOG_ERR("BLE Device Name filters cannot be set (err %d)", err);
+				continue;
+			}
+			wanted = true;
+		}
+
+		if (wanted) {
+			err = bt_scan_start(BT_SCAN_TYPE_SCAN_ACTIVE);
+			if (err) {
+				LOG_ERR("Scanning failed to start (err %d)", err);
+				return;
+			}
+		}
+	}
+
+	if (!wanted) {
+		if (ble_scanning) {
+			LOG_INF("Every target is connected, scanning stopped");
+			ble_scanning = false;
+			submit_ble_ctrl_event(BLE_CTRL_SCAN_STOPPED, 0);
+		}
+		return;
+	}
+	if (!ble_scanning) {
+		ble_scanning = true;
+		submit_ble_ctrl_event(BLE_CTRL_SCAN_STARTED, 0);
+	}
+}
+
+// Writes the addresses that changed to settings
+static void save_work_handler(struct k_work *work)
+{
+	if (!IS_ENABLED(CONFIG_SETTINGS)) {
+		return;
+	}
+
+	for (size_t i = 0; i < NUS_MAX_PEERS; i++) {
+		struct nus_peer_record record;
+		char key[16];
+		int err;
+
+		if (!peers[i].addr_dirty) {
+			continue;
+		}
+		peers[i].addr_dirty = false;
+
+		memset(&record, 0, sizeof(record));
+		strncpy(record.name, peers[i].addr_name, NUS_PEER_NAME_SIZE - 1);
+		bt_addr_le_copy(&record.addr, &peers[i].addr);
+		if (peers[i].have_handles) {
+			record.rx = peers[i].handles.rx;
+			record.tx = peers[i].handles.tx;
+			record.tx_ccc = peers[i].handles.tx_ccc;
+			record.write_nr = peers[i].handles_write_nr;
+		}
+		snprintf(key, sizeof(key), "nus/peer/%d", (int) i);
+		err = settings_save_one(key, &record, sizeof(record));
+		if (err) {
+			LOG_ERR("Saving the address of target %d failed (err %d)", (int) i, err);
+		}
+	}
+}
+
+#if IS_ENABLED(CONFIG_SETTINGS)
+static int nus_settings_set(const char *key, size_t len, settings_read_cb read_cb, void *cb_arg)
+{
+	struct nus_peer_record record;
+	const char *next;
+	int rc;
+
+	if (!settings_name_steq(key, "peer", &next) || next == NULL) {
+		return -ENOENT;
+	}
+	long target = strtol(next, NULL, 10);
+	if (target < 0 || target >= NUS_MAX_PEERS || len != sizeof(record)) {
+		return -EINVAL;
+	}
+
+	rc = read_cb(cb_arg, &record, sizeof(record));
+	if (rc < 0) {
+		return rc;
+	}
+	record.name[NUS_PEER_NAME_SIZE - 1] = '\0';
+
+	// Only used once the nRF9160 gives the target the same name again
+	struct nus_peer *peer = &peers[target];
+	memcpy(peer->addr_name, record.name, NUS_PEER_NAME_SIZE);
+	bt_addr_le_copy(&peer->addr, &record.addr);
+	peer->have_addr = true;
+	peer->have_handles = (record.rx != 0 && record.tx != 0 && record.tx_ccc != 0);
+	peer->handles.rx = record.rx;
+	peer->handles.tx = record.tx;
+	peer->handles.tx_ccc = record.tx_ccc;
+	peer->handles_write_nr = record.write_nr;
+	return 0;
+}
+
+SETTINGS_STATIC_HANDLER_DEFINE(nus_handler, "nus", NULL, nus_settings_set, NULL, NULL);
+#endif
+
+// Call with nus_tx_lock held
+static void peer_request_params(struct nus_peer *peer, bool active)
+{
+	const struct bt_le_conn_param *param = active ?
+		BT_LE_CONN_PARAM(NUS_ACTIVE_INTERVAL_MIN, NUS_ACTIVE_INTERVAL_MAX, NUS_ACTIVE_LATENCY, NUS_CONN_TIMEOUT) :
+		BT_LE_CONN_PARAM(NUS_IDLE_INTERVAL_MIN, NUS_IDLE_INTERVAL_MAX, NUS_IDLE_LATENCY, NUS_CONN_TIMEOUT);
+	int64_t now = k_uptime_get();
+
+	int err = bt_conn_le_param_update(peer->conn, param);
+	if (err && err != -EALREADY) {
+		LOG_WRN("Target %d: connection parameter update failed (err %d)", peer_target(peer), err);
+		return;
+	}
+	if (!err) {
+		peer->param_requested = now;
+	}
+
+	if (active && !peer->active) {
+		peer->active_since = now;
+	}
+	else if (!active && peer->active) {
+		peer->link.active_ms += (uint32_t) (now - peer->active_since);
+	}
+	peer->active = active;
+}
+
+// Switches to the short interval, and back to the idle one NUS_ACTIVE_HOLD_MS after the last command
+static void peer_command_sent(struct nus_peer *peer)
+{
+	k_mutex_lock(&nus_tx_lock, K_FOREVER);
+	if (!peer->active) {
+		peer_request_params(peer, true);
+	}
+	k_work_reschedule(&peer->idle_work, K_MSEC(NUS_ACTIVE_HOLD_MS));
+	k_mutex_unlock(&nus_tx_lock);
+}
+
+static void idle_work_handler(struct k_work *work)
+{
+	struct nus_peer *peer = CONTAINER_OF(k_work_delayable_from_work(work), struct nus_peer, idle_work);
+
+	k_mutex_lock(&nus_tx_lock, K_FOREVER);
+	if (peer->conn != NULL && peer->active) {
+		peer_request_params(peer, false);
+	}
+	k_mutex_unlock(&nus_tx_lock);
+}
+
+static const char *phy_to_string(uint8_t phy)
+{
+	switch (phy) {
+	case BT_GAP_LE_PHY_1M:
+		return "1M";
+	case BT_GAP_LE_PHY_2M:
+		return "2M";
+	case BT_GAP_LE_PHY_CODED:
+		return "coded";
+	default:
+		return "unknown";
+	}
+}
+
+static void link_check_work_handler(struct k_work *work)
+{
+	struct nus_peer *peer = CONTAINER_OF(k_work_delayable_from_work(work), struct nus_peer, link_check_work);
+	struct bt_conn_info info;
+
+	if (peer->conn == NULL || bt_conn_get_info(peer->conn, &info) != 0) {
+		return;
+	}
+
+	peer->link.tx_phy = info.le.phy->tx_phy;
+	peer->link.rx_phy = info.le.phy->rx_phy;
+	peer->link.tx_max_len = info.le.data_len->tx_max_len;
+	peer->link.rx_max_len = info.le.data_len->rx_max_len;
+	if (info.le.phy->tx_phy != BT_GAP_LE_PHY_2M || info.le.phy->rx_phy != BT_GAP_LE_PHY_2M) {
+		LOG_WRN("Target %d did not take the 2M PHY, TX %s RX %s", peer_target(peer),
+			phy_to_string(info.le.phy->tx_phy), phy_to_string(info.le.phy->rx_phy));
+	}
+	if (info.le.data_len->tx_max_len < NUS_DATA_LEN_MAX) {
+		LOG_WRN("Target %d did not take the extended data length, TX %d bytes RX %d bytes",
+			peer_target(peer), info.le.data_len->tx_max_len, info.le.data_len->rx_max_len);
+	}
+}
+
+static int read_rssi(struct nus_peer *peer, int8_t *rssi)
+{
+	struct net_buf *buf;
+	struct net_buf *rsp = NULL;
+	struct bt_hci_cp_read_rssi *cp;
+	struct bt_hci_rp_read_rssi *rp;
+	int err;
+
+	if (!peer->have_conn_handle) {
+		return -ENOTCONN;
+	}
+	buf = bt_hci_cmd_create(BT_HCI_OP_READ_RSSI, sizeof(*cp));
+	if (buf == NULL) {
+		return -ENOBUFS;
+	}
+	cp = net_buf_add(buf, sizeof(*cp));
+	cp->handle = sys_cpu_to_le16(peer->conn_handle);
+
+	err = bt_hci_cmd_send_sync(BT_HCI_OP_READ_RSSI, buf, &rsp);
+	if (err) {
+		return err;
+	}
+	rp = (void *) rsp->data;
+	err = rp->status ? -EIO : 0;
+	*rssi = rp->rssi;
+	net_buf_unref(rsp);
+	return err;
+}
+
+// Call with nus_tx_lock held
+static void quality_add_rssi(struct nus_peer *peer, int8_t rssi)
+{
+	struct chip_link_quality *q = &peer->quality;
+	size_t bucket = 0;
+
+	while (bucket < CHIP_LINK_RSSI_BUCKET_COUNT - 1 && rssi > rssi_bucket_bounds[bucket]) {
+		bucket++;
+	}
+	if (q->rssi_buckets[bucket] < UINT16_MAX) {
+		q->rssi_buckets[bucket]++;
+	}
+	q->rssi_min = (peer->rssi_samples == 0) ? rssi : MIN(q->rssi_min, rssi);
+	q->rssi_max = (peer->rssi_samples == 0) ? rssi : MAX(q->rssi_max, rssi);
+	peer->rssi_sum += rssi;
+	peer->rssi_samples++;
+}
+
+// Hands what was collected for a target to the nRF9160 and starts over
+static void quality_report(struct nus_peer *peer)
+{
+	struct ble_ctrl_event *event = new_ble_ctrl_event();
+	struct chip_link_quality *q = &peer->quality;
+
+	event->cmd = BLE_CTRL_LINK_QUALITY;
+	event->target = peer_target(peer);
+	event->cmd_id = 0;
+	event->ble_ms = 0;
+	event->light_states[0] = '\0';
+
+	k_mutex_lock(&nus_tx_lock, K_FOREVER);
+	q->rssi_mean = (peer->rssi_samples == 0) ? 0 : (int8_t) (peer->rssi_sum / peer->rssi_samples);
+	q->conn_events = (uint32_t) atomic_clear(&peer->conn_events);
+	q->conn_events_skipped = (uint32_t) atomic_clear(&peer->conn_events_skipped);
+	event->link_quality = *q;
+	memset(q, 0, sizeof(*q));
+	peer->rssi_sum = 0;
+	peer->rssi_samples = 0;
+	k_mutex_unlock(&nus_tx_lock);
+
+	LOG_DBG("Target %d: RSSI %d/%d/%d dBm, %d connection events, %d skipped, %d disconnects",
+		event->target, event->link_quality.rssi_min, event->link_quality.rssi_mean,
+		event->link_quality.rssi_max, event->link_quality.conn_events,
+		event->link_quality.conn_events_skipped, event->link_quality.disconnects);
+	APP_EVENT_SUBMIT(event);
+}
+
+// Samples the RSSI of every connected peer, and sends the link quality every CHIP_LINK_QUALITY_INTERVAL_MS
+static void quality_work_handler(struct k_work *work)
+{
+	for (size_t i = 0; i < NUS_MAX_PEERS; i++) {
+		int8_t rssi;
+
+		if (!peers[i].ready || read_rssi(&peers[i], &rssi) != 0) {
+			continue;
+		}
+		k_mutex_lock(&nus_tx_lock, K_FOREVER);
+		quality_add_rssi(&peers[i], rssi);
+		k_mutex_unlock(&nus_tx_lock);
+	}
+
+	if (++quality_ticks >= CHIP_LINK_QUALITY_INTERVAL_MS / NUS_RSSI_SAMPLE_MS) {
+		quality_ticks = 0;
+		for (size_t i = 0; i < NUS_MAX_PEERS; i++) {
+			if (peers[i].name[0] != '\0') {
+				quality_report(&peers[i]);
+			}
+		}
+	}
+	k_work_reschedule(&quality_work, K_MSEC(NUS_RSSI_SAMPLE_MS));
+}
+
+#if defined(CONFIG_BT_HCI_VS_EVT_USER)
+// The SoftDevice Controller reports every connection event it ran. A jump in the event counter means
+// it skipped events, ie. because scanning or another peer had the radio.
+static bool qos_event_received(struct net_buf_simple *buf)
+{
+	const sdc_hci_subevent_vs_qos_conn_event_report_t *evt;
+
+	if (buf->len < 1 + sizeof(*evt) || buf->data[0] != SDC_HCI_SUBEVENT_VS_QOS_CONN_EVENT_REPORT) {
+		return false;
+	}
+	evt = (const void *) &buf->data[1];
+
+	uint16_t handle = sys_le16_to_cpu(evt->conn_handle);
+	uint16_t counter = sys_le16_to_cpu(evt->event_counter);
+	for (size_t i = 0; i < NUS_MAX_PEERS; i++) {
+		struct nus_peer *peer = &peers[i];
+
+		if (!peer->have_conn_handle || peer->conn_handle != handle) {
+			continue;
+		}
+		if (peer->qos_have_counter && (uint16_t) (counter - peer->qos_last_counter) > 1) {
+			atomic_add(&peer->conn_events_skipped, (uint16_t) (counter - peer->qos_last_counter) - 1);
+		}
+		peer->qos_last_counter = counter;
+		peer->qos_have_counter = true;
+		atomic_inc(&peer->conn_events);
+		break;
+	}
+	return true;
+}
+
+static void qos_reports_enable(void)
+{
+	sdc_hci_cmd_vs_qos_conn_event_report_enable_t *cmd;
+	struct net_buf *buf;
+	int err;
+
+	err = bt_hci_register_vnd_evt_cb(qos_event_received);
+	if (err) {
+		LOG_WRN("Failed to register for QoS reports (err %d)", err);
+		return;
+	}
+	buf = bt_hci_cmd_create(SDC_HCI_OPCODE_CMD_VS_QOS_CONN_EVENT_REPORT_ENABLE, sizeof(*cmd));
+	if (buf == NULL) {
+		LOG_WRN("No buffer for enabling QoS reports");
+		return;
+	}
+	cmd = net_buf_add(buf, sizeof(*cmd));
+	cmd->enable = 1;
+	err = bt_hci_cmd_send_sync(SDC_HCI_OPCODE_CMD_VS_QOS_CONN_EVENT_REPORT_ENABLE, buf, NULL);
+	if (err) {
+		LOG_WRN("Failed to enable QoS reports, connection events are not counted (err %d)", err);
+	}
+}
+#endif
+
+static char light_state_to_char(enum light_states state)
+{
+	switch (state) {
+	case LIGHT_OFF:
+		return 'o';
+	case LIGHT_RED:
+		return 'r';
+	case LIGHT_YELLOW:
+		return 'y';
+	case LIGHT_GREEN:
+		return 'g';
+	default:
+		return 0;
+	}
+}
+
+// Call with nus_tx_lock held, the write of the frame in flight is over
+static void tx_write_done(struct nus_peer *peer, bool failed)
+{
+	if (!peer->tx_in_flight) {
+		return;
+	}
+	peer->tx_in_flight = false;
+
+	uint32_t latency_ms = (uint32_t) (k_uptime_get() - peer->tx_in_flight_queued);
+	peer->tx.writes++;
+	if (failed) {
+		peer->tx.errors++;
+	}
+	// Running average over the last 16 or so writes
+	peer->tx.latency_avg_ms = (peer->tx.writes == 1) ? latency_ms
+		: peer->tx.latency_avg_ms - peer->tx.latency_avg_ms / 16 + latency_ms / 16;
+	peer->tx.latency_max_ms = MAX(peer->tx.latency_max_ms, latency_ms);
+
+	// Either the next frame goes out, or the write timeout is no longer needed
+	k_work_reschedule(&peer->tx_work, K_NO_WAIT);
+}
 
 static void ble_data_sent(struct bt_nus_client *nus, uint8_t err,
 					const uint8_t *const data, uint16_t len)
 {
-	ARG_UNUSED(nus);
+	struct nus_peer *peer = CONTAINER_OF(nus, struct nus_peer, client);
 	ARG_UNUSED(data);
 	ARG_UNUSED(len);
 
-	k_sem_give(&nus_write_sem);
-
 	if (err) {
 		LOG_WRN("ATT error code: 0x%02X", err);
 	}
+
+	k_mutex_lock(&nus_tx_lock, K_FOREVER);
+	tx_write_done(peer, err != 0);
+	k_mutex_unlock(&nus_tx_lock);
+}
+
+static void ble_data_sent_nr(struct bt_conn *conn, void *user_data)
+{
+	struct nus_peer *peer = user_data;
+
+	k_mutex_lock(&nus_tx_lock, K_FOREVER);
+	tx_write_done(peer, false);
+	k_mutex_unlock(&nus_tx_lock);
+}
+
+// Call with nus_tx_lock held, writes the waiting frame as "S<first>:<states>#<seq>;"
+static void tx_write_frame(struct nus_peer *peer)
+{
+	size_t first = 0;
+	size_t last = AE_CMD_MAX_FRAME_LIGHTS;
+	uint16_t frame_id = (peer->tx_seq == UINT16_MAX) ? 1 : peer->tx_seq + 1;
+	int err;
+
+	while (first < AE_CMD_MAX_FRAME_LIGHTS && peer->tx_heads[first] == '-') {
+		first++;
+	}
+	while (last > first && peer->tx_heads[last - 1] == '-') {
+		last--;
+	}
+	snprintf(peer->cmd_buf, sizeof(peer->cmd_buf), "S%d:%.*s#%d;", (int) first + 1, (int) (last - first),
+		 &peer->tx_heads[first], frame_id);
+	LOG_INF("Sending to %d: %s (%d commands)", peer_target(peer), peer->cmd_buf, peer->tx_depth);
+
+	peer->tx_in_flight = true;
+	peer->tx_in_flight_queued = peer->tx_queued;
+	peer->tx_write_time = k_uptime_get();
+	if (peer->write_nr) {
+		err = bt_gatt_write_without_response_cb(peer->conn, peer->client.handles.rx, peer->cmd_buf,
+							strlen(peer->cmd_buf), false, ble_data_sent_nr, peer);
+	}
+	else {
+		err = bt_nus_client_send(&peer->client, peer->cmd_buf, strlen(peer->cmd_buf));
+	}
+	if (err) {
+		// Everything stays waiting, and is merged with whatever comes in meanwhile
+		LOG_WRN("Failed to send data over BLE connection (err %d)", err);
+		peer->tx_in_flight = false;
+		peer->tx.errors++;
+		k_work_reschedule(&peer->tx_work, K_MSEC(NUS_WRITE_RETRY_MS));
+		return;
+	}
+
+	for (size_t i = 0; i < peer->tx_id_count; i++) {
+		peer->pending_acks[peer->next_pending_ack].cmd_id = peer->tx_ids[i].cmd_id;
+		peer->pending_acks[peer->next_pending_ack].frame_id = frame_id;
+		peer->pending_acks[peer->next_pending_ack].sent_time = peer->tx_ids[i].queued;
+		peer->next_pending_ack = (peer->next_pending_ack + 1) % PENDING_ACK_COUNT;
+	}
+	for (size_t i = 0; i < AE_CMD_MAX_FRAME_LIGHTS; i++) {
+		if (peer->tx_heads[i] != '-') {
+			peer->written_heads[i] = peer->tx_heads[i];
+		}
+	}
+	peer->tx_seq = frame_id;
+	peer->ack_wait_since = peer->tx_write_time;
+	k_work_reschedule(&peer->ack_work, K_MSEC(NUS_ACK_TIMEOUT_MS));
+
+	memset(peer->tx_heads, '-', sizeof(peer->tx_heads));
+	peer->tx_depth = 0;
+	peer->tx_id_count = 0;
+	k_work_reschedule(&peer->tx_work, K_MSEC(NUS_WRITE_TIMEOUT_MS));
+}
+
+// The newest frame was not acknowledged in time, writes whatever the ESP32 has not confirmed again
+static void ack_work_handler(struct k_work *work)
+{
+	struct nus_peer *peer = CONTAINER_OF(k_work_delayable_from_work(work), struct nus_peer, ack_work);
+	bool resend = false;
+
+	k_mutex_lock(&nus_tx_lock, K_FOREVER);
+	if (!peer->ready || peer->ack_wait_since == 0) {
+		k_mutex_unlock(&nus_tx_lock);
+		return;
+	}
+	peer->tx.ack_timeouts++;
+
+	if (peer->ack_retries >= NUS_ACK_RETRIES) {
+		LOG_ERR("Target %d did not acknowledge frame %d after %d retries", peer_target(peer), peer->tx_seq,
+			peer->ack_retries);
+		peer->tx.unconfirmed++;
+		peer->ack_wait_since = 0;
+		peer->ack_retries = 0;
+		k_mutex_unlock(&nus_tx_lock);
+		return;
+	}
+
+	// A head with a newer state waiting goes out with that anyway
+	for (size_t i = 0; i < AE_CMD_MAX_FRAME_LIGHTS; i++) {
+		if (peer->written_heads[i] != '-' && peer->written_heads[i] != peer->confirmed_heads[i]
+			&& peer->tx_heads[i] == '-') {
+			peer->tx_heads[i] = peer->written_heads[i];
+			resend = true;
+		}
+	}
+	if (resend) {
+		LOG_WRN("Frame %d to target %d not acknowledged, writing it again", peer->tx_seq, peer_target(peer));
+		peer->ack_retries++;
+		peer->tx.retransmits++;
+		if (peer->quality.retransmits < UINT16_MAX) {
+			peer->quality.retransmits++;
+		}
+		if (peer->tx_depth == 0) {
+			peer->tx_queued = k_uptime_get();
+			peer->tx_depth = 1;
+		}
+		if (!peer->tx_in_flight) {
+			k_work_reschedule(&peer->tx_work, K_NO_WAIT);
+		}
+	}
+	else {
+		// Only the acknowledgement got lost, an older one already confirmed every head
+		peer->ack_wait_since = 0;
+	}
+	k_mutex_unlock(&nus_tx_lock);
+}
+
+static void tx_work_handler(struct k_work *work)
+{
+	struct nus_peer *peer = CONTAINER_OF(k_work_delayable_from_work(work), struct nus_peer, tx_work);
+
+	k_mutex_lock(&nus_tx_lock, K_FOREVER);
+	if (peer->tx_in_flight) {
+		if (k_uptime_get() - peer->tx_write_time < NUS_WRITE_TIMEOUT_MS) {
+			// The completion brings us back
+			k_mutex_unlock(&nus_tx_lock);
+			return;
+		}
+		LOG_ERR("NUS write to target %d timed out", peer_target(peer));
+		peer->tx.timeouts++;
+		tx_write_done(peer, true);
+	}
+	if (peer->ready && peer->tx_depth > 0) {
+		tx_write_frame(peer);
+	}
+	k_mutex_unlock(&nus_tx_lock);
+}
+
+// Queues light states for a peer, states holds one char per light starting at first_light
+// (1..AE_CMD_MAX_FRAME_LIGHTS), '-' leaves a light as it is. Never blocks.
+static int nus_tx_queue(struct nus_peer *peer, uint8_t first_light, const char *states, uint16_t cmd_id)
+{
+	size_t count = strlen(states);
+	int64_t now = k_uptime_get();
+
+	if (first_light == 0 || first_light - 1 + count > AE_CMD_MAX_FRAME_LIGHTS) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&nus_tx_lock, K_FOREVER);
+	if (peer->tx_depth == 0) {
+		peer->tx_queued = now;
+	}
+	else {
+		peer->tx.coalesced++;
+	}
+	peer->tx_depth++;
+	peer->tx.depth_max = MAX(peer->tx.depth_max, peer->tx_depth);
+
+	for (size_t i = 0; i < count; i++) {
+		if (states[i] != '-') {
+			peer->tx_heads[first_light - 1 + i] = states[i];
+		}
+	}
+	if (cmd_id != 0) {
+		if (peer->tx_id_count == NUS_TX_IDS) {
+			LOG_WRN("Command %d merged away untracked", peer->tx_ids[0].cmd_id);
+			memmove(&peer->tx_ids[0], &peer->tx_ids[1], sizeof(peer->tx_ids[0]) * (NUS_TX_IDS - 1));
+			peer->tx_id_count--;
+		}
+		peer->tx_ids[peer->tx_id_count].cmd_id = cmd_id;
+		peer->tx_ids[peer->tx_id_count].queued = now;
+		peer->tx_id_count++;
+	}
+
+	if (!peer->tx_in_flight) {
+		k_work_reschedule(&peer->tx_work, K_NO_WAIT);
+	}
+	peer_command_sent(peer);
+	k_mutex_unlock(&nus_tx_lock);
+
+	return 0;
+}
+
+// Call with nus_tx_lock held, drops everything waiting or in flight when a peer disconnects
+static void tx_reset(struct nus_peer *peer)
+{
+	memset(peer->tx_heads, '-', sizeof(peer->tx_heads));
+	peer->tx_depth = 0;
+	peer->tx_id_count = 0;
+	peer->tx_in_flight = false;
+	memset(peer->pending_acks, 0, sizeof(peer->pending_acks));
+	memset(peer->written_heads, '-', sizeof(peer->written_heads));
+	memset(peer->confirmed_heads, '-', sizeof(peer->confirmed_heads));
+	peer->acked_seq = 0;
+	peer->ack_wait_since = 0;
+	peer->ack_retries = 0;
+}
+
+// states holds what the ESP32 says its heads show (light 1 first), NULL if the acknowledgement has none
+static void ble_ack_received(struct nus_peer *peer, uint16_t frame_id, const char *states)
+{
+	bool found = false;
+	bool changed = false;
+	int64_t now = k_uptime_get();
+	struct ble_ctrl_event *state_event = NULL;
+
+	k_mutex_lock(&nus_tx_lock, K_FOREVER);
+	for (size_t i = 0; i < PENDING_ACK_COUNT; i++) {
+		if (peer->pending_acks[i].cmd_id == 0 || peer->pending_acks[i].frame_id != frame_id) {
+			continue;
+		}
+
+		// Hand it to the nRF9160, which keeps the latency histograms
+		struct ble_ctrl_event *event = new_ble_ctrl_event();
+		event->cmd = BLE_CTRL_CMD_ACK;
+		event->target = peer_target(peer);
+		event->cmd_id = peer->pending_acks[i].cmd_id;
+		event->ble_ms = (uint32_t) (now - peer->pending_acks[i].sent_time);
+		event->light_states[0] = '\0';
+		memset(&event->link_quality, 0, sizeof(event->link_quality));
+		APP_EVENT_SUBMIT(event);
+		peer->pending_acks[i].cmd_id = 0;
+		found = true;
+	}
+
+	// Frames are applied in order, so only an acknowledgement newer than the last one says anything new,
+	// and one from before a reconnect or from the future says nothing at all. The exception is the ESP32
+	// reporting its lamps again under the last number, when its clearance changed them.
+	bool newer = (peer->acked_seq == 0 || (int16_t) (frame_id - peer->acked_seq) > 0)
+		&& (int16_t) (peer->tx_seq - frame_id) >= 0;
+	bool repeated = (states != NULL && peer->acked_seq != 0 && frame_id == peer->acked_seq);
+	if (newer || repeated) {
+		char confirmed[AE_CMD_MAX_FRAME_LIGHTS];
+		memcpy(confirmed, peer->confirmed_heads, sizeof(confirmed));
+		if (states != NULL) {
+			for (size_t i = 0; i < AE_CMD_MAX_FRAME_LIGHTS && states[i] != '\0'; i++) {
+				confirmed[i] = states[i];
+			}
+		}
+		else if (frame_id == peer->tx_seq) {
+			// An ESP32 that only acknowledges applied what it was sent
+			memcpy(confirmed, peer->written_heads, sizeof(confirmed));
+		}
+
+		peer->acked_seq = frame_id;
+		if (frame_id == peer->tx_seq) {
+			peer->ack_wait_since = 0;
+			peer->ack_retries = 0;
+		}
+		changed = (memcmp(confirmed, peer->confirmed_heads, sizeof(confirmed)) != 0);
+		memcpy(peer->confirmed_heads, confirmed, sizeof(confirmed));
+		found = true;
+	}
+
+	if (changed) {
+		state_event = new_ble_ctrl_event();
+		state_event->cmd = BLE_CTRL_LIGHT_STATE;
+		state_event->target = peer_target(peer);
+		state_event->cmd_id = 0;
+		state_event->ble_ms = 0;
+		memset(&state_event->link_quality, 0, sizeof(state_event->link_quality));
+		size_t count = AE_CMD_MAX_FRAME_LIGHTS;
+		while (count > 0 && peer->confirmed_heads[count - 1] == '-') {
+			count--;
+		}
+		memcpy(state_event->light_states, peer->confirmed_heads, count);
+		state_event->light_states[count] = '\0';
+	}
+	k_mutex_unlock(&nus_tx_lock);
+
+	if (state_event != NULL) {
+		LOG_INF("Target %d confirmed %s", peer_target(peer), state_event->light_states);
+		APP_EVENT_SUBMIT(state_event);
+	}
+	if (!found) {
+		LOG_DBG("Ack for unknown frame %d", frame_id);
+	}
+}
+
+// "a<seq>;" or "a<seq>:<one state char per head>;"
+static void ble_ack_parse(struct nus_peer *peer, char *ack)
+{
+	char *end;
+	long frame_id = strtol(ack, &end, 10);
+	const char *states = NULL;
+
+	if (frame_id <= 0 || frame_id > UINT16_MAX) {
+		return;
+	}
+	if (*end == ':') {
+		states = end + 1;
+		if (strspn(states, "rygo") != strlen(states)) {
+			LOG_WRN("Bad light states from target %d: %s", peer_target(peer), states);
+			states = NULL;
+		}
+	}
+	ble_ack_received(peer, (uint16_t) frame_id, states);
 }
 
 static uint8_t ble_data_received(struct bt_nus_client *nus,
 						const uint8_t *data, uint16_t len)
 {
-	ARG_UNUSED(nus);
-	ARG_UNUSED(data);
-    ARG_UNUSED(len);
+	struct nus_peer *peer = CONTAINER_OF(nus, struct nus_peer, client);
+
+	for (uint16_t i = 0; i < len; i++) {
+		char c = data[i];
+		if (c == 'a') {
+			peer->rx_started = true;
+			peer->rx_idx = 0;
+		}
+		else if (peer->rx_started && c == ';') {
+			peer->rx_buf[peer->rx_idx] = '\0';
+			peer->rx_started = false;
+			ble_ack_parse(peer, peer->rx_buf);
+		}
+		else if (peer->rx_started) {
+			if (peer->rx_idx >= BLE_RX_BUF_SIZE - 1) {
+				peer->rx_started = false;
+				continue;
+			}
+			peer->rx_buf[peer->rx_idx++] = c;
+		}
+	}
 
 	return BT_GATT_ITER_CONTINUE;
 }
 
+static void start_next_discovery(void);
+
+// The connection to the peer can take commands, remembers where it was found and how long it was gone
+static void peer_connection_ready(struct nus_peer *peer)
+{
+	const bt_addr_le_t *dst = bt_conn_get_dst(peer->conn);
+
+	if (!peer->have_addr || bt_addr_le_cmp(&peer->addr, dst) != 0 || strcmp(peer->addr_name, peer->name) != 0) {
+		bt_addr_le_copy(&peer->addr, dst);
+		memcpy(peer->addr_name, peer->name, NUS_PEER_NAME_SIZE);
+		peer->have_addr = true;
+		peer->addr_dirty = true;
+	}
+	if (peer->addr_dirty) {
+		k_work_submit(&save_work);
+	}
+	peer->addr_failed = false;
+
+	if (peer->lost_at == 0) {
+		return;
+	}
+	uint32_t took_ms = (uint32_t) (k_uptime_get() - peer->lost_at);
+	peer->lost_at = 0;
+
+	struct nus_reconnect_stats *stats = &peer->reconnect;
+	stats->reconnects++;
+	if (peer->by_address) {
+		stats->by_address++;
+	}
+	stats->ms_last = took_ms;
+	// Running average over the last 8 or so reconnects
+	stats->ms_avg = (stats->reconnects == 1) ? took_ms : stats->ms_avg - stats->ms_avg / 8 + took_ms / 8;
+	stats->ms_max = MAX(stats->ms_max, took_ms);
+
+	k_mutex_lock(&nus_tx_lock, K_FOREVER);
+	if (peer->quality.reconnects < UINT8_MAX) {
+		peer->quality.reconnects++;
+	}
+	peer->quality.reconnect_ms_max = MAX(peer->quality.reconnect_ms_max, (uint16_t) MIN(took_ms, UINT16_MAX));
+	k_mutex_unlock(&nus_tx_lock);
+
+	LOG_INF("Target %d back after %d ms by %s, %d reconnects (%d by address, %d misses), avg %d ms max %d ms",
+		peer_target(peer), took_ms, peer->by_address ? "address" : "name", stats->reconnects, stats->by_address,
+		stats->address_misses, stats->ms_avg, stats->ms_max);
+	LOG_INF("Target %d: cached handles used %d times, %d of them stale", peer_target(peer),
+		stats->cached, stats->cache_stale);
+}
+
 static void discovery_complete(struct bt_gatt_dm *dm,
 			       void *context)
 {
-	struct bt_nus_client *nus = context;
-	LOG_INF("Service discovery completed");
+	struct nus_peer *peer = context;
+	LOG_INF("Service discovery completed for target %d", peer_target(peer));
 
 	bt_gatt_dm_data_print(dm);
 
-	bt_nus_handles_assign(dm, nus);
-	bt_nus_subscribe_receive(nus);
+	bt_nus_handles_assign(dm, &peer->client);
+	bt_nus_subscribe_receive(&peer->client);
+
+	const struct bt_gatt_dm_attr *rx_chrc = bt_gatt_dm_char_by_uuid(dm, BT_UUID_NUS_RX);
+	const struct bt_gatt_chrc *rx_val = (rx_chrc != NULL) ? bt_gatt_dm_attr_chrc_val(rx_chrc) : NULL;
+	peer->write_nr = (rx_val != NULL) && (rx_val->properties & BT_GATT_CHRC_WRITE_WITHOUT_RESP);
+	LOG_INF("Target %d writes %s response", peer_target(peer), peer->write_nr ? "without" : "with");
 
 	bt_gatt_dm_data_release(dm);
+	discovery_running = false;
+
+	// For the next connection, peer_connection_ready() saves them along with the address
+	if (!peer->have_handles || peer->handles_write_nr != peer->write_nr
+		|| memcmp(&peer->handles, &peer->client.handles, sizeof(peer->handles)) != 0) {
+		peer->handles = peer->client.handles;
+		peer->handles_write_nr = peer->write_nr;
+		peer->have_handles = true;
+		peer->addr_dirty = true;
+	}
+
+	// Commands can only be written from here on
+	peer->ready = true;
+	peer_connection_ready(peer);
+	submit_ble_ctrl_event(BLE_CTRL_CONNECTED, peer_target(peer));
+
+	start_next_discovery();
 }
 
 static void discovery_service_not_found(struct bt_conn *conn,
 					void *context)
 {
 	LOG_INF("Service not found");
+	discovery_running = false;
+	// Without NUS the peer is of no use, free its slot so scanning finds the right device
+	bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	start_next_discovery();
 }
 
 static void discovery_error(struct bt_conn *conn,
@@ -97,6 +1284,9 @@ static void discovery_error(struct bt_conn *conn,
 			    void *context)
 {
 	LOG_WRN("Error while discovering GATT database: (%d)", err);
+	discovery_running = false;
+	bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	start_next_discovery();
 }
 
 struct bt_gatt_dm_cb discovery_cb = {
@@ -105,23 +1295,105 @@ struct bt_gatt_dm_cb discovery_cb = {
 	.error_found       = discovery_error,
 };
 
-static void gatt_discover(struct bt_conn *conn)
+static uint8_t verify_read(struct bt_conn *conn, uint8_t err,
+			   struct bt_gatt_read_params *params, const void *data, uint16_t length)
+{
+	struct nus_peer *peer = peer_by_conn(conn);
+
+	if (peer == NULL) {
+		return BT_GATT_ITER_STOP;
+	}
+
+	bool rx = (params == &peer->verify_params[0]);
+	uint16_t value_handle = rx ? peer->handles.rx : peer->handles.tx;
+	const uint8_t *decl = data;
+	struct bt_uuid_128 uuid;
+
+	// A characteristic declaration: properties (1), value handle (2), 128 bit UUID (16)
+	bool match = !err && decl != NULL && length == 19 && sys_get_le16(decl + 1) == value_handle
+		&& bt_uuid_create(&uuid.uuid, decl + 3, 16) && bt_uuid_cmp(&uuid.uuid, rx ? BT_UUID_NUS_RX : BT_UUID_NUS_TX) == 0;
+
+	if (!match && peer->have_handles) {
+		LOG_WRN("GATT database of target %d changed (err %d), discovering again", peer_target(peer), err);
+		peer->have_handles = false;
+		peer->addr_dirty = true;
+		peer->reconnect.cache_stale++;
+		k_work_submit(&save_work);
+		// Commands may have gone to the wrong attribute, start over on a clean connection
+		bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+	}
+	return BT_GATT_ITER_STOP;
+}
+
+// Sets up the NUS client with the handles of the previous connection, no service discovery needed
+static void use_cached_handles(struct nus_peer *peer)
 {
 	int err;
-	LOG_INF("Beginning GATT service discovery...");
-	if (conn != default_conn) {
-		LOG_ERR("gett_discover, conn != default_conn !!");
-		k_sleep(K_SECONDS(2));
+
+	LOG_INF("Target %d uses its cached NUS handles", peer_target(peer));
+	peer->client.conn = peer->conn;
+	peer->client.handles = peer->handles;
+	peer->write_nr = peer->handles_write_nr;
+	err = bt_nus_subscribe_receive(&peer->client);
+	if (err) {
+		LOG_WRN("Subscribing to target %d failed (err %d)", peer_target(peer), err);
+	}
+	peer->reconnect.cached++;
+
+	// The declaration is the attribute right before the value, both reads are queued behind the subscription
+	for (size_t i = 0; i < ARRAY_SIZE(peer->verify_params); i++) {
+		struct bt_gatt_read_params *params = &peer->verify_params[i];
+		params->func = verify_read;
+		params->handle_count = 1;
+		params->single.handle = ((i == 0) ? peer->handles.rx : peer->handles.tx) - 1;
+		params->single.offset = 0;
+		err = bt_gatt_read(peer->conn, params);
+		if (err) {
+			LOG_WRN("Cached handles of target %d cannot be checked (err %d)", peer_target(peer), err);
+		}
+	}
+
+	peer->ready = true;
+	peer_connection_ready(peer);
+	submit_ble_ctrl_event(BLE_CTRL_CONNECTED, peer_target(peer));
+}
+
+static void gatt_discover(struct nus_peer *peer)
+{
+	int err;
+
+	if (peer->ready) {
 		return;
 	}
-	
-	err = bt_gatt_dm_start(conn,
+	if (peer->have_handles && peer->have_addr && bt_addr_le_cmp(&peer->addr, bt_conn_get_dst(peer->conn)) == 0) {
+		use_cached_handles(peer);
+		return;
+	}
+	if (discovery_running) {
+		peer->discovery_pending = true;
+		return;
+	}
+
+	LOG_INF("Beginning GATT service discovery for target %d...", peer_target(peer));
+	peer->discovery_pending = false;
+	err = bt_gatt_dm_start(peer->conn,
 			       BT_UUID_NUS_SERVICE,
 			       &discovery_cb,
-			       &nus_client);
+			       peer);
 	if (err) {
 		LOG_ERR("could not start the discovery procedure, error "
 			"code: %d", err);
+		return;
+	}
+	discovery_running = true;
+}
+
+static void start_next_discovery(void)
+{
+	for (size_t i = 0; i < NUS_MAX_PEERS && !discovery_running; i++) {
+		if (peers[i].conn != NULL && peers[i].discovery_pending) {
+			gatt_discover(&peers[i]);
+		}
 	}
 }
 
@@ -137,81 +1409,237 @@ static void exchange_func(struct bt_conn *conn, uint8_t err, struct bt_gatt_exch
 static void connected(struct bt_conn *conn, uint8_t conn_err)
 {
 	char addr[BT_ADDR_LE_STR_LEN];
+	struct nus_peer *peer = peer_by_conn(conn);
+	bool attempt_by_address = initiating;
+	bool attempt_auto = initiating_auto;
 	int err;
 
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
+	connecting_peer = -1;
+	initiating = false;
+	initiating_auto = false;
+
+	if (peer == NULL && !conn_err) {
+		// Through the accept list, the address tells which target it is
+		peer = peer_by_address(bt_conn_get_dst(conn));
+		if (peer != NULL) {
+			peer->conn = bt_conn_ref(conn);
+			peer->by_address = true;
+		}
+	}
+
 	if (conn_err) {
 		LOG_INF("Failed to connect to %s (%d)", addr, conn_err);
 
-		if (default_conn == conn) {
-			bt_conn_unref(default_conn);
-			default_conn = NULL;
-
-			err = bt_scan_start(BT_SCAN_TYPE_SCAN_ACTIVE);
-			if (err) {
-				LOG_ERR("Scanning failed to start (err %d)",
-					err);
+		if (attempt_by_address) {
+			// Not at its last address, the controller may have been replaced: scan for its name instead
+			for (size_t i = 0; i < NUS_MAX_PEERS; i++) {
+				if (&peers[i] == peer || (attempt_auto && peer_by_address_wanted(&peers[i]))) {
+					LOG_WRN("Target %d not found at its address, scanning for its name", (int) i);
+					peers[i].addr_failed = true;
+					peers[i].reconnect.address_misses++;
+				}
 			}
 		}
-
+		if (peer != NULL) {
+			bt_conn_unref(peer->conn);
+			peer->conn = NULL;
+		}
+		update_connecting();
 		return;
 	}
 
-	LOG_INF("Connected: %s", addr);
+	if (peer == NULL) {
+		// scan_connecting() already dropped it, or the accept list was changing while it connected
+		LOG_WRN("Connection to %s that is not one of our targets", addr);
+		bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+		update_connecting();
+		return;
+	}
 
-	static struct bt_gatt_exchange_params exchange_params;
+	LOG_INF("Connected: %s, target %d", addr, peer_target(peer));
 
-	exchange_params.func = exchange_func;
-	err = bt_gatt_exchange_mtu(conn, &exchange_params);
+	peer->exchange_params.func = exchange_func;
+	err = bt_gatt_exchange_mtu(conn, &peer->exchange_params);
 	if (err) {
 		LOG_WRN("MTU exchange failed (err %d)", err);
 	}
 
-	gatt_discover(conn);
+	// Both make every packet shorter on air, and a 20 byte command fits one packet either way
+	err = bt_conn_le_phy_update(conn, BT_CONN_LE_PHY_PARAM_2M);
+	if (err) {
+		LOG_WRN("PHY update failed (err %d)", err);
+	}
+	err = bt_conn_le_data_len_update(conn, BT_LE_DATA_LEN_PARAM_MAX);
+	if (err) {
+		LOG_WRN("Data length update failed (err %d)", err);
+	}
 
-	err = bt_scan_stop();
-	if ((!err) && (err != -EALREADY)) {
-		LOG_ERR("Stop LE scan failed (err %d)", err);
+	struct bt_conn_info info;
+	memset(&peer->link, 0, sizeof(peer->link));
+	memset(&peer->tx, 0, sizeof(peer->tx));
+	peer->write_nr = false;
+	if (bt_conn_get_info(conn, &info) == 0) {
+		peer->link.interval = info.le.interval;
+		peer->link.latency = info.le.latency;
+		peer->link.timeout = info.le.timeout;
 	}
-	ble_scanning = false;
+	k_mutex_lock(&nus_tx_lock, K_FOREVER);
+	peer->active = false;
+	peer->param_requested = 0;
+	k_mutex_unlock(&nus_tx_lock);
+	k_work_reschedule(&peer->link_check_work, K_MSEC(NUS_LINK_CHECK_DELAY_MS));
+
+	peer->qos_have_counter = false;
+	peer->have_conn_handle = (bt_hci_get_conn_handle(conn, &peer->conn_handle) == 0);
+
+	gatt_discover(peer);
 
-    // Fire off a CONNECTED event
-	struct ble_ctrl_event *event;
-    event = new_ble_ctrl_event();
-    event->cmd = BLE_CTRL_CONNECTED;
-    APP_EVENT_SUBMIT(event);
-	ble_connected = true;
+	// Carry on with the targets that are still missing
+	update_connecting();
 }
 
 static void disconnected(struct bt_conn *conn, uint8_t reason)
 {
 	char addr[BT_ADDR_LE_STR_LEN];
+	struct nus_peer *peer = peer_by_conn(conn);
 
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
 	LOG_INF("Disconnected: %s (reason %u)", addr, reason);
 
-	if (default_conn != conn) {
-		LOG_ERR("disconnected() default_conn != conn");
+	if (peer == NULL) {
+		LOG_ERR("disconnected() unknown conn");
 		return;
 	}
 
-	bt_conn_unref(default_conn);
-	default_conn = NULL;
+	k_work_cancel_delayable(&peer->idle_work);
+	k_work_cancel_delayable(&peer->link_check_work);
+	k_mutex_lock(&nus_tx_lock, K_FOREVER);
+	if (peer->active) {
+		peer->link.active_ms += (uint32_t) (k_uptime_get() - peer->active_since);
+		peer->active = false;
+	}
+	k_mutex_unlock(&nus_tx_lock);
+	LOG_INF("Target %d: %d parameter updates, slowest %d ms, %d ms on the short interval", peer_target(peer),
+		peer->link.param_updates, peer->link.param_update_ms_max, peer->link.active_ms);
+
+	LOG_INF("Target %d: %d writes, %d commands merged, deepest %d, latency avg %d ms max %d ms, %d errors, %d timeouts",
+		peer_target(peer), peer->tx.writes, peer->tx.coalesced, peer->tx.depth_max, peer->tx.latency_avg_ms,
+		peer->tx.latency_max_ms, peer->tx.errors, peer->tx.timeouts);
+	LOG_INF("Target %d: %d acknowledgements late, %d frames written again, %d given up on", peer_target(peer),
+		peer->tx.ack_timeouts, peer->tx.retransmits, peer->tx.unconfirmed);
+
+	bool was_ready = peer->ready;
+	peer->have_conn_handle = false;
+	k_mutex_lock(&nus_tx_lock, K_FOREVER);
+	// A write in flight never completes now
+	tx_reset(peer);
+	if (peer->quality.disconnects < UINT8_MAX) {
+		peer->quality.disconnects++;
+	}
+	peer->quality.last_reason = reason;
+	k_mutex_unlock(&nus_tx_lock);
+	k_work_cancel_delayable(&peer->tx_work);
+	k_work_cancel_delayable(&peer->ack_work);
+	bt_conn_unref(peer->conn);
+	peer->conn = NULL;
+	peer->ready = false;
+	peer->discovery_pending = false;
+	peer->rx_started = false;
+
+	if (was_ready) {
+		peer->lost_at = k_uptime_get();
+		submit_ble_ctrl_event(BLE_CTRL_DISCONNECTED, peer_target(peer));
+	}
+	update_connecting();
+}
+
+static bool le_param_req(struct bt_conn *conn, struct bt_le_conn_param *param)
+{
+	struct nus_peer *peer = peer_by_conn(conn);
+	bool active = false;
 
-    // Fire off a DISCONNECTED event
-	struct ble_ctrl_event *event;
-    event = new_ble_ctrl_event();
-    event->cmd = BLE_CTRL_DISCONNECTED;
-    APP_EVENT_SUBMIT(event);
-	ble_connected = false;
+	if (peer != NULL) {
+		k_mutex_lock(&nus_tx_lock, K_FOREVER);
+		active = peer->active;
+		k_mutex_unlock(&nus_tx_lock);
+	}
+
+	// While commands are flowing we keep the short interval, otherwise the ESP32 may pick
+	if (active) {
+		LOG_INF("Target %d asked for interval %d-%d, latency %d while active, rejected", peer_target(peer),
+			param->interval_min, param->interval_max, param->latency);
+		return false;
+	}
+	return true;
+}
+
+static void le_param_updated(struct bt_conn *conn, uint16_t interval,
+			     uint16_t latency, uint16_t timeout)
+{
+	struct nus_peer *peer = peer_by_conn(conn);
+	uint32_t took_ms = 0;
+	bool active;
+
+	if (peer == NULL) {
+		return;
+	}
+
+	k_mutex_lock(&nus_tx_lock, K_FOREVER);
+	peer->link.interval = interval;
+	peer->link.latency = latency;
+	peer->link.timeout = timeout;
+	peer->link.param_updates++;
+	if (peer->param_requested != 0) {
+		took_ms = (uint32_t) (k_uptime_get() - peer->param_requested);
+		peer->param_requested = 0;
+		peer->link.param_update_ms_last = took_ms;
+		peer->link.param_update_ms_max = MAX(peer->link.param_update_ms_max, took_ms);
+	}
+	active = peer->active;
+	k_mutex_unlock(&nus_tx_lock);
+
+	LOG_INF("Target %d: interval %d us, latency %d, timeout %d ms (%s, took %d ms)", peer_target(peer),
+		interval * 1250, latency, timeout * 10, active ? "active" : "idle", took_ms);
+}
+
+static void le_phy_updated(struct bt_conn *conn,
+			   struct bt_conn_le_phy_info *param)
+{
+	struct nus_peer *peer = peer_by_conn(conn);
+
+	if (peer == NULL) {
+		return;
+	}
+
+	peer->link.tx_phy = param->tx_phy;
+	peer->link.rx_phy = param->rx_phy;
+	LOG_INF("Target %d: PHY TX %s RX %s", peer_target(peer),
+		phy_to_string(param->tx_phy), phy_to_string(param->rx_phy));
+}
+
+static void le_data_len_updated(struct bt_conn *conn,
+				struct bt_conn_le_data_len_info *info)
+{
+	struct nus_peer *peer = peer_by_conn(conn);
+
+	if (peer == NULL) {
+		return;
+	}
+
+	peer->link.tx_max_len = info->tx_max_len;
+	peer->link.rx_max_len = info->rx_max_len;
+	LOG_INF("Target %d: data length TX %d bytes RX %d bytes", peer_target(peer),
+		info->tx_max_len, info->rx_max_len);
 }
 
 static void security_changed(struct bt_conn *conn, bt_security_t level,
 			     enum bt_security_err err)
 {
 	char addr[BT_ADDR_LE_STR_LEN];
+	struct nus_peer *peer = peer_by_conn(conn);
 
 	bt_addr_le_to_str(bt_conn_get_dst(conn), addr, sizeof(addr));
 
@@ -222,7 +1650,9 @@ static void security_changed(struct bt_conn *conn, bt_security_t level,
 			level, err);
 	}
 
-	gatt_discover(conn);
+	if (peer != NULL) {
+		gatt_discover(peer);
+	}
 }
 
 static void scan_filter_match(struct bt_scan_device_info *device_info,
@@ -235,17 +1665,34 @@ static void scan_filter_match(struct bt_scan_device_info *device_info,
 
 	LOG_INF("Filters matched. Address: %s connectable: %d",
 		addr, connectable);
+
+	// The scan module connects right after this, remember which target the device is
+	connecting_peer = -1;
+	for (size_t i = 0; i < NUS_MAX_PEERS && filter_match->name.match; i++) {
+		if (peers[i].conn == NULL && strcmp(peers[i].name, filter_match->name.name) == 0) {
+			connecting_peer = i;
+			break;
+		}
+	}
 }
 
 static void scan_connecting_error(struct bt_scan_device_info *device_info)
 {
 	LOG_ERR("scan connecting error!");
+	connecting_peer = -1;
+	update_connecting();
 }
 
 static void scan_connecting(struct bt_scan_device_info *device_info,
 			    struct bt_conn *conn)
 {
-	default_conn = bt_conn_ref(conn);
+	if (connecting_peer < 0) {
+		LOG_ERR("Connecting to a device that is not one of our targets");
+		bt_conn_disconnect(conn, BT_HCI_ERR_REMOTE_USER_TERM_CONN);
+		return;
+	}
+	peers[connecting_peer].conn = bt_conn_ref(conn);
+	peers[connecting_peer].by_address = false;
 }
 
 static void auth_cancel(struct bt_conn *conn)
@@ -293,7 +1740,11 @@ static struct bt_conn_auth_info_cb conn_auth_info_callbacks = {
 BT_CONN_CB_DEFINE(conn_callbacks) = {
 	.connected = connected,
 	.disconnected = disconnected,
-	.security_changed = security_changed
+	.security_changed = security_changed,
+	.le_param_req = le_param_req,
+	.le_param_updated = le_param_updated,
+	.le_phy_updated = le_phy_updated,
+	.le_data_len_updated = le_data_len_updated
 };
 
 static int nus_client_init(void)
@@ -306,10 +1757,21 @@ static int nus_client_init(void)
 		}
 	};
 
-	err = bt_nus_client_init(&nus_client, &init);
-	if (err) {
-		LOG_ERR("NUS Client initialization failed (err %d)", err);
-		return err;
+	k_work_init(&save_work, save_work_handler);
+	k_work_init_delayable(&quality_work, quality_work_handler);
+	for (size_t i = 0; i < NUS_MAX_PEERS; i++) {
+		k_work_init_delayable(&peers[i].tx_work, tx_work_handler);
+		k_work_init_delayable(&peers[i].ack_work, ack_work_handler);
+		memset(peers[i].tx_heads, '-', sizeof(peers[i].tx_heads));
+		memset(peers[i].written_heads, '-', sizeof(peers[i].written_heads));
+		memset(peers[i].confirmed_heads, '-', sizeof(peers[i].confirmed_heads));
+		k_work_init_delayable(&peers[i].idle_work, idle_work_handler);
+		k_work_init_delayable(&peers[i].link_check_work, link_check_work_handler);
+		err = bt_nus_client_init(&peers[i].client, &init);
+		if (err) {
+			LOG_ERR("NUS Client initialization failed (err %d)", err);
+			return err;
+		}
 	}
 
 	LOG_INF("NUS Client module initialized");
@@ -326,13 +1788,8 @@ static int scan_init(void)
 	bt_scan_init(&scan_init);
 	bt_scan_cb_register(&scan_cb);
 
-	err = bt_scan_filter_add(BT_SCAN_FILTER_TYPE_NAME, target_device_name);
-	if (err) {
-		LOG_ERR("BLE Device Name filters cannot be set (err %d)", err);
-		return err;
-	}
-
-	err = bt_scan_filter_enable(BT_SCAN_NAME_FILTER, true);
+	// The name filters themselves are set by update_connecting(), any one of them is a match
+	err = bt_scan_filter_enable(BT_SCAN_NAME_FILTER, false);
 	if (err) {
 		LOG_ERR("Filters cannot be turned on (err %d)", err);
 		return err;
@@ -385,109 +1842,90 @@ static void nus_module_startup() {
     if(err) {
         LOG_ERR("nus_client_init() err: %d", err);
     }
+
+#if defined(CONFIG_BT_HCI_VS_EVT_USER)
+	qos_reports_enable();
+#endif
+	k_work_reschedule(&quality_work, K_MSEC(NUS_RSSI_SAMPLE_MS));
 }
 
-void send_ble_command(char* s) {
-	// We must wait for the string to be sent over BLE, otherwise we risk invalidating the memory
-	int err = k_sem_take(&nus_write_sem, NUS_WRITE_TIMEOUT);
-	if (err) {
-		LOG_ERR("NUS send timeout");
+// The peer commands for target go to, NULL if it is not connected
+static struct nus_peer *command_peer(uint8_t target)
+{
+	if (target >= NUS_MAX_PEERS) {
+		LOG_ERR("Command for unknown target %d", target);
+		return NULL;
 	}
-
-	LOG_INF("Sending: %s", s);
-
-	err = bt_nus_client_send(&nus_client, s, strlen(s));
-	if (err) {
-		LOG_ERR("Failed to send data over BLE connection (err %d)", err);
+	if (!peers[target].ready) {
+		LOG_WRN("Target %d is not connected, command dropped", target);
+		return NULL;
 	}
+	return &peers[target];
 }
 
 static bool app_event_handler(const struct app_event_header *aeh)
 {
-	int err;
-
     if (is_ae_command_event(aeh)) {
 		const struct ae_command_event *event =
 			cast_ae_command_event(aeh);
         switch (event->cmd) {
             case AE_CMD_START_SCAN:
-				bt_scan_filter_remove_all();
-				strncpy(target_device_name, event->scan_target, 30);
-				err = bt_scan_filter_add(BT_SCAN_FILTER_TYPE_NAME, target_device_name);
-				if (err) {
-					LOG_ERR("BLE Device Name filters cannot be set (err %d)", err);
-					return err;
-				}
-				else {
-					LOG_INF("Set name filter: %s", target_device_name);
+				if (event->target >= NUS_MAX_PEERS || event->scan_target == NULL) {
+					LOG_ERR("Invalid scan target %d", event->target);
+					break;
 				}
-				
-				if (!ble_scanning) {
-					err = bt_scan_start(BT_SCAN_TYPE_SCAN_ACTIVE);
-					if (err) {
-						LOG_ERR("Scanning failed to start (err %d)", err);
-					}
-					ble_scanning = true;
+			{
+				struct nus_peer *peer = &peers[event->target];
+				strncpy(peer->name, event->scan_target, NUS_PEER_NAME_SIZE - 1);
+				peer->name[NUS_PEER_NAME_SIZE - 1] = '\0';
+				if (strcmp(peer->name, peer->addr_name) != 0) {
+					// A different controller, its address is found by name first
+					peer->have_addr = false;
 				}
-				// Fire off a SCANNING_STARTED event so that the AE knows we are scanning
-				struct ble_ctrl_event *event2;
-				event2 = new_ble_ctrl_event();
-				event2->cmd = BLE_CTRL_SCAN_STARTED;
-				APP_EVENT_SUBMIT(event2);
+				peer->addr_failed = false;
+				LOG_INF("Set target %d: %s%s", event->target, peer->name, peer->have_addr ? ", address known" : "");
+			}
+				update_connecting();
             break;
             case AE_CMD_STOP_SCAN:
-                if (ble_scanning) {
-					err = bt_scan_stop();
-					if ((!err) && (err != -EALREADY)) {
-						LOG_ERR("Stop LE scan failed (err %d)", err);
+				// Targets that are connected stay in use, so they are scanned for again if they disconnect
+				for (size_t i = 0; i < NUS_MAX_PEERS; i++) {
+					if (peers[i].conn == NULL) {
+						peers[i].name[0] = '\0';
 					}
 				}
-				ble_scanning = false;
-				// Fire off a SCANNING_STOPPED event so that the AE knows we are not scanning
-				struct ble_ctrl_event *event3;
-				event3 = new_ble_ctrl_event();
-				event3->cmd = BLE_CTRL_SCAN_STOPPED;
-				APP_EVENT_SUBMIT(event3);
+				update_connecting();
             break;
-            case AE_CMD_SET_STATE1:
-            	LOG_INF("AE CMD SET STATE 1");
-                switch(event->light_state) {
-					case LIGHT_OFF:
-					send_ble_command("off1;");
-					break;
-					case LIGHT_RED:
-					send_ble_command("red1;");
-					break;
-					case LIGHT_YELLOW:
-					send_ble_command("yellow1;");
-					break;
-					case LIGHT_GREEN:
-					send_ble_command("green1;");
-					break;
-					default:
-					LOG_ERR("Unabled light state %d", event->light_state);
-					break;
-				}
+            case AE_CMD_SET_STATE:
+            {
+                // Goes out as a one head frame, so it merges with the frames around it
+                char state[2] = { light_state_to_char(event->light_state), '\0' };
+                if (state[0] == 0) {
+                    LOG_ERR("Unabled light state %d", event->light_state);
+                    break;
+                }
+                struct nus_peer *peer = command_peer(event->target);
+                if (peer == NULL) {
+                    break;
+                }
+                LOG_INF("AE CMD SET STATE %d", event->light);
+                if (nus_tx_queue(peer, event->light, state, 0) != 0) {
+                    LOG_ERR("Unknown light %d", event->light);
+                }
+            }
             break;
-            case AE_CMD_SET_STATE2:
-                LOG_INF("AE CMD SET STATE2");
-                switch(event->light_state) {
-					case LIGHT_OFF:
-					send_ble_command("off2;");
-					break;
-					case LIGHT_RED:
-					send_ble_command("red2;");
-					break;
-					case LIGHT_YELLOW:
-					send_ble_command("yellow2;");
-					break;
-					case LIGHT_GREEN:
-					send_ble_command("green2;");
-					break;
-					default:
-					LOG_ERR("Unabled light state %d", event->light_state);
-					break;
-				}
+            case AE_CMD_SET_FRAME:
+            {
+                // The frame goes out as one BLE write so the traffic light applies every head at once
+                struct nus_peer *peer = command_peer(event->target);
+                if (peer == NULL) {
+                    break;
+                }
+                LOG_INF("AE CMD SET FRAME %d:%s", event->light, event->frame);
+                if (nus_tx_queue(peer, event->light, event->frame, event->cmd_id) != 0) {
+                    LOG_ERR("Frame %d:%s does not fit", event->light, event->frame);
+                }
+            }
             break;
             default:
                 LOG_WRN("AE CMD type not handled! %d", event->cmd);
@@ -502,9 +1940,6 @@ static bool app_event_handler(const struct app_event_header *aeh)
 			cast_module_state_event(aeh);
 
 		if (check_state(event, MODULE_ID(main), MODULE_STATE_READY)) {
-			target_device_name = k_malloc(30);
-			char * default_target_name = "Intersection-Default";
-			strncpy(target_device_name, default_target_name, 30);
             nus_module_startup();
 		}
 
@@ -12,9 +12,9 @@
 #define MODULE uart_handler
 #include "events/module_state_event.h"
 #include "events/peer_conn_event.h"
-#include "events/ble_ctrl_event.h"
 #include "events/cdc_data_event.h"
 #include "events/uart_data_event.h"
+#include "uart_tx.h"
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(MODULE);
@@ -32,6 +32,9 @@ static const struct device *devices[] = {
 #define UART_SLAB_BLOCK_COUNT (UART_DEVICE_COUNT * CONFIG_BRIDGE_UART_BUF_COUNT)
 #define UART_SLAB_ALIGNMENT 4
 #define UART_RX_TIMEOUT_USEC 1000
+/* Longest a baud rate change waits for the TX ring to go out, and for RX to stop */
+#define UART_BAUDRATE_DRAIN_TIMEOUT_MS 500
+#define UART_RX_DISABLE_TIMEOUT_MS 100
 
 #if defined(CONFIG_PM_DEVICE)
 #define UART_SET_PM_STATE true
@@ -63,6 +66,14 @@ static uint32_t uart_default_baudrate[UART_DEVICE_COUNT];
 static int subscriber_count[UART_DEVICE_COUNT];
 static bool enable_rx_retry[UART_DEVICE_COUNT];
 static atomic_t uart_tx_started[UART_DEVICE_COUNT];
+static struct k_mutex uart_tx_lock[UART_DEVICE_COUNT];
+/* Given on every TX_DONE and TX_ABORTED */
+static struct k_sem uart_tx_space[UART_DEVICE_COUNT];
+/* Set while uart_baudrate_set() has RX stopped, UART_RX_DISABLED then gives uart_rx_stopped */
+static bool rx_paused[UART_DEVICE_COUNT];
+static struct k_sem uart_rx_stopped[UART_DEVICE_COUNT];
+/* Framing, parity, overrun and break errors, read by the chip link */
+static uint32_t line_errors[UART_DEVICE_COUNT];
 
 static void enable_uart_rx(uint8_t dev_idx);
 static void disable_uart_rx(uint8_t dev_idx);
@@ -160,7 +171,10 @@ static void uart_callback(const struct device *dev, struct uart_event *evt,
 		}
 		break;
 	case UART_RX_DISABLED:
-		if (enable_rx_retry[dev_idx]) {
+		if (rx_paused[dev_idx]) {
+			/* uart_baudrate_set() enables it again */
+			k_sem_give(&uart_rx_stopped[dev_idx]);
+		} else if (enable_rx_retry[dev_idx]) {
 			enable_uart_rx(dev_idx);
 			enable_rx_retry[dev_idx] = false;
 		} else if (UART_SET_PM_STATE) {
@@ -175,13 +189,16 @@ static void uart_callback(const struct device *dev, struct uart_event *evt,
 		} else {
 			uart_tx_start(dev_idx);
 		}
+		k_sem_give(&uart_tx_space[dev_idx]);
 		break;
 	case UART_TX_ABORTED:
 		uart_tx_finish(dev_idx, evt->data.tx.len);
 		atomic_set(&uart_tx_started[dev_idx], false);
+		k_sem_give(&uart_tx_space[dev_idx]);
 		break;
 	case UART_RX_STOPPED:
 		LOG_WRN("UART_%d stop reason %d", dev_idx, evt->data.rx_stop.reason);
+		line_errors[dev_idx]++;
 
 		/* Retry automatically in case of unexpected stop.
 		 * Typically happens when the peer does not drive its TX GPIO,
@@ -225,6 +242,90 @@ static void set_uart_baudrate(uint8_t dev_idx, uint32_t baudrate)
 	}
 }
 
+#if defined(CONFIG_BRIDGE_UART1_HW_FLOW_CONTROL)
+/* The nRF9160 holds CTS while its RX buffers are full instead of losing bytes */
+static void enable_hw_flow_control(uint8_t dev_idx)
+{
+	struct uart_config cfg;
+	int err;
+
+	err = uart_config_get(devices[dev_idx], &cfg);
+	if (err) {
+		LOG_ERR("uart_config_get: %d", err);
+		return;
+	}
+
+	cfg.flow_ctrl = UART_CFG_FLOW_CTRL_RTS_CTS;
+	err = uart_configure(devices[dev_idx], &cfg);
+	if (err) {
+		LOG_ERR("UART_%d RTS/CTS not available: %d", dev_idx, err);
+	}
+}
+#endif
+
+int uart_baudrate_set(uint8_t dev_idx, uint32_t baudrate)
+{
+	struct uart_config cfg;
+	bool rx_was_enabled;
+	int64_t end;
+	int err;
+
+	if (dev_idx >= UART_DEVICE_COUNT) {
+		return -EINVAL;
+	}
+
+	/* No new frames while switching, and the ones in the ring still go out at the old rate */
+	k_mutex_lock(&uart_tx_lock[dev_idx], K_FOREVER);
+	end = k_uptime_get() + UART_BAUDRATE_DRAIN_TIMEOUT_MS;
+	while (atomic_get(&uart_tx_started[dev_idx])) {
+		int64_t remaining = end - k_uptime_get();
+
+		if (remaining <= 0 || k_sem_take(&uart_tx_space[dev_idx], K_MSEC(remaining)) != 0) {
+			k_mutex_unlock(&uart_tx_lock[dev_idx]);
+			LOG_ERR("UART_%d TX did not drain, staying at the old baud rate", dev_idx);
+			return -EBUSY;
+		}
+	}
+
+	/* Stop RX, so the DMA never runs across the switch. Bytes on the line right then are lost either way. */
+	k_sem_reset(&uart_rx_stopped[dev_idx]);
+	rx_paused[dev_idx] = true;
+	rx_was_enabled = (uart_rx_disable(devices[dev_idx]) == 0);
+	if (rx_was_enabled &&
+	    k_sem_take(&uart_rx_stopped[dev_idx], K_MSEC(UART_RX_DISABLE_TIMEOUT_MS)) != 0) {
+		LOG_WRN("UART_%d RX did not stop", dev_idx);
+	}
+
+	err = uart_config_get(devices[dev_idx], &cfg);
+	if (err) {
+		LOG_ERR("uart_config_get: %d", err);
+	} else {
+		cfg.baudrate = (baudrate != 0) ? baudrate : uart_default_baudrate[dev_idx];
+		err = uart_configure(devices[dev_idx], &cfg);
+		if (err) {
+			LOG_ERR("uart_configure: %d", err);
+		}
+	}
+
+	/* Also picks up a restart that was asked for while RX was stopped */
+	rx_paused[dev_idx] = false;
+	if (rx_was_enabled || enable_rx_retry[dev_idx]) {
+		enable_rx_retry[dev_idx] = false;
+		enable_uart_rx(dev_idx);
+	}
+	k_mutex_unlock(&uart_tx_lock[dev_idx]);
+
+	if (!err) {
+		LOG_INF("UART_%d at %d baud", dev_idx, cfg.baudrate);
+	}
+	return err;
+}
+
+uint32_t uart_line_errors_get(uint8_t dev_idx)
+{
+	return (dev_idx < UART_DEVICE_COUNT) ? line_errors[dev_idx] : 0;
+}
+
 static void set_uart_power_state(uint8_t dev_idx, bool active)
 {
 #if UART_SET_PM_STATE
@@ -310,19 +411,48 @@ static void uart_tx_finish(uint8_t dev_idx, size_t len)
 	}
 }
 
-static int uart_tx_enqueue(uint8_t *data, size_t data_len, uint8_t dev_idx)
+int uart_tx_enqueue(const uint8_t *data, size_t data_len, uint8_t dev_idx, k_timeout_t timeout)
 {
-	atomic_t started;
-	uint32_t written;
+	struct ring_buf *rb;
+	uint64_t end;
 	int err;
 
-	written = ring_buf_put(&uart_tx_ringbufs[dev_idx].rb, data, data_len);
-	if (written == 0) {
+	if (dev_idx >= UART_DEVICE_COUNT || data_len > UART_BUF_SIZE) {
+		return -EINVAL;
+	}
+	if (data_len == 0) {
+		return 0;
+	}
+
+	rb = &uart_tx_ringbufs[dev_idx].rb;
+	end = sys_clock_timeout_end_calc(timeout);
+
+	/* The nRF9160 link writes from more than one thread (acks, retransmits) */
+	err = k_mutex_lock(&uart_tx_lock[dev_idx], timeout);
+	if (err) {
 		return -ENOMEM;
 	}
 
-	started = atomic_set(&uart_tx_started[dev_idx], true);
-	if (!started) {
+	while (ring_buf_space_get(rb) < data_len) {
+		k_timeout_t wait = timeout;
+
+		if (!K_TIMEOUT_EQ(timeout, K_NO_WAIT) && !K_TIMEOUT_EQ(timeout, K_FOREVER)) {
+			/* What is left of the timeout after the previous waits */
+			int64_t remaining = (int64_t) (end - k_uptime_ticks());
+
+			wait = remaining > 0 ? K_TICKS(remaining) : K_NO_WAIT;
+		}
+		if (K_TIMEOUT_EQ(wait, K_NO_WAIT) || k_sem_take(&uart_tx_space[dev_idx], wait)) {
+			k_mutex_unlock(&uart_tx_lock[dev_idx]);
+			LOG_DBG("UART_%d TX ring full, dropped %d bytes", dev_idx, (int) data_len);
+			return -ENOMEM;
+		}
+	}
+
+	ring_buf_put(rb, data, data_len);
+	k_mutex_unlock(&uart_tx_lock[dev_idx]);
+
+	if (atomic_cas(&uart_tx_started[dev_idx], false, true)) {
 		err = uart_tx_start(dev_idx);
 		if (err) {
 			LOG_ERR("uart_tx_start: %d", err);
@@ -330,12 +460,6 @@ static int uart_tx_enqueue(uint8_t *data, size_t data_len, uint8_t dev_idx)
 		}
 	}
 
-	if (written == data_len) {
-		return 0;
-	} else {
-		return -ENOMEM;
-	}
-
 	return 0;
 }
 
@@ -367,7 +491,7 @@ static bool app_event_handler(const struct app_event_header *aeh)
 			return false;
 		}
 
-		err = uart_tx_enqueue(event->buf, event->len, event->dev_idx);
+		err = uart_tx_enqueue(event->buf, event->len, event->dev_idx, K_NO_WAIT);
 		if (err == -ENOMEM) {
 			LOG_WRN("CDC_%d->UART_%d overflow",
 				event->dev_idx,
@@ -379,43 +503,6 @@ static bool app_event_handler(const struct app_event_header *aeh)
 		return false;
 	}
 
-	if (is_ble_ctrl_event(aeh)) {
-		const struct ble_ctrl_event *event =
-			cast_ble_ctrl_event(aeh);
-		if (event->cmd == BLE_CTRL_CONNECTED) {
-			// "!C;" - connected message to nRF9160
-			// 3 - length of the string "!C;"
-			// 1 - device index (corresponds to UART1)
-			err = uart_tx_enqueue("!C;", 3, 1);
-		}
-		else if (event->cmd == BLE_CTRL_DISCONNECTED) {
-			// "!D;" - disconnected message to nRF9160
-			// 3 - length of the string "!D;"
-			// 1 - device index (corresponds to UART1)
-			err = uart_tx_enqueue("!D;", 3, 1);
-		}
-		else if (event->cmd == BLE_CTRL_SCAN_STARTED) {
-			// 1 - device index (corresponds to UART1)
-			err = uart_tx_enqueue("!SCAN_START;", 12, 1);
-		}
-		else if (event->cmd == BLE_CTRL_SCAN_STOPPED) {
-			// 1 - device index (corresponds to UART1)
-			err = uart_tx_enqueue("!SCAN_STOP;", 11, 1);
-		}
-		else {
-			LOG_ERR("Unhandled BLE CTRL event! cmd: %d", event->cmd);
-			return false;
-		}
-		
-		if (err == -ENOMEM) {
-			LOG_WRN("BLE->UART_1 overflow");
-		} else if (err) {
-			LOG_ERR("uart_tx_enqueue: %d", err);
-		}
-
-		return false;
-	}
-
 	if (is_peer_conn_event(aeh)) {
 		const struct peer_conn_event *event =
 			cast_peer_conn_event(aeh);
@@ -484,6 +571,10 @@ static bool app_event_handler(const struct app_event_header *aeh)
 				enable_rx_retry[i] = false;
 
 				atomic_set(&uart_tx_started[i], false);
+				k_mutex_init(&uart_tx_lock[i]);
+				k_sem_init(&uart_tx_space[i], 0, 1);
+				k_sem_init(&uart_rx_stopped[i], 0, 1);
+				rx_paused[i] = false;
 
 				ring_buf_init(
 					&uart_tx_ringbufs[i].rb,
@@ -494,7 +585,10 @@ static bool app_event_handler(const struct app_event_header *aeh)
 					set_uart_power_state(i, false);
 				}
 			}
-			
+
+#if defined(CONFIG_BRIDGE_UART1_HW_FLOW_CONTROL)
+			enable_hw_flow_control(1);
+#endif
 			// At startup, enable the UART1 connection with the Thingy:91
 			struct peer_conn_event *event = new_peer_conn_event();
 			event->dev_idx = 1;
@@ -514,6 +608,5 @@ static bool app_event_handler(const struct app_event_header *aeh)
 APP_EVENT_LISTENER(MODULE, app_event_handler);
 APP_EVENT_SUBSCRIBE(MODULE, module_state_event);
 APP_EVENT_SUBSCRIBE(MODULE, peer_conn_event);
-APP_EVENT_SUBSCRIBE(MODULE, ble_ctrl_event);
 APP_EVENT_SUBSCRIBE(MODULE, cdc_data_event);
 APP_EVENT_SUBSCRIBE_FINAL(MODULE, uart_data_event);
\ No newline at end of file
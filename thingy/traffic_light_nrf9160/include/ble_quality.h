@@ -0,0 +1,32 @@
+#ifndef TRAFFIC_LIGHT_NRF9160_BLE_QUALITY_H_
+#define TRAFFIC_LIGHT_NRF9160_BLE_QUALITY_H_
+
+/*
+    Quality of the BLE link between the nRF52840 and each signal controller. The nRF52840 collects it into
+    fixed size aggregates and sends one CHIP_LINK_MSG_LINK_QUALITY per controller every
+    CHIP_LINK_QUALITY_INTERVAL_MS. They are merged here until the telemetry summary picks them up, so the
+    cloud gets one "blq" attribute per intersection on the telemetry cadence instead of an update per event.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include "chip_link.h"
+
+// Size of the string written by ble_quality_format() for one controller
+#define BLE_QUALITY_TELEMETRY_LENGTH 128
+
+// Call this at startup
+void ble_quality_init();
+
+// Merges a report from the nRF52840 into the summary of a signal controller
+// @param target - Index of the controller in BLE_CONTROLLERS
+void ble_quality_add(uint8_t target, const struct chip_link_quality* quality);
+
+// Writes the summary of a signal controller collected since the last call, then clears it:
+// "<target>:<reports>,<rssi min>,<rssi mean>,<rssi max>,<bucket 0>/<bucket 1>/...,<connection events>,
+// <skipped>,<disconnects>,<last reason>,<reconnects>,<slowest reconnect ms>,<retransmits>"
+// The RSSI is in dBm, the buckets are those of CHIP_LINK_RSSI_BUCKET_BOUNDS.
+// @return the length written, 0 if the controller sent no report since the last call
+size_t ble_quality_format(uint8_t target, char* output, size_t output_len);
+
+#endif // TRAFFIC_LIGHT_NRF9160_BLE_QUALITY_H_
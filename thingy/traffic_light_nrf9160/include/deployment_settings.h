@@ -16,4 +16,18 @@
 #define M2M_ORIGINATOR "Cthingy91" DEVICE_LETTER
 #define BLE_TARGET "Intersection" DEVICE_LETTER
 
+// Number of intersections (one flex container each) that this AE runs,
+// and the number of signal heads at each intersection
+#define INTERSECTION_COUNT 1
+#define LIGHTS_PER_INTERSECTION 2
+
+// Signal controllers (ESP32s) the nRF52840 keeps connected, at most CHIP_LINK_MAX_TARGETS.
+// Each one drives a run of heads of one intersection, numbered from 1 on the controller itself:
+// { BLE name, intersection, first head of the intersection it drives (0..), number of heads }
+// ie. two controllers sharing a four head intersection would be
+// { { "IntersectionB", 0, 0, 2 }, { "IntersectionC", 0, 2, 2 } }
+#define BLE_CONTROLLERS { \
+	{ BLE_TARGET, 0, 0, LIGHTS_PER_INTERSECTION }, \
+}
+
 #endif
\ No newline at end of file
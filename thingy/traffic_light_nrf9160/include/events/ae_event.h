@@ -23,16 +23,15 @@
 extern "C" {
 #endif
 
-enum ae_lights {
-	AE_LIGHT_NONE, AE_LIGHT1, AE_LIGHT2
-};
+// Upper bound on the number of signal heads at one intersection
+#define AE_MAX_LIGHTS 8
 
 enum ae_light_states {
 	AE_LIGHT_STATE_NONE, AE_LIGHT_OFF, AE_LIGHT_RED, AE_LIGHT_YELLOW, AE_LIGHT_GREEN
 };
 
 enum ae_event_types {
-	AE_EVENT_LIGHT_CMD, AE_EVENT_REGISTER, AE_EVENT_CREATE_DATA_MODEL, AE_EVENT_POLL, AE_EVENT_TEST_MODE, AE_EVENT_DEREGISTER, AE_EVENT_TEST_CREATE_DATA, AE_EVENT_TEST_REGISTER
+	AE_EVENT_LIGHT_CMD, AE_EVENT_REGISTER, AE_EVENT_CREATE_DATA_MODEL, AE_EVENT_POLL, AE_EVENT_TEST_MODE, AE_EVENT_DEREGISTER, AE_EVENT_TEST_CREATE_DATA, AE_EVENT_TEST_REGISTER, AE_EVENT_TEST_RETRIEVE
 };
 
 /** Peer connection event. */
@@ -41,9 +40,12 @@ struct ae_event {
 
 	// Command type
 	enum ae_event_types cmd;
-	// State that the lights should be put into
-	enum ae_light_states new_light1_state;
-	enum ae_light_states new_light2_state;
+	// Intersection (flex container index) that the light states belong to
+	uint8_t intersection;
+	// State that each light of the intersection should be put into
+	enum ae_light_states new_light_states[AE_MAX_LIGHTS];
+	// k_uptime_get() when a light command from the cloud arrived, 0 if its latency is not tracked
+	int64_t received_time;
 	// If set to true, then AE_EVENT_REGISTER should then trigger an AE_EVENT_CREATE_DATA_MODEL
 	bool do_init_sequence;
 	bool reset;
@@ -19,6 +19,8 @@
 #include <app_event_manager.h>
 #include <app_event_manager_profiler_tracer.h>
 
+#include "events/ae_event.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -27,7 +29,8 @@ enum ble_cmd {
 	BLE_CONNECTED,
 	BLE_DISCONNECTED,
 	BLE_SCAN_STARTED,
-	BLE_SCAN_STOPPED
+	BLE_SCAN_STOPPED,
+	BLE_LIGHT_STATE
 };
 
 /** Peer connection event. */
@@ -35,6 +38,11 @@ struct ble_event {
 	struct app_event_header header;
 
 	enum ble_cmd cmd;
+	// BLE_CONNECTED, BLE_DISCONNECTED and BLE_LIGHT_STATE only, index of the signal controller in BLE_CONTROLLERS
+	uint8_t target;
+	// BLE_LIGHT_STATE only, what the controller confirmed its heads show (light 1 first), NONE if unknown
+	enum ae_light_states light_states[AE_MAX_LIGHTS];
+	uint8_t light_count;
 };
 
 APP_EVENT_TYPE_DECLARE(ble_event);
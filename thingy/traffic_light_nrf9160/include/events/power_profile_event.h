@@ -4,12 +4,12 @@
  * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
  */
 
-#ifndef _UART_DATA_EVENT_H_
-#define _UART_DATA_EVENT_H_
+#ifndef _POWER_PROFILE_EVENT_H_
+#define _POWER_PROFILE_EVENT_H_
 
 /**
- * @brief UART Data Event
- * @defgroup uart_data_event UART Data Event
+ * @brief Power Profile Event
+ * @defgroup power_profile_event Power Profile Event
  * @{
  */
 
@@ -19,20 +19,20 @@
 #include <app_event_manager.h>
 #include <app_event_manager_profiler_tracer.h>
 
+#include "power_profile.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
-/** Peer connection event. */
-struct uart_data_event {
+/** A different power profile was selected, see power_profile.h. */
+struct power_profile_event {
 	struct app_event_header header;
 
-	uint8_t dev_idx;
-	uint8_t *buf;
-	size_t len;
+	enum power_profile profile;
 };
 
-APP_EVENT_TYPE_DECLARE(uart_data_event);
+APP_EVENT_TYPE_DECLARE(power_profile_event);
 
 #ifdef __cplusplus
 }
@@ -42,4 +42,4 @@ APP_EVENT_TYPE_DECLARE(uart_data_event);
  * @}
  */
 
-#endif /* _UART_DATA_EVENT_H_ */
+#endif /* _POWER_PROFILE_EVENT_H_ */
@@ -0,0 +1,57 @@
+#ifndef TRAFFIC_LIGHT_NRF9160_LATENCY_STATS_H_
+#define TRAFFIC_LIGHT_NRF9160_LATENCY_STATS_H_
+
+/*
+    End to end latency of light commands, from the notification arriving at the AE to the ESP32 acknowledging it.
+    Every command from the cloud gets an ID that travels with the light frame ("!S1:g-#42;") to the nRF52840
+    and over BLE to the ESP32. The ESP32 acknowledges it, the nRF52840 adds how long the BLE hop took
+    and sends "!A42,<ble ms>;" back. Each hop is collected into a histogram per intersection:
+        ae    - notification received until the frame was handed to the UART
+        uart  - UART to the nRF52840 and back, including its processing (ack - frame sent - ble)
+        ble   - NUS write until the ESP32's acknowledgement, measured by the nRF52840
+        total - notification received until acknowledged
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum latency_hop {
+    LATENCY_HOP_AE,
+    LATENCY_HOP_UART,
+    LATENCY_HOP_BLE,
+    LATENCY_HOP_TOTAL,
+    LATENCY_HOP_COUNT
+};
+
+// Upper bounds (ms) of the histogram buckets, the last bucket holds everything slower
+#define LATENCY_BUCKET_BOUNDS_MS { 25, 50, 100, 200, 500, 1000, 2000 }
+#define LATENCY_BUCKET_COUNT 8
+
+// Commands that can be waiting for their acknowledgement at the same time
+#define LATENCY_MAX_PENDING 8
+
+// Size of the string written by latency_stats_format()
+#define LATENCY_TELEMETRY_LENGTH 256
+
+// Call this at startup
+void latency_stats_init();
+
+// Starts timing a light command for an intersection, call it when its frame is about to be sent.
+// Commands that change nothing are not sent and get no ID, so they never push others out of the pending slots.
+// @param received_time - k_uptime_get() when the notification carrying the command arrived
+// @return the command ID to send along with the frame, never 0
+uint16_t latency_cmd_begin(uint8_t intersection, int64_t received_time);
+
+// The frame carrying the command has been handed to the UART
+void latency_cmd_sent(uint16_t cmd_id);
+
+// The ESP32 acknowledged the command
+// @param ble_ms - Time the BLE hop took, as measured by the nRF52840
+void latency_cmd_acked(uint16_t cmd_id, uint32_t ble_ms);
+
+// Writes the histograms of an intersection collected since the last call, then clears them.
+// One entry per hop: "<hop>:<count>,<mean>,<max>,<bucket 0>/<bucket 1>/...", separated by ';'
+// @return the number of acknowledged commands in the summary
+int latency_stats_format(uint8_t intersection, char* output, size_t output_len);
+
+#endif // TRAFFIC_LIGHT_NRF9160_LATENCY_STATS_H_
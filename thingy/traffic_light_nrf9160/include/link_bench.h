@@ -0,0 +1,61 @@
+#ifndef TRAFFIC_LIGHT_NRF9160_LINK_BENCH_H_
+#define TRAFFIC_LIGHT_NRF9160_LINK_BENCH_H_
+
+/*
+    Benchmark and soak test of the link to the nRF52840, started from the upper tester ("!bench32,5,1000;").
+    Sends sequenced BENCH_PING frames (see chip_link.h) of a given size at a given interval, the nRF52840
+    echoes each of them straight from its chip link, so nothing above the link is involved on that side.
+    Payload: bench seq (2, little endian), then a filler pattern up to the frame size.
+
+    A frame whose echo has not come back by the time its slot is needed again, or by the end of the
+    run, is lost. An echo older than the newest one seen so far is reordered. Round trip times go into
+    LINK_BENCH_BUCKET_US wide buckets, so the percentiles are bucket upper bounds, the maximum is exact.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// bench seq + at least two bytes of filler
+#define LINK_BENCH_MIN_SIZE 4
+// Frames that can be waiting for their echo
+#define LINK_BENCH_SLOTS 64
+#define LINK_BENCH_BUCKET_US 50
+// Everything slower than LINK_BENCH_BUCKETS * LINK_BENCH_BUCKET_US lands in the last bucket
+#define LINK_BENCH_BUCKETS 200
+// How long a run waits for the last echoes
+#define LINK_BENCH_GRACE_MS 500
+// A soak test reports this often, each report covering the time since the previous one
+#define LINK_BENCH_REPORT_INTERVAL_MS 10000
+
+struct link_bench_report {
+    uint32_t sent;
+    uint32_t echoed;
+    uint32_t lost;
+    uint32_t reordered;
+    // The link was not up or was changing its baud rate
+    uint32_t skipped;
+    // Encoded frame bytes echoed per second, in each direction
+    uint32_t bytes_per_sec;
+    uint32_t rtt_p50_us;
+    uint32_t rtt_p90_us;
+    uint32_t rtt_p99_us;
+    uint32_t rtt_max_us;
+};
+
+// @param final - True for the last report of a run
+typedef void (*link_bench_report_cb_t)(const struct link_bench_report* report, bool final);
+
+// Starts a run, replacing any run in progress
+// @param size - Payload bytes per frame, LINK_BENCH_MIN_SIZE to CHIP_LINK_MAX_PAYLOAD
+// @param count - Frames to send, 0 keeps going until link_bench_stop()
+// @return 0, -EINVAL for a size or interval out of range
+int link_bench_start(size_t size, uint32_t interval_ms, uint32_t count, link_bench_report_cb_t report);
+
+// Ends the run after the grace period, which gives the final report
+void link_bench_stop();
+
+// A BENCH_ECHO arrived from the nRF52840
+void link_bench_echo(const uint8_t* payload, size_t len);
+
+#endif // TRAFFIC_LIGHT_NRF9160_LINK_BENCH_H_
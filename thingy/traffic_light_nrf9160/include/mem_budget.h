@@ -0,0 +1,27 @@
+#ifndef TRAFFIC_LIGHT_NRF9160_MEM_BUDGET_H_
+#define TRAFFIC_LIGHT_NRF9160_MEM_BUDGET_H_
+
+/*
+    The budget rule and the report line of the memory monitor (see mem_monitor.h), apart from the
+    kernel so the host tests can check them. tester.py parses the lines.
+*/
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mem_monitor.h"
+
+// Longest line mem_budget_format() writes, terminator included
+#define MEM_BUDGET_LINE_SIZE 80
+// Longer names are cut, the line stays complete
+#define MEM_BUDGET_NAME_MAX 32
+
+// @return true if more than MEM_MONITOR_BUDGET_PERCENT of size was used at the peak
+bool mem_budget_over(size_t peak, size_t size);
+
+// Writes "!mem:<kind>,<name>,<peak>,<size>,<ok|over>;\r\n"
+// @param output - At least MEM_BUDGET_LINE_SIZE bytes
+// @return the length of the line
+size_t mem_budget_format(char* output, const char* kind, const char* name, size_t peak, size_t size);
+
+#endif // TRAFFIC_LIGHT_NRF9160_MEM_BUDGET_H_
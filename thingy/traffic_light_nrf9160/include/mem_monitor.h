@@ -0,0 +1,21 @@
+#ifndef TRAFFIC_LIGHT_NRF9160_MEM_MONITOR_H_
+#define TRAFFIC_LIGHT_NRF9160_MEM_MONITOR_H_
+
+/*
+    Peak memory usage of every thread stack, heap, memory slab and UART RX queue in the application.
+    Each item has a budget (a percentage of its size), so a change that eats into the
+    headroom shows up as "over" in the report instead of as a crash in the field.
+*/
+
+// Percentage of a stack, heap or slab that may be used before it is reported as over budget
+#define MEM_MONITOR_BUDGET_PERCENT 80
+
+// How often the budgets are checked in the background (ms)
+#define MEM_MONITOR_CHECK_INTERVAL_MS 60000
+
+// Logs the peak usage of every item and sends it to the upper tester (UART 0) as
+// "!mem:<kind>,<name>,<peak>,<size>,<ok|over>;" lines, followed by "!mem:done,<over count>;"
+// @return the number of items whose peak usage is over budget
+int mem_monitor_report();
+
+#endif // TRAFFIC_LIGHT_NRF9160_MEM_MONITOR_H_
@@ -29,6 +29,10 @@ int put_request(char* host, char* url, char* payload, size_t payload_size, const
 // @param url - String representing the URL path (ie. /index.html)
 int delete_request(char* host, char* url, const char** headers);
 
+// Sets how long a request may take, including the time the response waits in the network for the modem to wake up.
+// Applies from the next request on.
+void http_set_request_timeout(int32_t timeout_ms);
+
 void take_http_sem();
 void give_http_sem();
 
@@ -38,6 +42,9 @@ void free_json_response(cJSON* parsed_json);
 char* get_http_rx_content();
 size_t get_http_rx_content_length();
 
+// Returns the X-M2M-RI header of the last response, or an empty string if it had none
+char* get_http_rx_rqi();
+
 // We need to define these special functions for cJSON to call when doing malloc's and frees
 void* cjson_alloc(size_t size);
 void cjson_free(void* ptr);
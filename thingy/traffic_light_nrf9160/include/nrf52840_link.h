@@ -0,0 +1,36 @@
+#ifndef TRAFFIC_LIGHT_NRF9160_NRF52840_LINK_H_
+#define TRAFFIC_LIGHT_NRF9160_NRF52840_LINK_H_
+
+/*
+    Messages to the nRF52840, implemented in nrf52840_parser.c.
+    They go out as binary frames (see chip_link.h) once the nRF52840 has completed the handshake,
+    otherwise as the ASCII commands ("!S1:g-#42;", "!start_scanIntersectionB;", "!stop_scan;").
+    The target of a message is the index of a signal controller in BLE_CONTROLLERS, each one has its
+    own BLE connection on the nRF52840. ASCII commands for any target but 0 end with "@<target>".
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include "events/ae_event.h"
+#include "chip_link.h"
+
+// Sets the lights of a signal controller starting at first_light (1..N on the controller),
+// AE_LIGHT_STATE_NONE leaves a light as it is
+// @param cmd_id - Latency tracking ID the ESP32 acknowledges, 0 if the command is not tracked
+void nrf52840_link_send_frame(uint8_t target, uint8_t first_light, const enum ae_light_states* states, size_t count,
+							  uint16_t cmd_id);
+
+// Gives the target the BLE name of its controller, the nRF52840 scans for it and keeps it connected
+void nrf52840_link_start_scan(uint8_t target, const char* name);
+
+// Stops scanning for every target that is not connected yet
+void nrf52840_link_stop_scan();
+
+// Sends one benchmark frame (see link_bench.h), never retransmitted and never sent as ASCII
+// @return 0, -ENOTCONN if the link is not up
+int nrf52840_link_bench_ping(const uint8_t* payload, size_t len);
+
+// Frame counters and the negotiated baud rate of the link, all 0 before it has started
+void nrf52840_link_stats_get(struct chip_link_stats* stats);
+
+#endif // TRAFFIC_LIGHT_NRF9160_NRF52840_LINK_H_
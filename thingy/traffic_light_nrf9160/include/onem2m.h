@@ -1,6 +1,9 @@
 #ifndef TRAFFIC_LIGHT_NRF9160_ONEM2M_H_
 #define TRAFFIC_LIGHT_NRF9160_ONEM2M_H_
 
+#include <stdint.h>
+#include "events/ae_event.h"
+
 void init_oneM2M();
 
 // Access Control Policy (ACP)
@@ -13,22 +16,29 @@ char* createAE();
 bool discoverAE();
 bool deleteAE();
 
-// Flex Container
-char* createFlexContainer();
-bool discoverFlexContainer();
-bool deleteFLEX();
-void retrieveFlexContainer();
-bool updateFlexContainer(const char* l1s, const char* l2s, const char* bts);
+// Flex Container, one per intersection
+char* createFlexContainer(uint8_t intersection);
+bool discoverFlexContainer(uint8_t intersection);
+bool deleteFLEX(uint8_t intersection);
+void retrieveFlexContainer(uint8_t intersection);
+// Longest fragment updateFlexContainerAttributes() takes, terminator included
+#define ONEM2M_FLEX_ATTRIBUTES_LENGTH 2000
+// Updates only the given attributes, a JSON fragment such as "\"bts\": \"connected\", \"c1s\": \"red\"".
+// A fragment longer than ONEM2M_FLEX_ATTRIBUTES_LENGTH is refused rather than sent cut short.
+bool updateFlexContainerAttributes(uint8_t intersection, const char* attributes);
 
 // Polling Channel (PCH)
 void createPCH();
 bool discoverPCH();
 bool deletePCH();
-void onem2m_performPoll();
+// Performs one long poll of the PCH, and handles any notification it returns.
+// @param timeout_ms - How long the CSE holds the poll open waiting for a notification (X-M2M-RET)
+// Returns 1 if a notification was received, 0 if the poll ended without one, or a negative value on error.
+int onem2m_performPoll(uint32_t timeout_ms);
 
-// Subscriptions (SUB)
-void createSUB();
-bool discoverSUB();
-bool deleteSUB();
+// Subscriptions (SUB), one per intersection flex container
+void createSUB(uint8_t intersection);
+bool discoverSUB(uint8_t intersection);
+bool deleteSUB(uint8_t intersection);
 
 #endif // TRAFFIC_LIGHT_NRF9160_ONEM2M_H_
\ No newline at end of file
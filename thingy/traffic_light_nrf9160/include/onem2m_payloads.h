@@ -34,13 +34,13 @@ static char* flex_container_create_payload = "{\
             \"%s\"\
         ],\
         \"cnd\": \"edu.psu.cse.traffic.trafficLightIntersection\",\
-        \"rn\": \"intersection\",\
-        \"l1s\": \"red\",\
-        \"l2s\": \"red\",\
+        \"rn\": \"%s\",\
+        %s\
         \"bts\": \"disconnected\"\
     }\
 }";
 
-static char* pch_ack_payload = "{\"m2m:rsp\":{\"rqi\": \"%s\", \"pc\": %s, \"rsc\": 2004, \"rvi\": \"3\" }}";
+// The notification is not echoed back, with the telemetry attributes it no longer fits the request buffer
+static char* pch_ack_payload = "{\"m2m:rsp\":{\"rqi\": \"%s\", \"rsc\": 2004, \"rvi\": \"3\" }}";
 
 #endif // TRAFFIC_LIGHT_NRF9160_ONEM2M_PAYLOADS_H_
\ No newline at end of file
@@ -0,0 +1,53 @@
+#ifndef TRAFFIC_LIGHT_NRF9160_ONEM2M_REQUESTS_H_
+#define TRAFFIC_LIGHT_NRF9160_ONEM2M_REQUESTS_H_
+
+/*
+    Request identifier (X-M2M-RI) generation and the table of outstanding oneM2M requests.
+    Every request sent to the CSE gets its own RI, which lets us match responses to requests
+    and time each request from the moment it is sent until its response comes back.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define ONEM2M_RQI_LENGTH 50
+#define ONEM2M_RI_HEADER_LENGTH (ONEM2M_RQI_LENGTH + 16)
+
+// Maximum number of requests that can be in flight at the same time
+#define ONEM2M_MAX_OUTSTANDING_REQUESTS 4
+
+struct onem2m_request {
+    // Request identifier sent in the X-M2M-RI header
+    char rqi[ONEM2M_RQI_LENGTH];
+    // Ready-made "X-M2M-RI: <rqi>\r\n" header line for the HTTP header list
+    char ri_header[ONEM2M_RI_HEADER_LENGTH];
+    // Name of the operation, used for logging only
+    const char* op;
+    // Uptime (ms) at which the request was started
+    int64_t start_time;
+    bool in_use;
+};
+
+// Call this at startup, picks a new random per-boot prefix for the request identifiers
+void onem2m_requests_init();
+
+// Allocates a slot in the outstanding request table and generates a new request identifier for it.
+// Never returns NULL, if the table is full the oldest outstanding request is dropped.
+// Call it once the HTTP semaphore is taken, the round trip time is measured from here.
+// @param op - Name of the operation (ie. "createAE"), must be a string literal
+struct onem2m_request* onem2m_request_begin(const char* op);
+
+// Completes a request. The response is matched to the outstanding request by the X-M2M-RI
+// header the CSE echoed back and its round trip time is logged. Only the slot of req is released,
+// a response that belongs to another outstanding request is logged as stale.
+// @param req - Request returned by onem2m_request_begin()
+// @param response_code - Return value of the HTTP request function
+void onem2m_request_end(struct onem2m_request* req, int response_code);
+
+// Returns the outstanding request with the given identifier, or NULL if there is none
+struct onem2m_request* onem2m_request_find(const char* rqi);
+
+// Round trip time in ms of the most recently completed request
+int32_t onem2m_request_last_rtt();
+
+#endif // TRAFFIC_LIGHT_NRF9160_ONEM2M_REQUESTS_H_
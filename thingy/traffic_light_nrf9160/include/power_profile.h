@@ -0,0 +1,80 @@
+#ifndef TRAFFIC_LIGHT_NRF9160_POWER_PROFILE_H_
+#define TRAFFIC_LIGHT_NRF9160_POWER_PROFILE_H_
+
+/*
+    Power-latency profiles of the LTE link. A profile sets the eDRX cycle and PSM timers the modem asks the
+    network for, and the long poll cadence that goes with them, so the radio sleeps as much as the command
+    latency the profile promises allows:
+        responsive - eDRX and PSM off, back to back long polls. For peak hours.
+        lowpower   - 10.24 s eDRX cycle, long polls of 50 s that leave the radio idle between paging
+                     occasions. A notification reaches the AE in under 20 s.
+        standby    - PSM, the AE wakes the modem to poll every 5 minutes. For intersections that are dark
+                     or running a timing plan overnight.
+    The cloud selects the profile with the "pwr" attribute of a flex container, it applies to the whole device.
+    With several intersections the most responsive profile any of them asks for is used. An unknown "pwr"
+    asks for responsive, a missing one for nothing, and responsive is used while none asks for a profile.
+
+    For each profile the time it was active, the time the radio was RRC connected and the delay from the CSE
+    changing a flex container ("lt") until the notification arrived are collected and reported in "pws".
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+enum power_profile {
+    POWER_PROFILE_RESPONSIVE,
+    POWER_PROFILE_LOW_POWER,
+    POWER_PROFILE_STANDBY,
+    POWER_PROFILE_COUNT
+};
+
+struct power_profile_params {
+    // As written to the "pwr" attribute
+    const char* name;
+    // LTE-M eDRX cycle and paging time window, 4 bit strings as in 3GPP TS 24.008, NULL to turn eDRX off
+    const char* edrx;
+    const char* ptw;
+    // Periodic TAU (T3412 extended) and active time (T3324), 8 bit strings, NULL to turn PSM off
+    const char* psm_tau;
+    const char* psm_active_time;
+    // Longest the network may hold back data for the device while it sleeps, the eDRX cycle
+    uint32_t paging_ms;
+    // X-M2M-RET of the long poll
+    uint32_t poll_timeout_ms;
+    // Wait between the end of one poll and the start of the next, 0 to poll back to back
+    uint32_t poll_interval_ms;
+    // Longest time from the CSE sending a notification until the AE has it that the profile allows for
+    uint32_t latency_budget_ms;
+};
+
+// Size of the string written by power_profile_format()
+#define POWER_PROFILE_TELEMETRY_LENGTH 192
+
+// Call this at startup, clears the statistics. The profile is left as it is.
+void power_profile_init();
+
+const struct power_profile_params* power_profile_params(enum power_profile profile);
+
+enum power_profile power_profile_current();
+
+// Looks up a profile by its "pwr" name
+// @return 0 on success, -EINVAL if there is no such profile
+int power_profile_from_name(const char* name, enum power_profile* profile);
+
+// Switches to a profile, submits a power_profile_event if it is not the current one already
+void power_profile_select(enum power_profile profile);
+
+// The modem entered (true) or left (false) RRC connected mode
+void power_profile_rrc_update(bool connected);
+
+// A notification arrived delay_ms after the CSE changed the resource it is about
+void power_profile_cmd_delivered(uint32_t delay_ms);
+
+// Writes the statistics collected since the last call, then clears them. The current profile comes first,
+// followed by one entry per profile that was active, separated by ';':
+//     "<profile>:<active s>,<radio on s>,<radio on permille>,<notifications>,<mean delay ms>,<max delay ms>,<budget ms>"
+// @return the length of the string written
+size_t power_profile_format(char* output, size_t output_len);
+
+#endif // TRAFFIC_LIGHT_NRF9160_POWER_PROFILE_H_
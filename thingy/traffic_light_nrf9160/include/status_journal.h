@@ -0,0 +1,55 @@
+#ifndef TRAFFIC_LIGHT_NRF9160_STATUS_JOURNAL_H_
+#define TRAFFIC_LIGHT_NRF9160_STATUS_JOURNAL_H_
+
+/*
+    Journal of the status updates (light states, bluetooth state, telemetry) that have not reached the CSE yet.
+    Only the latest value of each attribute of each intersection is kept, so the journal never grows while
+    offline, and replaying it sends one update per intersection with everything the cloud missed.
+    With CONFIG_STATUS_JOURNAL_NVS the unsent values are also kept in flash, so they survive a reboot.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "deployment_settings.h"
+#include "events/ae_event.h"
+
+// Flex container attributes that are journaled, followed by one "c<n>s" attribute per light with the state
+// its head shows. The "l<n>s" attributes are the commands from the cloud, the AE never writes them.
+enum status_attr {
+    STATUS_ATTR_BTS,
+    STATUS_ATTR_TLM,
+    STATUS_ATTR_BLQ,
+    STATUS_ATTR_PWS,
+    STATUS_ATTR_CONFIRMED_FIRST,
+    STATUS_ATTR_COUNT = STATUS_ATTR_CONFIRMED_FIRST + LIGHTS_PER_INTERSECTION
+};
+
+// Longest attribute value that can be journaled, the telemetry summary is the largest
+#define STATUS_JOURNAL_VALUE_LENGTH 256
+
+// Call this at startup, loads any updates that were persisted before a reboot
+void status_journal_init();
+
+// Records the latest value of an attribute, replacing any unsent value for it. A value equal to the last
+// one recorded is ignored, whether that one was sent already or not.
+// Never sends anything, call status_journal_flush() to do that.
+void status_journal_set(uint8_t intersection, enum status_attr attr, const char* value);
+
+// Records the state every light of an intersection shows, into its "c<n>s" attribute
+void status_journal_set_lights(uint8_t intersection, const enum ae_light_states* states, size_t count);
+
+// Journals every value of an intersection again, for a flex container that was just created and
+// holds none of them
+void status_journal_resend(uint8_t intersection);
+
+// Sends the journaled attributes to the CSE, one update per intersection, oldest change first.
+// An intersection with more than one update holds (ONEM2M_FLEX_ATTRIBUTES_LENGTH) is split over several.
+// Updates that fail stay in the journal for the next flush.
+// @return the number of intersections that still have unsent attributes
+int status_journal_flush();
+
+// Number of attributes waiting to be sent
+size_t status_journal_pending();
+
+#endif // TRAFFIC_LIGHT_NRF9160_STATUS_JOURNAL_H_
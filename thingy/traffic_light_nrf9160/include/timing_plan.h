@@ -0,0 +1,53 @@
+#ifndef TRAFFIC_LIGHT_NRF9160_TIMING_PLAN_H_
+#define TRAFFIC_LIGHT_NRF9160_TIMING_PLAN_H_
+
+/*
+    Signal timing plans, executed on the device so that phase changes do not depend on the LTE round trip.
+
+    A plan is carried in the "tpl" attribute of an intersection's flex container as a list of phases,
+    each one state character per light followed by its duration in seconds, and an optional cycle offset:
+        "gr:20,yr:3,rr:2,rg:20,ry:3,rr:2@5"
+    The state characters are r (red), y (yellow), g (green), o (off) and - (leave the light as it is).
+    The cycle is aligned to wall clock time plus the offset, so intersections sharing a cycle length stay coordinated.
+    An empty or missing "tpl" hands the lights back to the "l<n>s" attributes.
+*/
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "deployment_settings.h"
+#include "events/ae_event.h"
+
+#define TIMING_PLAN_MAX_PHASES 8
+#define TIMING_PLAN_MAX_LENGTH 128
+
+struct timing_plan_phase {
+    enum ae_light_states states[LIGHTS_PER_INTERSECTION];
+    uint32_t duration_ms;
+};
+
+struct timing_plan {
+    struct timing_plan_phase phases[TIMING_PLAN_MAX_PHASES];
+    size_t phase_count;
+    // Sum of all phase durations
+    uint32_t cycle_ms;
+    // Start of the cycle relative to a multiple of cycle_ms in wall clock time
+    uint32_t offset_ms;
+};
+
+// Parses a plan string (see above)
+// @return 0 on success, -EINVAL if the string is not a valid plan
+int timing_plan_parse(const char* str, struct timing_plan* plan);
+
+// Starts, replaces or stops (empty string) the plan of an intersection.
+// Setting the plan that is already running does nothing, so notifications for other attributes do not restart it.
+// An invalid plan stops the current one.
+// @return 0 on success, -EINVAL if the plan is invalid
+int timing_plan_set(uint8_t intersection, const char* plan_string);
+
+// Returns true if the lights of the intersection are driven by a timing plan
+bool timing_plan_active(uint8_t intersection);
+
+// Stops the plans of every intersection, the lights stay in their current state
+void timing_plan_stop_all();
+
+#endif // TRAFFIC_LIGHT_NRF9160_TIMING_PLAN_H_
@@ -0,0 +1,56 @@
+#ifndef TRAFFIC_LIGHT_NRF9160_UART_RX_H_
+#define TRAFFIC_LIGHT_NRF9160_UART_RX_H_
+
+/*
+    Received UART data, implemented in uart_handler.c.
+    Every UART has one consumer (UART0 the AT handler, UART1 the nRF52840 parser) that drains
+    its queue from its own thread, so a slow parser never holds up the app event manager.
+    The chunks point straight into the RX slab blocks, nothing is copied. The consumer must
+    hand every chunk back with uart_rx_release() once it has parsed it.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zephyr/kernel.h>
+
+// Chunks that can wait for a consumer per UART, anything more is dropped and counted
+#define UART_RX_QUEUE_DEPTH 16
+
+// The RX timeout ends a chunk when the line has been idle this long, it adapts to the traffic:
+// longer while data comes in as many small chunks, back to the minimum when the line is quiet
+#define UART_RX_TIMEOUT_MIN_USEC 1000
+#define UART_RX_TIMEOUT_MAX_USEC 8000
+// Chunks looked at before the timeout is reconsidered
+#define UART_RX_ADAPT_WINDOW 16
+// Average chunk below this many bytes means messages are being split up
+#define UART_RX_SMALL_CHUNK 16
+// A window that took longer than this is quiet traffic, where latency matters more
+#define UART_RX_QUIET_WINDOW_MS 1000
+
+struct uart_rx_chunk {
+    uint8_t* buf;
+    size_t len;
+};
+
+struct uart_rx_stats {
+    uint32_t chunks;
+    // The consumer's queue was full
+    uint32_t dropped;
+    // No free slab block for the driver, bytes were lost in the UART
+    uint32_t overruns;
+    uint32_t queue_high_water;
+    uint32_t rx_timeout_us;
+    // Framing, parity, overrun and break errors reported by the UART
+    uint32_t line_errors;
+};
+
+// Waits for the next chunk received on a UART
+// @return 0, or -EAGAIN if nothing arrived before the timeout
+int uart_rx_get(uint8_t dev_idx, struct uart_rx_chunk* chunk, k_timeout_t timeout);
+
+// Hands a chunk back once it has been parsed
+void uart_rx_release(struct uart_rx_chunk* chunk);
+
+void uart_rx_stats_get(uint8_t dev_idx, struct uart_rx_stats* stats);
+
+#endif // TRAFFIC_LIGHT_NRF9160_UART_RX_H_
@@ -0,0 +1,42 @@
+#ifndef TRAFFIC_LIGHT_NRF9160_UART_TX_H_
+#define TRAFFIC_LIGHT_NRF9160_UART_TX_H_
+
+/*
+    Sending on the UARTs, implemented in uart_handler.c.
+    UART0 goes to the upper tester, UART1 to the nRF52840.
+    Data is copied into a ring buffer per UART and sent from there. A write is all or nothing,
+    so a frame is never cut in half when the ring is full: the caller either waits for room
+    or gets an error, and every refused write is counted as a drop.
+*/
+
+#include <stdint.h>
+#include <stddef.h>
+#include <zephyr/kernel.h>
+
+struct uart_tx_stats {
+    uint32_t bytes;
+    // Successful writes
+    uint32_t frames;
+    // Writes refused because the ring stayed full
+    uint32_t drops;
+    uint32_t ring_high_water;
+    uint32_t ring_size;
+    // From the oldest byte of a transfer being written to its TX_DONE
+    uint32_t done_latency_avg_us;
+    uint32_t done_latency_max_us;
+};
+
+// Queues data for sending
+// @param timeout - How long to wait for room in the ring, K_NO_WAIT fails straight away when it is full
+// @return 0, -ENOMEM if there was no room in time, -EINVAL if the data can never fit
+int uart_tx_send(uint8_t dev_idx, const uint8_t* data, size_t len, k_timeout_t timeout);
+
+void uart_tx_stats_get(uint8_t dev_idx, struct uart_tx_stats* stats);
+
+// Changes the baud rate of a UART, in both directions. Waits for the TX ring to go out at the old rate
+// and stops RX across the switch, writers wait meanwhile.
+// @param baudrate - 0 goes back to the devicetree rate
+// @return 0, -EBUSY if the TX ring did not go out in time, or the error of the UART driver
+int uart_baudrate_set(uint8_t dev_idx, uint32_t baudrate);
+
+#endif // TRAFFIC_LIGHT_NRF9160_UART_TX_H_
@@ -0,0 +1,105 @@
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "ble_quality.h"
+
+LOG_MODULE_REGISTER(ble_quality, LOG_LEVEL_INF);
+
+struct quality_summary {
+    uint32_t reports;
+    int8_t rssi_min;
+    int8_t rssi_max;
+    // The reports only carry the mean, it is weighted by their number of readings
+    int32_t rssi_sum;
+    uint32_t rssi_samples;
+    uint32_t rssi_buckets[CHIP_LINK_RSSI_BUCKET_COUNT];
+    uint32_t conn_events;
+    uint32_t conn_events_skipped;
+    uint32_t disconnects;
+    uint8_t last_reason;
+    uint32_t reconnects;
+    uint32_t reconnect_ms_max;
+    uint32_t retransmits;
+};
+
+static struct quality_summary summaries[CHIP_LINK_MAX_TARGETS];
+K_MUTEX_DEFINE(ble_quality_lock);
+
+void ble_quality_init() {
+    k_mutex_lock(&ble_quality_lock, K_FOREVER);
+    memset(summaries, 0, sizeof(summaries));
+    k_mutex_unlock(&ble_quality_lock);
+}
+
+void ble_quality_add(uint8_t target, const struct chip_link_quality* quality) {
+    if (target >= CHIP_LINK_MAX_TARGETS) {
+        return;
+    }
+
+    uint32_t samples = 0;
+    for (size_t b = 0; b < CHIP_LINK_RSSI_BUCKET_COUNT; b++) {
+        samples += quality->rssi_buckets[b];
+    }
+
+    k_mutex_lock(&ble_quality_lock, K_FOREVER);
+    struct quality_summary* s = &summaries[target];
+    if (samples > 0) {
+        s->rssi_min = (s->rssi_samples == 0) ? quality->rssi_min : MIN(s->rssi_min, quality->rssi_min);
+        s->rssi_max = (s->rssi_samples == 0) ? quality->rssi_max : MAX(s->rssi_max, quality->rssi_max);
+        s->rssi_sum += (int32_t) quality->rssi_mean * (int32_t) samples;
+        s->rssi_samples += samples;
+        for (size_t b = 0; b < CHIP_LINK_RSSI_BUCKET_COUNT; b++) {
+            s->rssi_buckets[b] += quality->rssi_buckets[b];
+        }
+    }
+    s->reports++;
+    s->conn_events += quality->conn_events;
+    s->conn_events_skipped += quality->conn_events_skipped;
+    s->disconnects += quality->disconnects;
+    if (quality->disconnects > 0) {
+        s->last_reason = quality->last_reason;
+    }
+    s->reconnects += quality->reconnects;
+    s->reconnect_ms_max = MAX(s->reconnect_ms_max, quality->reconnect_ms_max);
+    s->retransmits += quality->retransmits;
+    k_mutex_unlock(&ble_quality_lock);
+
+    LOG_DBG("Target %d: RSSI %d/%d/%d dBm, %d connection events, %d skipped, %d disconnects", target,
+            quality->rssi_min, quality->rssi_mean, quality->rssi_max, (int) quality->conn_events,
+            (int) quality->conn_events_skipped, quality->disconnects);
+}
+
+size_t ble_quality_format(uint8_t target, char* output, size_t output_len) {
+    if (target >= CHIP_LINK_MAX_TARGETS || output_len == 0) {
+        return 0;
+    }
+
+    k_mutex_lock(&ble_quality_lock, K_FOREVER);
+    struct quality_summary* s = &summaries[target];
+    output[0] = '\0';
+    if (s->reports == 0) {
+        k_mutex_unlock(&ble_quality_lock);
+        return 0;
+    }
+
+    size_t len = snprintf(output, output_len, "%d:%d,%d,%d,%d,", target, (int) s->reports, s->rssi_min,
+                          (int) (s->rssi_samples ? s->rssi_sum / (int32_t) s->rssi_samples : 0), s->rssi_max);
+    for (size_t b = 0; b < CHIP_LINK_RSSI_BUCKET_COUNT && len < output_len; b++) {
+        len += snprintf(output + len, output_len - len, (b == 0) ? "%d" : "/%d", (int) s->rssi_buckets[b]);
+    }
+    if (len < output_len) {
+        len += snprintf(output + len, output_len - len, ",%d,%d,%d,%d,%d,%d,%d", (int) s->conn_events,
+                        (int) s->conn_events_skipped, (int) s->disconnects, s->last_reason, (int) s->reconnects,
+                        (int) s->reconnect_ms_max, (int) s->retransmits);
+    }
+    if (len >= output_len) {
+        LOG_WRN("Link quality summary truncated");
+        len = output_len - 1;
+    }
+
+    memset(s, 0, sizeof(*s));
+    k_mutex_unlock(&ble_quality_lock);
+    return len;
+}
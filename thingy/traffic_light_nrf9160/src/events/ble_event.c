@@ -15,10 +15,10 @@ static void log_ble_event(const struct app_event_header *aeh)
 
 	switch(event->cmd) {
 		case BLE_CONNECTED:
-		APP_EVENT_MANAGER_LOG(aeh, "BLE Event: CONNECTED");
+		APP_EVENT_MANAGER_LOG(aeh, "BLE Event: CONNECTED %d", event->target);
 		break;
 		case BLE_DISCONNECTED:
-		APP_EVENT_MANAGER_LOG(aeh, "BLE Event: DISCONNECTED");
+		APP_EVENT_MANAGER_LOG(aeh, "BLE Event: DISCONNECTED %d", event->target);
 		break;
 		case BLE_SCAN_STARTED:
 		APP_EVENT_MANAGER_LOG(aeh, "BLE Event: SCAN_STARTED");
@@ -26,6 +26,9 @@ static void log_ble_event(const struct app_event_header *aeh)
 		case BLE_SCAN_STOPPED:
 		APP_EVENT_MANAGER_LOG(aeh, "BLE Event: SCAN_STOPPED");
 		break;
+		case BLE_LIGHT_STATE:
+		APP_EVENT_MANAGER_LOG(aeh, "BLE Event: LIGHT_STATE %d, %d lights", event->target, event->light_count);
+		break;
 	}
 
 }
@@ -0,0 +1,26 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <stdio.h>
+#include <assert.h>
+
+#include "events/power_profile_event.h"
+
+static void log_power_profile_event(const struct app_event_header *aeh)
+{
+	const struct power_profile_event *event = cast_power_profile_event(aeh);
+
+	APP_EVENT_MANAGER_LOG(aeh,
+		"Power profile: %s",
+		power_profile_params(event->profile)->name);
+}
+
+APP_EVENT_TYPE_DEFINE(power_profile_event,
+		  log_power_profile_event,
+		  NULL,
+		  APP_EVENT_FLAGS_CREATE(
+			IF_ENABLED(CONFIG_LOG_PEER_CONN_EVENT,
+				(APP_EVENT_TYPE_FLAGS_INIT_LOG_ENABLE))));
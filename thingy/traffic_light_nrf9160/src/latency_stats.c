@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "latency_stats.h"
+#include "deployment_settings.h"
+
+LOG_MODULE_REGISTER(latency_stats, LOG_LEVEL_INF);
+
+struct latency_histogram {
+    uint32_t buckets[LATENCY_BUCKET_COUNT];
+    uint32_t count;
+    uint32_t sum_ms;
+    uint32_t max_ms;
+};
+
+struct pending_cmd {
+    uint16_t id;
+    uint8_t intersection;
+    int64_t received_time;
+    int64_t sent_time;
+    bool in_use;
+};
+
+static const uint32_t bucket_bounds_ms[LATENCY_BUCKET_COUNT - 1] = LATENCY_BUCKET_BOUNDS_MS;
+static const char* hop_names[LATENCY_HOP_COUNT] = { "ae", "uart", "ble", "total" };
+
+static struct latency_histogram histograms[INTERSECTION_COUNT][LATENCY_HOP_COUNT];
+static struct pending_cmd pending[LATENCY_MAX_PENDING];
+static size_t next_pending = 0;
+static uint16_t next_cmd_id = 1;
+K_MUTEX_DEFINE(latency_stats_lock);
+
+void latency_stats_init() {
+    k_mutex_lock(&latency_stats_lock, K_FOREVER);
+    memset(histograms, 0, sizeof(histograms));
+    memset(pending, 0, sizeof(pending));
+    next_pending = 0;
+    k_mutex_unlock(&latency_stats_lock);
+}
+
+static struct pending_cmd* find_pending(uint16_t cmd_id) {
+    for (size_t i = 0; i < LATENCY_MAX_PENDING; i++) {
+        if (pending[i].in_use && pending[i].id == cmd_id) {
+            return &pending[i];
+        }
+    }
+    return NULL;
+}
+
+static void record(uint8_t intersection, enum latency_hop hop, int64_t ms) {
+    struct latency_histogram* h = &histograms[intersection][hop];
+    uint32_t value = (ms < 0) ? 0 : (uint32_t) ms;
+
+    size_t bucket = 0;
+    while (bucket < LATENCY_BUCKET_COUNT - 1 && value >= bucket_bounds_ms[bucket]) {
+        bucket++;
+    }
+    h->buckets[bucket]++;
+    h->count++;
+    h->sum_ms += value;
+    h->max_ms = MAX(h->max_ms, value);
+}
+
+uint16_t latency_cmd_begin(uint8_t intersection, int64_t received_time) {
+    k_mutex_lock(&latency_stats_lock, K_FOREVER);
+    uint16_t id = next_cmd_id++;
+    if (next_cmd_id == 0) {
+        // 0 means "no ID" on the links
+        next_cmd_id = 1;
+    }
+
+    // Oldest entry gets reused, its acknowledgement was most likely lost
+    struct pending_cmd* p = &pending[next_pending];
+    next_pending = (next_pending + 1) % LATENCY_MAX_PENDING;
+    p->id = id;
+    p->intersection = intersection;
+    p->received_time = received_time;
+    p->sent_time = 0;
+    p->in_use = true;
+    k_mutex_unlock(&latency_stats_lock);
+    return id;
+}
+
+void latency_cmd_sent(uint16_t cmd_id) {
+    k_mutex_lock(&latency_stats_lock, K_FOREVER);
+    struct pending_cmd* p = find_pending(cmd_id);
+    if (p != NULL) {
+        p->sent_time = k_uptime_get();
+    }
+    k_mutex_unlock(&latency_stats_lock);
+}
+
+void latency_cmd_acked(uint16_t cmd_id, uint32_t ble_ms) {
+    k_mutex_lock(&latency_stats_lock, K_FOREVER);
+    struct pending_cmd* p = find_pending(cmd_id);
+    if (p == NULL || p->sent_time == 0) {
+        LOG_DBG("Ack for unknown command %d", cmd_id);
+        k_mutex_unlock(&latency_stats_lock);
+        return;
+    }
+
+    int64_t now = k_uptime_get();
+    int64_t total = now - p->received_time;
+    record(p->intersection, LATENCY_HOP_AE, p->sent_time - p->received_time);
+    record(p->intersection, LATENCY_HOP_UART, (now - p->sent_time) - ble_ms);
+    record(p->intersection, LATENCY_HOP_BLE, ble_ms);
+    record(p->intersection, LATENCY_HOP_TOTAL, total);
+    LOG_INF("Command %d applied in %d ms (ble %d ms)", cmd_id, (int) total, (int) ble_ms);
+    p->in_use = false;
+    k_mutex_unlock(&latency_stats_lock);
+}
+
+int latency_stats_format(uint8_t intersection, char* output, size_t output_len) {
+    if (intersection >= INTERSECTION_COUNT || output_len == 0) {
+        return 0;
+    }
+
+    k_mutex_lock(&latency_stats_lock, K_FOREVER);
+    size_t len = 0;
+    output[0] = '\0';
+    for (size_t hop = 0; hop < LATENCY_HOP_COUNT; hop++) {
+        struct latency_histogram* h = &histograms[intersection][hop];
+        len += snprintf(output + len, output_len - len, "%s%s:%d,%d,%d,", (hop == 0) ? "" : ";",
+                        hop_names[hop], (int) h->count, (int) (h->count ? h->sum_ms / h->count : 0), (int) h->max_ms);
+        if (len >= output_len) {
+            LOG_WRN("Latency summary truncated");
+            break;
+        }
+        for (size_t b = 0; b < LATENCY_BUCKET_COUNT && len < output_len; b++) {
+            len += snprintf(output + len, output_len - len, (b == 0) ? "%d" : "/%d", (int) h->buckets[b]);
+        }
+        if (len >= output_len) {
+            LOG_WRN("Latency summary truncated");
+            break;
+        }
+    }
+
+    int count = histograms[intersection][LATENCY_HOP_TOTAL].count;
+    memset(histograms[intersection], 0, sizeof(histograms[intersection]));
+    k_mutex_unlock(&latency_stats_lock);
+    return count;
+}
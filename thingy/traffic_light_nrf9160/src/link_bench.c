@@ -0,0 +1,226 @@
+#include <string.h>
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/logging/log.h>
+
+#include "link_bench.h"
+#include "nrf52840_link.h"
+#include "chip_link.h"
+
+LOG_MODULE_REGISTER(link_bench, LOG_LEVEL_INF);
+
+struct bench_slot {
+    uint16_t seq;
+    uint32_t sent_cycles;
+    bool waiting;
+};
+
+static struct bench_slot slots[LINK_BENCH_SLOTS];
+static uint32_t rtt_buckets[LINK_BENCH_BUCKETS];
+// Counters of the current report
+static struct link_bench_report window;
+static int64_t window_start;
+
+static link_bench_report_cb_t report_cb;
+static uint8_t frame[CHIP_LINK_MAX_PAYLOAD];
+static size_t frame_size;
+static size_t wire_size;
+static uint32_t interval_ms;
+// Frames still to send, 0 for a soak test
+static uint32_t remaining;
+static bool soak;
+static bool running;
+static bool draining;
+static uint16_t next_seq;
+static uint16_t newest_echo;
+static bool echo_seen;
+static int64_t next_report;
+
+static struct k_work_delayable bench_work;
+static bool work_initialized = false;
+K_MUTEX_DEFINE(link_bench_lock);
+
+// Upper bound of the bucket the given share of the samples falls in
+static uint32_t percentile_us(uint32_t count, uint32_t percent) {
+    uint32_t target = (count * percent + 99) / 100;
+    uint32_t seen = 0;
+
+    for (size_t i = 0; i < LINK_BENCH_BUCKETS; i++) {
+        seen += rtt_buckets[i];
+        if (seen >= target) {
+            return (i + 1) * LINK_BENCH_BUCKET_US;
+        }
+    }
+    return LINK_BENCH_BUCKETS * LINK_BENCH_BUCKET_US;
+}
+
+// Call with the lock held, hands over the counters since the previous report and starts a new window
+static void take_report(struct link_bench_report* report, int64_t now) {
+    *report = window;
+
+    int64_t elapsed = now - window_start;
+    if (elapsed > 0) {
+        report->bytes_per_sec = (uint32_t) (((uint64_t) window.echoed * wire_size * 1000) / elapsed);
+    }
+    if (window.echoed > 0) {
+        // A bucket's upper bound can be above anything actually measured
+        report->rtt_p50_us = MIN(percentile_us(window.echoed, 50), window.rtt_max_us);
+        report->rtt_p90_us = MIN(percentile_us(window.echoed, 90), window.rtt_max_us);
+        report->rtt_p99_us = MIN(percentile_us(window.echoed, 99), window.rtt_max_us);
+    }
+
+    memset(&window, 0, sizeof(window));
+    memset(rtt_buckets, 0, sizeof(rtt_buckets));
+    window_start = now;
+}
+
+// Call with the lock held
+static void send_ping() {
+    struct bench_slot* slot = &slots[next_seq % LINK_BENCH_SLOTS];
+
+    if (slot->waiting) {
+        // Its echo is overdue, the slot is needed
+        window.lost++;
+    }
+
+    // Ready before the frame goes out, the echo can be quick
+    sys_put_le16(next_seq, frame);
+    slot->seq = next_seq;
+    slot->sent_cycles = k_cycle_get_32();
+    slot->waiting = true;
+    if (nrf52840_link_bench_ping(frame, frame_size) != 0) {
+        slot->waiting = false;
+        window.skipped++;
+        return;
+    }
+    next_seq++;
+    window.sent++;
+}
+
+static void bench_work_handler(struct k_work* work) {
+    struct link_bench_report report;
+    bool have_report = false;
+    bool final = false;
+    link_bench_report_cb_t cb;
+
+    k_mutex_lock(&link_bench_lock, K_FOREVER);
+    int64_t now = k_uptime_get();
+    cb = report_cb;
+
+    if (!running) {
+        k_mutex_unlock(&link_bench_lock);
+        return;
+    }
+
+    if (draining) {
+        // Whatever has not come back by now never will
+        for (size_t i = 0; i < LINK_BENCH_SLOTS; i++) {
+            if (slots[i].waiting) {
+                slots[i].waiting = false;
+                window.lost++;
+            }
+        }
+        take_report(&report, now);
+        have_report = true;
+        final = true;
+        running = false;
+    }
+    else {
+        send_ping();
+        if (!soak && --remaining == 0) {
+            draining = true;
+        }
+        if (soak && now >= next_report) {
+            take_report(&report, now);
+            have_report = true;
+            next_report = now + LINK_BENCH_REPORT_INTERVAL_MS;
+        }
+        k_work_reschedule(&bench_work, K_MSEC(draining ? LINK_BENCH_GRACE_MS : interval_ms));
+    }
+    k_mutex_unlock(&link_bench_lock);
+
+    if (have_report && cb != NULL) {
+        cb(&report, final);
+    }
+}
+
+int link_bench_start(size_t size, uint32_t interval, uint32_t count, link_bench_report_cb_t report) {
+    uint8_t encoded[CHIP_LINK_MAX_ENCODED];
+
+    if (size < LINK_BENCH_MIN_SIZE || size > CHIP_LINK_MAX_PAYLOAD || interval == 0) {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&link_bench_lock, K_FOREVER);
+    if (!work_initialized) {
+        k_work_init_delayable(&bench_work, bench_work_handler);
+        work_initialized = true;
+    }
+
+    // Filler that exercises every bit and the COBS zero handling
+    for (size_t i = 2; i < size; i++) {
+        frame[i] = (uint8_t) (i * 0x35);
+    }
+    frame_size = size;
+    wire_size = chip_link_encode(CHIP_LINK_MSG_BENCH_PING, 0, frame, size, encoded);
+    interval_ms = interval;
+    remaining = count;
+    soak = (count == 0);
+    draining = false;
+    running = true;
+    next_seq = 0;
+    echo_seen = false;
+    report_cb = report;
+    memset(slots, 0, sizeof(slots));
+    memset(&window, 0, sizeof(window));
+    memset(rtt_buckets, 0, sizeof(rtt_buckets));
+    window_start = k_uptime_get();
+    next_report = window_start + LINK_BENCH_REPORT_INTERVAL_MS;
+    k_work_reschedule(&bench_work, K_NO_WAIT);
+    k_mutex_unlock(&link_bench_lock);
+
+    LOG_INF("Link benchmark: %d byte frames every %d ms, %d frames", (int) size, (int) interval, (int) count);
+    return 0;
+}
+
+void link_bench_stop() {
+    k_mutex_lock(&link_bench_lock, K_FOREVER);
+    if (running && !draining) {
+        draining = true;
+        k_work_reschedule(&bench_work, K_MSEC(LINK_BENCH_GRACE_MS));
+    }
+    k_mutex_unlock(&link_bench_lock);
+}
+
+void link_bench_echo(const uint8_t* payload, size_t len) {
+    if (len < LINK_BENCH_MIN_SIZE) {
+        return;
+    }
+
+    uint32_t now = k_cycle_get_32();
+    uint16_t seq = sys_get_le16(payload);
+
+    k_mutex_lock(&link_bench_lock, K_FOREVER);
+    struct bench_slot* slot = &slots[seq % LINK_BENCH_SLOTS];
+    if (!running || !slot->waiting || slot->seq != seq) {
+        // Late, after its frame was already counted as lost
+        k_mutex_unlock(&link_bench_lock);
+        return;
+    }
+    slot->waiting = false;
+
+    uint32_t rtt_us = k_cyc_to_us_floor32(now - slot->sent_cycles);
+    rtt_buckets[MIN(rtt_us / LINK_BENCH_BUCKET_US, LINK_BENCH_BUCKETS - 1)]++;
+    window.rtt_max_us = MAX(window.rtt_max_us, rtt_us);
+    window.echoed++;
+
+    if (echo_seen && (int16_t) (seq - newest_echo) < 0) {
+        window.reordered++;
+    }
+    else {
+        newest_echo = seq;
+        echo_seen = true;
+    }
+    k_mutex_unlock(&link_bench_lock);
+}
@@ -0,0 +1,19 @@
+#include <stdio.h>
+#include <stdint.h>
+
+#include "mem_budget.h"
+
+bool mem_budget_over(size_t peak, size_t size) {
+    // 64 bit, a size_t times 100 overflows for anything above 42 MB
+    return (uint64_t) peak * 100 > (uint64_t) size * MEM_MONITOR_BUDGET_PERCENT;
+}
+
+size_t mem_budget_format(char* output, const char* kind, const char* name, size_t peak, size_t size) {
+    int len = snprintf(output, MEM_BUDGET_LINE_SIZE, "!mem:%.8s,%.*s,%u,%u,%s;\r\n", kind, MEM_BUDGET_NAME_MAX,
+                       name, (unsigned int) peak, (unsigned int) size, mem_budget_over(peak, size) ? "over" : "ok");
+    if (len < 0) {
+        output[0] = '\0';
+        return 0;
+    }
+    return (size_t) len;
+}
@@ -10,6 +10,14 @@
 
 #include "deployment_settings.h"
 #include "onem2m.h"
+#include "timing_plan.h"
+#include "latency_stats.h"
+#include "ble_quality.h"
+#include "power_profile.h"
+#include "status_journal.h"
+#include "nrf52840_link.h"
+#include "mem_monitor.h"
+#include "modules/http_module.h"
 
 #define MODULE traffic_light_ae
 #include <caf/events/module_state_event.h>
@@ -17,64 +25,163 @@
 #include "events/ble_event.h"
 #include "events/ae_event.h"
 #include "events/led_state_event.h"
+#include "events/power_profile_event.h"
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(MODULE);
 
-#define POLL_THREAD_STACK_SIZE 32768
-#define POLLING_CHANNEL_PRIORITY 5
-K_THREAD_STACK_DEFINE(poll_thread_stack, POLL_THREAD_STACK_SIZE);
-struct k_thread polling_thread;
-
-// The external function uart_tx_enqueue is defined in uart_handler.c
-extern int uart_tx_enqueue(uint8_t *data, size_t data_len, uint8_t dev_idx); 
+// Polling runs on its own work queue so the long poll (up to X-M2M-RET) never blocks the system work queue.
+// It also runs the status journal flushes, the telemetry summary and the AE requests, one at a time.
+// All of the large request/response and telemetry buffers are static, so the stack holds:
+//   - the frames of this application on the deepest chain, poll_work_handler -> onem2m_performPoll ->
+//     updateLightStatesFromJSON, about 600 bytes by -fstack-usage on a 64 bit host, less on the target
+//   - the HTTP client, socket, cJSON and logging calls below them, allowed for until measured
+// The "!mem:thread,poll_workq,..." line of the memStats report has the peak on the target, it must stay "ok".
+#define POLL_WORKQ_APP_FRAMES 768
+#define POLL_WORKQ_LIBRARY_FRAMES 2048
+#define POLL_WORKQ_STACK_SIZE 4096
+BUILD_ASSERT((POLL_WORKQ_APP_FRAMES + POLL_WORKQ_LIBRARY_FRAMES) * 100 <= POLL_WORKQ_STACK_SIZE * MEM_MONITOR_BUDGET_PERCENT,
+			 "The poll work queue stack has to hold its call chains within the memory monitor's budget");
+#define POLL_WORKQ_PRIORITY 5
+// After a failed poll wait this long before retrying, doubling up to the maximum on every failure
+#define POLL_BACKOFF_MIN_MS 1000
+#define POLL_BACKOFF_MAX_MS 60000
+// HTTP timeout never goes below this, and is the poll timeout plus the paging delay plus this margin otherwise
+#define HTTP_REQUEST_TIMEOUT_MIN_MS 12000
+#define HTTP_REQUEST_MARGIN_MS 4000
+K_THREAD_STACK_DEFINE(poll_workq_stack, POLL_WORKQ_STACK_SIZE);
+static struct k_work_q poll_workq;
+static struct k_work_delayable poll_work;
+
+// How often the command latency summary, the BLE link quality and the power profile statistics
+// are published to the "tlm", "blq" and "pws" attributes
+#define TELEMETRY_INTERVAL_MS 300000
+// Runs on the poll work queue as well, so it never blocks the system work queue on the HTTP semaphore
+static struct k_work_delayable telemetry_work;
+// Sends what BLE and light state changes journaled. On the poll work queue too, so the event manager
+// thread never waits for the HTTP semaphore while a long poll holds it.
+static struct k_work status_work;
+// Registration, data model and test requests make HTTP requests too, and a long poll holds the HTTP semaphore
+// for up to its timeout. The event handler queues them here for the poll work queue, in order, which runs
+// them as soon as the poll in flight ends and before the next one starts.
+struct ae_request {
+	enum ae_event_types cmd;
+	bool do_init_sequence;
+	bool reset;
+};
+#define AE_REQUEST_QUEUE_SIZE 8
+K_MSGQ_DEFINE(ae_request_msgq, sizeof(struct ae_request), AE_REQUEST_QUEUE_SIZE, 4);
+static struct k_work ae_request_work;
+
+enum poll_state {
+	POLL_STOPPED,
+	POLL_RUNNING,
+	POLL_BACKOFF
+};
+static enum poll_state poll_state = POLL_STOPPED;
+static uint32_t poll_backoff_ms = POLL_BACKOFF_MIN_MS;
+
+// A signal controller (ESP32), see BLE_CONTROLLERS
+struct ble_controller {
+	const char* name;
+	uint8_t intersection;
+	// Index of the first head it drives within its intersection
+	uint8_t first_head;
+	uint8_t heads;
+};
+
+static const struct ble_controller ble_controllers[] = BLE_CONTROLLERS;
+#define BLE_CONTROLLER_COUNT ARRAY_SIZE(ble_controllers)
+BUILD_ASSERT(BLE_CONTROLLER_COUNT <= CHIP_LINK_MAX_TARGETS, "Too many BLE controllers for the nRF52840");
 
 // AE state variables
 bool lte_connected = false;
-bool ble_connected = false;
+// Per entry of ble_controllers
+bool ble_connected[BLE_CONTROLLER_COUNT];
 bool ble_scanning = false;
-enum ae_light_states light1_state = AE_LIGHT_RED;
-enum ae_light_states light2_state = AE_LIGHT_RED;
-bool poll_thread_started = false;
-struct k_sem polling_sem;
+enum ae_light_states light_states[INTERSECTION_COUNT][LIGHTS_PER_INTERSECTION];
+// What the traffic light was last told, so only the heads that changed are sent. NONE means unknown.
+enum ae_light_states sent_light_states[INTERSECTION_COUNT][LIGHTS_PER_INTERSECTION];
+// What the signal controllers acknowledged their heads show, NONE while unknown
+enum ae_light_states confirmed_light_states[INTERSECTION_COUNT][LIGHTS_PER_INTERSECTION];
 bool test_mode_started = false;
 bool registered = false; 
 bool data_model_created = false;
 
+BUILD_ASSERT(LIGHTS_PER_INTERSECTION <= AE_MAX_LIGHTS, "Too many lights per intersection");
+
 void register_ae();
 void create_data_model();
 
-void take_poll_sem() {
-	k_sem_take(&polling_sem, K_FOREVER);
+// Sends everything the status journal holds. While offline the updates just stay
+// journaled, collapsed to the latest value, until the data model is back after a reconnect.
+void flush_status_journal() {
+	if (!lte_connected || !data_model_created) {
+		LOG_DBG("Offline, %d status updates journaled", (int) status_journal_pending());
+		return;
+	}
+	status_journal_flush();
 }
 
-void give_poll_sem() {
-	k_sem_give(&polling_sem);
+// An intersection is connected once every controller driving it is
+bool intersection_connected(uint8_t intersection) {
+	bool any = false;
+	for (size_t i = 0; i < BLE_CONTROLLER_COUNT; i++) {
+		if (ble_controllers[i].intersection != intersection) {
+			continue;
+		}
+		if (!ble_connected[i]) {
+			return false;
+		}
+		any = true;
+	}
+	return any;
 }
 
-void send_command(const char* cmd) {
-	// Device index of 1 is to send to nRF52840
-	uart_tx_enqueue((uint8_t*) cmd, strlen(cmd), 1);
+bool all_controllers_connected() {
+	for (size_t i = 0; i < BLE_CONTROLLER_COUNT; i++) {
+		if (!ble_connected[i]) {
+			return false;
+		}
+	}
+	return true;
 }
 
-void push_flex_container() {
-	char l1_state_string[10];
-	char l2_state_string[10];
-	memset(l1_state_string,0,10);
-	memset(l2_state_string,0,10);
-	light_state_to_string(light1_state, l1_state_string);
-	light_state_to_string(light2_state, l2_state_string);
-
-	char ble_string[20];
-	memset(ble_string, 0, 20);
-	if (ble_connected) {
-		strcpy(ble_string, "connected");
-	}
-	else {
-		strcpy(ble_string, "disconnected");
+// The "c<n>s" attributes show what the lamps actually do: the confirmed state of every head a
+// controller drives, the commanded state of the others. The "l<n>s" attributes are left to the cloud,
+// writing them would come back as a notification and be taken for a command.
+void journal_intersection(uint8_t intersection) {
+	enum ae_light_states reported[LIGHTS_PER_INTERSECTION];
+
+	memcpy(reported, light_states[intersection], sizeof(reported));
+	for (size_t i = 0; i < BLE_CONTROLLER_COUNT; i++) {
+		const struct ble_controller* c = &ble_controllers[i];
+		if (c->intersection != intersection) {
+			continue;
+		}
+		for (size_t j = 0; j < c->heads && c->first_head + j < LIGHTS_PER_INTERSECTION; j++) {
+			reported[c->first_head + j] = confirmed_light_states[intersection][c->first_head + j];
+		}
 	}
+	status_journal_set_lights(intersection, reported, LIGHTS_PER_INTERSECTION);
+	status_journal_set(intersection, STATUS_ATTR_BTS, intersection_connected(intersection) ? "connected" : "disconnected");
+}
 
-	updateFlexContainer(l1_state_string, l2_state_string, ble_string);
+static void status_work_handler(struct k_work *work) {
+	flush_status_journal();
+}
+
+// Journals the state of an intersection, the update goes out from the poll work queue
+void push_intersection(uint8_t intersection) {
+	journal_intersection(intersection);
+	k_work_submit_to_queue(&poll_workq, &status_work);
+}
+
+void push_flex_container() {
+	for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+		journal_intersection(i);
+	}
+	k_work_submit_to_queue(&poll_workq, &status_work);
 }
 
 void set_green_led() {
@@ -95,40 +202,119 @@ void set_red_led() {
 	APP_EVENT_SUBMIT(l);
 }
 
-void update_light_states() {
-	switch (light1_state) {
-		case AE_LIGHT_OFF:
-		send_command("!off1;");
-		break;
-		case AE_LIGHT_RED:
-		send_command("!red1;");
-		break;
-		case AE_LIGHT_YELLOW:
-		send_command("!yellow1;");
-		break;
-		case AE_LIGHT_GREEN:
-		send_command("!green1;");
-		break;
-		default:
-		// Do nothing
-		break;
-	}
-	switch (light2_state) {
-		case AE_LIGHT_OFF:
-		send_command("!off2;");
-		break;
-		case AE_LIGHT_RED:
-		send_command("!red2;");
-		break;
-		case AE_LIGHT_YELLOW:
-		send_command("!yellow2;");
-		break;
-		case AE_LIGHT_GREEN:
-		send_command("!green2;");
-		break;
-		default:
+// @param received_time - Arrival of the cloud command the frame carries, 0 (and cmd_id NULL) if it is not tracked
+// @param cmd_id - Latency tracking ID of the command, taken here by the first frame that is sent for it
+static void send_controller_frame(uint8_t target, int64_t received_time, uint16_t* cmd_id) {
+	// Every head of the controller goes out as one frame, numbered 1..N on the controller.
+	// Heads that have not changed are sent as AE_LIGHT_STATE_NONE. ie. for a controller driving
+	// heads 2 and 3 of an intersection { NONE, GREEN } sets the intersection's third head to green.
+	const struct ble_controller* c = &ble_controllers[target];
+	enum ae_light_states frame[LIGHTS_PER_INTERSECTION];
+	bool changed = false;
+
+	if (c->intersection >= INTERSECTION_COUNT || c->first_head + c->heads > LIGHTS_PER_INTERSECTION) {
+		LOG_ERR("BLE controller %s drives heads that do not exist", c->name);
+		return;
+	}
+	if (!ble_connected[target]) {
+		// It gets everything once it connects
+		return;
+	}
+
+	for (size_t i = 0; i < c->heads; i++) {
+		enum ae_light_states state = light_states[c->intersection][c->first_head + i];
+		if (state == AE_LIGHT_STATE_NONE || state == sent_light_states[c->intersection][c->first_head + i]) {
+			frame[i] = AE_LIGHT_STATE_NONE;
+			continue;
+		}
+		frame[i] = state;
+		sent_light_states[c->intersection][c->first_head + i] = state;
+		changed = true;
+	}
+
+	if (!changed) {
 		// Do nothing
-		break;
+		return;
+	}
+
+	uint16_t id = 0;
+	if (received_time != 0) {
+		if (*cmd_id == 0) {
+			*cmd_id = latency_cmd_begin(c->intersection, received_time);
+		}
+		id = *cmd_id;
+	}
+	nrf52840_link_send_frame(target, 1, frame, c->heads, id);
+}
+
+static void send_light_frame(uint8_t intersection, int64_t received_time) {
+	// Each controller of the intersection gets the heads it drives. Commands from the cloud carry
+	// their latency tracking ID along with the frames, the first acknowledgement completes it.
+	uint16_t cmd_id = 0;
+
+	for (uint8_t i = 0; i < BLE_CONTROLLER_COUNT; i++) {
+		if (ble_controllers[i].intersection == intersection) {
+			send_controller_frame(i, received_time, &cmd_id);
+		}
+	}
+	if (cmd_id != 0) {
+		latency_cmd_sent(cmd_id);
+	}
+}
+
+void update_light_states(uint8_t intersection) {
+	send_light_frame(intersection, 0);
+}
+
+// Forget what the traffic lights were last told, so the next update sends every head
+void invalidate_sent_light_states() {
+	for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+		for (size_t j = 0; j < LIGHTS_PER_INTERSECTION; j++) {
+			sent_light_states[i][j] = AE_LIGHT_STATE_NONE;
+		}
+	}
+}
+
+// The same for the heads of one controller, when it (re)connects. What it confirmed no longer holds either.
+void invalidate_controller_light_states(uint8_t target) {
+	const struct ble_controller* c = &ble_controllers[target];
+	for (size_t i = 0; i < c->heads; i++) {
+		sent_light_states[c->intersection][c->first_head + i] = AE_LIGHT_STATE_NONE;
+		confirmed_light_states[c->intersection][c->first_head + i] = AE_LIGHT_STATE_NONE;
+	}
+}
+
+// A controller acknowledged what its heads show
+// @return True if that differs from what it confirmed before
+static bool confirm_controller_light_states(uint8_t target, const enum ae_light_states* states, size_t count) {
+	const struct ble_controller* c = &ble_controllers[target];
+	bool changed = false;
+
+	for (size_t i = 0; i < c->heads && i < count && c->first_head + i < LIGHTS_PER_INTERSECTION; i++) {
+		enum ae_light_states* confirmed = &confirmed_light_states[c->intersection][c->first_head + i];
+		if (states[i] != AE_LIGHT_STATE_NONE && *confirmed != states[i]) {
+			*confirmed = states[i];
+			changed = true;
+		}
+	}
+	return changed;
+}
+
+void update_all_light_states() {
+	for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+		update_light_states(i);
+	}
+}
+
+void set_all_lights_red() {
+	for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+		// A running timing plan does not need the cloud, so it keeps the lights
+		if (timing_plan_active(i)) {
+			continue;
+		}
+		for (size_t j = 0; j < LIGHTS_PER_INTERSECTION; j++) {
+			light_states[i][j] = AE_LIGHT_RED;
+		}
 	}
 }
 
@@ -147,140 +333,266 @@ void register_ae() {
 }
 
 void create_data_model() {
-	if(!discoverFlexContainer()) {
-		createFlexContainer();
-		createSUB();
+	for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+		if(!discoverFlexContainer(i)) {
+			createFlexContainer(i);
+			createSUB(i);
+			// The new container has none of what was sent to the one before it
+			status_journal_resend(i);
+		}
+		else if (!discoverSUB(i)) {
+			createSUB(i);
+		}
 	}
-	else if (!discoverSUB()) {
-		createSUB();
+}
+
+void delete_data_model() {
+	for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+		deleteSUB(i);
+		deleteFLEX(i);
 	}
 }
 
-void do_poll() {
-	while(true) {
-		LOG_INF("poll loop");
-		take_poll_sem();
-		LOG_INF("take poll sem");
-		onem2m_performPoll();
-		LOG_INF("done poll");
-		struct ae_event* a = new_ae_event();
-		a->cmd = AE_EVENT_POLL;
-		APP_EVENT_SUBMIT(a);
+static void poll_work_handler(struct k_work *work) {
+	if (poll_state == POLL_STOPPED) {
+		return;
+	}
+
+	int ret = onem2m_performPoll(power_profile_params(power_profile_current())->poll_timeout_ms);
+
+	// Polling may have been stopped while the request was in flight
+	if (poll_state == POLL_STOPPED) {
+		return;
+	}
+
+	if (ret < 0) {
+		LOG_WRN("Poll failed, retrying in %d ms", (int) poll_backoff_ms);
+		poll_state = POLL_BACKOFF;
+		k_work_reschedule_for_queue(&poll_workq, &poll_work, K_MSEC(poll_backoff_ms));
+		poll_backoff_ms = MIN(poll_backoff_ms * 2, POLL_BACKOFF_MAX_MS);
+		return;
 	}
+
+	// Timed out or got a notification, either way back to the PCH, straight away unless the power profile
+	// lets the modem sleep in between. The notification may just have changed the profile.
+	poll_state = POLL_RUNNING;
+	poll_backoff_ms = POLL_BACKOFF_MIN_MS;
+	uint32_t interval_ms = power_profile_params(power_profile_current())->poll_interval_ms;
+	k_work_reschedule_for_queue(&poll_workq, &poll_work, K_MSEC(interval_ms));
 }
 
-static bool app_event_handler(const struct app_event_header *aeh)
-{
-	if(is_ae_event(aeh)) {
-		const struct ae_event *event = cast_ae_event(aeh);
-		if (event->cmd == AE_EVENT_LIGHT_CMD) {
-			light1_state = event->new_light1_state;
-			light2_state = event->new_light2_state;
-			update_light_states();
+// The poll cadence follows the profile from the next poll on. The HTTP timeout has to cover the long poll
+// plus the time a response can wait in the network for the next paging occasion.
+static void apply_power_profile(enum power_profile profile) {
+	const struct power_profile_params* params = power_profile_params(profile);
+	uint32_t timeout_ms = params->poll_timeout_ms + params->paging_ms + HTTP_REQUEST_MARGIN_MS;
+	http_set_request_timeout(MAX(HTTP_REQUEST_TIMEOUT_MIN_MS, timeout_ms));
+	if (poll_state == POLL_RUNNING) {
+		// Cuts a standby wait short, a poll in flight is followed by another one
+		k_work_reschedule_for_queue(&poll_workq, &poll_work, K_NO_WAIT);
+	}
+}
+
+static void telemetry_work_handler(struct k_work *work) {
+	// Only this work item uses them, kept off the poll work queue's stack
+	static char tlm[LATENCY_TELEMETRY_LENGTH];
+	static char blq[STATUS_JOURNAL_VALUE_LENGTH];
+	static char pws[POWER_PROFILE_TELEMETRY_LENGTH];
+
+	// The profile is for the whole device, every intersection reports it
+	bool have_pws = power_profile_format(pws, sizeof(pws)) > 0;
+
+	for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+		// Nothing to report if no command was acknowledged since the last summary
+		if (latency_stats_format(i, tlm, sizeof(tlm)) > 0) {
+			status_journal_set(i, STATUS_ATTR_TLM, tlm);
 		}
-// <<<<<<< HEAD
-		//TODO:
-		//Temporarily commented out while testing AT parsing
-		else if (event->cmd == AE_EVENT_POLL) {
-			if (!poll_thread_started) {
-				poll_thread_started = true;
-				LOG_INF("STARTING POLLING THREAD");
-				k_thread_create(&polling_thread, poll_thread_stack,
-								K_THREAD_STACK_SIZEOF(poll_thread_stack),
-								do_poll,
-								NULL, NULL, NULL,
-								POLLING_CHANNEL_PRIORITY, 0, K_NO_WAIT);
+
+		// One entry per signal controller of the intersection that reported, separated by ';'
+		size_t len = 0;
+		for (uint8_t c = 0; c < BLE_CONTROLLER_COUNT; c++) {
+			size_t sep = (len > 0) ? 1 : 0;
+			if (ble_controllers[c].intersection != i || len + sep + 1 >= sizeof(blq)) {
+				continue;
 			}
-			else {
-				if(!test_mode_started){
-					LOG_INF("RESTART POLLING THREAD");
-					give_poll_sem();
+			size_t n = ble_quality_format(c, blq + len + sep, sizeof(blq) - len - sep);
+			if (n > 0 && sep) {
+				blq[len] = ';';
+			}
+			if (n > 0) {
+				len += sep + n;
+			}
+		}
+		if (len > 0) {
+			status_journal_set(i, STATUS_ATTR_BLQ, blq);
+		}
+		if (have_pws) {
+			status_journal_set(i, STATUS_ATTR_PWS, pws);
+		}
+	}
+	flush_status_journal();
+	k_work_reschedule_for_queue(&poll_workq, &telemetry_work, K_MSEC(TELEMETRY_INTERVAL_MS));
+}
 
-				}
-				else{
-					LOG_INF("POLLING THREAD STOPPED");
+void start_polling() {
+	if (poll_state != POLL_STOPPED) {
+		return;
+	}
+	LOG_INF("Start polling");
+	poll_state = POLL_RUNNING;
+	poll_backoff_ms = POLL_BACKOFF_MIN_MS;
+	k_work_reschedule_for_queue(&poll_workq, &poll_work, K_NO_WAIT);
+}
+
+void stop_polling() {
+	if (poll_state == POLL_STOPPED) {
+		return;
+	}
+	LOG_INF("Stop polling");
+	poll_state = POLL_STOPPED;
+	// A poll that is already in flight finishes, but is not rescheduled
+	k_work_cancel_delayable(&poll_work);
+}
+
+static void handle_ae_request(const struct ae_request* req) {
+	if (req->cmd == AE_EVENT_REGISTER) {
+		register_ae();
+		registered = true;
+		if (req->do_init_sequence) {
+			// Trigger the AE_EVENT_CREATE_DATA_MODEL EVENT
+			struct ae_event* a = new_ae_event();
+			a->cmd = AE_EVENT_CREATE_DATA_MODEL;
+			a->do_init_sequence = true;
+			APP_EVENT_SUBMIT(a);
+		}
+	}
+	else if (req->cmd == AE_EVENT_CREATE_DATA_MODEL) {
+		create_data_model();
+		data_model_created = true;
+		if (req->do_init_sequence) {
+			// Also replays whatever was journaled while we were offline
+			LOG_INF("Replaying %d journaled status updates", (int) status_journal_pending());
+			push_flex_container();
+			// Trigger the AE_EVENT_POLL EVENT
+			struct ae_event* a = new_ae_event();
+			a->cmd = AE_EVENT_POLL;
+			APP_EVENT_SUBMIT(a);
+		}
+	}
+	else if(req->cmd == AE_EVENT_DEREGISTER){
+		if (registered && data_model_created){
+			timing_plan_stop_all();
+			delete_data_model();
+			data_model_created = false;
+			deletePCH();
+			deleteAE();
+			deleteACP();
+			registered = false;
+
+			if (req->reset){
+				register_ae();
+				registered = true;
+				create_data_model();
+				data_model_created = true;
+				for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+					retrieveFlexContainer(i);
 				}
 			}
 		}
-		else if (event->cmd == AE_EVENT_REGISTER) {
+		else{
+			LOG_INF("TRIED DEREGISTERING WHEN NOT REGISTERED OR DATA MODEL NOT CREATED");
+		}
+	}
+	else if(req->cmd == AE_EVENT_TEST_REGISTER){
+		if (!registered){
 			register_ae();
 			registered = true;
-			if (event->do_init_sequence) {
-				// Trigger the AE_EVENT_CREATE_DATA_MODEL EVENT
-				struct ae_event* a = new_ae_event();
-				a->cmd = AE_EVENT_CREATE_DATA_MODEL;
-				a->do_init_sequence = true;
-				APP_EVENT_SUBMIT(a);
-			}
+		}
+		else{
+			LOG_INF("TRIED TO REGISTER WHEN ITS ALREADY CREATED");
+		}
 	}
-		else if (event->cmd == AE_EVENT_CREATE_DATA_MODEL) {
+	else if(req->cmd == AE_EVENT_TEST_CREATE_DATA){
+		if (registered && !data_model_created){
 			create_data_model();
 			data_model_created = true;
-			if (event->do_init_sequence) {
-				push_flex_container();
-				// Trigger the AE_EVENT_POLL EVENT
-				struct ae_event* a = new_ae_event();
-				a->cmd = AE_EVENT_POLL;
-				APP_EVENT_SUBMIT(a);
-			}
 		}
+		else if(!registered && !data_model_created){
+			LOG_INF("TRIED TO CREATE DATA MODEL WITHOUT REGISTERING");
+		}
+		else{
+			LOG_INF("TRIED TO CREATE DATA MODEL WHEN ITS ALREADY CREATED");
+		}
+	}
+	else if(req->cmd == AE_EVENT_TEST_RETRIEVE){
+		for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+			retrieveFlexContainer(i);
+		}
+	}
+}
+
+static void ae_request_work_handler(struct k_work *work) {
+	struct ae_request req;
+	while (k_msgq_get(&ae_request_msgq, &req, K_NO_WAIT) == 0) {
+		handle_ae_request(&req);
+	}
+}
+
+static void queue_ae_request(const struct ae_event* event) {
+	struct ae_request req = {
+		.cmd = event->cmd,
+		.do_init_sequence = event->do_init_sequence,
+		.reset = event->reset,
+	};
+	if (k_msgq_put(&ae_request_msgq, &req, K_NO_WAIT) != 0) {
+		LOG_ERR("AE request queue full, dropping request %d", (int) req.cmd);
+		return;
+	}
+	k_work_submit_to_queue(&poll_workq, &ae_request_work);
+}
 
+static bool app_event_handler(const struct app_event_header *aeh)
+{
+	if(is_ae_event(aeh)) {
+		const struct ae_event *event = cast_ae_event(aeh);
+		if (event->cmd == AE_EVENT_LIGHT_CMD) {
+			if (event->intersection >= INTERSECTION_COUNT) {
+				LOG_ERR("Light command for unknown intersection %d", event->intersection);
+				return false;
+			}
+			for (size_t i = 0; i < LIGHTS_PER_INTERSECTION; i++) {
+				// Lights that were not part of the update keep their state
+				if (event->new_light_states[i] != AE_LIGHT_STATE_NONE) {
+					light_states[event->intersection][i] = event->new_light_states[i];
+				}
+			}
+			send_light_frame(event->intersection, event->received_time);
+		}
+		else if (event->cmd == AE_EVENT_POLL) {
+			if (!test_mode_started) {
+				start_polling();
+			}
+			else {
+				LOG_INF("Test mode active, not polling");
+			}
+		}
 		//test to AT commands
 		else if(event->cmd == AE_EVENT_TEST_MODE){
 			if(!test_mode_started){
-				//change variable so the semphore cannot be taken by the loop
 				test_mode_started = true;
+				stop_polling();
 			}
 			else{
 				test_mode_started = false;
-				//retrigger polling event to give up semaphore
+				//retrigger polling event to resume polling
 				struct ae_event* a = new_ae_event();
 				a->cmd = AE_EVENT_POLL;
 				APP_EVENT_SUBMIT(a);
 			}
 		}
-		else if(event->cmd == AE_EVENT_DEREGISTER){
-			if (registered && data_model_created){
-				deleteSUB();
-				deleteFLEX();
-				data_model_created = false;
-				deletePCH();
-				deleteAE();
-				deleteACP();
-				registered = false;
-
-				if (event->reset){
-					register_ae();
-					registered = true;
-					create_data_model();
-					data_model_created = true;
-					retrieveFlexContainer();
-				}
-			}
-			else{
-				LOG_INF("TRIED DEREGISTERING WHEN NOT REGISTERED OR DATA MODEL NOT CREATED");
-			}
-		}
-		else if(event->cmd == AE_EVENT_TEST_REGISTER){
-			if (!registered){
-				register_ae();
-				registered = true;
-			}
-			else{
-				LOG_INF("TRIED TO REGISTER WHEN ITS ALREADY CREATED");
-			}
-		}
-		else if(event->cmd == AE_EVENT_TEST_CREATE_DATA){
-			if (registered && !data_model_created){
-				create_data_model();
-				data_model_created = true;
-			}
-			else if(!registered && !data_model_created){
-				LOG_INF("TRIED TO CREATE DATA MODEL WITHOUT REGISTERING");
-			}
-			else{
-				LOG_INF("TRIED TO CREATE DATA MODEL WHEN ITS ALREADY CREATED");
-			}
+		else {
+			// Everything else talks to the CSE
+			queue_ae_request(event);
 		}
 		
 		return false;
@@ -296,7 +608,7 @@ static bool app_event_handler(const struct app_event_header *aeh)
 			a->do_init_sequence = true;
 			APP_EVENT_SUBMIT(a);
 			
-			if (ble_connected) {
+			if (all_controllers_connected()) {
 				set_green_led();
 			}
 			else{
@@ -306,43 +618,58 @@ static bool app_event_handler(const struct app_event_header *aeh)
 		else if (event->conn_state == LTE_DISCONNECTED) {
 			lte_connected = false;
 			LOG_INF("Got LTE_DISCONNECTED");
+			stop_polling();
 			set_red_led();
-			// If we are paired with a traffic light, set it to RED until we re-establish our connection
-			light1_state = AE_LIGHT_RED;
-			light2_state = AE_LIGHT_RED;
-			if (ble_connected) {
-				update_light_states();
-			}
+			// Set the traffic lights we are paired with to RED until we re-establish our connection,
+			// unless a timing plan is driving them
+			set_all_lights_red();
+			update_all_light_states();
         }
 		return false;
 	}
 
 	if (is_ble_event(aeh)) {
 		const struct ble_event *event = cast_ble_event(aeh);
+		if ((event->cmd == BLE_CONNECTED || event->cmd == BLE_DISCONNECTED || event->cmd == BLE_LIGHT_STATE)
+			&& event->target >= BLE_CONTROLLER_COUNT) {
+			LOG_ERR("BLE event for unknown controller %d", event->target);
+			return false;
+		}
 		if (event->cmd == BLE_CONNECTED) {
-			LOG_INF("Got BLUETOOTH CONNECTED");
-			ble_connected = true;
+			const struct ble_controller* c = &ble_controllers[event->target];
+			LOG_INF("Got BLUETOOTH CONNECTED %s", c->name);
+			ble_connected[event->target] = true;
+			invalidate_controller_light_states(event->target);
 			if (lte_connected) {
-				set_green_led();
-				update_light_states();
-				push_flex_container();
+				if (all_controllers_connected()) {
+					set_green_led();
+				}
 			}
 			else {
-				light1_state = AE_LIGHT_RED;
-				light2_state = AE_LIGHT_RED;
-				update_light_states();
+				set_all_lights_red();
 				LOG_INF("Got BLUETOOTH CONNECTED BEFORE LTE");
 			}
-			send_command("!stop_scan;");
+			send_controller_frame(event->target, 0, NULL);
+			push_intersection(c->intersection);
         }
 		else if (event->cmd == BLE_DISCONNECTED) {
-			ble_connected = false;
+			const struct ble_controller* c = &ble_controllers[event->target];
+			LOG_INF("Got BLUETOOTH DISCONNECTED %s", c->name);
+			ble_connected[event->target] = false;
+			invalidate_controller_light_states(event->target);
 			if (lte_connected) {
 				set_blue_led();
-				push_flex_container();
 			}
-			send_command("!start_scan" BLE_TARGET ";");
+			push_intersection(c->intersection);
+			// The nRF52840 scans for it again by itself, this covers an nRF52840 that restarted
+			nrf52840_link_start_scan(event->target, c->name);
         }
+		else if (event->cmd == BLE_LIGHT_STATE) {
+			// Reported as it changes, so the cloud sees the lamps rather than the commands
+			if (confirm_controller_light_states(event->target, event->light_states, event->light_count)) {
+				push_intersection(ble_controllers[event->target].intersection);
+			}
+		}
 		else if (event->cmd == BLE_SCAN_STARTED) {
 			ble_scanning = true;
         }
@@ -352,6 +679,12 @@ static bool app_event_handler(const struct app_event_header *aeh)
 		return false;
 	}
 
+	if (is_power_profile_event(aeh)) {
+		const struct power_profile_event *event = cast_power_profile_event(aeh);
+		apply_power_profile(event->profile);
+		return false;
+	}
+
 	if (is_module_state_event(aeh)) {
 		const struct module_state_event *event =
 			cast_module_state_event(aeh);
@@ -359,12 +692,30 @@ static bool app_event_handler(const struct app_event_header *aeh)
 		if (check_state(event, MODULE_ID(main), MODULE_STATE_READY)) {
 			ble_scanning = false;
 			lte_connected = false;
-			poll_thread_started = false;
 			test_mode_started = false;
 			registered = false; 
 			data_model_created = false;
-			k_sem_init(&polling_sem, 1, 1);
-			send_command("!start_scan" BLE_TARGET ";");
+			set_all_lights_red();
+			invalidate_sent_light_states();
+			k_work_queue_start(&poll_workq, poll_workq_stack,
+							   K_THREAD_STACK_SIZEOF(poll_workq_stack),
+							   POLL_WORKQ_PRIORITY, NULL);
+			k_thread_name_set(&poll_workq.thread, "poll_workq");
+			k_work_init_delayable(&poll_work, poll_work_handler);
+			poll_state = POLL_STOPPED;
+			latency_stats_init();
+			ble_quality_init();
+			power_profile_init();
+			apply_power_profile(power_profile_current());
+			status_journal_init();
+			k_work_init_delayable(&telemetry_work, telemetry_work_handler);
+			k_work_init(&status_work, status_work_handler);
+			k_work_init(&ae_request_work, ae_request_work_handler);
+			k_work_reschedule_for_queue(&poll_workq, &telemetry_work, K_MSEC(TELEMETRY_INTERVAL_MS));
+			for (uint8_t i = 0; i < BLE_CONTROLLER_COUNT; i++) {
+				ble_connected[i] = false;
+				nrf52840_link_start_scan(i, ble_controllers[i].name);
+			}
 			set_red_led();
 			init_oneM2M();
 		}
@@ -380,4 +731,5 @@ APP_EVENT_LISTENER(MODULE, app_event_handler);
 APP_EVENT_SUBSCRIBE(MODULE, module_state_event);
 APP_EVENT_SUBSCRIBE(MODULE, ble_event);
 APP_EVENT_SUBSCRIBE(MODULE, lte_event);
-APP_EVENT_SUBSCRIBE(MODULE, ae_event);
\ No newline at end of file
+APP_EVENT_SUBSCRIBE(MODULE, ae_event);
+APP_EVENT_SUBSCRIBE(MODULE, power_profile_event);
\ No newline at end of file
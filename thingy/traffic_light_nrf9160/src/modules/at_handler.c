@@ -5,169 +5,259 @@
  */
 
 #include <zephyr/types.h>
+#include <stdio.h>
 #include <zephyr/sys/ring_buffer.h>
 #include <zephyr/drivers/uart.h>
 #include <zephyr/pm/device.h>
 
 #define MODULE at_handler
 #include <caf/events/module_state_event.h>
-#include "events/uart_data_event.h"
 #include "events/ae_event.h"
 #include "onem2m.h"
+#include "deployment_settings.h"
+#include "mem_monitor.h"
+#include "cmd_lexer.h"
+#include "uart_rx.h"
+#include "uart_tx.h"
+#include "nrf52840_link.h"
+#include "link_bench.h"
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(MODULE);
 
 #define AT_PARSE_BUFFER_SIZE 256
+// Enough trie nodes for every character of every command name below
+#define AT_LEXER_NODES 128
+// Commands run on this thread, the ones that talk to the CSE hand that to the AE module
+#define AT_THREAD_STACK_SIZE 4096
+#define AT_THREAD_PRIORITY 7
+#define AT_REPORT_LINE_SIZE 96
+#define AT_REPORT_TX_TIMEOUT_MS 100
 bool in_test_mode = false;
-char at_parse_buf[AT_PARSE_BUFFER_SIZE];
-bool at_started = false;
-bool at_ended = false;
-size_t parse_buf_idx = 0; // the location in the cmd_parse_buff that we are writing to
 
-void parse_at_command(char c) {
+static bool require_test_mode() {
+	if (!in_test_mode) {
+		LOG_INF("Not In Test Mode!");
+	}
+	return in_test_mode;
+}
 
-	//Message has been started, but we are not at the end
-	if (at_started && c != ';') {
-		
-		//Then add to our current mesasge
-		at_parse_buf[parse_buf_idx] = c;
-		parse_buf_idx++;
-	
-	//Start of a message
-	} else if (!at_started && c == '!') {
-
-		//Set index to 0, reset any junk that might be in our buffer.
-		parse_buf_idx = 0;
-		memset(at_parse_buf, 0, AT_PARSE_BUFFER_SIZE);
-		at_started = true;
-	
-	//End of a message
-	} else if (at_started && c == ';') {
-
-		//Then print what the message was
-		if (strncmp(at_parse_buf, "reset", AT_PARSE_BUFFER_SIZE) == 0) {
-			LOG_INF("Got reset command!");
-			if (in_test_mode){
-				struct ae_event* a = new_ae_event();
-				a->cmd = AE_EVENT_DEREGISTER;
-				a->reset = true;
-				APP_EVENT_SUBMIT(a);
-
-			}
-			else{
-				LOG_INF("Not In Test Mode!");
-			}
-		
-		} else if (strncmp(at_parse_buf, "register", AT_PARSE_BUFFER_SIZE) == 0) {
-			LOG_INF("Got register command!");
-			if (in_test_mode){
-				struct ae_event* a = new_ae_event();
-				a->cmd = AE_EVENT_TEST_REGISTER;
-				APP_EVENT_SUBMIT(a);
-			}
-			else{
-				LOG_INF("Not In Test Mode!");
-			}
-		
-		} else if (strncmp(at_parse_buf, "createDataModel", AT_PARSE_BUFFER_SIZE) == 0) {
-			LOG_INF("Got create data model command!");
-			if (in_test_mode){
-				struct ae_event* a = new_ae_event();
-				a->cmd = AE_EVENT_TEST_CREATE_DATA;
-				APP_EVENT_SUBMIT(a);
-			}
-			else{
-				LOG_INF("Not In Test Mode!");
-			}
-		
-		} else if (strncmp(at_parse_buf, "retrieveNotifications", AT_PARSE_BUFFER_SIZE) == 0) {
-			LOG_INF("Got retrieve notifications command!");
-			if (in_test_mode){
-				retrieveFlexContainer();
-			}
-			else{
-				LOG_INF("Not In Test Mode!");
-			}
-
-		} else if (strncmp(at_parse_buf, "updateDataModel", AT_PARSE_BUFFER_SIZE) == 0) {
-			LOG_INF("Got update data model command!");
-			if (in_test_mode){
-				push_flex_container();
-			}
-			else{
-				LOG_INF("Not In Test Mode!");
-			}
-		
-		} else if (strncmp(at_parse_buf, "deregister", AT_PARSE_BUFFER_SIZE) == 0) {
-			LOG_INF("Got deregister command!");
-			if (in_test_mode){
-				struct ae_event* a = new_ae_event();
-				a->cmd = AE_EVENT_DEREGISTER;
-				a->reset = false;
-				APP_EVENT_SUBMIT(a);
-			}
-			else{
-				LOG_INF("Not In Test Mode!");
-			}
-
-		} else if (strncmp(at_parse_buf, "testBegin", AT_PARSE_BUFFER_SIZE) == 0){
-			LOG_INF("Got Begin Test Command command!");
-			if (!in_test_mode){
-				//trigger begining of the test;
-				in_test_mode = true;
-				struct ae_event* a = new_ae_event();
-				a->cmd = AE_EVENT_TEST_MODE;
-				APP_EVENT_SUBMIT(a);
-			}
-			else{
-				LOG_INF("Already In Test Mode!");
-			}
-
-		} else if (strncmp(at_parse_buf, "testEnd", AT_PARSE_BUFFER_SIZE) == 0){
-			LOG_INF("Got Begin End Command command!");
-			if (in_test_mode){
-				//trigger end of the test;
-				in_test_mode = false;
-				struct ae_event* a = new_ae_event();
-				a->cmd = AE_EVENT_TEST_MODE;
-				APP_EVENT_SUBMIT(a);
-			}
-			else{
-				LOG_INF("Not In Test Mode!");
-			}
-
-		} else {
-			LOG_ERR("Failed to parse message from UART 0! %s", at_parse_buf);
-		}
+// "reset" and "deregister", value says whether to reset afterwards
+static int at_deregister(const struct cmd_lexer_cmd* cmd, const char* args) {
+	LOG_INF("Got %s command!", cmd->name);
+	if (require_test_mode()) {
+		struct ae_event* a = new_ae_event();
+		a->cmd = AE_EVENT_DEREGISTER;
+		a->reset = cmd->value;
+		APP_EVENT_SUBMIT(a);
+	}
+	return 0;
+}
 
-		at_started = false;
+static int at_register(const struct cmd_lexer_cmd* cmd, const char* args) {
+	LOG_INF("Got register command!");
+	if (require_test_mode()) {
+		struct ae_event* a = new_ae_event();
+		a->cmd = AE_EVENT_TEST_REGISTER;
+		APP_EVENT_SUBMIT(a);
 	}
+	return 0;
+}
 
-	if (parse_buf_idx >= AT_PARSE_BUFFER_SIZE) {
-		LOG_WRN("nRF52840 parse buf overrun!");
-		at_started = false;
+static int at_create_data_model(const struct cmd_lexer_cmd* cmd, const char* args) {
+	LOG_INF("Got create data model command!");
+	if (require_test_mode()) {
+		struct ae_event* a = new_ae_event();
+		a->cmd = AE_EVENT_TEST_CREATE_DATA;
+		APP_EVENT_SUBMIT(a);
 	}
+	return 0;
 }
 
+static int at_retrieve_notifications(const struct cmd_lexer_cmd* cmd, const char* args) {
+	LOG_INF("Got retrieve notifications command!");
+	if (require_test_mode()) {
+		// The AE module makes the requests, this thread does not wait for a long poll to end
+		struct ae_event* a = new_ae_event();
+		a->cmd = AE_EVENT_TEST_RETRIEVE;
+		APP_EVENT_SUBMIT(a);
+	}
+	return 0;
+}
 
-static bool app_event_handler(const struct app_event_header *aeh)
-{
-	if (is_uart_data_event(aeh)) {
-		const struct uart_data_event *event =
-			cast_uart_data_event(aeh);
-		if (event->dev_idx == 0) {
-
-			//This is coming from the upper tester
-			//we will build a string byte by byte
-            for (size_t i = 0; i < event->len; i++) {
-				parse_at_command(event->buf[i]);
-			}
-        }
+static int at_update_data_model(const struct cmd_lexer_cmd* cmd, const char* args) {
+	LOG_INF("Got update data model command!");
+	if (require_test_mode()) {
+		push_flex_container();
+	}
+	return 0;
+}
 
-		return false;
+static int at_mem_stats(const struct cmd_lexer_cmd* cmd, const char* args) {
+	LOG_INF("Got memory stats command!");
+	// Read only, so this does not need test mode
+	int over_count = mem_monitor_report();
+	if (over_count > 0) {
+		LOG_WRN("%d memory budgets exceeded", over_count);
 	}
+	return 0;
+}
 
+static void send_report_line(const char* line, int len) {
+	// Device index of 0 is the upper tester
+	uart_tx_send(0, (const uint8_t*) line, MIN(len, AT_REPORT_LINE_SIZE - 1), K_MSEC(AT_REPORT_TX_TIMEOUT_MS));
+}
+
+// Sends "!uart:<dev>,tx,<bytes>,<frames>,<drops>,<ring peak>,<ring size>,<TX_DONE avg us>,<TX_DONE max us>;"
+// and "!uart:<dev>,rx,<chunks>,<dropped>,<overruns>,<queue peak>,<RX timeout us>,<line errors>;" for every UART,
+// then "!uart:link,<baud rate, 0 for the default>,<negotiations>,<fallbacks>,<retransmits>,<lost>,<CRC errors>;"
+static int at_uart_stats(const struct cmd_lexer_cmd* cmd, const char* args) {
+	LOG_INF("Got UART stats command!");
+	char line[AT_REPORT_LINE_SIZE];
+	int len;
+
+	for (uint8_t dev_idx = 0; dev_idx < 2; dev_idx++) {
+		struct uart_tx_stats tx;
+		struct uart_rx_stats rx;
+		uart_tx_stats_get(dev_idx, &tx);
+		uart_rx_stats_get(dev_idx, &rx);
+
+		len = snprintf(line, sizeof(line), "!uart:%d,tx,%u,%u,%u,%u,%u,%u,%u;\r\n", dev_idx,
+					   tx.bytes, tx.frames, tx.drops, tx.ring_high_water, tx.ring_size,
+					   tx.done_latency_avg_us, tx.done_latency_max_us);
+		send_report_line(line, len);
+		len = snprintf(line, sizeof(line), "!uart:%d,rx,%u,%u,%u,%u,%u,%u;\r\n", dev_idx,
+					   rx.chunks, rx.dropped, rx.overruns, rx.queue_high_water, rx.rx_timeout_us, rx.line_errors);
+		send_report_line(line, len);
+	}
+
+	struct chip_link_stats link;
+	nrf52840_link_stats_get(&link);
+	len = snprintf(line, sizeof(line), "!uart:link,%u,%u,%u,%u,%u,%u;\r\n", link.baudrate,
+				   link.baud_negotiations, link.baud_fallbacks, link.tx_retransmits, link.tx_lost, link.rx_crc_errors);
+	send_report_line(line, len);
+	len = snprintf(line, sizeof(line), "!uart:done;\r\n");
+	send_report_line(line, len);
+	return 0;
+}
+
+// "!bench:<sent>,<echoed>,<lost>,<reordered>,<skipped>,<bytes/s each way>,<p50 us>,<p90 us>,<p99 us>,<max us>[,done];"
+static void bench_report(const struct link_bench_report* report, bool final) {
+	char line[AT_REPORT_LINE_SIZE];
+	int len = snprintf(line, sizeof(line), "!bench:%u,%u,%u,%u,%u,%u,%u,%u,%u,%u%s;\r\n",
+					   report->sent, report->echoed, report->lost, report->reordered, report->skipped,
+					   report->bytes_per_sec, report->rtt_p50_us, report->rtt_p90_us, report->rtt_p99_us,
+					   report->rtt_max_us, final ? ",done" : "");
+	send_report_line(line, len);
+}
+
+// "bench<frame size>,<interval ms>,<frames>", 0 frames runs a soak test until "benchStop"
+static int at_bench(const struct cmd_lexer_cmd* cmd, const char* args) {
+	unsigned int size;
+	unsigned int interval_ms;
+	unsigned int count;
+
+	LOG_INF("Got link benchmark command!");
+	if (sscanf(args, "%u,%u,%u", &size, &interval_ms, &count) != 3) {
+		return -EINVAL;
+	}
+	if (require_test_mode()) {
+		return link_bench_start(size, interval_ms, count, bench_report);
+	}
+	return 0;
+}
+
+static int at_bench_stop(const struct cmd_lexer_cmd* cmd, const char* args) {
+	LOG_INF("Got link benchmark stop command!");
+	link_bench_stop();
+	return 0;
+}
+
+static int at_test_begin(const struct cmd_lexer_cmd* cmd, const char* args) {
+	LOG_INF("Got Begin Test Command command!");
+	if (!in_test_mode){
+		//trigger begining of the test;
+		in_test_mode = true;
+		struct ae_event* a = new_ae_event();
+		a->cmd = AE_EVENT_TEST_MODE;
+		APP_EVENT_SUBMIT(a);
+	}
+	else{
+		LOG_INF("Already In Test Mode!");
+	}
+	return 0;
+}
+
+static int at_test_end(const struct cmd_lexer_cmd* cmd, const char* args) {
+	LOG_INF("Got Begin End Command command!");
+	if (require_test_mode()) {
+		//trigger end of the test;
+		in_test_mode = false;
+		struct ae_event* a = new_ae_event();
+		a->cmd = AE_EVENT_TEST_MODE;
+		APP_EVENT_SUBMIT(a);
+	}
+	return 0;
+}
+
+static const struct cmd_lexer_cmd at_commands[] = {
+	{ "reset", false, at_deregister, true },
+	{ "register", false, at_register, 0 },
+	{ "createDataModel", false, at_create_data_model, 0 },
+	{ "retrieveNotifications", false, at_retrieve_notifications, 0 },
+	{ "updateDataModel", false, at_update_data_model, 0 },
+	{ "deregister", false, at_deregister, false },
+	{ "memStats", false, at_mem_stats, 0 },
+	{ "uartStats", false, at_uart_stats, 0 },
+	{ "bench", true, at_bench, 0 },
+	{ "benchStop", false, at_bench_stop, 0 },
+	{ "testBegin", false, at_test_begin, 0 },
+	{ "testEnd", false, at_test_end, 0 },
+};
+
+CMD_LEXER_DEFINE(at_lexer, at_commands, AT_PARSE_BUFFER_SIZE, AT_LEXER_NODES);
+
+void parse_at_command(char c) {
+	switch (cmd_lexer_feed(&at_lexer, c)) {
+		case CMD_LEXER_UNKNOWN:
+		case CMD_LEXER_BAD_ARGS:
+			LOG_ERR("Failed to parse message from UART 0! %s", at_lexer.buf);
+		break;
+		case CMD_LEXER_OVERFLOW:
+			LOG_WRN("UART 0 parse buf overrun!");
+		break;
+		default:
+		break;
+	}
+}
+
+
+// Drains UART0, which is coming from the upper tester, so slow commands never hold up the event manager
+static void at_thread_fn(void) {
+	struct uart_rx_chunk chunk;
+
+	int err = cmd_lexer_init(&at_lexer);
+	if (err) {
+		LOG_ERR("Failed to build the command table (err %d), looking commands up one by one", err);
+	}
+
+	while (true) {
+		if (uart_rx_get(0, &chunk, K_FOREVER) != 0) {
+			continue;
+		}
+		//we will build a string byte by byte
+		for (size_t i = 0; i < chunk.len; i++) {
+			parse_at_command(chunk.buf[i]);
+		}
+		uart_rx_release(&chunk);
+	}
+}
+
+K_THREAD_DEFINE(at_thread, AT_THREAD_STACK_SIZE, at_thread_fn, NULL, NULL, NULL,
+		AT_THREAD_PRIORITY, 0, 0);
+
+static bool app_event_handler(const struct app_event_header *aeh)
+{
 	if (is_module_state_event(aeh)) {
 		const struct module_state_event *event =
 			cast_module_state_event(aeh);
@@ -188,4 +278,3 @@ static bool app_event_handler(const struct app_event_header *aeh)
 }
 APP_EVENT_LISTENER(MODULE, app_event_handler);
 APP_EVENT_SUBSCRIBE(MODULE, module_state_event);
-APP_EVENT_SUBSCRIBE(MODULE, uart_data_event);
\ No newline at end of file
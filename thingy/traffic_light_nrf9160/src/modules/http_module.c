@@ -8,6 +8,7 @@
 
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <net/socket.h>
 #include <net/net_ip.h>
@@ -35,8 +36,8 @@ struct k_sem http_request_sem;
 // String representation of the resolved IP address
 static char resolved_ip_addr[INET6_ADDRSTRLEN];
 
-// HTTP timeout is 3 seconds
-static int32_t HTTP_REQUEST_TIMEOUT = 12 * MSEC_PER_SEC;
+// HTTP timeout is 12 seconds unless the power profile needs longer, see http_set_request_timeout()
+static int32_t http_request_timeout = 12 * MSEC_PER_SEC;
 
 // Buffer that we store the HTTP response in. Make sure you have the http_request_sem before accessing this.
 static char http_rx_buf[HTTP_RX_BUF_SIZE];
@@ -50,6 +51,11 @@ static size_t http_content_length = 0;
 // HTTP Response status code
 static uint16_t http_response_code = 0;
 
+// Request identifier (X-M2M-RI) that the CSE echoed back in the response headers
+#define HTTP_RX_RQI_SIZE 50
+static char http_rx_rqi[HTTP_RX_RQI_SIZE];
+static bool rqi_header_found = false;
+
 static int http_socket = -1;
 static bool host_resolved = false;
 
@@ -84,6 +90,14 @@ size_t get_http_rx_content_length() {
 	return http_content_length;
 }
 
+char* get_http_rx_rqi() {
+	return http_rx_rqi;
+}
+
+void http_set_request_timeout(int32_t timeout_ms) {
+	http_request_timeout = timeout_ms;
+}
+
 void take_http_sem() {
 	k_sem_take(&http_request_sem, K_FOREVER);
 }
@@ -124,12 +138,42 @@ static void response_cb(struct http_response *rsp,
 	LOG_INF("Response status %s", rsp->http_status);
 }
 
+/* The http_client calls these for every response header, after it has done its own parsing */
+static int on_header_field(struct http_parser *parser, const char *at, size_t length)
+{
+	ARG_UNUSED(parser);
+	rqi_header_found = (length == strlen("X-M2M-RI") && strncasecmp(at, "X-M2M-RI", length) == 0);
+	return 0;
+}
+
+static int on_header_value(struct http_parser *parser, const char *at, size_t length)
+{
+	ARG_UNUSED(parser);
+	if (rqi_header_found) {
+		size_t copy_len = MIN(length, HTTP_RX_RQI_SIZE - 1);
+		memcpy(http_rx_rqi, at, copy_len);
+		http_rx_rqi[copy_len] = '\0';
+		rqi_header_found = false;
+	}
+	return 0;
+}
+
+static const struct http_parser_settings http_header_cb = {
+	.on_header_field = on_header_field,
+	.on_header_value = on_header_value
+};
+
 static int perform_http_request(struct http_request* req) {
 	int retry_count = 0;
 	int response = 0;
 	bool ok = false;
 	bool http_connected = false;
 
+	// Forget the RI from the last response, and get told about the headers of this one
+	memset(http_rx_rqi, 0, HTTP_RX_RQI_SIZE);
+	rqi_header_found = false;
+	req->http_cb = &http_header_cb;
+
 	if(!host_resolved) {
 		resolve_target_host();
 		host_resolved = true;
@@ -153,7 +197,7 @@ static int perform_http_request(struct http_request* req) {
 	if (http_connected) {
 		retry_count = 0;
 		while (retry_count < 3) {
-			response = http_client_req(http_socket, req, HTTP_REQUEST_TIMEOUT, NULL);
+			response = http_client_req(http_socket, req, http_request_timeout, NULL);
 			
 			if (response < 0) {
 				LOG_ERR("http_client_req returned %d !", response);
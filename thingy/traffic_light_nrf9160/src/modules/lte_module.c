@@ -19,6 +19,8 @@
 #include <caf/events/module_state_event.h>
 #include "events/modem_module_event.h"
 #include "events/lte_event.h"
+#include "events/power_profile_event.h"
+#include "power_profile.h"
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(MODULE);
@@ -29,6 +31,7 @@ BUILD_ASSERT(!IS_ENABLED(CONFIG_LTE_AUTO_INIT_AND_CONNECT),
 struct modem_msg_data {
 	union {
 		struct modem_module_event modem;
+		struct power_profile_event power;
 	} module;
 };
 
@@ -84,6 +87,7 @@ static void send_edrx_update(float edrx, float ptw);
 static inline int adjust_rsrp(int input, enum sample_type type);
 static inline int adjust_rsrq(int input);
 static int lte_connect(void);
+static int configure_low_power(enum power_profile profile);
 
 /* Convenience functions used in internal state handling. */
 static char *state2str(enum state_type state)
@@ -142,6 +146,13 @@ static bool app_event_handler(const struct app_event_header *aeh)
 		enqueue_msg = true;
 	}
 
+	if (is_power_profile_event(aeh)) {
+		struct power_profile_event *evt = cast_power_profile_event(aeh);
+
+		msg.module.power = *evt;
+		enqueue_msg = true;
+	}
+
 	if (is_module_state_event(aeh)) {
 		const struct module_state_event *event =
 			cast_module_state_event(aeh);
@@ -189,6 +200,12 @@ static void lte_evt_handler(const struct lte_lc_evt *const evt)
 		LOG_DBG("PSM parameter update: TAU: %d, Active time: %d",
 			evt->psm_cfg.tau, evt->psm_cfg.active_time);
 		send_psm_update(evt->psm_cfg.tau, evt->psm_cfg.active_time);
+
+		/* The network decides, it may grant other timers than requested or none. */
+		if ((power_profile_params(power_profile_current())->psm_tau != NULL) &&
+		    (evt->psm_cfg.active_time < 0)) {
+			LOG_WRN("PSM requested but not granted by the network");
+		}
 		break;
 	case LTE_LC_EVT_EDRX_UPDATE: {
 		char log_buf[60];
@@ -202,12 +219,25 @@ static void lte_evt_handler(const struct lte_lc_evt *const evt)
 		}
 
 		send_edrx_update(evt->edrx_cfg.edrx, evt->edrx_cfg.ptw);
+
+		/* A longer cycle than requested breaks the latency the profile promises. */
+		const struct power_profile_params *profile =
+			power_profile_params(power_profile_current());
+
+		if ((evt->edrx_cfg.mode != LTE_LC_LTE_MODE_NONE) &&
+		    (evt->edrx_cfg.edrx * MSEC_PER_SEC > profile->latency_budget_ms)) {
+			LOG_WRN("Network granted a %d ms eDRX cycle, over the %d ms of the %s profile",
+				(int)(evt->edrx_cfg.edrx * MSEC_PER_SEC),
+				(int)profile->latency_budget_ms, profile->name);
+		}
 		break;
 	}
 	case LTE_LC_EVT_RRC_UPDATE:
 		LOG_DBG("RRC mode: %s",
 			evt->rrc_mode == LTE_LC_RRC_MODE_CONNECTED ?
 			"Connected" : "Idle");
+		/* Radio on time of the power profile, the paging occasions while idle are not counted. */
+		power_profile_rrc_update(evt->rrc_mode == LTE_LC_RRC_MODE_CONNECTED);
 		break;
 	case LTE_LC_EVT_CELL_UPDATE:
 		LOG_DBG("LTE cell changed: Cell ID: %d, Tracking area: %d",
@@ -405,17 +435,52 @@ static void send_neighbor_cell_update(struct lte_lc_cells_info *cell_info)
 	APP_EVENT_SUBMIT(evt);
 }
 
-static int configure_low_power(void)
+/* Requests the eDRX cycle and PSM timers of a power profile, they take effect once the
+ * network grants them, see LTE_LC_EVT_EDRX_UPDATE and LTE_LC_EVT_PSM_UPDATE.
+ */
+static int configure_low_power(enum power_profile profile)
 {
+	const struct power_profile_params *params = power_profile_params(profile);
 	int err;
-	LOG_INF("configure_low_power");
-	err = lte_lc_psm_req(false);
+
+	LOG_INF("configure_low_power: %s", params->name);
+
+	if (params->edrx != NULL) {
+		err = lte_lc_edrx_param_set(LTE_LC_LTE_MODE_LTEM, params->edrx);
+		if (err) {
+			LOG_ERR("lte_lc_edrx_param_set, error: %d", err);
+			return err;
+		}
+
+		err = lte_lc_ptw_set(LTE_LC_LTE_MODE_LTEM, params->ptw);
+		if (err) {
+			LOG_ERR("lte_lc_ptw_set, error: %d", err);
+			return err;
+		}
+	}
+
+	err = lte_lc_edrx_req(params->edrx != NULL);
+	if (err) {
+		LOG_ERR("lte_lc_edrx_req, error: %d", err);
+		return err;
+	}
+
+	if (params->psm_tau != NULL) {
+		err = lte_lc_psm_param_set(params->psm_tau, params->psm_active_time);
+		if (err) {
+			LOG_ERR("lte_lc_psm_param_set, error: %d", err);
+			return err;
+		}
+	}
+
+	err = lte_lc_psm_req(params->psm_tau != NULL);
 	if (err) {
 		LOG_ERR("lte_lc_psm_req, error: %d", err);
 		return err;
 	}
 
-	LOG_DBG("PSM disabled");
+	LOG_DBG("eDRX %s, PSM %s", params->edrx != NULL ? "requested" : "disabled",
+		params->psm_tau != NULL ? "requested" : "disabled");
 
 	return 0;
 }
@@ -478,7 +543,7 @@ static int setup(void)
 		return err;
 	}
 
-	err = configure_low_power();
+	err = configure_low_power(power_profile_current());
 	if (err) {
 		LOG_ERR("configure_low_power, error: %d", err);
 		return err;
@@ -601,7 +666,14 @@ static void on_state_connected(struct modem_msg_data *msg)
 /* Message handler for all states. */
 static void on_all_states(struct modem_msg_data *msg)
 {
+	if (is_power_profile_event(&msg->module.power.header)) {
+		int err = configure_low_power(msg->module.power.profile);
 
+		if (err) {
+			LOG_ERR("configure_low_power, error: %d", err);
+			SEND_ERROR(modem, MODEM_EVT_ERROR, err);
+		}
+	}
 }
 
 static void module_thread_fn(void)
@@ -664,4 +736,5 @@ K_THREAD_DEFINE(modem_module_thread, 6144,
 
 APP_EVENT_LISTENER(MODULE, app_event_handler);
 APP_EVENT_SUBSCRIBE(MODULE, module_state_event);
+APP_EVENT_SUBSCRIBE(MODULE, power_profile_event);
 APP_EVENT_SUBSCRIBE_FINAL(MODULE, modem_module_event);
\ No newline at end of file
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2020 Nordic Semiconductor ASA
+ *
+ * SPDX-License-Identifier: LicenseRef-Nordic-5-Clause
+ */
+
+#include <zephyr/kernel.h>
+#include <zephyr/sys/sys_heap.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "mem_monitor.h"
+#include "mem_budget.h"
+#include "uart_rx.h"
+#include "uart_tx.h"
+
+#define MODULE mem_monitor
+#include <caf/events/module_state_event.h>
+
+#include <zephyr/logging/log.h>
+LOG_MODULE_REGISTER(MODULE);
+
+// A report is a burst of lines, wait for the UART rather than lose some of them
+#define MEM_REPORT_TX_TIMEOUT_MS 100
+
+// Heaps and slabs owned by other modules
+extern struct k_heap cjson_heap;
+extern struct k_mem_slab uart_rx_slab;
+#if CONFIG_HEAP_MEM_POOL_SIZE > 0
+extern struct k_heap _system_heap;
+#endif
+
+struct mem_report_ctx {
+	// Send the report to the upper tester, otherwise only log items that are over budget
+	bool send;
+	int over_count;
+};
+
+static struct k_work_delayable mem_check_work;
+
+static void report_item(struct mem_report_ctx* ctx, const char* kind, const char* name, size_t peak, size_t size) {
+	bool over = mem_budget_over(peak, size);
+	if (over) {
+		ctx->over_count++;
+		LOG_WRN("%s %s over budget: %d of %d bytes used", kind, name, (int) peak, (int) size);
+	}
+	else if (ctx->send) {
+		LOG_INF("%s %s: %d of %d bytes used", kind, name, (int) peak, (int) size);
+	}
+
+	if (ctx->send) {
+		char line[MEM_BUDGET_LINE_SIZE];
+		size_t len = mem_budget_format(line, kind, name, peak, size);
+		// Device index of 0 is the upper tester
+		uart_tx_send(0, (uint8_t*) line, len, K_MSEC(MEM_REPORT_TX_TIMEOUT_MS));
+	}
+}
+
+static void report_thread(const struct k_thread *cthread, void *user_data) {
+	struct k_thread *thread = (struct k_thread *) cthread;
+	struct mem_report_ctx* ctx = user_data;
+	size_t unused;
+	char name[16];
+
+	if (k_thread_stack_space_get(thread, &unused) != 0) {
+		return;
+	}
+
+	const char* thread_name = k_thread_name_get(thread);
+	if (thread_name == NULL || thread_name[0] == '\0') {
+		snprintf(name, sizeof(name), "%p", (void*) thread);
+		thread_name = name;
+	}
+
+	size_t size = thread->stack_info.size;
+	report_item(ctx, "thread", thread_name, size - unused, size);
+}
+
+static void report_heap(struct mem_report_ctx* ctx, const char* name, struct k_heap* heap) {
+	struct sys_memory_stats stats;
+	if (sys_heap_runtime_stats_get(&heap->heap, &stats) != 0) {
+		return;
+	}
+	report_item(ctx, "heap", name, stats.max_allocated_bytes, stats.allocated_bytes + stats.free_bytes);
+}
+
+static void report_slab(struct mem_report_ctx* ctx, const char* name, struct k_mem_slab* slab) {
+#ifdef CONFIG_MEM_SLAB_TRACE_MAX_UTILIZATION
+	size_t peak_blocks = k_mem_slab_max_used_get(slab);
+#else
+	size_t peak_blocks = k_mem_slab_num_used_get(slab);
+#endif
+	report_item(ctx, "slab", name, peak_blocks * slab->block_size, slab->num_blocks * slab->block_size);
+}
+
+static void report_rx_queue(struct mem_report_ctx* ctx, const char* name, uint8_t dev_idx) {
+	struct uart_rx_stats stats;
+	uart_rx_stats_get(dev_idx, &stats);
+	if (stats.dropped > 0 || stats.overruns > 0) {
+		LOG_WRN("%s lost data: %d chunks dropped, %d RX overruns", name, (int) stats.dropped, (int) stats.overruns);
+	}
+	report_item(ctx, "queue", name, stats.queue_high_water * sizeof(struct uart_rx_chunk),
+				UART_RX_QUEUE_DEPTH * sizeof(struct uart_rx_chunk));
+}
+
+static int check_budgets(bool send) {
+	struct mem_report_ctx ctx = {
+		.send = send,
+		.over_count = 0
+	};
+
+	// Unlocked, report_thread() logs and writes to the UART
+	k_thread_foreach_unlocked(report_thread, &ctx);
+	report_heap(&ctx, "cjson_heap", &cjson_heap);
+#if CONFIG_HEAP_MEM_POOL_SIZE > 0
+	report_heap(&ctx, "system_heap", &_system_heap);
+#endif
+	report_slab(&ctx, "uart_rx_slab", &uart_rx_slab);
+	report_rx_queue(&ctx, "uart0_rx_queue", 0);
+	report_rx_queue(&ctx, "uart1_rx_queue", 1);
+
+	return ctx.over_count;
+}
+
+int mem_monitor_report() {
+	int over_count = check_budgets(true);
+
+	char line[MEM_BUDGET_LINE_SIZE];
+	int len = snprintf(line, MEM_BUDGET_LINE_SIZE, "!mem:done,%d;\r\n", over_count);
+	uart_tx_send(0, (uint8_t*) line, MIN(len, MEM_BUDGET_LINE_SIZE - 1), K_MSEC(MEM_REPORT_TX_TIMEOUT_MS));
+
+	return over_count;
+}
+
+static void mem_check_work_handler(struct k_work *work) {
+	check_budgets(false);
+	k_work_reschedule(&mem_check_work, K_MSEC(MEM_MONITOR_CHECK_INTERVAL_MS));
+}
+
+static bool app_event_handler(const struct app_event_header *aeh)
+{
+	if (is_module_state_event(aeh)) {
+		const struct module_state_event *event =
+			cast_module_state_event(aeh);
+
+		if (check_state(event, MODULE_ID(main), MODULE_STATE_READY)) {
+			k_work_init_delayable(&mem_check_work, mem_check_work_handler);
+			k_work_reschedule(&mem_check_work, K_MSEC(MEM_MONITOR_CHECK_INTERVAL_MS));
+		}
+
+		return false;
+	}
+
+	/* If event is unhandled, unsubscribe. */
+	__ASSERT_NO_MSG(false);
+
+	return false;
+}
+APP_EVENT_LISTENER(MODULE, app_event_handler);
+APP_EVENT_SUBSCRIBE(MODULE, module_state_event);
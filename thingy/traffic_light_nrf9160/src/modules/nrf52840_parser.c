@@ -6,87 +6,419 @@
 
 #include <zephyr/types.h>
 #include <zephyr/sys/ring_buffer.h>
+#include <zephyr/sys/byteorder.h>
 #include <zephyr/drivers/uart.h>
 #include <zephyr/pm/device.h>
+#include <stdio.h>
+#include <string.h>
 
 #define MODULE nrf52840_parser
 #include <caf/events/module_state_event.h>
-#include "events/uart_data_event.h"
 #include "events/ble_event.h"
+#include "latency_stats.h"
+#include "ble_quality.h"
+#include "link_bench.h"
+#include "nrf52840_link.h"
+#include "chip_link.h"
+#include "cmd_lexer.h"
+#include "uart_rx.h"
+#include "uart_tx.h"
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(MODULE);
 
 // nRF52840 Message parsing variables
 #define BACKEND_PARSE_BUFFER_SIZE 100
-char backend_parse_buf[BACKEND_PARSE_BUFFER_SIZE];
-bool backend_started = false;
-size_t backend_parse_buf_idx = 0; // the location in the backend_parse_buff that we are writing to
+#define BACKEND_LEXER_NODES 32
+#define BACKEND_THREAD_STACK_SIZE 2048
+#define BACKEND_THREAD_PRIORITY 7
+// Binary frames are retransmitted by the link, so they only wait briefly for room in the TX ring
+#define BACKEND_FRAME_TX_TIMEOUT_MS 10
+// ASCII commands get no second chance
+#define BACKEND_ASCII_TX_TIMEOUT_MS 200
 
-void parse_nrf52840_char(char c) {
-	
-	if (backend_started && c != ';') {
-		// Message has been started, but we are not at the end
-		backend_parse_buf[backend_parse_buf_idx] = c;
-		backend_parse_buf_idx++;
-	}
-	else if (!backend_started && c == '!') {
-		// Start of message from nRF52840
-		backend_parse_buf_idx = 0;
-		memset(backend_parse_buf, 0, BACKEND_PARSE_BUFFER_SIZE);
-		backend_started = true;
-	}
-	else if (backend_started && c == ';') {
-
-		// Found end of the message
-		if (strncmp(backend_parse_buf, "C", BACKEND_PARSE_BUFFER_SIZE) == 0) {
-			LOG_INF("Got BLE_CONNECTED from nRF52840!");
-			struct ble_event* b = new_ble_event();
-			b->cmd = BLE_CONNECTED;
-			APP_EVENT_SUBMIT(b);
+static struct chip_link link;
+static bool link_initialized = false;
+
+static void submit_ble_event(enum ble_cmd cmd, uint8_t target) {
+	struct ble_event* b = new_ble_event();
+	b->cmd = cmd;
+	b->target = target;
+	b->light_count = 0;
+	APP_EVENT_SUBMIT(b);
+}
+
+static enum ae_light_states link_to_light(uint8_t light) {
+	switch (light) {
+		case CHIP_LINK_LIGHT_OFF:
+			return AE_LIGHT_OFF;
+		case CHIP_LINK_LIGHT_RED:
+			return AE_LIGHT_RED;
+		case CHIP_LINK_LIGHT_YELLOW:
+			return AE_LIGHT_YELLOW;
+		case CHIP_LINK_LIGHT_GREEN:
+			return AE_LIGHT_GREEN;
+		case CHIP_LINK_LIGHT_UNCHANGED:
+		default:
+			return AE_LIGHT_STATE_NONE;
+	}
+}
+
+// What a signal controller confirmed its heads show, one chip_link_light per head
+static void submit_light_state(uint8_t target, const uint8_t* lights, size_t count) {
+	struct ble_event* b = new_ble_event();
+	b->cmd = BLE_LIGHT_STATE;
+	b->target = target;
+	b->light_count = (uint8_t) MIN(count, AE_MAX_LIGHTS);
+	for (size_t i = 0; i < AE_MAX_LIGHTS; i++) {
+		b->light_states[i] = (i < b->light_count) ? link_to_light(lights[i]) : AE_LIGHT_STATE_NONE;
+	}
+	APP_EVENT_SUBMIT(b);
+}
+
+// "SCAN_START" and "SCAN_STOP", value is the ble_cmd to submit
+static int backend_ble_state(const struct cmd_lexer_cmd* cmd, const char* args) {
+	LOG_INF("Got %s from nRF52840!", cmd->name);
+	submit_ble_event(cmd->value, 0);
+	return 0;
+}
+
+// "C" and "D" for the first signal controller, "C@<target>" and "D@<target>" for the others
+static int backend_ble_conn(const struct cmd_lexer_cmd* cmd, const char* args) {
+	unsigned int target = 0;
+	if (*args != '\0' && (sscanf(args, "@%u", &target) != 1 || target >= CHIP_LINK_MAX_TARGETS)) {
+		return -EINVAL;
+	}
+	LOG_INF("Got %s for %d from nRF52840!", cmd->name, target);
+	submit_ble_event(cmd->value, (uint8_t) target);
+	return 0;
+}
+
+// Light command acknowledged by the ESP32, "A<command id>,<BLE hop ms>"
+static int backend_cmd_ack(const struct cmd_lexer_cmd* cmd, const char* args) {
+	unsigned int cmd_id;
+	unsigned int ble_ms;
+	if (sscanf(args, "%u,%u", &cmd_id, &ble_ms) != 2) {
+		return -EINVAL;
+	}
+	latency_cmd_acked((uint16_t) cmd_id, ble_ms);
+	return 0;
+}
+
+// Light state confirmed by the ESP32, "L<one state char per head>[@<target>]"
+static int backend_light_state(const struct cmd_lexer_cmd* cmd, const char* args) {
+	uint8_t lights[AE_MAX_LIGHTS];
+	unsigned int target = 0;
+	size_t count = 0;
+
+	for (; *args != '\0' && *args != '@'; args++) {
+		if (count == AE_MAX_LIGHTS) {
+			return -EINVAL;
 		}
-		else if (strncmp(backend_parse_buf, "D", BACKEND_PARSE_BUFFER_SIZE) == 0) {
-			LOG_INF("Got BLE_DISCONNECTED from nRF52840!");
-			struct ble_event* b = new_ble_event();
-			b->cmd = BLE_DISCONNECTED;
-			APP_EVENT_SUBMIT(b);
+		switch (*args) {
+			case 'o':
+				lights[count++] = CHIP_LINK_LIGHT_OFF;
+			break;
+			case 'r':
+				lights[count++] = CHIP_LINK_LIGHT_RED;
+			break;
+			case 'y':
+				lights[count++] = CHIP_LINK_LIGHT_YELLOW;
+			break;
+			case 'g':
+				lights[count++] = CHIP_LINK_LIGHT_GREEN;
+			break;
+			case '-':
+				lights[count++] = CHIP_LINK_LIGHT_UNCHANGED;
+			break;
+			default:
+				return -EINVAL;
 		}
-		else if (strncmp(backend_parse_buf, "SCAN_START", BACKEND_PARSE_BUFFER_SIZE) == 0) {
+	}
+	if (*args == '@' && (sscanf(args, "@%u", &target) != 1 || target >= CHIP_LINK_MAX_TARGETS)) {
+		return -EINVAL;
+	}
+	submit_light_state((uint8_t) target, lights, count);
+	return 0;
+}
+
+static const struct cmd_lexer_cmd backend_commands[] = {
+	{ "C", true, backend_ble_conn, BLE_CONNECTED },
+	{ "D", true, backend_ble_conn, BLE_DISCONNECTED },
+	{ "SCAN_START", false, backend_ble_state, BLE_SCAN_STARTED },
+	{ "SCAN_STOP", false, backend_ble_state, BLE_SCAN_STOPPED },
+	{ "A", true, backend_cmd_ack, 0 },
+	{ "L", true, backend_light_state, 0 },
+};
+
+CMD_LEXER_DEFINE(backend_lexer, backend_commands, BACKEND_PARSE_BUFFER_SIZE, BACKEND_LEXER_NODES);
+
+void parse_nrf52840_char(char c) {
+	switch (cmd_lexer_feed(&backend_lexer, c)) {
+		case CMD_LEXER_UNKNOWN:
+		case CMD_LEXER_BAD_ARGS:
+			LOG_ERR("Failed to parse message from nRF52840! %s", backend_lexer.buf);
+		break;
+		case CMD_LEXER_OVERFLOW:
+			LOG_WRN("nRF52840 parse buf overrun!");
+		break;
+		default:
+		break;
+	}
+}
+
+static int link_write(const uint8_t* data, size_t len) {
+	// Device index of 1 is to send to nRF52840
+	return uart_tx_send(1, data, len, K_MSEC(BACKEND_FRAME_TX_TIMEOUT_MS));
+}
+
+static void link_received(uint8_t type, const uint8_t* payload, size_t len) {
+	switch (type) {
+		case CHIP_LINK_MSG_BLE_CONNECTED:
+		case CHIP_LINK_MSG_BLE_DISCONNECTED:
+			if (len != 1 || payload[0] >= CHIP_LINK_MAX_TARGETS) {
+				LOG_ERR("Bad connection frame from nRF52840");
+				break;
+			}
+			LOG_INF("Got BLE_%s for %d from nRF52840!",
+					type == CHIP_LINK_MSG_BLE_CONNECTED ? "CONNECTED" : "DISCONNECTED", payload[0]);
+			submit_ble_event(type == CHIP_LINK_MSG_BLE_CONNECTED ? BLE_CONNECTED : BLE_DISCONNECTED, payload[0]);
+		break;
+		case CHIP_LINK_MSG_SCAN_STARTED:
 			LOG_INF("Got BLE_SCAN_STARTED from nRF52840!");
-			struct ble_event* b = new_ble_event();
-			b->cmd = BLE_SCAN_STARTED;
-			APP_EVENT_SUBMIT(b);
-		}
-		else if (strncmp(backend_parse_buf, "SCAN_STOP", BACKEND_PARSE_BUFFER_SIZE) == 0) {
+			submit_ble_event(BLE_SCAN_STARTED, 0);
+		break;
+		case CHIP_LINK_MSG_SCAN_STOPPED:
 			LOG_INF("Got BLE_SCAN_STOPPED from nRF52840!");
-			struct ble_event* b = new_ble_event();
-			b->cmd = BLE_SCAN_STOPPED;
-			APP_EVENT_SUBMIT(b);
+			submit_ble_event(BLE_SCAN_STOPPED, 0);
+		break;
+		case CHIP_LINK_MSG_BENCH_ECHO:
+			link_bench_echo(payload, len);
+		break;
+		case CHIP_LINK_MSG_CMD_ACK:
+			if (len != 4) {
+				LOG_ERR("Bad acknowledgement frame from nRF52840, length %d", (int) len);
+				break;
+			}
+			latency_cmd_acked(sys_get_le16(&payload[0]), sys_get_le16(&payload[2]));
+		break;
+		case CHIP_LINK_MSG_LIGHT_STATE:
+			if (len < 1 || payload[0] >= CHIP_LINK_MAX_TARGETS) {
+				LOG_ERR("Bad light state frame from nRF52840");
+				break;
+			}
+			submit_light_state(payload[0], &payload[1], len - 1);
+		break;
+		case CHIP_LINK_MSG_LINK_QUALITY: {
+			uint8_t target;
+			struct chip_link_quality quality;
+			if (chip_link_quality_decode(payload, len, &target, &quality) != 0 || target >= CHIP_LINK_MAX_TARGETS) {
+				LOG_ERR("Bad link quality frame from nRF52840, length %d", (int) len);
+				break;
+			}
+			ble_quality_add(target, &quality);
 		}
-		else {
-			LOG_ERR("Failed to parse message from nRF52840! %s", backend_parse_buf);
+		break;
+		default:
+			LOG_ERR("Unknown frame type 0x%02x from nRF52840!", type);
+		break;
+	}
+}
+
+static char link_light_to_char(uint8_t light) {
+	switch (light) {
+		case CHIP_LINK_LIGHT_OFF:
+			return 'o';
+		case CHIP_LINK_LIGHT_RED:
+			return 'r';
+		case CHIP_LINK_LIGHT_YELLOW:
+			return 'y';
+		case CHIP_LINK_LIGHT_GREEN:
+			return 'g';
+		case CHIP_LINK_LIGHT_UNCHANGED:
+		default:
+			return '-';
+	}
+}
+
+// The nRF52840 has not completed the handshake, or did not acknowledge a frame, use the ASCII commands
+static void link_send_ascii(uint8_t type, const uint8_t* payload, size_t len) {
+	char cmd[CHIP_LINK_MAX_PAYLOAD + 20];
+	// Commands for any signal controller but the first end with "@<target>"
+	char target[5] = "";
+	int cmd_len = 0;
+
+	if ((type == CHIP_LINK_MSG_SET_FRAME || type == CHIP_LINK_MSG_START_SCAN) && len > 0 && payload[0] != 0) {
+		snprintf(target, sizeof(target), "@%d", payload[0]);
+	}
+
+	switch (type) {
+		case CHIP_LINK_MSG_SET_FRAME: {
+			// "!S<first light>:<one char per head>[#<command id>][@<target>];"
+			char frame[CHIP_LINK_MAX_PAYLOAD];
+			if (len < 4) {
+				return;
+			}
+			size_t light_count = MIN(len - 4, sizeof(frame) - 1);
+			for (size_t i = 0; i < light_count; i++) {
+				frame[i] = link_light_to_char(payload[4 + i]);
+			}
+			frame[light_count] = '\0';
+			uint16_t cmd_id = sys_get_le16(&payload[2]);
+			if (cmd_id != 0) {
+				cmd_len = snprintf(cmd, sizeof(cmd), "!S%d:%s#%d%s;", payload[1], frame, cmd_id, target);
+			}
+			else {
+				cmd_len = snprintf(cmd, sizeof(cmd), "!S%d:%s%s;", payload[1], frame, target);
+			}
+		}
+		break;
+		case CHIP_LINK_MSG_START_SCAN:
+			if (len < 1) {
+				return;
+			}
+			cmd_len = snprintf(cmd, sizeof(cmd), "!start_scan%.*s%s;", (int) len - 1, (const char*) &payload[1], target);
+		break;
+		case CHIP_LINK_MSG_STOP_SCAN:
+			cmd_len = snprintf(cmd, sizeof(cmd), "!stop_scan;");
+		break;
+		default:
+			LOG_ERR("No ASCII command for frame type 0x%02x", type);
+			return;
+	}
+
+	int err = uart_tx_send(1, (const uint8_t*) cmd, MIN((size_t) cmd_len, sizeof(cmd) - 1),
+						   K_MSEC(BACKEND_ASCII_TX_TIMEOUT_MS));
+	if (err) {
+		LOG_ERR("ASCII command to nRF52840 dropped: %d", err);
+	}
+}
+
+static int link_set_baudrate(uint32_t baudrate) {
+	return uart_baudrate_set(1, baudrate);
+}
+
+static uint32_t link_line_errors(void) {
+	struct uart_rx_stats stats;
+	uart_rx_stats_get(1, &stats);
+	return stats.line_errors;
+}
+
+static const struct chip_link_ops link_ops = {
+	.write = link_write,
+	.received = link_received,
+	.send_ascii = link_send_ascii,
+	.set_baudrate = link_set_baudrate,
+	.line_errors = link_line_errors,
+};
+
+static void link_send(uint8_t type, const uint8_t* payload, size_t len) {
+	if (!link_initialized) {
+		link_send_ascii(type, payload, len);
+		return;
+	}
+	chip_link_send(&link, type, payload, len);
+}
+
+static uint8_t light_to_link(enum ae_light_states state) {
+	switch (state) {
+		case AE_LIGHT_OFF:
+			return CHIP_LINK_LIGHT_OFF;
+		case AE_LIGHT_RED:
+			return CHIP_LINK_LIGHT_RED;
+		case AE_LIGHT_YELLOW:
+			return CHIP_LINK_LIGHT_YELLOW;
+		case AE_LIGHT_GREEN:
+			return CHIP_LINK_LIGHT_GREEN;
+		case AE_LIGHT_STATE_NONE:
+		default:
+			return CHIP_LINK_LIGHT_UNCHANGED;
+	}
+}
+
+void nrf52840_link_send_frame(uint8_t target, uint8_t first_light, const enum ae_light_states* states, size_t count,
+							  uint16_t cmd_id) {
+	uint8_t payload[CHIP_LINK_MAX_PAYLOAD];
+	count = MIN(count, CHIP_LINK_MAX_PAYLOAD - 4);
+
+	payload[0] = target;
+	payload[1] = first_light;
+	sys_put_le16(cmd_id, &payload[2]);
+	for (size_t i = 0; i < count; i++) {
+		payload[4 + i] = light_to_link(states[i]);
+	}
+	link_send(CHIP_LINK_MSG_SET_FRAME, payload, 4 + count);
+}
+
+void nrf52840_link_start_scan(uint8_t target, const char* name) {
+	uint8_t payload[CHIP_LINK_MAX_PAYLOAD];
+	size_t len = MIN(strlen(name), CHIP_LINK_MAX_PAYLOAD - 1);
+
+	payload[0] = target;
+	memcpy(&payload[1], name, len);
+	link_send(CHIP_LINK_MSG_START_SCAN, payload, 1 + len);
+}
+
+void nrf52840_link_stop_scan() {
+	link_send(CHIP_LINK_MSG_STOP_SCAN, NULL, 0);
+}
+
+// Drains UART1, which is coming from the nRF52840
+static void backend_thread_fn(void) {
+	struct uart_rx_chunk chunk;
+
+	int err = cmd_lexer_init(&backend_lexer);
+	if (err) {
+		LOG_ERR("Failed to build the command table (err %d), looking commands up one by one", err);
+	}
+
+	while (true) {
+		if (uart_rx_get(1, &chunk, K_FOREVER) != 0) {
+			continue;
+		}
+		for (size_t i = 0; i < chunk.len; i++) {
+			if (link_initialized && chip_link_rx_byte(&link, chunk.buf[i])) {
+				// Part of a binary frame
+				continue;
+			}
+			parse_nrf52840_char(chunk.buf[i]);
 		}
-		backend_started = false;
+		uart_rx_release(&chunk);
 	}
+}
 
-	if (backend_parse_buf_idx >= BACKEND_PARSE_BUFFER_SIZE) {
-		LOG_WRN("nRF52840 parse buf overrun!");
-		backend_started = false;
+int nrf52840_link_bench_ping(const uint8_t* payload, size_t len) {
+	if (!link_initialized) {
+		return -ENOTCONN;
 	}
+	return chip_link_send_unreliable(&link, CHIP_LINK_MSG_BENCH_PING, payload, len);
 }
 
+void nrf52840_link_stats_get(struct chip_link_stats* stats) {
+	if (!link_initialized) {
+		memset(stats, 0, sizeof(struct chip_link_stats));
+		return;
+	}
+	chip_link_stats_get(&link, stats);
+}
+
+K_THREAD_DEFINE(nrf52840_parser_thread, BACKEND_THREAD_STACK_SIZE, backend_thread_fn, NULL, NULL, NULL,
+		BACKEND_THREAD_PRIORITY, 0, 0);
+
 static bool app_event_handler(const struct app_event_header *aeh)
 {
 
-	if (is_uart_data_event(aeh)) {
-		const struct uart_data_event *event =
-			cast_uart_data_event(aeh);
-		if (event->dev_idx == 1) {
-			//This is coming from the nRF52840
-            for (size_t i = 0; i < event->len; i++) {
-				parse_nrf52840_char(event->buf[i]);
-			}
-        }
+	if (is_module_state_event(aeh)) {
+		const struct module_state_event *event =
+			cast_module_state_event(aeh);
+
+		if (check_state(event, MODULE_ID(main), MODULE_STATE_READY)) {
+			chip_link_init(&link, &link_ops);
+			link_initialized = true;
+			chip_link_start(&link);
+			// The nRF9160 picks the baud rate, the nRF52840 follows
+			chip_link_negotiate(&link);
+		}
 
 		return false;
 	}
@@ -101,5 +433,5 @@ static bool app_event_handler(const struct app_event_header *aeh)
 	return false;
 }
 APP_EVENT_LISTENER(MODULE, app_event_handler);
-APP_EVENT_SUBSCRIBE(MODULE, uart_data_event);
-APP_EVENT_SUBSCRIBE_FINAL(MODULE, ble_event);
\ No newline at end of file
+APP_EVENT_SUBSCRIBE(MODULE, module_state_event);
+APP_EVENT_SUBSCRIBE_FINAL(MODULE, ble_event);
@@ -11,8 +11,9 @@
 
 #define MODULE uart_handler
 #include <caf/events/module_state_event.h>
-#include "events/uart_data_event.h"
 #include "events/peer_conn_event.h"
+#include "uart_rx.h"
+#include "uart_tx.h"
 
 #include <zephyr/logging/log.h>
 LOG_MODULE_REGISTER(MODULE);
@@ -30,7 +31,10 @@ static const struct device *devices[] = {
 #define UART_SLAB_BLOCK_SIZE sizeof(struct uart_rx_buf)
 #define UART_SLAB_BLOCK_COUNT (UART_DEVICE_COUNT * CONFIG_BRIDGE_UART_BUF_COUNT)
 #define UART_SLAB_ALIGNMENT 4
-#define UART_RX_TIMEOUT_USEC 1000
+
+/* Longest a baud rate change waits for the TX ring to go out, and for RX to stop */
+#define UART_BAUDRATE_DRAIN_TIMEOUT_MS 500
+#define UART_RX_DISABLE_TIMEOUT_MS 100
 
 #if defined(CONFIG_PM_DEVICE)
 #define UART_SET_PM_STATE true
@@ -38,8 +42,6 @@ static const struct device *devices[] = {
 #define UART_SET_PM_STATE false
 #endif
 
-K_SEM_DEFINE(uart1_tx_sem, 1, 1);
-
 struct uart_rx_buf {
 	atomic_t ref_counter;
 	size_t len;
@@ -65,11 +67,43 @@ static int subscriber_count[UART_DEVICE_COUNT];
 static bool enable_rx_retry[UART_DEVICE_COUNT];
 static atomic_t uart_tx_started[UART_DEVICE_COUNT];
 
+/* One queue per UART, each drained by its consumer's thread */
+K_MSGQ_DEFINE(uart0_rx_queue, sizeof(struct uart_rx_chunk), UART_RX_QUEUE_DEPTH, 4);
+K_MSGQ_DEFINE(uart1_rx_queue, sizeof(struct uart_rx_chunk), UART_RX_QUEUE_DEPTH, 4);
+static struct k_msgq *rx_queues[] = {
+	&uart0_rx_queue,
+	&uart1_rx_queue
+};
+BUILD_ASSERT(ARRAY_SIZE(rx_queues) == UART_DEVICE_COUNT);
+
+static struct uart_rx_stats rx_stats[UART_DEVICE_COUNT];
+/* Current adaptive RX timeout and the window it is judged on */
+static uint32_t rx_timeout_us[UART_DEVICE_COUNT];
+static uint32_t rx_window_chunks[UART_DEVICE_COUNT];
+static uint32_t rx_window_bytes[UART_DEVICE_COUNT];
+static int64_t rx_window_start[UART_DEVICE_COUNT];
+
+/* Writers hold the lock while they wait for room, so frames go out whole and in order */
+static struct k_mutex uart_tx_lock[UART_DEVICE_COUNT];
+/* Given on every TX_DONE, a waiting writer then checks the room again */
+static struct k_sem uart_tx_space[UART_DEVICE_COUNT];
+/* Set while uart_baudrate_set() has RX stopped, UART_RX_DISABLED then gives uart_rx_stopped */
+static bool rx_paused[UART_DEVICE_COUNT];
+static struct k_sem uart_rx_stopped[UART_DEVICE_COUNT];
+static struct uart_tx_stats tx_stats[UART_DEVICE_COUNT];
+static uint64_t tx_latency_total_us[UART_DEVICE_COUNT];
+static uint32_t tx_latency_count[UART_DEVICE_COUNT];
+/* Cycle count of the first write since the last transfer started, 0 if none */
+static uint32_t tx_first_write[UART_DEVICE_COUNT];
+/* Cycle count of the oldest byte in the transfer in flight */
+static uint32_t tx_batch_write[UART_DEVICE_COUNT];
+
 static void enable_uart_rx(uint8_t dev_idx);
 static void disable_uart_rx(uint8_t dev_idx);
 static void set_uart_power_state(uint8_t dev_idx, bool active);
 static int uart_tx_start(uint8_t dev_idx);
 static void uart_tx_finish(uint8_t dev_idx, size_t len);
+static void uart_tx_done_latency(uint8_t dev_idx);
 
 static inline struct uart_rx_buf *block_start_get(uint8_t *buf)
 {
@@ -124,23 +158,99 @@ static void uart_rx_buf_unref(void *buf)
 	}
 }
 
+/* Picks the RX timeout for the next window of chunks, restarting RX if it changed */
+static void adapt_rx_timeout(uint8_t dev_idx, size_t len, bool line_idle)
+{
+	rx_window_chunks[dev_idx]++;
+	rx_window_bytes[dev_idx] += len;
+	if (rx_window_chunks[dev_idx] < UART_RX_ADAPT_WINDOW) {
+		return;
+	}
+
+	int64_t now = k_uptime_get();
+	uint32_t timeout = rx_timeout_us[dev_idx];
+	uint32_t average = rx_window_bytes[dev_idx] / rx_window_chunks[dev_idx];
+
+	if (now - rx_window_start[dev_idx] > UART_RX_QUIET_WINDOW_MS) {
+		/* Quiet line, deliver every message as soon as it ends */
+		timeout = UART_RX_TIMEOUT_MIN_USEC;
+	} else if (average < UART_RX_SMALL_CHUNK) {
+		/* Busy line split into many small chunks, wait a little longer for each */
+		timeout = MIN(timeout * 2, UART_RX_TIMEOUT_MAX_USEC);
+	}
+
+	rx_window_chunks[dev_idx] = 0;
+	rx_window_bytes[dev_idx] = 0;
+	rx_window_start[dev_idx] = now;
+
+	/* Only restart while the line is idle, so no bytes are in flight */
+	if (timeout != rx_timeout_us[dev_idx] && line_idle) {
+		LOG_DBG("UART_%d RX timeout %d us", dev_idx, timeout);
+		rx_timeout_us[dev_idx] = timeout;
+		rx_stats[dev_idx].rx_timeout_us = timeout;
+		/* UART_RX_DISABLED enables it again with the new timeout */
+		enable_rx_retry[dev_idx] = true;
+		disable_uart_rx(dev_idx);
+	}
+}
+
+static void uart_rx_dispatch(uint8_t dev_idx, uint8_t *buf, size_t len)
+{
+	struct uart_rx_chunk chunk = {
+		.buf = buf,
+		.len = len
+	};
+
+	rx_stats[dev_idx].chunks++;
+
+	/* The consumer now holds a reference to the block */
+	uart_rx_buf_ref(buf);
+	if (k_msgq_put(rx_queues[dev_idx], &chunk, K_NO_WAIT) != 0) {
+		uart_rx_buf_unref(buf);
+		rx_stats[dev_idx].dropped++;
+		LOG_WRN("UART_%d consumer too slow, dropped %d bytes", dev_idx, (int) len);
+		return;
+	}
+
+	rx_stats[dev_idx].queue_high_water = MAX(rx_stats[dev_idx].queue_high_water,
+						 k_msgq_num_used_get(rx_queues[dev_idx]));
+}
+
+int uart_rx_get(uint8_t dev_idx, struct uart_rx_chunk *chunk, k_timeout_t timeout)
+{
+	if (dev_idx >= UART_DEVICE_COUNT) {
+		return -EINVAL;
+	}
+	return k_msgq_get(rx_queues[dev_idx], chunk, timeout);
+}
+
+void uart_rx_release(struct uart_rx_chunk *chunk)
+{
+	uart_rx_buf_unref(chunk->buf);
+	chunk->buf = NULL;
+	chunk->len = 0;
+}
+
+void uart_rx_stats_get(uint8_t dev_idx, struct uart_rx_stats *stats)
+{
+	if (dev_idx < UART_DEVICE_COUNT) {
+		*stats = rx_stats[dev_idx];
+	}
+}
+
 static void uart_callback(const struct device *dev, struct uart_event *evt,
 			  void *user_data)
 {
 	int dev_idx = (int) user_data;
-	struct uart_data_event *event;
 	struct uart_rx_buf *buf;
 	int err;
 
 	switch (evt->type) {
 	case UART_RX_RDY:
-		uart_rx_buf_ref(evt->data.rx.buf);
-
-		event = new_uart_data_event();
-		event->dev_idx = dev_idx;
-		event->buf = &evt->data.rx.buf[evt->data.rx.offset];
-		event->len = evt->data.rx.len;
-		APP_EVENT_SUBMIT(event);
+		uart_rx_dispatch(dev_idx, &evt->data.rx.buf[evt->data.rx.offset], evt->data.rx.len);
+		/* A chunk that stops short of the end of its buffer was ended by the RX timeout */
+		adapt_rx_timeout(dev_idx, evt->data.rx.len,
+				 evt->data.rx.offset + evt->data.rx.len < UART_BUF_SIZE);
 		break;
 	case UART_RX_BUF_RELEASED:
 		if (evt->data.rx_buf.buf) {
@@ -150,6 +260,7 @@ static void uart_callback(const struct device *dev, struct uart_event *evt,
 	case UART_RX_BUF_REQUEST:
 		buf = uart_rx_buf_alloc();
 		if (buf == NULL) {
+			rx_stats[dev_idx].overruns++;
 			LOG_WRN("UART_%d RX overflow", dev_idx);
 			break;
 		}
@@ -161,7 +272,10 @@ static void uart_callback(const struct device *dev, struct uart_event *evt,
 		}
 		break;
 	case UART_RX_DISABLED:
-		if (enable_rx_retry[dev_idx]) {
+		if (rx_paused[dev_idx]) {
+			/* uart_baudrate_set() enables it again */
+			k_sem_give(&uart_rx_stopped[dev_idx]);
+		} else if (enable_rx_retry[dev_idx]) {
 			enable_uart_rx(dev_idx);
 			enable_rx_retry[dev_idx] = false;
 		} else if (UART_SET_PM_STATE) {
@@ -170,22 +284,28 @@ static void uart_callback(const struct device *dev, struct uart_event *evt,
 		break;
 	case UART_TX_DONE:
 		uart_tx_finish(dev_idx, evt->data.tx.len);
+		uart_tx_done_latency(dev_idx);
 
 		if (ring_buf_is_empty(&uart_tx_ringbufs[dev_idx].rb)) {
 			atomic_set(&uart_tx_started[dev_idx], false);
-			if (dev_idx == 1) {
-				k_sem_give(&uart1_tx_sem);
+			/* A writer may have added data after the check above */
+			if (!ring_buf_is_empty(&uart_tx_ringbufs[dev_idx].rb) &&
+			    atomic_cas(&uart_tx_started[dev_idx], false, true)) {
+				uart_tx_start(dev_idx);
 			}
 		} else {
 			uart_tx_start(dev_idx);
 		}
+		k_sem_give(&uart_tx_space[dev_idx]);
 		break;
 	case UART_TX_ABORTED:
 		uart_tx_finish(dev_idx, evt->data.tx.len);
 		atomic_set(&uart_tx_started[dev_idx], false);
+		k_sem_give(&uart_tx_space[dev_idx]);
 		break;
 	case UART_RX_STOPPED:
 		LOG_WRN("UART_%d stop reason %d", dev_idx, evt->data.rx_stop.reason);
+		rx_stats[dev_idx].line_errors++;
 
 		/* Retry automatically in case of unexpected stop.
 		 * Typically happens when the peer does not drive its TX GPIO,
@@ -234,7 +354,7 @@ static void enable_uart_rx(uint8_t dev_idx)
 		return;
 	}
 
-	err = uart_rx_enable(dev, buf->buf, sizeof(buf->buf), UART_RX_TIMEOUT_USEC);
+	err = uart_rx_enable(dev, buf->buf, sizeof(buf->buf), rx_timeout_us[dev_idx]);
 	if (err) {
 		uart_rx_buf_unref(buf);
 		LOG_ERR("uart_rx_enable: %d", err);
@@ -265,6 +385,12 @@ static int uart_tx_start(uint8_t dev_idx)
 			&buf,
 			sizeof(uart_tx_ringbufs[dev_idx].buf));
 
+	/* Without new writes the transfer holds what was left over after a ring wrap */
+	if (tx_first_write[dev_idx] != 0) {
+		tx_batch_write[dev_idx] = tx_first_write[dev_idx];
+		tx_first_write[dev_idx] = 0;
+	}
+
 	err = uart_tx(devices[dev_idx], buf, len, 0);
 	if (err) {
 		LOG_ERR("uart_tx: %d", err);
@@ -285,23 +411,66 @@ static void uart_tx_finish(uint8_t dev_idx, size_t len)
 	}
 }
 
-int uart_tx_enqueue(uint8_t *data, size_t data_len, uint8_t dev_idx)
+static void uart_tx_done_latency(uint8_t dev_idx)
+{
+	uint32_t us = k_cyc_to_us_floor32(k_cycle_get_32() - tx_batch_write[dev_idx]);
+
+	tx_latency_total_us[dev_idx] += us;
+	tx_latency_count[dev_idx]++;
+	tx_stats[dev_idx].done_latency_max_us = MAX(tx_stats[dev_idx].done_latency_max_us, us);
+}
+
+int uart_tx_send(uint8_t dev_idx, const uint8_t *data, size_t len, k_timeout_t timeout)
 {
-	atomic_t started;
-	uint32_t written;
+	struct ring_buf *rb;
+	uint64_t end;
 	int err;
 
-	if(dev_idx == 1) {
-		k_sem_take(&uart1_tx_sem, K_FOREVER);
+	if (dev_idx >= UART_DEVICE_COUNT || len > UART_BUF_SIZE) {
+		return -EINVAL;
 	}
+	if (len == 0) {
+		return 0;
+	}
+
+	rb = &uart_tx_ringbufs[dev_idx].rb;
+	end = sys_clock_timeout_end_calc(timeout);
 
-	written = ring_buf_put(&uart_tx_ringbufs[dev_idx].rb, data, data_len);
-	if (written == 0) {
+	err = k_mutex_lock(&uart_tx_lock[dev_idx], timeout);
+	if (err) {
+		tx_stats[dev_idx].drops++;
 		return -ENOMEM;
 	}
 
-	started = atomic_set(&uart_tx_started[dev_idx], true);
-	if (!started) {
+	while (ring_buf_space_get(rb) < len) {
+		k_timeout_t wait = timeout;
+
+		if (!K_TIMEOUT_EQ(timeout, K_NO_WAIT) && !K_TIMEOUT_EQ(timeout, K_FOREVER)) {
+			/* What is left of the timeout after the previous waits */
+			int64_t remaining = (int64_t) (end - k_uptime_ticks());
+
+			wait = remaining > 0 ? K_TICKS(remaining) : K_NO_WAIT;
+		}
+		if (K_TIMEOUT_EQ(wait, K_NO_WAIT) || k_sem_take(&uart_tx_space[dev_idx], wait)) {
+			tx_stats[dev_idx].drops++;
+			k_mutex_unlock(&uart_tx_lock[dev_idx]);
+			LOG_DBG("UART_%d TX ring full, dropped %d bytes", dev_idx, (int) len);
+			return -ENOMEM;
+		}
+	}
+
+	if (tx_first_write[dev_idx] == 0) {
+		/* 0 means no write, a real count of 0 is off by one cycle */
+		tx_first_write[dev_idx] = k_cycle_get_32() | 1;
+	}
+	ring_buf_put(rb, data, len);
+	tx_stats[dev_idx].bytes += len;
+	tx_stats[dev_idx].frames++;
+	tx_stats[dev_idx].ring_high_water = MAX(tx_stats[dev_idx].ring_high_water,
+						ring_buf_size_get(rb));
+	k_mutex_unlock(&uart_tx_lock[dev_idx]);
+
+	if (atomic_cas(&uart_tx_started[dev_idx], false, true)) {
 		err = uart_tx_start(dev_idx);
 		if (err) {
 			LOG_ERR("uart_tx_start: %d", err);
@@ -309,28 +478,102 @@ int uart_tx_enqueue(uint8_t *data, size_t data_len, uint8_t dev_idx)
 		}
 	}
 
-	if (written == data_len) {
-		return 0;
+	return 0;
+}
+
+void uart_tx_stats_get(uint8_t dev_idx, struct uart_tx_stats *stats)
+{
+	if (dev_idx >= UART_DEVICE_COUNT) {
+		return;
+	}
+	*stats = tx_stats[dev_idx];
+	stats->ring_size = UART_BUF_SIZE;
+	stats->done_latency_avg_us = tx_latency_count[dev_idx] ?
+		(uint32_t) (tx_latency_total_us[dev_idx] / tx_latency_count[dev_idx]) : 0;
+}
+
+int uart_baudrate_set(uint8_t dev_idx, uint32_t baudrate)
+{
+	struct uart_config cfg;
+	bool rx_was_enabled;
+	int64_t end;
+	int err;
+
+	if (dev_idx >= UART_DEVICE_COUNT) {
+		return -EINVAL;
+	}
+
+	/* No new frames while switching, and the ones in the ring still go out at the old rate */
+	k_mutex_lock(&uart_tx_lock[dev_idx], K_FOREVER);
+	end = k_uptime_get() + UART_BAUDRATE_DRAIN_TIMEOUT_MS;
+	while (atomic_get(&uart_tx_started[dev_idx])) {
+		int64_t remaining = end - k_uptime_get();
+
+		if (remaining <= 0 || k_sem_take(&uart_tx_space[dev_idx], K_MSEC(remaining)) != 0) {
+			k_mutex_unlock(&uart_tx_lock[dev_idx]);
+			LOG_ERR("UART_%d TX did not drain, staying at the old baud rate", dev_idx);
+			return -EBUSY;
+		}
+	}
+
+	/* Stop RX, so the DMA never runs across the switch. Bytes on the line right then are lost either way. */
+	k_sem_reset(&uart_rx_stopped[dev_idx]);
+	rx_paused[dev_idx] = true;
+	rx_was_enabled = (uart_rx_disable(devices[dev_idx]) == 0);
+	if (rx_was_enabled &&
+	    k_sem_take(&uart_rx_stopped[dev_idx], K_MSEC(UART_RX_DISABLE_TIMEOUT_MS)) != 0) {
+		LOG_WRN("UART_%d RX did not stop", dev_idx);
+	}
+
+	err = uart_config_get(devices[dev_idx], &cfg);
+	if (err) {
+		LOG_ERR("uart_config_get: %d", err);
 	} else {
-		return -ENOMEM;
+		cfg.baudrate = (baudrate != 0) ? baudrate : uart_default_baudrate[dev_idx];
+		err = uart_configure(devices[dev_idx], &cfg);
+		if (err) {
+			LOG_ERR("uart_configure: %d", err);
+		}
 	}
 
-	return 0;
+	/* Also picks up a restart that was asked for while RX was stopped */
+	rx_paused[dev_idx] = false;
+	if (rx_was_enabled || enable_rx_retry[dev_idx]) {
+		enable_rx_retry[dev_idx] = false;
+		enable_uart_rx(dev_idx);
+	}
+	k_mutex_unlock(&uart_tx_lock[dev_idx]);
+
+	if (!err) {
+		LOG_INF("UART_%d at %d baud", dev_idx, cfg.baudrate);
+	}
+	return err;
 }
 
-static bool app_event_handler(const struct app_event_header *aeh)
+#if defined(CONFIG_BRIDGE_UART1_HW_FLOW_CONTROL)
+/* The nRF52840 holds CTS while its RX buffers are full instead of losing bytes */
+static void enable_hw_flow_control(uint8_t dev_idx)
 {
+	struct uart_config cfg;
 	int err;
 
-	if (is_uart_data_event(aeh)) {
-		const struct uart_data_event *event =
-			cast_uart_data_event(aeh);
-
-		/* All subscribers have gotten a chance to copy data at this point */
-		uart_rx_buf_unref(event->buf);
+	err = uart_config_get(devices[dev_idx], &cfg);
+	if (err) {
+		LOG_ERR("uart_config_get: %d", err);
+		return;
+	}
 
-		return true;
+	cfg.flow_ctrl = UART_CFG_FLOW_CTRL_RTS_CTS;
+	err = uart_configure(devices[dev_idx], &cfg);
+	if (err) {
+		LOG_ERR("UART_%d RTS/CTS not available: %d", dev_idx, err);
 	}
+}
+#endif
+
+static bool app_event_handler(const struct app_event_header *aeh)
+{
+	int err;
 
 	if (is_module_state_event(aeh)) {
 		const struct module_state_event *event =
@@ -356,6 +599,22 @@ static bool app_event_handler(const struct app_event_header *aeh)
 				enable_rx_retry[i] = false;
 
 				atomic_set(&uart_tx_started[i], false);
+				k_mutex_init(&uart_tx_lock[i]);
+				k_sem_init(&uart_tx_space[i], 0, 1);
+				k_sem_init(&uart_rx_stopped[i], 0, 1);
+				rx_paused[i] = false;
+				memset(&tx_stats[i], 0, sizeof(tx_stats[i]));
+				tx_latency_total_us[i] = 0;
+				tx_latency_count[i] = 0;
+				tx_first_write[i] = 0;
+				tx_batch_write[i] = 0;
+
+				rx_timeout_us[i] = UART_RX_TIMEOUT_MIN_USEC;
+				rx_window_chunks[i] = 0;
+				rx_window_bytes[i] = 0;
+				rx_window_start[i] = k_uptime_get();
+				memset(&rx_stats[i], 0, sizeof(rx_stats[i]));
+				rx_stats[i].rx_timeout_us = UART_RX_TIMEOUT_MIN_USEC;
 
 				ring_buf_init(
 					&uart_tx_ringbufs[i].rb,
@@ -365,10 +624,13 @@ static bool app_event_handler(const struct app_event_header *aeh)
 				if (UART_SET_PM_STATE) {
 					set_uart_power_state(i, false);
 				}
-
-				enable_uart_rx(0);
-				enable_uart_rx(1);
 			}
+
+#if defined(CONFIG_BRIDGE_UART1_HW_FLOW_CONTROL)
+			enable_hw_flow_control(1);
+#endif
+			enable_uart_rx(0);
+			enable_uart_rx(1);
 		}
 
 		return false;
@@ -380,5 +642,4 @@ static bool app_event_handler(const struct app_event_header *aeh)
 	return false;
 }
 APP_EVENT_LISTENER(MODULE, app_event_handler);
-APP_EVENT_SUBSCRIBE_FIRST(MODULE, module_state_event);
-APP_EVENT_SUBSCRIBE_FINAL(MODULE, uart_data_event);
\ No newline at end of file
+APP_EVENT_SUBSCRIBE_FIRST(MODULE, module_state_event);
\ No newline at end of file
@@ -5,9 +5,14 @@
 #include <zephyr/kernel.h>
 
 #include <cJSON.h>
+#include <date_time.h>
 
 #include "onem2m.h"
 #include "onem2m_payloads.h"
+#include "onem2m_requests.h"
+#include "timing_plan.h"
+#include "latency_stats.h"
+#include "power_profile.h"
 #include "deployment_settings.h"
 #include "modules/http_module.h"
 #include "events/ae_event.h"
@@ -22,13 +27,15 @@ char acpi[ACPI_LENGTH];
 char aeurl[aei_LENGTH];
 
 #define flexident_LENGTH 50
-char flexident[flexident_LENGTH]; 
+char flexident[INTERSECTION_COUNT][flexident_LENGTH]; 
 
 #define PCH_LENGTH 50
 char pchurl[PCH_LENGTH];
 
 #define SUB_LENGTH 50
-char suburl[PCH_LENGTH];
+char suburl[INTERSECTION_COUNT][SUB_LENGTH];
+
+#define RN_LENGTH 30
 
 #define RQI_LENGTH 50
 char rqi_value[RQI_LENGTH];
@@ -36,6 +43,8 @@ const char* rqi_header = rqi_value;
 
 #define MAX_ONEM2M_REQUEST_PAYLOAD_SIZE 2048
 static char onem2m_request_payload[MAX_ONEM2M_REQUEST_PAYLOAD_SIZE];
+// "{\"traffic:trfint\": {" and "}}" around the attributes of an update
+BUILD_ASSERT(ONEM2M_FLEX_ATTRIBUTES_LENGTH + 22 <= MAX_ONEM2M_REQUEST_PAYLOAD_SIZE, "Flex Container updates do not fit");
 
 #define MAX_ONEM2M_URL_SIZE 200
 static char onem2m_url_buffer[MAX_ONEM2M_URL_SIZE];
@@ -44,9 +53,10 @@ void init_oneM2M() {
     // Call this at startup
     memset(acpi, 0, ACPI_LENGTH);
     memset(aeurl, 0, aei_LENGTH);
-    memset(flexident, 0, flexident_LENGTH);
+    memset(flexident, 0, sizeof(flexident));
     memset(pchurl, 0, PCH_LENGTH);
-    memset(suburl, 0, SUB_LENGTH);
+    memset(suburl, 0, sizeof(suburl));
+    onem2m_requests_init();
 }
 
 void clear_onem2m_request_payload() {
@@ -57,33 +67,200 @@ void clear_onem2m_url_buffer() {
     memset(onem2m_url_buffer, 0, MAX_ONEM2M_URL_SIZE);
 }
 
-void updateLightStatesFromJSON(const cJSON* flex) {
-    struct ae_event* v = new_ae_event();
-    v->cmd = AE_EVENT_LIGHT_CMD;
-    
-    //have the data from the flex container. parse the data out
-    //parse light one status
-    const cJSON* lOne = cJSON_GetObjectItemCaseSensitive(flex, "l1s");
-    if (cJSON_IsString(lOne) && (lOne->valuestring != NULL))
-    {
-        //Do something with the data
-        LOG_INF("Got light 1s status: %s", lOne->valuestring);
-        v->new_light1_state = string_to_light_state(lOne->valuestring, strlen(lOne->valuestring));
+// Resource name of the flex container for an intersection.
+// The first one keeps the plain "intersection" name so existing deployments are found again.
+static void intersection_rn(uint8_t intersection, char* output) {
+    if (intersection == 0) {
+        strcpy(output, "intersection");
     }
     else {
-        LOG_ERR("Failed to find \"l1s\" JSON field!");
+        sprintf(output, "intersection%d", intersection + 1);
     }
+}
 
-    //parse light two status
-    const cJSON* lTwo = cJSON_GetObjectItemCaseSensitive(flex, "l2s");
-    if (cJSON_IsString(lTwo) && (lTwo->valuestring != NULL))
-    {
-        //Do something with the data
-        LOG_INF("Got light 2s status: %s", lTwo->valuestring);
-        v->new_light2_state = string_to_light_state(lTwo->valuestring, strlen(lTwo->valuestring));
+// Resource name of the subscription on an intersection's flex container
+static void subscription_rn(uint8_t intersection, char* output) {
+    if (intersection == 0) {
+        strcpy(output, M2M_ORIGINATOR "SUB");
     }
     else {
-        LOG_ERR("Failed to find \"l2s\" JSON field!");
+        sprintf(output, M2M_ORIGINATOR "SUB%d", intersection + 1);
+    }
+}
+
+// Figures out which of our intersections a flex container representation belongs to.
+// Returns -1 if it is not one of ours.
+static int intersection_from_json(const cJSON* flex) {
+    const cJSON* ri = cJSON_GetObjectItemCaseSensitive(flex, "ri");
+    if (cJSON_IsString(ri) && (ri->valuestring != NULL)) {
+        for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+            if (strncmp(flexident[i], ri->valuestring, flexident_LENGTH) == 0) {
+                return i;
+            }
+        }
+    }
+
+    const cJSON* rn = cJSON_GetObjectItemCaseSensitive(flex, "rn");
+    if (cJSON_IsString(rn) && (rn->valuestring != NULL)) {
+        char name[RN_LENGTH];
+        for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+            intersection_rn(i, name);
+            if (strncmp(name, rn->valuestring, RN_LENGTH) == 0) {
+                return i;
+            }
+        }
+    }
+    return -1;
+}
+
+// Appends the "l1s": "red", "l2s": ... attributes of an intersection to a JSON payload
+static void append_light_attributes(char* payload, const enum ae_light_states* states, size_t count) {
+    char state_string[10];
+    for (size_t i = 0; i < count; i++) {
+        memset(state_string, 0, 10);
+        light_state_to_string(states[i], state_string);
+        sprintf(payload + strlen(payload), "\"l%ds\": \"%s\",", (int) (i + 1), state_string);
+    }
+}
+
+// Days from 1970-01-01 to a date of the Gregorian calendar
+static int64_t days_from_civil(int year, int month, int day) {
+    year -= (month <= 2) ? 1 : 0;
+    int64_t era = ((year >= 0) ? year : year - 399) / 400;
+    int64_t year_of_era = year - era * 400;
+    int64_t day_of_year = (153 * (month + ((month > 2) ? -3 : 9)) + 2) / 5 + day - 1;
+    int64_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+// Parses a oneM2M timestamp, "YYYYMMDDTHHMMSS" in UTC with an optional ",ffffff" fraction of a second
+// Returns 0 on success, or -EINVAL if the string is not a timestamp
+static int onem2m_time_to_ms(const char* str, int64_t* ms) {
+    int year, month, day, hour, minute, second;
+    if (strlen(str) < 15 || str[8] != 'T' ||
+        sscanf(str, "%4d%2d%2dT%2d%2d%2d", &year, &month, &day, &hour, &minute, &second) != 6) {
+        return -EINVAL;
+    }
+
+    int64_t seconds = days_from_civil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second;
+    int fraction_ms = 0;
+    if (str[15] == ',') {
+        for (size_t i = 16, scale = 100; i < 19 && str[i] >= '0' && str[i] <= '9'; i++, scale /= 10) {
+            fraction_ms += (str[i] - '0') * scale;
+        }
+    }
+    *ms = seconds * 1000 + fraction_ms;
+    return 0;
+}
+
+// Records how long a notification took from the CSE changing the flex container ("lt") until it got here.
+// Needs the wall clock, the CSE's and ours are both assumed to be in sync with the network.
+static void record_notification_delay(const cJSON* flex) {
+    const cJSON* lt = cJSON_GetObjectItemCaseSensitive(flex, "lt");
+    int64_t changed;
+    int64_t now;
+    if (!cJSON_IsString(lt) || (lt->valuestring == NULL) || onem2m_time_to_ms(lt->valuestring, &changed) != 0) {
+        LOG_DBG("No \"lt\" in the notification");
+        return;
+    }
+    if (date_time_now(&now) != 0) {
+        return;
+    }
+    power_profile_cmd_delivered((now > changed) ? (uint32_t) (now - changed) : 0);
+}
+
+// "tpl" as last applied for each flex container. Notifications about other attributes, such as the
+// ones caused by our own status updates, carry it unchanged and must not act on it again.
+static bool applied_valid[INTERSECTION_COUNT];
+static char applied_tpl[INTERSECTION_COUNT][TIMING_PLAN_MAX_LENGTH];
+
+// The profile each flex container asks for with "pwr", none without the attribute
+static bool pwr_requested[INTERSECTION_COUNT];
+static enum power_profile pwr_request[INTERSECTION_COUNT];
+// What the device runs, only changed when the result of the requests does
+static bool profile_applied = false;
+static enum power_profile applied_profile;
+
+// The power profile is for the whole device. The most responsive profile any intersection asks for wins,
+// responsive if none asks for one, so intersections that disagree do not switch it back and forth.
+static void updatePowerProfileFromJSON(uint8_t intersection, const cJSON* flex) {
+    pwr_requested[intersection] = false;
+    const cJSON* pwr = cJSON_GetObjectItemCaseSensitive(flex, "pwr");
+    if (cJSON_IsString(pwr) && (pwr->valuestring != NULL) && (pwr->valuestring[0] != '\0')) {
+        if (power_profile_from_name(pwr->valuestring, &pwr_request[intersection]) != 0) {
+            LOG_WRN("Unknown power profile \"%s\"", pwr->valuestring);
+            pwr_request[intersection] = POWER_PROFILE_RESPONSIVE;
+        }
+        pwr_requested[intersection] = true;
+    }
+
+    // The profiles are ordered from the most responsive one
+    enum power_profile profile = POWER_PROFILE_COUNT;
+    for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+        if (pwr_requested[i] && pwr_request[i] < profile) {
+            profile = pwr_request[i];
+        }
+    }
+    if (profile == POWER_PROFILE_COUNT) {
+        profile = POWER_PROFILE_RESPONSIVE;
+    }
+
+    if (profile_applied && profile == applied_profile) {
+        return;
+    }
+    profile_applied = true;
+    applied_profile = profile;
+    power_profile_select(profile);
+}
+
+// A timing plan ("tpl") takes over the lights, the "l<n>s" attributes only apply without one
+static void updateTimingPlanFromJSON(uint8_t intersection, const cJSON* flex) {
+    const char* plan = "";
+    const cJSON* tpl = cJSON_GetObjectItemCaseSensitive(flex, "tpl");
+    if (cJSON_IsString(tpl) && (tpl->valuestring != NULL)) {
+        plan = tpl->valuestring;
+    }
+    if (applied_valid[intersection] && strncmp(applied_tpl[intersection], plan, TIMING_PLAN_MAX_LENGTH - 1) == 0) {
+        return;
+    }
+    strncpy(applied_tpl[intersection], plan, TIMING_PLAN_MAX_LENGTH - 1);
+    timing_plan_set(intersection, plan);
+}
+
+void updateLightStatesFromJSON(uint8_t intersection, const cJSON* flex) {
+    if (intersection >= INTERSECTION_COUNT) {
+        return;
+    }
+    updatePowerProfileFromJSON(intersection, flex);
+    updateTimingPlanFromJSON(intersection, flex);
+    applied_valid[intersection] = true;
+
+    if (timing_plan_active(intersection)) {
+        LOG_INF("Intersection %d is running a timing plan, ignoring light states", intersection);
+        return;
+    }
+
+    struct ae_event* v = new_ae_event();
+    v->cmd = AE_EVENT_LIGHT_CMD;
+    v->intersection = intersection;
+    // The latency tracking ID is only taken once a frame is actually sent for the command
+    v->received_time = k_uptime_get();
+
+    //have the data from the flex container. parse the data out, one "l<n>s" field per light
+    char field[8];
+    for (size_t i = 0; i < LIGHTS_PER_INTERSECTION; i++) {
+        sprintf(field, "l%ds", (int) (i + 1));
+        const cJSON* l = cJSON_GetObjectItemCaseSensitive(flex, field);
+        if (cJSON_IsString(l) && (l->valuestring != NULL))
+        {
+            LOG_INF("Got intersection %d %s status: %s", intersection, field, l->valuestring);
+            v->new_light_states[i] = string_to_light_state(l->valuestring, strlen(l->valuestring));
+        }
+        else {
+            // Lights that are missing from the update keep their current state
+            LOG_DBG("No \"%s\" JSON field for intersection %d", field, intersection);
+            v->new_light_states[i] = AE_LIGHT_STATE_NONE;
+        }
     }
     APP_EVENT_SUBMIT(v);
 }
@@ -92,19 +269,21 @@ void createACP() {
     /// @brief Attempts to create an ACP on the CSE
     LOG_INF("Creating ACP");
     
+    take_http_sem();
+    struct onem2m_request* req = onem2m_request_begin("createACP");
     //create headers needed for the creation of ACP
     const char* headers[] = {
         "Content-Type: application/json;ty=1\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RET: 8000\r\n",
         NULL};
-    
+
     // make post request
-    take_http_sem();
     int response_code = post_request(ENDPOINT_HOSTNAME, "/id-in", acp_create_payload, strlen(acp_create_payload), headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to create ACP!");
         give_http_sem();
@@ -139,21 +318,23 @@ void createACP() {
 bool discoverACP() {
     LOG_INF("Checking to see if ACP is already created");
 
+    take_http_sem();
+    struct onem2m_request* req = onem2m_request_begin("discoverACP");
     //create headers for get request
     const char* headers[] = {
         "Content-Type: application/json\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RET: 5000\r\n",
         NULL};
-    
+
     //create URL 
-    take_http_sem();
     clear_onem2m_url_buffer();
     sprintf(onem2m_url_buffer,"id-in?fu=1&drt=2&ty=1&rn=%s-ACP", M2M_ORIGINATOR);
     int response_code = get_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to check if ACP is already created");
         give_http_sem();
@@ -193,20 +374,22 @@ bool discoverACP() {
 bool deleteACP() {
     LOG_INF("Delete ACP");
 
+    take_http_sem();
+    struct onem2m_request* req = onem2m_request_begin("deleteACP");
     //create headers for delete request
     const char* headers[] = {
         "Content-Type: application/json\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RET: 8000\r\n",
         NULL};
 
-    take_http_sem();
     clear_onem2m_url_buffer();
     sprintf(onem2m_url_buffer,"/%s", acpi);
     int response_code = delete_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to delete ACP");
         give_http_sem();
@@ -220,24 +403,26 @@ bool deleteACP() {
 
 char* createAE() {
     LOG_INF("Creating AE");
+
+    take_http_sem();
+    //Create the payload to send to the ACME server, the buffer is shared with every other request
+    clear_onem2m_request_payload();
+    sprintf(onem2m_request_payload, ae_create_payload, acpi);
+    struct onem2m_request* req = onem2m_request_begin("createAE");
     //create headers needed for the creation of AE
     const char* headers[] = {
         "Content-Type: application/json;ty=2\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RET: 8000\r\n",
         NULL};
 
-    //Create the payload to send to the ACME server
-    clear_onem2m_request_payload();
-    sprintf(onem2m_request_payload, ae_create_payload, acpi);
-    
     // make post request
-    take_http_sem();
     LOG_INF("sending AE");
     int response_code = post_request(ENDPOINT_HOSTNAME, "/id-in", onem2m_request_payload, strlen(onem2m_request_payload), headers);
+    onem2m_request_end(req, response_code);
     LOG_INF("Recived AE");
     if (response_code <= 0) {
         LOG_ERR("Failed to create AE!");
@@ -275,21 +460,23 @@ char* createAE() {
 bool discoverAE() {
     LOG_INF("Checking to see if AE is already created");
 
+    take_http_sem();
+    struct onem2m_request* req = onem2m_request_begin("discoverAE");
     //create headers for get request
     const char* headers[] = {
         "Content-Type: application/json\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RET: 8000\r\n",
         NULL};
 
-    take_http_sem();
     //create URL 
     clear_onem2m_url_buffer();
     sprintf(onem2m_url_buffer,"id-in?fu=1&drt=2&ty=2&rn=intersection%s", DEVICE_LETTER);
     int response_code = get_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to check if AE is already created");
         give_http_sem();
@@ -328,20 +515,22 @@ bool discoverAE() {
 bool deleteAE() {
     LOG_INF("Delete AE");
 
+    take_http_sem();
+    struct onem2m_request* req = onem2m_request_begin("deleteAE");
     //create headers for delete request
     const char* headers[] = {
         "Content-Type: application/json\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RET: 8000\r\n",
         NULL};
 
-    take_http_sem();
     clear_onem2m_url_buffer();
     sprintf(onem2m_url_buffer,"/%s", aeurl);
     int response_code = delete_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to delete AE");
         give_http_sem();
@@ -353,28 +542,40 @@ bool deleteAE() {
     return true;
 }
 
-char* createFlexContainer() {
-    LOG_INF("Creating Flex Container");
+char* createFlexContainer(uint8_t intersection) {
+    LOG_INF("Creating Flex Container for intersection %d", intersection);
     
+    //Create the payload to send to the ACME server, every light starts out red
+    enum ae_light_states initial_states[LIGHTS_PER_INTERSECTION];
+    for (size_t i = 0; i < LIGHTS_PER_INTERSECTION; i++) {
+        initial_states[i] = AE_LIGHT_RED;
+    }
+    char light_attributes[LIGHTS_PER_INTERSECTION * 20];
+    memset(light_attributes, 0, sizeof(light_attributes));
+    append_light_attributes(light_attributes, initial_states, LIGHTS_PER_INTERSECTION);
+    char rn[RN_LENGTH];
+    intersection_rn(intersection, rn);
+
+    take_http_sem();
+    // The payload buffer is shared with every other request
+    clear_onem2m_request_payload();
+    sprintf(onem2m_request_payload, flex_container_create_payload, acpi, rn, light_attributes);
+    struct onem2m_request* req = onem2m_request_begin("createFlexContainer");
     //create headers needed for the creation of AE
     const char* headers[] = {
         "Content-Type: application/json;ty=28\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RET: 8000\r\n",
         NULL};
 
-    //Create the payload to send to the ACME server
-    clear_onem2m_request_payload();
-    sprintf(onem2m_request_payload, flex_container_create_payload, acpi);
-
     // make post request
-    take_http_sem();
     clear_onem2m_url_buffer();
     sprintf(onem2m_url_buffer,"/%s", aeurl);
     int response_code = post_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, onem2m_request_payload, strlen(onem2m_request_payload), headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to create Flex Container!");
         give_http_sem();
@@ -390,8 +591,8 @@ char* createFlexContainer() {
             if (cJSON_IsString(ri) && (ri->valuestring != NULL))
             {
                 // Copy the acpi from the JSON into the location pointed to
-                strncpy(flexident, ri->valuestring, flexident_LENGTH);
-                LOG_INF("Created Flex Container, Flex Contationer Identifier=%s", flexident);
+                strncpy(flexident[intersection], ri->valuestring, flexident_LENGTH);
+                LOG_INF("Created Flex Container, Flex Contationer Identifier=%s", flexident[intersection]);
             }
             else {
                 LOG_ERR("Failed to find \"ri\" JSON field!");
@@ -408,24 +609,28 @@ char* createFlexContainer() {
     return NULL;
 }
 
-bool discoverFlexContainer() {
-    LOG_INF("Checking to see if flex container is already created");
+bool discoverFlexContainer(uint8_t intersection) {
+    LOG_INF("Checking to see if flex container for intersection %d is already created", intersection);
+    char rn[RN_LENGTH];
+    intersection_rn(intersection, rn);
 
+    take_http_sem();
+    struct onem2m_request* req = onem2m_request_begin("discoverFlexContainer");
     //create headers for get request
     const char* headers[] = {
         "Content-Type: application/json\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RET: 8000\r\n",
         NULL};
-    
+
     //create URL 
-    take_http_sem();
     clear_onem2m_url_buffer();
-    sprintf(onem2m_url_buffer,"id-in?fu=1&drt=2&ty=28&pi=%s", aeurl);
+    sprintf(onem2m_url_buffer,"id-in?fu=1&drt=2&ty=28&pi=%s&rn=%s", aeurl, rn);
     int response_code = get_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to check if flex container is already created");
         give_http_sem();
@@ -442,8 +647,8 @@ bool discoverFlexContainer() {
             if (cJSON_IsString(aei) && (aei->valuestring != NULL))
             {
                 // Copy the acpi from the JSON into the location pointed to
-                strncpy(flexident, &aei->valuestring[7], flexident_LENGTH);
-                LOG_INF("Found flex container identity, acpi=%s", flexident);
+                strncpy(flexident[intersection], &aei->valuestring[7], flexident_LENGTH);
+                LOG_INF("Found flex container identity, acpi=%s", flexident[intersection]);
             }
             else {
                 LOG_ERR("Failed to find \"ri\" JSON field!");
@@ -461,24 +666,26 @@ bool discoverFlexContainer() {
     return true;
 }
 
-void retrieveFlexContainer() {
-    LOG_INF("getting contents of the flex container");
+void retrieveFlexContainer(uint8_t intersection) {
+    LOG_INF("getting contents of the flex container for intersection %d", intersection);
 
+    take_http_sem();
+    struct onem2m_request* req = onem2m_request_begin("retrieveFlexContainer");
     //need to create headers for the get request
     const char* headers[] = {
         "Content-Type: application/json\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RET: 8000\r\n",
         NULL};
-    
+
     //create a url that targest the flex container
-    take_http_sem();
     clear_onem2m_url_buffer();
-    sprintf(onem2m_url_buffer,"/%s", flexident);
+    sprintf(onem2m_url_buffer,"/%s", flexident[intersection]);
     int response_code = get_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to check if flex container is already created");
         give_http_sem();
@@ -491,7 +698,7 @@ void retrieveFlexContainer() {
         const cJSON* flex = cJSON_GetObjectItemCaseSensitive(j, "traffic:trfint");
         if (cJSON_IsObject(flex))
         {
-            updateLightStatesFromJSON(flex);
+            updateLightStatesFromJSON(intersection, flex);
         }
         else {
             LOG_ERR("Failed to find \"traffic:trfint\" JSON field! In Get function");
@@ -502,36 +709,39 @@ void retrieveFlexContainer() {
     return;
 }
 
-bool updateFlexContainer(const char* l1s, const char* l2s, const char* bts) {
-    LOG_INF("Updating Flex Container");
+bool updateFlexContainerAttributes(uint8_t intersection, const char* attributes) {
+    LOG_INF("Updating Flex Container for intersection %d", intersection);
 
-    //need to create headers for the get request
+    if (strlen(attributes) >= ONEM2M_FLEX_ATTRIBUTES_LENGTH) {
+        LOG_ERR("Flex Container update of %d bytes is too long", (int) strlen(attributes));
+        return false;
+    }
+
+    take_http_sem();
+    //create payload, attributes that are left out keep their value on the CSE.
+    //The payload buffer is shared with the poll, so only touch it once we hold the semaphore
+    clear_onem2m_request_payload();
+    snprintf(onem2m_request_payload, MAX_ONEM2M_REQUEST_PAYLOAD_SIZE, "{\"traffic:trfint\": {%s}}", attributes);
+
+    struct onem2m_request* req = onem2m_request_begin("updateFlexContainerAttributes");
+    //need to create headers for the put request
     const char* headers[] = {
         "Content-Type: application/json\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RTU: 1\r\n", // RUI = 1 means nonBlockingSync
         NULL};
 
-    //create payload
-    clear_onem2m_request_payload();
-    sprintf(onem2m_request_payload, "{\
-        \"traffic:trfint\": {\
-            \"l1s\": \"%s\",\
-            \"l2s\": \"%s\",\
-            \"bts\": \"%s\"\
-        }\
-    }", l1s, l2s, bts);
-
-    // make post request
-    take_http_sem();
+    // make put request
     clear_onem2m_url_buffer();
-    sprintf(onem2m_url_buffer,"/%s?rt=1", flexident);
+    sprintf(onem2m_url_buffer,"/%s?rt=1", flexident[intersection]);
     int response_code = put_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, onem2m_request_payload, strlen(onem2m_request_payload), headers);
-    if (response_code <= 0) {
-        LOG_ERR("Failed to update Flex Container!");
+    onem2m_request_end(req, response_code);
+    if (response_code < 200 || response_code >= 300) {
+        // Anything but success leaves the update journaled for the next try
+        LOG_ERR("Failed to update Flex Container! (%d)", response_code);
         give_http_sem();
         return false;
     }
@@ -540,29 +750,34 @@ bool updateFlexContainer(const char* l1s, const char* l2s, const char* bts) {
     return true;
 }
 
-bool deleteFLEX() {
-    LOG_INF("Delete FLEX");
+bool deleteFLEX(uint8_t intersection) {
+    LOG_INF("Delete FLEX for intersection %d", intersection);
 
+    take_http_sem();
+    struct onem2m_request* req = onem2m_request_begin("deleteFLEX");
     //create headers for delete request
     const char* headers[] = {
         "Content-Type: application/json\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RET: 8000\r\n",
         NULL};
 
-    take_http_sem();
     clear_onem2m_url_buffer();
-    sprintf(onem2m_url_buffer,"/%s", flexident);
+    sprintf(onem2m_url_buffer,"/%s", flexident[intersection]);
     int response_code = delete_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to delete FLEX");
         give_http_sem();
         return false;
     }
-    memset(flexident, 0, flexident_LENGTH);
+    memset(flexident[intersection], 0, flexident_LENGTH);
+    // A new container gets its "tpl" applied whatever it is, and asks for no power profile until it is read
+    applied_valid[intersection] = false;
+    pwr_requested[intersection] = false;
     give_http_sem();
     LOG_INF("FLEX Deleted");
     return true;
@@ -572,23 +787,25 @@ void createPCH() {
     /// @brief Attempts to create an PCH on the CSE
     LOG_INF("Creating PCH");
     
+    //create payload
+    char* create_pch_payload = "{\"m2m:pch\": {}}";
+
+    take_http_sem();
+    struct onem2m_request* req = onem2m_request_begin("createPCH");
     //create headers needed for the creation of ACP
     const char* headers[] = {
         "Content-Type: application/json;ty=15\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RET: 8000\r\n",
         NULL};
 
-    //create payload
-    char* create_pch_payload = "{\"m2m:pch\": {}}";
-
-    take_http_sem();
     clear_onem2m_url_buffer();
     sprintf(onem2m_url_buffer,"/%s", aeurl);
     int response_code = post_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, create_pch_payload, strlen(create_pch_payload), headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to check if PCH is already created");
         give_http_sem();
@@ -625,21 +842,23 @@ void createPCH() {
 bool discoverPCH() {
     LOG_INF("Checking to see if PCH is already created");
 
+    take_http_sem();
+    struct onem2m_request* req = onem2m_request_begin("discoverPCH");
     //create headers for get request
     const char* headers[] = {
         "Content-Type: application/json\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RET: 8000\r\n",
         NULL};
-    
+
     //create URL 
-    take_http_sem();
     clear_onem2m_url_buffer();
     sprintf(onem2m_url_buffer,"id-in?fu=1&drt=2&ty=15&pi=%s", aeurl);
     int response_code = get_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to check if PCH is already created");
         give_http_sem();
@@ -679,20 +898,22 @@ bool discoverPCH() {
 bool deletePCH() {
     LOG_INF("Delete PCH");
 
+    take_http_sem();
+    struct onem2m_request* req = onem2m_request_begin("deletePCH");
     //create headers for delete request
     const char* headers[] = {
         "Content-Type: application/json\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RET: 8000\r\n",
         NULL};
 
-    take_http_sem();
     clear_onem2m_url_buffer();
     sprintf(onem2m_url_buffer,"/%s", pchurl);
     int response_code = delete_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to delete PCH");
         give_http_sem();
@@ -704,24 +925,16 @@ bool deletePCH() {
     return true;
 }
 
-void createSUB() {
+void createSUB(uint8_t intersection) {
     /// @brief Attempts to create an SUB on the CSE
-    LOG_INF("Creating SUB");
+    LOG_INF("Creating SUB for intersection %d", intersection);
+    char rn[RN_LENGTH];
+    subscription_rn(intersection, rn);
     
-    //create headers needed for the creation of ACP
-    const char* headers[] = {
-        "Content-Type: application/json;ty=23\r\n",
-        "Accept: application/json\r\n",
-        "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
-        "X-M2M-RVI: 3\r\n",
-        "X-M2M-RET: 8000\r\n",
-        NULL};
-
-    //create payload
-    char payload[400];
-    memset(payload, 0, 400);
-    sprintf(payload, "{\
+    take_http_sem();
+    //create payload, in the buffer shared with every other request
+    clear_onem2m_request_payload();
+    sprintf(onem2m_request_payload, "{\
         \"m2m:sub\": {\
             \"acpi\": [\
                 \"%s\"\
@@ -729,7 +942,7 @@ void createSUB() {
             \"nu\": [\
                 \"%s\"\
             ],\
-            \"rn\": \"%sSUB\",\
+            \"rn\": \"%s\",\
             \"nct\": 1,\
             \"enc\": {\
                 \"net\": [\
@@ -737,12 +950,22 @@ void createSUB() {
                 ]\
             }\
         }\
-    }", acpi, M2M_ORIGINATOR, M2M_ORIGINATOR);
+    }", acpi, M2M_ORIGINATOR, rn);
+    struct onem2m_request* req = onem2m_request_begin("createSUB");
+    //create headers needed for the creation of ACP
+    const char* headers[] = {
+        "Content-Type: application/json;ty=23\r\n",
+        "Accept: application/json\r\n",
+        "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
+        req->ri_header,
+        "X-M2M-RVI: 3\r\n",
+        "X-M2M-RET: 8000\r\n",
+        NULL};
 
-    take_http_sem();
     clear_onem2m_url_buffer();
-    sprintf(onem2m_url_buffer,"/%s", flexident);
-    int response_code = post_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, payload, strlen(payload), headers);
+    sprintf(onem2m_url_buffer,"/%s", flexident[intersection]);
+    int response_code = post_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, onem2m_request_payload, strlen(onem2m_request_payload), headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to check if SUB is already created");
         give_http_sem();
@@ -759,8 +982,8 @@ void createSUB() {
             if (cJSON_IsString(ri) && (ri->valuestring != NULL))
             {
                 // Copy the acpi from the JSON into the location pointed to
-                strncpy(suburl, ri->valuestring, SUB_LENGTH);
-                LOG_INF("Created SUB, suburl=%s", suburl);
+                strncpy(suburl[intersection], ri->valuestring, SUB_LENGTH);
+                LOG_INF("Created SUB, suburl=%s", suburl[intersection]);
             }
             else {
                 LOG_ERR("Failed to find \"ri\" JSON field!");
@@ -779,24 +1002,28 @@ void createSUB() {
     return;
 }
 
-bool discoverSUB() {
-    LOG_INF("Checking to see if SUB is already created");
+bool discoverSUB(uint8_t intersection) {
+    LOG_INF("Checking to see if SUB for intersection %d is already created", intersection);
+    char rn[RN_LENGTH];
+    subscription_rn(intersection, rn);
 
+    take_http_sem();
+    struct onem2m_request* req = onem2m_request_begin("discoverSUB");
     //create headers for get request
     const char* headers[] = {
         "Content-Type: application/json\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RET: 8000\r\n",
         NULL};
-    
+
     //create URL 
-    take_http_sem();
     clear_onem2m_url_buffer();
-    sprintf(onem2m_url_buffer,"id-in?fu=1&drt=2&ty=23&rn=%sSUB", M2M_ORIGINATOR);
+    sprintf(onem2m_url_buffer,"id-in?fu=1&drt=2&ty=23&rn=%s", rn);
     int response_code = get_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to check if SUB is already created");
         give_http_sem();
@@ -813,8 +1040,8 @@ bool discoverSUB() {
             if (cJSON_IsString(aei) && (aei->valuestring != NULL))
             {
                 // Copy the acpi from the JSON into the location pointed to
-                strncpy(suburl, &aei->valuestring[7], SUB_LENGTH);
-                LOG_INF("Found SUB identity, suburl=%s", suburl);
+                strncpy(suburl[intersection], &aei->valuestring[7], SUB_LENGTH);
+                LOG_INF("Found SUB identity, suburl=%s", suburl[intersection]);
             }
             else {
                 LOG_ERR("Failed to find \"ri\" JSON field!");
@@ -834,59 +1061,65 @@ bool discoverSUB() {
     return true;
 }
 
-bool deleteSUB() {
-    LOG_INF("Delete SUB");
+bool deleteSUB(uint8_t intersection) {
+    LOG_INF("Delete SUB for intersection %d", intersection);
 
+    take_http_sem();
+    struct onem2m_request* req = onem2m_request_begin("deleteSUB");
     //create headers for delete request
     const char* headers[] = {
         "Content-Type: application/json\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: o4d3qpiix6p\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
         "X-M2M-RET: 8000\r\n",
         NULL};
 
-    take_http_sem();
     clear_onem2m_url_buffer();
-    sprintf(onem2m_url_buffer,"/%s", suburl);
+    sprintf(onem2m_url_buffer,"/%s", suburl[intersection]);
     int response_code = delete_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to delete SUB");
         give_http_sem();
         return false;
     }
-    memset(suburl, 0, SUB_LENGTH);
+    memset(suburl[intersection], 0, SUB_LENGTH);
     give_http_sem();
     LOG_INF("SUB Deleted");
     return true;
 }
 
-void onem2m_performPoll() {
+int onem2m_performPoll(uint32_t timeout_ms) {
+    take_http_sem();
+    struct onem2m_request* req = onem2m_request_begin("onem2m_performPoll");
+    char ret_header[32];
+    snprintf(ret_header, sizeof(ret_header), "X-M2M-RET: %u\r\n", (unsigned int) timeout_ms);
     const char* headers[] = {
         "Content-Type: application/json\r\n",
         "Accept: application/json\r\n",
         "X-M2M-Origin: " M2M_ORIGINATOR "\r\n", 
-        "X-M2M-RI: a34sds2efw4rg6r\r\n",
+        req->ri_header,
         "X-M2M-RVI: 3\r\n",
-        "X-M2M-RET: 8000\r\n",
+        ret_header,
         NULL};
-    
+
     //create URL 
-    take_http_sem();
     clear_onem2m_url_buffer();
     sprintf(onem2m_url_buffer, "%s/pcu", pchurl);
     int response_code = get_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, headers);
+    onem2m_request_end(req, response_code);
     if (response_code <= 0) {
         LOG_ERR("Failed to poll PCH!");
         give_http_sem();
-        return;
+        return -1;
     }
 
     if (response_code == 504) {
         // Response timed out, nothing to update
         give_http_sem();
-        return;
+        return 0;
     }
 
     cJSON* j = parse_json_response();
@@ -896,7 +1129,7 @@ void onem2m_performPoll() {
             LOG_INF("Failed to get m2m:rqp from PCH response!");
             free_json_response(j);
             give_http_sem();
-            return;
+            return 0;
         }
 
         const cJSON* rqi = cJSON_GetObjectItemCaseSensitive(rqp, "rqi");
@@ -909,7 +1142,7 @@ void onem2m_performPoll() {
             LOG_INF("Failed to get rqi from PCH response!");
             free_json_response(j);
             give_http_sem();
-            return;
+            return 0;
         }
 
         //pc.m2m:sgn.nev.rep.traffic:trfint
@@ -924,7 +1157,14 @@ void onem2m_performPoll() {
                     if (cJSON_IsObject(rep)) {
                         const cJSON* flex = cJSON_GetObjectItemCaseSensitive(rep, "traffic:trfint");
                         if (cJSON_IsObject(flex)) {
-                                updateLightStatesFromJSON(flex);   
+                            int intersection = intersection_from_json(flex);
+                            if (intersection >= 0) {
+                                record_notification_delay(flex);
+                                updateLightStatesFromJSON(intersection, flex);
+                            }
+                            else {
+                                LOG_ERR("Notification is not for any of our intersections!");
+                            }
                         }
                         else {
                             LOG_ERR("Failed to get m2m:rqp.pc.m2m:sgn.nev.rep.traffic:trfint from JSON!");
@@ -949,7 +1189,7 @@ void onem2m_performPoll() {
     else {
         free_json_response(j);
         give_http_sem();
-        return;
+        return 0;
     }
 
     // Send an acknowledge to the notification we received
@@ -965,30 +1205,26 @@ void onem2m_performPoll() {
         "X-M2M-RVI: 3\r\n",
     NULL};
 
-    char pc_echo[601];
-    memset(pc_echo,0,601);
-    // Note: At this point, rqp HAS to exist b/c we just retrieved it to update the lights
-    const cJSON* rqp = cJSON_GetObjectItemCaseSensitive(j, "m2m:rqp");
-    cJSON* pc = cJSON_GetObjectItemCaseSensitive(rqp, "pc");
-    if(!cJSON_PrintPreallocated(pc, pc_echo, 600, false)) {
-        LOG_ERR("Ran out of space in buffer while printing JSON for PCH response!");
+    clear_onem2m_request_payload();
+    int len = snprintf(onem2m_request_payload, MAX_ONEM2M_REQUEST_PAYLOAD_SIZE, pch_ack_payload, rqi_value);
+    if (len < 0 || len >= MAX_ONEM2M_REQUEST_PAYLOAD_SIZE) {
+        LOG_ERR("PCH acknowledgement does not fit the request buffer!");
         free_json_response(j);
         give_http_sem();
-        return;
+        return 1;
     }
-    clear_onem2m_request_payload();
-    sprintf(onem2m_request_payload, pch_ack_payload, rqi_value, pc_echo);
 
     response_code = post_request(ENDPOINT_HOSTNAME, onem2m_url_buffer, onem2m_request_payload, strlen(onem2m_request_payload), echo_headers);
-    if (response_code <= 0) {
-        LOG_ERR("Failed to echo PCH notification!");
+    if (response_code < 200 || response_code >= 300) {
+        // The lights are already updated, only the CSE is left waiting for the response
+        LOG_ERR("Failed to acknowledge PCH notification %s! (%d)", rqi_value, response_code);
         free_json_response(j);
         give_http_sem();
-        return;
+        return 1;
     }
     
     free_json_response(j);
     give_http_sem();
-    return;
+    return 1;
 }
 
@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/random/rand32.h>
+#include <zephyr/logging/log.h>
+
+#include "onem2m_requests.h"
+#include "deployment_settings.h"
+#include "modules/http_module.h"
+
+LOG_MODULE_REGISTER(oneM2M_requests, LOG_LEVEL_INF);
+
+static struct onem2m_request outstanding_requests[ONEM2M_MAX_OUTSTANDING_REQUESTS];
+K_MUTEX_DEFINE(onem2m_requests_lock);
+
+// Random per-boot prefix, so that identifiers from before a reboot never collide with new ones
+static uint32_t rqi_boot_nonce;
+// Monotonic part of the request identifier
+static uint32_t rqi_counter;
+
+static int32_t last_rtt = -1;
+
+void onem2m_requests_init() {
+    k_mutex_lock(&onem2m_requests_lock, K_FOREVER);
+    memset(outstanding_requests, 0, sizeof(outstanding_requests));
+    rqi_boot_nonce = sys_rand32_get();
+    rqi_counter = 0;
+    k_mutex_unlock(&onem2m_requests_lock);
+}
+
+struct onem2m_request* onem2m_request_begin(const char* op) {
+    struct onem2m_request* req = NULL;
+
+    k_mutex_lock(&onem2m_requests_lock, K_FOREVER);
+    for (size_t i = 0; i < ONEM2M_MAX_OUTSTANDING_REQUESTS; i++) {
+        if (!outstanding_requests[i].in_use) {
+            req = &outstanding_requests[i];
+            break;
+        }
+        // Remember the oldest request in case the table is full
+        if (req == NULL || outstanding_requests[i].start_time < req->start_time) {
+            req = &outstanding_requests[i];
+        }
+    }
+
+    if (req->in_use) {
+        LOG_WRN("Outstanding request table full, dropping %s (rqi %s)", req->op, req->rqi);
+    }
+
+    rqi_counter++;
+    memset(req, 0, sizeof(struct onem2m_request));
+    snprintf(req->rqi, ONEM2M_RQI_LENGTH, "%s-%08x-%x", M2M_ORIGINATOR, rqi_boot_nonce, rqi_counter);
+    snprintf(req->ri_header, ONEM2M_RI_HEADER_LENGTH, "X-M2M-RI: %s\r\n", req->rqi);
+    req->op = op;
+    req->start_time = k_uptime_get();
+    req->in_use = true;
+    k_mutex_unlock(&onem2m_requests_lock);
+
+    return req;
+}
+
+struct onem2m_request* onem2m_request_find(const char* rqi) {
+    if (rqi == NULL || rqi[0] == '\0') {
+        return NULL;
+    }
+
+    struct onem2m_request* found = NULL;
+    // Zephyr mutexes are recursive, so this is safe to call from onem2m_request_end()
+    k_mutex_lock(&onem2m_requests_lock, K_FOREVER);
+    for (size_t i = 0; i < ONEM2M_MAX_OUTSTANDING_REQUESTS; i++) {
+        if (outstanding_requests[i].in_use &&
+            strncmp(outstanding_requests[i].rqi, rqi, ONEM2M_RQI_LENGTH) == 0) {
+            found = &outstanding_requests[i];
+            break;
+        }
+    }
+    k_mutex_unlock(&onem2m_requests_lock);
+    return found;
+}
+
+void onem2m_request_end(struct onem2m_request* req, int response_code) {
+    k_mutex_lock(&onem2m_requests_lock, K_FOREVER);
+
+    if (response_code > 0) {
+        // Match the response to its request by the RI the CSE echoed back
+        const char* response_rqi = get_http_rx_rqi();
+        struct onem2m_request* match = onem2m_request_find(response_rqi);
+        if (match == NULL) {
+            LOG_DBG("Response rqi \"%s\" is not outstanding, completing %s", response_rqi, req->rqi);
+            match = req;
+        }
+        if (match != req) {
+            // Stale, its own request is still waiting and ends it with onem2m_request_end() as usual
+            LOG_WRN("Stale response for %s (rqi %s) while waiting on %s", match->op, match->rqi, req->op);
+        }
+        else {
+            last_rtt = (int32_t) (k_uptime_get() - req->start_time);
+            LOG_INF("%s (rqi %s) -> %d in %d ms", req->op, req->rqi, response_code, last_rtt);
+        }
+    }
+    else {
+        LOG_WRN("%s (rqi %s) failed after %d ms", req->op, req->rqi, (int32_t) (k_uptime_get() - req->start_time));
+    }
+
+    req->in_use = false;
+    k_mutex_unlock(&onem2m_requests_lock);
+}
+
+int32_t onem2m_request_last_rtt() {
+    return last_rtt;
+}
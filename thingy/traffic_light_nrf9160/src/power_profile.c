@@ -0,0 +1,176 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#include "power_profile.h"
+#include "events/power_profile_event.h"
+
+LOG_MODULE_REGISTER(power_profile, LOG_LEVEL_INF);
+
+static const struct power_profile_params profiles[POWER_PROFILE_COUNT] = {
+    [POWER_PROFILE_RESPONSIVE] = {
+        .name = "responsive",
+        .edrx = NULL,
+        .ptw = NULL,
+        .psm_tau = NULL,
+        .psm_active_time = NULL,
+        .paging_ms = 0,
+        .poll_timeout_ms = 8000,
+        .poll_interval_ms = 0,
+        .latency_budget_ms = 2000,
+    },
+    [POWER_PROFILE_LOW_POWER] = {
+        .name = "lowpower",
+        // 10.24 s cycle, 1.28 s paging time window
+        .edrx = "0001",
+        .ptw = "0000",
+        .psm_tau = NULL,
+        .psm_active_time = NULL,
+        .paging_ms = 10240,
+        // Long enough that the network releases the RRC connection between polls
+        .poll_timeout_ms = 50000,
+        .poll_interval_ms = 0,
+        .latency_budget_ms = 20000,
+    },
+    [POWER_PROFILE_STANDBY] = {
+        .name = "standby",
+        .edrx = NULL,
+        .ptw = NULL,
+        // 1 h periodic TAU, 20 s active time after every poll
+        .psm_tau = "00100001",
+        .psm_active_time = "00001010",
+        .paging_ms = 0,
+        // The PCH keeps notifications until they are polled, so a short poll picks them all up
+        .poll_timeout_ms = 2000,
+        .poll_interval_ms = 300000,
+        .latency_budget_ms = 310000,
+    },
+};
+
+struct profile_summary {
+    uint32_t active_ms;
+    uint32_t radio_ms;
+    uint32_t delivered;
+    uint32_t delay_sum_ms;
+    uint32_t delay_max_ms;
+};
+
+static struct profile_summary summaries[POWER_PROFILE_COUNT];
+static enum power_profile current = POWER_PROFILE_RESPONSIVE;
+static int64_t profile_since = 0;
+static bool rrc_connected = false;
+static int64_t rrc_since = 0;
+K_MUTEX_DEFINE(power_profile_lock);
+
+// Charges the time since the last call to the current profile
+static void account(int64_t now) {
+    summaries[current].active_ms += (uint32_t) (now - profile_since);
+    profile_since = now;
+    if (rrc_connected) {
+        summaries[current].radio_ms += (uint32_t) (now - rrc_since);
+    }
+    rrc_since = now;
+}
+
+void power_profile_init() {
+    k_mutex_lock(&power_profile_lock, K_FOREVER);
+    memset(summaries, 0, sizeof(summaries));
+    profile_since = k_uptime_get();
+    rrc_since = profile_since;
+    k_mutex_unlock(&power_profile_lock);
+}
+
+const struct power_profile_params* power_profile_params(enum power_profile profile) {
+    if (profile >= POWER_PROFILE_COUNT) {
+        return &profiles[POWER_PROFILE_RESPONSIVE];
+    }
+    return &profiles[profile];
+}
+
+enum power_profile power_profile_current() {
+    k_mutex_lock(&power_profile_lock, K_FOREVER);
+    enum power_profile profile = current;
+    k_mutex_unlock(&power_profile_lock);
+    return profile;
+}
+
+int power_profile_from_name(const char* name, enum power_profile* profile) {
+    for (size_t i = 0; i < POWER_PROFILE_COUNT; i++) {
+        if (strcmp(profiles[i].name, name) == 0) {
+            *profile = (enum power_profile) i;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+void power_profile_select(enum power_profile profile) {
+    if (profile >= POWER_PROFILE_COUNT) {
+        return;
+    }
+
+    k_mutex_lock(&power_profile_lock, K_FOREVER);
+    if (profile == current) {
+        k_mutex_unlock(&power_profile_lock);
+        return;
+    }
+    account(k_uptime_get());
+    LOG_INF("Power profile %s -> %s", profiles[current].name, profiles[profile].name);
+    current = profile;
+    k_mutex_unlock(&power_profile_lock);
+
+    struct power_profile_event* event = new_power_profile_event();
+    event->profile = profile;
+    APP_EVENT_SUBMIT(event);
+}
+
+void power_profile_rrc_update(bool connected) {
+    k_mutex_lock(&power_profile_lock, K_FOREVER);
+    account(k_uptime_get());
+    rrc_connected = connected;
+    k_mutex_unlock(&power_profile_lock);
+}
+
+void power_profile_cmd_delivered(uint32_t delay_ms) {
+    k_mutex_lock(&power_profile_lock, K_FOREVER);
+    struct profile_summary* s = &summaries[current];
+    s->delivered++;
+    s->delay_sum_ms += delay_ms;
+    s->delay_max_ms = MAX(s->delay_max_ms, delay_ms);
+    if (delay_ms > profiles[current].latency_budget_ms) {
+        LOG_WRN("Notification took %d ms, over the %d ms of the %s profile", (int) delay_ms,
+                (int) profiles[current].latency_budget_ms, profiles[current].name);
+    }
+    k_mutex_unlock(&power_profile_lock);
+}
+
+size_t power_profile_format(char* output, size_t output_len) {
+    if (output_len == 0) {
+        return 0;
+    }
+
+    k_mutex_lock(&power_profile_lock, K_FOREVER);
+    account(k_uptime_get());
+    size_t len = snprintf(output, output_len, "%s", profiles[current].name);
+    for (size_t i = 0; i < POWER_PROFILE_COUNT && len < output_len; i++) {
+        struct profile_summary* s = &summaries[i];
+        if (s->active_ms == 0) {
+            continue;
+        }
+        len += snprintf(output + len, output_len - len, ";%s:%d,%d,%d,%d,%d,%d,%d", profiles[i].name,
+                        (int) (s->active_ms / MSEC_PER_SEC), (int) (s->radio_ms / MSEC_PER_SEC),
+                        (int) ((uint64_t) s->radio_ms * 1000 / s->active_ms), (int) s->delivered,
+                        (int) (s->delivered ? s->delay_sum_ms / s->delivered : 0), (int) s->delay_max_ms,
+                        (int) profiles[i].latency_budget_ms);
+    }
+    if (len >= output_len) {
+        LOG_WRN("Power profile summary truncated");
+        len = output_len - 1;
+    }
+
+    memset(summaries, 0, sizeof(summaries));
+    k_mutex_unlock(&power_profile_lock);
+    return len;
+}
@@ -0,0 +1,296 @@
+#include <stdio.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#ifdef CONFIG_STATUS_JOURNAL_NVS
+#include <zephyr/device.h>
+#include <zephyr/drivers/flash.h>
+#include <zephyr/storage/flash_map.h>
+#include <zephyr/fs/nvs.h>
+#endif
+
+#include "status_journal.h"
+#include "onem2m.h"
+
+LOG_MODULE_REGISTER(status_journal, LOG_LEVEL_INF);
+
+// One attribute as a JSON fragment: separator, quoted name, colon and quoted value
+#define STATUS_JOURNAL_ATTR_FRAGMENT_LENGTH (2 + 8 + 2 + STATUS_JOURNAL_VALUE_LENGTH + 2)
+// As much as one update carries, attributes that do not fit go in the next update
+#define STATUS_JOURNAL_FRAGMENT_LENGTH ONEM2M_FLEX_ATTRIBUTES_LENGTH
+BUILD_ASSERT(STATUS_JOURNAL_FRAGMENT_LENGTH > STATUS_JOURNAL_ATTR_FRAGMENT_LENGTH,
+             "An update has to fit at least one attribute");
+
+struct status_entry {
+    // Order in which the attributes changed, 0 means there is nothing to send
+    uint32_t seq;
+    char value[STATUS_JOURNAL_VALUE_LENGTH];
+};
+
+static struct status_entry journal[INTERSECTION_COUNT][STATUS_ATTR_COUNT];
+static uint32_t next_seq = 1;
+// Only used while flushing, kept off the stack
+static char fragment[STATUS_JOURNAL_FRAGMENT_LENGTH];
+K_MUTEX_DEFINE(status_journal_lock);
+// Held for a whole flush, so two flushes never share the fragment buffer
+K_MUTEX_DEFINE(status_journal_flush_lock);
+
+#ifdef CONFIG_STATUS_JOURNAL_NVS
+#define STATUS_JOURNAL_NVS_SECTORS 3
+static struct nvs_fs journal_fs;
+static bool journal_fs_ready = false;
+
+static uint16_t nvs_id(uint8_t intersection, enum status_attr attr) {
+    // NVS IDs start at 1
+    return 1 + intersection * STATUS_ATTR_COUNT + attr;
+}
+
+static void journal_nvs_init() {
+    struct flash_pages_info info;
+
+    journal_fs.flash_device = FLASH_AREA_DEVICE(storage);
+    if (!device_is_ready(journal_fs.flash_device)) {
+        LOG_ERR("Flash device for the status journal is not ready");
+        return;
+    }
+    journal_fs.offset = FLASH_AREA_OFFSET(storage);
+    if (flash_get_page_info_by_offs(journal_fs.flash_device, journal_fs.offset, &info) != 0) {
+        LOG_ERR("Failed to get flash page info");
+        return;
+    }
+    journal_fs.sector_size = info.size;
+    journal_fs.sector_count = STATUS_JOURNAL_NVS_SECTORS;
+
+    int err = nvs_mount(&journal_fs);
+    if (err) {
+        LOG_ERR("Failed to mount status journal NVS (err %d)", err);
+        return;
+    }
+    journal_fs_ready = true;
+
+    for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+        for (size_t a = 0; a < STATUS_ATTR_COUNT; a++) {
+            struct status_entry* e = &journal[i][a];
+            if (nvs_read(&journal_fs, nvs_id(i, a), e, sizeof(struct status_entry)) == sizeof(struct status_entry)) {
+                e->value[STATUS_JOURNAL_VALUE_LENGTH - 1] = '\0';
+                next_seq = MAX(next_seq, e->seq + 1);
+                LOG_INF("Restored unsent status update %d/%d", i, (int) a);
+            }
+        }
+    }
+}
+
+static void journal_nvs_write(uint8_t intersection, enum status_attr attr) {
+    if (journal_fs_ready) {
+        nvs_write(&journal_fs, nvs_id(intersection, attr), &journal[intersection][attr], sizeof(struct status_entry));
+    }
+}
+
+static void journal_nvs_delete(uint8_t intersection, enum status_attr attr) {
+    if (journal_fs_ready) {
+        nvs_delete(&journal_fs, nvs_id(intersection, attr));
+    }
+}
+#endif
+
+void status_journal_init() {
+    k_mutex_lock(&status_journal_lock, K_FOREVER);
+    memset(journal, 0, sizeof(journal));
+    next_seq = 1;
+#ifdef CONFIG_STATUS_JOURNAL_NVS
+    journal_nvs_init();
+#endif
+    k_mutex_unlock(&status_journal_lock);
+}
+
+void status_journal_set(uint8_t intersection, enum status_attr attr, const char* value) {
+    if (intersection >= INTERSECTION_COUNT || attr >= STATUS_ATTR_COUNT) {
+        return;
+    }
+
+    k_mutex_lock(&status_journal_lock, K_FOREVER);
+    struct status_entry* e = &journal[intersection][attr];
+    if (strncmp(e->value, value, STATUS_JOURNAL_VALUE_LENGTH - 1) == 0) {
+        // Unchanged, either already waiting to be sent or already on the CSE
+        k_mutex_unlock(&status_journal_lock);
+        return;
+    }
+    strncpy(e->value, value, STATUS_JOURNAL_VALUE_LENGTH - 1);
+    e->value[STATUS_JOURNAL_VALUE_LENGTH - 1] = '\0';
+    e->seq = next_seq++;
+#ifdef CONFIG_STATUS_JOURNAL_NVS
+    // Stays in flash until it has been sent
+    journal_nvs_write(intersection, attr);
+#endif
+    k_mutex_unlock(&status_journal_lock);
+}
+
+void status_journal_set_lights(uint8_t intersection, const enum ae_light_states* states, size_t count) {
+    char state_string[10];
+    for (size_t i = 0; i < count && i < LIGHTS_PER_INTERSECTION; i++) {
+        memset(state_string, 0, 10);
+        light_state_to_string(states[i], state_string);
+        status_journal_set(intersection, STATUS_ATTR_CONFIRMED_FIRST + i, state_string);
+    }
+}
+
+void status_journal_resend(uint8_t intersection) {
+    if (intersection >= INTERSECTION_COUNT) {
+        return;
+    }
+
+    k_mutex_lock(&status_journal_lock, K_FOREVER);
+    for (size_t a = 0; a < STATUS_ATTR_COUNT; a++) {
+        struct status_entry* e = &journal[intersection][a];
+        if (e->seq != 0 || e->value[0] == '\0') {
+            continue;
+        }
+        e->seq = next_seq++;
+#ifdef CONFIG_STATUS_JOURNAL_NVS
+        journal_nvs_write(intersection, a);
+#endif
+    }
+    k_mutex_unlock(&status_journal_lock);
+}
+
+static void attr_name(enum status_attr attr, char* output) {
+    switch (attr) {
+        case STATUS_ATTR_BTS:
+            strcpy(output, "bts");
+        break;
+        case STATUS_ATTR_TLM:
+            strcpy(output, "tlm");
+        break;
+        case STATUS_ATTR_BLQ:
+            strcpy(output, "blq");
+        break;
+        case STATUS_ATTR_PWS:
+            strcpy(output, "pws");
+        break;
+        default:
+            sprintf(output, "c%ds", (int) (attr - STATUS_ATTR_CONFIRMED_FIRST + 1));
+        break;
+    }
+}
+
+// Intersection whose oldest unsent attribute is the oldest overall, -1 if there is none
+static int oldest_pending_intersection(const bool* attempted) {
+    int oldest = -1;
+    uint32_t oldest_seq = UINT32_MAX;
+    for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+        if (attempted[i]) {
+            continue;
+        }
+        for (size_t a = 0; a < STATUS_ATTR_COUNT; a++) {
+            uint32_t seq = journal[i][a].seq;
+            if (seq != 0 && seq < oldest_seq) {
+                oldest_seq = seq;
+                oldest = i;
+            }
+        }
+    }
+    return oldest;
+}
+
+int status_journal_flush() {
+    bool attempted[INTERSECTION_COUNT] = { false };
+    uint32_t sent_seq[STATUS_ATTR_COUNT];
+    char name[8];
+    int unsent = 0;
+
+    k_mutex_lock(&status_journal_flush_lock, K_FOREVER);
+    while (true) {
+        k_mutex_lock(&status_journal_lock, K_FOREVER);
+        int intersection = oldest_pending_intersection(attempted);
+        if (intersection < 0) {
+            k_mutex_unlock(&status_journal_lock);
+            break;
+        }
+
+        // Build the update under the lock, but send it without holding it so recording never waits on the network
+        size_t len = 0;
+        bool complete = true;
+        fragment[0] = '\0';
+        memset(sent_seq, 0, sizeof(sent_seq));
+        for (size_t a = 0; a < STATUS_ATTR_COUNT; a++) {
+            struct status_entry* e = &journal[intersection][a];
+            if (e->seq == 0) {
+                continue;
+            }
+            attr_name(a, name);
+            int attr_len = snprintf(fragment + len, STATUS_JOURNAL_FRAGMENT_LENGTH - len, "%s\"%s\": \"%s\"",
+                                    (len == 0) ? "" : ", ", name, e->value);
+            if ((attr_len < 0 || len + attr_len >= STATUS_JOURNAL_FRAGMENT_LENGTH) && len == 0) {
+                // Does not fit an update of its own either, it would never be sent
+                LOG_ERR("Status update %s of intersection %d too long, dropped", name, intersection);
+                fragment[0] = '\0';
+                e->seq = 0;
+#ifdef CONFIG_STATUS_JOURNAL_NVS
+                journal_nvs_delete(intersection, a);
+#endif
+                continue;
+            }
+            if (attr_len < 0 || len + attr_len >= STATUS_JOURNAL_FRAGMENT_LENGTH) {
+                // This one and the rest go in another update
+                fragment[len] = '\0';
+                complete = false;
+                break;
+            }
+            len += attr_len;
+            sent_seq[a] = e->seq;
+        }
+        // An intersection that did not fit in one update comes round again
+        attempted[intersection] = complete;
+        k_mutex_unlock(&status_journal_lock);
+
+        if (len == 0) {
+            // Everything pending was dropped
+            continue;
+        }
+        if (!updateFlexContainerAttributes(intersection, fragment)) {
+            attempted[intersection] = true;
+            continue;
+        }
+
+        // Attributes that changed again while we were sending stay in the journal
+        k_mutex_lock(&status_journal_lock, K_FOREVER);
+        for (size_t a = 0; a < STATUS_ATTR_COUNT; a++) {
+            if (sent_seq[a] != 0 && journal[intersection][a].seq == sent_seq[a]) {
+                journal[intersection][a].seq = 0;
+#ifdef CONFIG_STATUS_JOURNAL_NVS
+                journal_nvs_delete(intersection, a);
+#endif
+            }
+        }
+        k_mutex_unlock(&status_journal_lock);
+    }
+
+    k_mutex_lock(&status_journal_lock, K_FOREVER);
+    for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+        for (size_t a = 0; a < STATUS_ATTR_COUNT; a++) {
+            if (journal[i][a].seq != 0) {
+                unsent++;
+                break;
+            }
+        }
+    }
+    k_mutex_unlock(&status_journal_lock);
+    k_mutex_unlock(&status_journal_flush_lock);
+
+    return unsent;
+}
+
+size_t status_journal_pending() {
+    size_t pending = 0;
+    k_mutex_lock(&status_journal_lock, K_FOREVER);
+    for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+        for (size_t a = 0; a < STATUS_ATTR_COUNT; a++) {
+            if (journal[i][a].seq != 0) {
+                pending++;
+            }
+        }
+    }
+    k_mutex_unlock(&status_journal_lock);
+    return pending;
+}
@@ -0,0 +1,230 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <date_time.h>
+
+#include "timing_plan.h"
+
+LOG_MODULE_REGISTER(timing_plan, LOG_LEVEL_INF);
+
+// Longest phase we accept, anything longer is almost certainly a typo
+#define TIMING_PLAN_MAX_PHASE_S 3600
+
+struct plan_executor {
+    struct k_work_delayable work;
+    struct timing_plan plan;
+    // The plan string that is running, used to ignore repeats of the same plan
+    char source[TIMING_PLAN_MAX_LENGTH];
+    uint8_t intersection;
+    int current_phase;
+    bool active;
+};
+
+static struct plan_executor executors[INTERSECTION_COUNT];
+static bool executors_initialized = false;
+K_MUTEX_DEFINE(timing_plan_lock);
+
+static int char_to_light_state(char c, enum ae_light_states* state) {
+    switch (c) {
+        case 'r':
+            *state = AE_LIGHT_RED;
+            return 0;
+        case 'y':
+            *state = AE_LIGHT_YELLOW;
+            return 0;
+        case 'g':
+            *state = AE_LIGHT_GREEN;
+            return 0;
+        case 'o':
+            *state = AE_LIGHT_OFF;
+            return 0;
+        case '-':
+            *state = AE_LIGHT_STATE_NONE;
+            return 0;
+        default:
+            return -EINVAL;
+    }
+}
+
+int timing_plan_parse(const char* str, struct timing_plan* plan) {
+    memset(plan, 0, sizeof(struct timing_plan));
+    const char* p = str;
+
+    while (*p != '\0' && *p != '@') {
+        if (plan->phase_count >= TIMING_PLAN_MAX_PHASES) {
+            return -EINVAL;
+        }
+        struct timing_plan_phase* phase = &plan->phases[plan->phase_count];
+
+        // One state character per light
+        for (size_t i = 0; i < LIGHTS_PER_INTERSECTION; i++, p++) {
+            if (char_to_light_state(*p, &phase->states[i]) != 0) {
+                return -EINVAL;
+            }
+        }
+        if (*p != ':') {
+            return -EINVAL;
+        }
+        p++;
+
+        char* end = NULL;
+        double seconds = strtod(p, &end);
+        if (end == p || seconds <= 0 || seconds > TIMING_PLAN_MAX_PHASE_S) {
+            return -EINVAL;
+        }
+        phase->duration_ms = (uint32_t) (seconds * 1000);
+        plan->cycle_ms += phase->duration_ms;
+        plan->phase_count++;
+
+        p = end;
+        if (*p == ',') {
+            p++;
+        }
+        else if (*p != '\0' && *p != '@') {
+            return -EINVAL;
+        }
+    }
+
+    if (plan->phase_count == 0 || plan->cycle_ms == 0) {
+        return -EINVAL;
+    }
+
+    if (*p == '@') {
+        p++;
+        char* end = NULL;
+        double offset = strtod(p, &end);
+        if (end == p || *end != '\0' || offset < 0) {
+            return -EINVAL;
+        }
+        plan->offset_ms = ((uint32_t) (offset * 1000)) % plan->cycle_ms;
+    }
+    return 0;
+}
+
+// Wall clock time if we have it, so plans on different devices line up, otherwise uptime
+static int64_t plan_time_now() {
+    int64_t now;
+    if (date_time_now(&now) == 0) {
+        return now;
+    }
+    return k_uptime_get();
+}
+
+static void plan_work_handler(struct k_work* work) {
+    struct k_work_delayable* dwork = k_work_delayable_from_work(work);
+    struct plan_executor* ex = CONTAINER_OF(dwork, struct plan_executor, work);
+
+    k_mutex_lock(&timing_plan_lock, K_FOREVER);
+    if (!ex->active) {
+        k_mutex_unlock(&timing_plan_lock);
+        return;
+    }
+
+    // Work out where in the cycle we are from the clock rather than counting phases,
+    // so a late work item never makes the plan drift
+    int64_t position = (plan_time_now() - ex->plan.offset_ms) % ex->plan.cycle_ms;
+    if (position < 0) {
+        position += ex->plan.cycle_ms;
+    }
+
+    int phase = 0;
+    int64_t phase_end = ex->plan.phases[0].duration_ms;
+    while (position >= phase_end && phase < (int) ex->plan.phase_count - 1) {
+        phase++;
+        phase_end += ex->plan.phases[phase].duration_ms;
+    }
+
+    if (phase != ex->current_phase) {
+        LOG_DBG("Intersection %d phase %d", ex->intersection, phase);
+        ex->current_phase = phase;
+
+        struct ae_event* v = new_ae_event();
+        v->cmd = AE_EVENT_LIGHT_CMD;
+        v->intersection = ex->intersection;
+        v->received_time = 0;
+        for (size_t i = 0; i < LIGHTS_PER_INTERSECTION; i++) {
+            v->new_light_states[i] = ex->plan.phases[phase].states[i];
+        }
+        APP_EVENT_SUBMIT(v);
+    }
+
+    k_work_reschedule(&ex->work, K_MSEC(phase_end - position));
+    k_mutex_unlock(&timing_plan_lock);
+}
+
+static void init_executors() {
+    if (executors_initialized) {
+        return;
+    }
+    for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+        memset(&executors[i], 0, sizeof(struct plan_executor));
+        executors[i].intersection = i;
+        k_work_init_delayable(&executors[i].work, plan_work_handler);
+    }
+    executors_initialized = true;
+}
+
+static void stop_executor(struct plan_executor* ex) {
+    if (ex->active) {
+        LOG_INF("Stopping timing plan for intersection %d", ex->intersection);
+    }
+    ex->active = false;
+    memset(ex->source, 0, TIMING_PLAN_MAX_LENGTH);
+    k_work_cancel_delayable(&ex->work);
+}
+
+int timing_plan_set(uint8_t intersection, const char* plan_string) {
+    if (intersection >= INTERSECTION_COUNT) {
+        return -EINVAL;
+    }
+
+    k_mutex_lock(&timing_plan_lock, K_FOREVER);
+    init_executors();
+    struct plan_executor* ex = &executors[intersection];
+
+    if (plan_string == NULL || plan_string[0] == '\0') {
+        stop_executor(ex);
+        k_mutex_unlock(&timing_plan_lock);
+        return 0;
+    }
+
+    if (ex->active && strncmp(ex->source, plan_string, TIMING_PLAN_MAX_LENGTH) == 0) {
+        // Same plan, keep it running undisturbed
+        k_mutex_unlock(&timing_plan_lock);
+        return 0;
+    }
+
+    if (strlen(plan_string) >= TIMING_PLAN_MAX_LENGTH || timing_plan_parse(plan_string, &ex->plan) != 0) {
+        LOG_ERR("Invalid timing plan for intersection %d: %s", intersection, plan_string);
+        stop_executor(ex);
+        k_mutex_unlock(&timing_plan_lock);
+        return -EINVAL;
+    }
+
+    LOG_INF("Starting timing plan for intersection %d: %d phases, %d ms cycle", intersection,
+            (int) ex->plan.phase_count, (int) ex->plan.cycle_ms);
+    strcpy(ex->source, plan_string);
+    ex->current_phase = -1;
+    ex->active = true;
+    k_work_reschedule(&ex->work, K_NO_WAIT);
+    k_mutex_unlock(&timing_plan_lock);
+    return 0;
+}
+
+bool timing_plan_active(uint8_t intersection) {
+    if (intersection >= INTERSECTION_COUNT) {
+        return false;
+    }
+    return executors[intersection].active;
+}
+
+void timing_plan_stop_all() {
+    k_mutex_lock(&timing_plan_lock, K_FOREVER);
+    init_executors();
+    for (uint8_t i = 0; i < INTERSECTION_COUNT; i++) {
+        stop_executor(&executors[i]);
+    }
+    k_mutex_unlock(&timing_plan_lock);
+}
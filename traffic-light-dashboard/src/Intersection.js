@@ -30,6 +30,9 @@ export class IntersectionFlexContainer extends FlexContainer {
         this.ble_state = response.bts;
         this.light1_state = response.l1s;
         this.light2_state = response.l2s;
+        // What the lamps actually show, reported by the thingy once the signal controller confirms it
+        this.light1_confirmed = response.c1s;
+        this.light2_confirmed = response.c2s;
     }
 
     handle_update_notification(update_notification) {
@@ -83,6 +86,7 @@ export class IntersectionComponent extends React.Component {
 
             <div className="intersection-id" >Intersection: {intersectionLetter}</div>
             <div>Bluetooth: <span className={bt_state} >{bt_status}</span></div>
+            <div>Showing: {intersection.light1_confirmed || "unknown"} / {intersection.light2_confirmed || "unknown"}</div>
             <TrafficLightComponent lightvalues={light1_values} 
                                     name="1" onClick={this.clickHandler} key="1" />
             <TrafficLightComponent lightvalues={light2_values} 